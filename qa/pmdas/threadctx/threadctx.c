@@ -0,0 +1,86 @@
+/*
+ * threadctx PMDA ... two thread-safe DSO PMDAs for QA of pmcd -w,
+ * each reporting whether pmdaGetContext() is the client context that
+ * pmcd gave it for the fetch in progress
+ *
+ * Copyright (c) 2018 Red Hat.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/pmda.h>
+
+typedef struct {
+    int		context;	/* e_context at the start of the fetch */
+} threadctx_t;
+
+static threadctx_t	threadctx[2];
+
+/* threadctx.{a,b}.agree */
+static pmdaMetric metrics_a[] = {
+    { &threadctx[0],
+      { PMDA_PMID(0,0), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT,
+        PMDA_PMUNITS(0, 0, 0, 0, 0, 0) } }
+};
+
+static pmdaMetric metrics_b[] = {
+    { &threadctx[1],
+      { PMDA_PMID(0,0), PM_TYPE_U32, PM_INDOM_NULL, PM_SEM_INSTANT,
+        PMDA_PMUNITS(0, 0, 0, 0, 0, 0) } }
+};
+
+/*
+ * callback provided to pmdaFetch
+ */
+static int
+threadctx_fetchCallBack(pmdaMetric *mdesc, unsigned int inst, pmAtomValue *atom)
+{
+    threadctx_t	*tp = (threadctx_t *)mdesc->m_user;
+
+    if (pmID_cluster(mdesc->m_desc.pmid) != 0 ||
+        pmID_item(mdesc->m_desc.pmid) != 0)
+	return PM_ERR_PMID;
+    if (inst != PM_IN_NULL)
+	return PM_ERR_INST;
+
+    /* long enough for the other PMDA to be called on another thread */
+    usleep(20000);
+    atom->ul = (pmdaGetContext() == tp->context);
+    return 1;
+}
+
+static int
+threadctx_fetch(int numpmid, pmID pmidlist[], pmResult **resp, pmdaExt *pmda)
+{
+    threadctx_t	*tp = (threadctx_t *)pmda->e_metrics[0].m_user;
+
+    tp->context = pmda->e_context;
+    return pmdaFetch(numpmid, pmidlist, resp, pmda);
+}
+
+static void
+threadctx_init(pmdaInterface *dp, char *name, pmdaMetric *metrics, int nmetrics)
+{
+    pmdaDSO(dp, PMDA_INTERFACE_5, name, NULL);
+    if (dp->status != 0)
+	return;
+
+    dp->comm.flags |= PMDA_FLAG_THREADSAFE;
+    dp->version.any.fetch = threadctx_fetch;
+    pmdaSetFetchCallBack(dp, threadctx_fetchCallBack);
+    pmdaInit(dp, NULL, 0, metrics, nmetrics);
+}
+
+/* Initialise the DSO agents */
+void
+threadctx_a_init(pmdaInterface *dp)
+{
+    threadctx_init(dp, "threadctx A DSO",
+		   metrics_a, sizeof(metrics_a)/sizeof(metrics_a[0]));
+}
+
+void
+threadctx_b_init(pmdaInterface *dp)
+{
+    threadctx_init(dp, "threadctx B DSO",
+		   metrics_b, sizeof(metrics_b)/sizeof(metrics_b[0]));
+}
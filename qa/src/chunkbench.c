@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Exercise and time the pmseries compressed chunk encoding (chunk.c
+ * from libpcp_web - delta-of-delta timestamps, XOR values).
+ *
+ * Synthetic series shaped like archive data - constant and slowly
+ * changing gauges, counters, noisy doubles, regular and jittery or
+ * irregular sample intervals - are cut into fixed time windows as
+ * the loader does, encoded, then decoded and compared bit for bit
+ * with what went in.  Reports the encoded bytes per point alongside
+ * the raw form (value string plus score, as each sorted set member
+ * is stored without chunks, ignoring Redis per-member overheads);
+ * encode and decode timings are only reported with -t, so the
+ * output is stable.
+ */
+
+#include <pcp/pmapi.h>
+#include "chunk.h"
+
+static int	nsamples = 100000;	/* -n */
+static int	window = 3600;		/* -w */
+static int	tflag;			/* -t */
+static int	errors;
+
+static struct timeval	start;
+
+static void
+timer_start(void)
+{
+    pmtimevalNow(&start);
+}
+
+static void
+timer_stop(const char *what, double nops)
+{
+    struct timeval	now;
+    double		secs;
+
+    pmtimevalNow(&now);
+    secs = pmtimevalSub(&now, &start);
+    if (tflag)
+	fprintf(stderr, "%s: %.3f sec, %.1f nsec/op, %.0f op/sec\n",
+		what, secs, nops > 0 ? secs * 1e9 / nops : 0,
+		secs > 0 ? nops / secs : 0);
+}
+
+/* deterministic pseudo-random numbers, same sequence everywhere */
+static __uint64_t	seed;
+
+static unsigned int
+rnd(unsigned int range)
+{
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int)(seed >> 33) % range;
+}
+
+typedef struct {
+    const char		*name;
+    int			type;
+    int			interval;	/* nominal, microseconds */
+    int			jitter;		/* +/- microseconds */
+    void		(*next)(int, pmAtomValue *);
+} workload_t;
+
+static void
+constant(int i, pmAtomValue *ap)
+{
+    ap->ul = 42;
+}
+
+static void
+counter(int i, pmAtomValue *ap)
+{
+    ap->ull += 4096 * rnd(64);
+}
+
+static void
+loadavg(int i, pmAtomValue *ap)
+{
+    ap->d = (int)(ap->d * 100 + rnd(21) - 10) / 100.0;
+    if (ap->d < 0)
+	ap->d = 0;
+}
+
+static void
+utilisation(int i, pmAtomValue *ap)
+{
+    ap->f = rnd(10000) / 100.0;
+}
+
+static void
+noise(int i, pmAtomValue *ap)
+{
+    ap->d = (double)rnd(1U << 30) / (double)(1 + rnd(1U << 30));
+}
+
+static void
+sawtooth(int i, pmAtomValue *ap)
+{
+    ap->ll = (i % 100) * -1000LL;
+}
+
+static workload_t workloads[] = {
+    { "constant u32",	PM_TYPE_U32,	1000000,	0,	constant },
+    { "counter u64",	PM_TYPE_U64,	1000000,	300,	counter },
+    { "loadavg double",	PM_TYPE_DOUBLE,	10000000,	2000,	loadavg },
+    { "percent float",	PM_TYPE_FLOAT,	60000000,	5000,	utilisation },
+    { "noisy double",	PM_TYPE_DOUBLE,	1000000,	300,	noise },
+    { "irregular 64",	PM_TYPE_64,	0,		0,	sawtooth },
+};
+#define NWORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+/* string form, as stored in the values sorted set without chunks */
+static size_t
+rawsize(int type, pmAtomValue *ap)
+{
+    char	buffer[64];
+    double	d;
+
+    switch (type) {
+    case PM_TYPE_U32:
+	return pmsprintf(buffer, sizeof(buffer), "%u", ap->ul);
+    case PM_TYPE_64:
+	return pmsprintf(buffer, sizeof(buffer), "%lld", (long long)ap->ll);
+    case PM_TYPE_U64:
+	return pmsprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)ap->ull);
+    default:
+	break;
+    }
+    d = (type == PM_TYPE_FLOAT) ? ap->f : ap->d;
+    if ((long long)d == d)
+	return pmsprintf(buffer, sizeof(buffer), "%lld", (long long)d);
+    return pmsprintf(buffer, sizeof(buffer), "%f", d);
+}
+
+static int
+same(int type, pmAtomValue *a, pmAtomValue *b)
+{
+    switch (type) {
+    case PM_TYPE_32:
+    case PM_TYPE_U32:
+	return a->ul == b->ul;
+    case PM_TYPE_FLOAT:
+	return memcmp(&a->f, &b->f, sizeof(float)) == 0;
+    default:
+	break;
+    }
+    return memcmp(&a->ull, &b->ull, sizeof(__uint64_t)) == 0;
+}
+
+static void
+bench(workload_t *wp)
+{
+    chunk_t		chunk = {0};
+    chunkReader		reader;
+    pmAtomValue		*values, atom = {0};
+    __int64_t		*stamps, stamp, limit;
+    unsigned char	**blobs;
+    const void		*bytes;
+    size_t		*lengths, length, total = 0, raw = 0;
+    int			i, n, sts, nchunks = 0, ok = 1;
+
+    seed = 0x5eed;
+    values = (pmAtomValue *)calloc(nsamples, sizeof(pmAtomValue));
+    stamps = (__int64_t *)calloc(nsamples, sizeof(__int64_t));
+    blobs = (unsigned char **)calloc(nsamples, sizeof(unsigned char *));
+    lengths = (size_t *)calloc(nsamples, sizeof(size_t));
+    if (!values || !stamps || !blobs || !lengths) {
+	perror("calloc");
+	exit(1);
+    }
+
+    /* samples from 2018-01-01, a window apart and with some jitter */
+    stamp = 1514764800LL * 1000000;
+    for (i = 0; i < nsamples; i++) {
+	if (wp->interval)
+	    stamp += wp->interval;
+	else
+	    stamp += 1000 * (1 + rnd(100000));
+	stamps[i] = stamp + (wp->jitter ? rnd(2 * wp->jitter) - wp->jitter : 0);
+	wp->next(i, &atom);
+	values[i] = atom;
+	raw += rawsize(wp->type, &atom) + sizeof(double);
+    }
+
+    /* encode, cutting a new chunk at each window boundary */
+    timer_start();
+    limit = 0;
+    for (i = 0; i <= nsamples; i++) {
+	if (i == nsamples || stamps[i] >= limit) {
+	    if ((bytes = chunk_bytes(&chunk, &length)) != NULL) {
+		if ((blobs[nchunks] = malloc(length)) == NULL) {
+		    perror("malloc");
+		    exit(1);
+		}
+		memcpy(blobs[nchunks], bytes, length);
+		lengths[nchunks++] = length;
+		total += length;
+		chunk_reset(&chunk);
+	    }
+	    if (i == nsamples)
+		break;
+	    limit = (stamps[i] / 1000000 / window + 1) * window * 1000000;
+	}
+	if ((sts = chunk_append(&chunk, wp->type, stamps[i], &values[i])) < 0) {
+	    printf("%s: append failed: %s\n", wp->name, pmErrStr(sts));
+	    ok = 0;
+	    break;
+	}
+    }
+    timer_stop("encode", nsamples);
+    chunk_free(&chunk);
+
+    /* decode every chunk, checking each sample against the original */
+    timer_start();
+    for (i = n = 0; ok && i < nchunks; i++) {
+	if (chunk_reader(&reader, blobs[i], lengths[i]) < 0 ||
+	    reader.type != wp->type) {
+	    printf("%s: chunk %d header corrupt\n", wp->name, i);
+	    ok = 0;
+	    break;
+	}
+	while ((sts = chunk_next(&reader, &stamp, &atom)) > 0) {
+	    if (n >= nsamples || stamp != stamps[n] ||
+		!same(wp->type, &atom, &values[n])) {
+		printf("%s: sample %d mismatch\n", wp->name, n);
+		ok = 0;
+		break;
+	    }
+	    n++;
+	}
+	if (sts < 0) {
+	    printf("%s: chunk %d decode failed: %s\n",
+			wp->name, i, pmErrStr(sts));
+	    ok = 0;
+	}
+    }
+    timer_stop("decode", nsamples);
+    if (ok && n != nsamples) {
+	printf("%s: decoded %d of %d samples\n", wp->name, n, nsamples);
+	ok = 0;
+    }
+
+    printf("%s: %d samples, %d chunks, %.2f bytes/point (raw %.2f)%s\n",
+	    wp->name, nsamples, nchunks, (double)total / nsamples,
+	    (double)raw / nsamples, ok ? "" : " FAILED");
+    if (!ok)
+	errors++;
+
+    for (i = 0; i < nchunks; i++)
+	free(blobs[i]);
+    free(lengths);
+    free(blobs);
+    free(stamps);
+    free(values);
+}
+
+/* damaged chunks must be refused, not decoded into garbage or overrun */
+static void
+corrupt(void)
+{
+    chunk_t		chunk = {0};
+    chunkReader		reader;
+    pmAtomValue		atom;
+    __int64_t		stamp;
+    const void		*bytes;
+    size_t		length;
+    int			i, sts;
+
+    for (i = 0; i < 100; i++) {
+	atom.d = i * 1.5;
+	chunk_append(&chunk, PM_TYPE_DOUBLE, i * 1000000LL + rnd(1000), &atom);
+    }
+    bytes = chunk_bytes(&chunk, &length);
+
+    if (chunk_reader(&reader, bytes, 3) >= 0) {
+	printf("corrupt: short header accepted\n");
+	errors++;
+    }
+    if (chunk_append(&chunk, PM_TYPE_U32, 0, &atom) != -EINVAL) {
+	printf("corrupt: mixed types accepted\n");
+	errors++;
+    }
+    chunk_reader(&reader, bytes, length / 2);
+    while ((sts = chunk_next(&reader, &stamp, &atom)) > 0)
+	;
+    if (sts != -EPROTO) {
+	printf("corrupt: truncated chunk not detected\n");
+	errors++;
+    }
+    printf("corrupt: %d samples, truncated at %d\n", reader.count, reader.next);
+    chunk_free(&chunk);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		c;
+    int		errflag = 0;
+    char	*endnum;
+    int		i;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "n:tw:?")) != EOF) {
+	switch (c) {
+
+	case 'n':	/* samples per series */
+	    nsamples = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nsamples < 1) {
+		fprintf(stderr, "%s: -n requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* report timings on stderr */
+	    tflag++;
+	    break;
+
+	case 'w':	/* chunk window, seconds */
+	    window = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || window < 1) {
+		fprintf(stderr, "%s: -w requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [-t] [-n samples] [-w window]\n", pmGetProgname());
+	exit(1);
+    }
+
+    for (i = 0; i < NWORKLOADS; i++) {
+	if (tflag)
+	    fprintf(stderr, "== %s\n", workloads[i].name);
+	bench(&workloads[i]);
+    }
+    corrupt();
+
+    exit(errors != 0);
+}
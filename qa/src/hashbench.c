@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Exercise and time the libpcp __pmHash* interfaces.
+ *
+ * Workloads are lookup heavy, like archive replay: a PMID table the
+ * size of a large archive's metadata, and interpolation-style fetches
+ * that find each metric then each of its instances.  Everything is
+ * checked against the chained lookup the table has always provided,
+ * and timings are only reported with -t, so the output is stable.
+ */
+
+#include <pcp/pmapi.h>
+#include "libpcp.h"
+
+static int	nmetrics = 2000;	/* -n */
+static int	ninst = 64;		/* -i */
+static int	nfetch = 200;		/* -f */
+static int	tflag;			/* -t */
+static int	errors;
+
+static struct timeval	start;
+
+static void
+timer_start(void)
+{
+    pmtimevalNow(&start);
+}
+
+static void
+timer_stop(const char *what, double nops)
+{
+    struct timeval	now;
+    double		secs;
+
+    pmtimevalNow(&now);
+    secs = pmtimevalSub(&now, &start);
+    if (tflag)
+	fprintf(stderr, "%s: %.3f sec, %.1f nsec/op\n",
+		what, secs, nops > 0 ? secs * 1e9 / nops : 0);
+}
+
+static void
+check(const char *what, int ok)
+{
+    if (!ok) {
+	printf("%s: FAILED\n", what);
+	errors++;
+    }
+}
+
+/* the first node with key on its hash chain, as found before the index */
+static __pmHashNode *
+chainsearch(unsigned int key, __pmHashCtl *hcp)
+{
+    __pmHashNode	*hp;
+
+    if (hcp->hsize == 0)
+	return NULL;
+    for (hp = hcp->hash[key % hcp->hsize]; hp != NULL; hp = hp->next) {
+	if (hp->key == key)
+	    return hp;
+    }
+    return NULL;
+}
+
+static unsigned int
+pmidkey(int i)
+{
+    /* spread over domains and clusters, like a busy linux archive */
+    return (unsigned int)pmID_build(60 + i % 7, (i / 7) % 64, i / 448);
+}
+
+static void
+pmids(void)
+{
+    __pmHashCtl		hc = { 0 };
+    __pmHashNode	*hp;
+    unsigned int	key;
+    long		i, n, nlookup = (long)nmetrics * nfetch;
+    int			ok;
+
+    timer_start();
+    for (i = 0; i < nmetrics; i++)
+	__pmHashAdd(pmidkey(i), (void *)i, &hc);
+    timer_stop("pmid add", nmetrics);
+
+    for (ok = 1, i = 0; i < nmetrics; i++) {
+	hp = __pmHashSearch(pmidkey(i), &hc);
+	if (hp == NULL || (long)hp->data != i || hp != chainsearch(pmidkey(i), &hc))
+	    ok = 0;
+    }
+    check("pmid search", ok);
+    check("pmid missing", __pmHashSearch(pmID_build(511, 0, 0), &hc) == NULL);
+
+    timer_start();
+    for (n = i = 0; i < nlookup; i++) {
+	key = pmidkey((i * 7919) % nmetrics);
+	if ((hp = __pmHashSearch(key, &hc)) != NULL)
+	    n++;
+    }
+    timer_stop("pmid lookup", nlookup);
+    check("pmid lookup", n == nlookup);
+
+    timer_start();
+    for (n = i = 0; i < nlookup; i++) {
+	key = pmidkey((i * 7919) % nmetrics);
+	if ((hp = chainsearch(key, &hc)) != NULL)
+	    n++;
+    }
+    timer_stop("pmid lookup (chained)", nlookup);
+
+    for (n = 0, hp = __pmHashWalk(&hc, PM_HASH_WALK_START); hp != NULL;
+	 hp = __pmHashWalk(&hc, PM_HASH_WALK_NEXT))
+	n++;
+    check("pmid walk", n == nmetrics);
+
+    printf("pmid: %d keys, %ld lookups\n", nmetrics, nlookup);
+    for (i = 0; i < nmetrics; i++)
+	check("pmid delete", __pmHashDel(pmidkey(i), (void *)i, &hc) == 1);
+    check("pmid empty", __pmHashSearch(pmidkey(0), &hc) == NULL);
+    __pmHashClear(&hc);
+}
+
+/*
+ * Per-metric instance tables, as in interp.c: the metric is found by
+ * PMID and each of its instances by instance id, once per fetch.
+ */
+static void
+replay(void)
+{
+    __pmHashCtl		hc = { 0 };
+    __pmHashCtl		*ihc;
+    __pmHashNode	*hp, *ihp;
+    unsigned int	*keys;
+    long		i, j, f, n, nlookup;
+    int			ok;
+
+    if ((keys = (unsigned int *)malloc(ninst * sizeof(unsigned int))) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    for (j = 0; j < ninst; j++)
+	keys[j] = (unsigned int)(j * 3 + 1);
+
+    timer_start();
+    __pmHashReserve(nmetrics, &hc);
+    for (i = 0; i < nmetrics; i++) {
+	if ((ihc = (__pmHashCtl *)calloc(1, sizeof(__pmHashCtl))) == NULL) {
+	    perror("calloc");
+	    exit(1);
+	}
+	check("bulk add", __pmHashAddBulk(ninst, keys, NULL, ihc) == ninst);
+	__pmHashAdd(pmidkey(i), (void *)ihc, &hc);
+    }
+    timer_stop("replay setup", (double)nmetrics * ninst);
+
+    nlookup = (long)nmetrics * (ninst + 1) * (nfetch / 10);
+    timer_start();
+    for (n = 0, f = 0; f < nfetch / 10; f++) {
+	for (i = 0; i < nmetrics; i++) {
+	    if ((hp = __pmHashSearch(pmidkey(i), &hc)) == NULL)
+		continue;
+	    n++;
+	    ihc = (__pmHashCtl *)hp->data;
+	    for (j = 0; j < ninst; j++) {
+		if ((ihp = __pmHashSearch(keys[(j + f) % ninst], ihc)) != NULL)
+		    n++;
+	    }
+	}
+    }
+    timer_stop("replay lookup", nlookup);
+    check("replay lookup", n == nlookup);
+
+    timer_start();
+    for (n = 0, f = 0; f < nfetch / 10; f++) {
+	for (i = 0; i < nmetrics; i++) {
+	    if ((hp = chainsearch(pmidkey(i), &hc)) == NULL)
+		continue;
+	    n++;
+	    ihc = (__pmHashCtl *)hp->data;
+	    for (j = 0; j < ninst; j++) {
+		if ((ihp = chainsearch(keys[(j + f) % ninst], ihc)) != NULL)
+		    n++;
+	    }
+	}
+    }
+    timer_stop("replay lookup (chained)", nlookup);
+
+    printf("replay: %d metrics x %d instances, %ld lookups\n",
+	    nmetrics, ninst, nlookup);
+
+    for (ok = 1, hp = __pmHashWalk(&hc, PM_HASH_WALK_START); hp != NULL;
+	 hp = __pmHashWalk(&hc, PM_HASH_WALK_NEXT)) {
+	ihc = (__pmHashCtl *)hp->data;
+	for (n = 0, ihp = __pmHashWalk(ihc, PM_HASH_WALK_START); ihp != NULL;
+	     ihp = __pmHashWalk(ihc, PM_HASH_WALK_NEXT)) {
+	    free(ihp);
+	    n++;
+	}
+	if (n != ninst)
+	    ok = 0;
+	__pmHashClear(ihc);
+	free(ihc);
+	free(hp);
+    }
+    check("replay walk", ok);
+    __pmHashClear(&hc);
+    free(keys);
+}
+
+static __pmHashWalkState
+dropodd(const __pmHashNode *hp, void *arg)
+{
+    (void)arg;
+    return ((long)hp->data & 1) ? PM_HASH_WALK_DELETE_NEXT : PM_HASH_WALK_NEXT;
+}
+
+/*
+ * Duplicate keys and deletions, checking every search against the
+ * chains after each change.
+ */
+static void
+churn(void)
+{
+    __pmHashCtl		hc = { 0 };
+    __pmHashNode	*hp;
+    long		i, n;
+    int			ok = 1;
+
+    for (i = 0; i < nmetrics; i++) {
+	__pmHashAdd((unsigned int)(i % (nmetrics / 4 + 1)), (void *)i, &hc);
+	if (__pmHashSearch((unsigned int)(i % (nmetrics / 4 + 1)), &hc) !=
+	    chainsearch((unsigned int)(i % (nmetrics / 4 + 1)), &hc))
+	    ok = 0;
+    }
+    check("churn add", ok);
+
+    __pmHashWalkCB(dropodd, NULL, &hc);
+    for (n = 0, hp = __pmHashWalk(&hc, PM_HASH_WALK_START); hp != NULL;
+	 hp = __pmHashWalk(&hc, PM_HASH_WALK_NEXT)) {
+	if ((long)hp->data & 1)
+	    ok = 0;
+	n++;
+    }
+    check("churn walk delete", ok && n == (nmetrics + 1) / 2);
+
+    for (i = 0; i < nmetrics; i += 3)
+	__pmHashDel((unsigned int)(i % (nmetrics / 4 + 1)), (void *)i, &hc);
+    for (i = 0; i <= nmetrics / 4; i++) {
+	if (__pmHashSearch((unsigned int)i, &hc) != chainsearch((unsigned int)i, &hc))
+	    ok = 0;
+    }
+    check("churn delete", ok);
+
+    for (n = 0, hp = __pmHashWalk(&hc, PM_HASH_WALK_START); hp != NULL;
+	 hp = __pmHashWalk(&hc, PM_HASH_WALK_NEXT)) {
+	__pmHashDel(hp->key, hp->data, &hc);
+	n++;
+    }
+    check("churn empty", __pmHashSearch(0, &hc) == NULL && hc.nkeys == 0);
+    printf("churn: %d adds, %ld remained\n", nmetrics, n);
+    __pmHashClear(&hc);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		c;
+    int		errflag = 0;
+    char	*endnum;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "f:i:n:t?")) != EOF) {
+	switch (c) {
+
+	case 'f':	/* fetches replayed */
+	    nfetch = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nfetch < 10) {
+		fprintf(stderr, "%s: -f requires numeric argument >= 10\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'i':	/* instances per metric */
+	    ninst = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || ninst < 1) {
+		fprintf(stderr, "%s: -i requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'n':	/* metrics */
+	    nmetrics = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nmetrics < 1) {
+		fprintf(stderr, "%s: -n requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* report timings on stderr */
+	    tflag++;
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [-t] [-f fetches] [-i instances] [-n metrics]\n", pmGetProgname());
+	exit(1);
+    }
+
+    pmids();
+    replay();
+    churn();
+
+    exit(errors != 0);
+}
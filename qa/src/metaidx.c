@@ -0,0 +1,53 @@
+/*
+ * Write the binary .metaidx index for each archive named on the
+ * command line, using __pmLogWriteMetaIndex().
+ *
+ * Copyright (c) 2018 Red Hat.
+ */
+
+#include <pcp/pmapi.h>
+#include "libpcp.h"
+
+int
+main(int argc, char *argv[])
+{
+    int		c;
+    int		sts;
+    int		errflag = 0;
+    int		exitsts = 0;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "D:")) != EOF) {
+	switch (c) {
+
+	case 'D':	/* debug options */
+	    sts = pmSetDebug(optarg);
+	    if (sts < 0) {
+		fprintf(stderr, "%s: unrecognized debug options specification (%s)\n",
+		    pmGetProgname(), optarg);
+		errflag++;
+	    }
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind == argc) {
+	fprintf(stderr, "Usage: %s [-D debug] archive ...\n", pmGetProgname());
+	exit(1);
+    }
+
+    for ( ; optind < argc; optind++) {
+	if ((sts = __pmLogWriteMetaIndex(argv[optind])) < 0) {
+	    fprintf(stderr, "%s: %s: %s\n", pmGetProgname(), argv[optind], pmErrStr(sts));
+	    exitsts = 1;
+	}
+    }
+
+    exit(exitsts);
+}
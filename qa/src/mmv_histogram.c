@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Many threads observing values into MMV histogram and sketch
+ * metrics concurrently (lock-free bucket updates).  Every thread
+ * observes the same, known, distribution so the counts and the
+ * quantiles derived by pmdammv are exact and predictable.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/mmv_stats.h>
+#include <pthread.h>
+
+static mmv_instances2_t instances[] = {
+    {	.internal = 0, .external = "zero" },
+};
+
+static mmv_indom2_t indoms[] = {
+    {	.serial = 1,
+	.count = 1,
+	.instances = instances,
+    },
+};
+
+static mmv_metric2_t metrics[] = {
+    {	.name = "latency",
+	.item = 1,
+	.type = MMV_TYPE_HISTOGRAM,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,1,0,0,PM_TIME_USEC,0),
+	.shorttext = "Uniformly distributed, zero up to the count",
+    },
+    {	.name = "response",
+	.item = 2,
+	.type = MMV_TYPE_SKETCH,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,1,0,0,PM_TIME_SEC,0),
+	.shorttext = "Uniformly distributed, milliseconds up to count",
+    },
+    {	.name = "small",
+	.item = 3,
+	.type = MMV_TYPE_HISTOGRAM,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "Zero to nine, one bucket each",
+    },
+    {	.name = "requests",
+	.item = 4,
+	.type = MMV_TYPE_U64,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE),
+	.shorttext = "Observations made by all threads",
+    },
+    {	.name = "clashing",	/* derived items 532-535, one is taken */
+	.item = 5,
+	.type = MMV_TYPE_HISTOGRAM,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "Never observed, p50 item used by \"taken\"",
+    },
+    {	.name = "taken",
+	.item = 533,
+	.type = MMV_TYPE_U32,
+	.semantics = MMV_SEM_INSTANT,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "Uses an item reserved for derived metrics",
+    },
+    {	.name = "high",		/* no reserved items for this one */
+	.item = 200,
+	.type = MMV_TYPE_SKETCH,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "Never observed, item too high for derived metrics",
+    },
+};
+
+static void		*map;
+static pmAtomValue	*latency, *response, *small, *requests;
+static int		count = 100000;		/* -c */
+
+static void *
+observe(void *arg)
+{
+    int		named = (*(int *)arg == 0);
+    int		i;
+
+    for (i = 0; i < count; i++) {
+	if (named)	/* one thread uses the names, the rest handles */
+	    mmv_stats_observe(map, "latency", NULL, i);
+	else
+	    mmv_observe_value(map, latency, i);
+	mmv_observe_value(map, response, (i + 1) / 1000.0);
+	mmv_observe_value(map, small, i % 10);
+	mmv_inc_atomvalue(map, requests, 1);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    pthread_t		*threads;
+    int			*ids;
+    struct timeval	start, end;
+    mmv_metric2_t	bad = metrics[0];
+    char		*endnum;
+    int			nthreads = 4;
+    int			vflag = 0;
+    int			errflag = 0;
+    int			c, i, sts;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "c:t:v?")) != EOF) {
+	switch (c) {
+
+	case 'c':	/* observations per thread */
+	    count = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || count < 1) {
+		fprintf(stderr, "%s: -c requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* number of observing threads */
+	    nthreads = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nthreads < 1) {
+		fprintf(stderr, "%s: -t requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'v':	/* report observation rate on stderr */
+	    vflag++;
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [-v] [-c count] [-t threads]\n", pmGetProgname());
+	exit(1);
+    }
+
+    /* buckets are the instances, so no instance domain is allowed */
+    bad.indom = 1;
+    map = mmv_stats2_init("histogram", 42, 0, &bad, 1, indoms, 1);
+    printf("histogram with indom: %s\n", map ? "accepted" : osstrerror());
+
+    map = mmv_stats2_init("histogram", 42, 0,
+			metrics, sizeof(metrics) / sizeof(metrics[0]),
+			NULL, 0);
+    if (!map) {
+	fprintf(stderr, "mmv_stats2_init failed: %s\n", osstrerror());
+	exit(1);
+    }
+
+    latency = mmv_lookup_value_desc(map, "latency", NULL);
+    response = mmv_lookup_value_desc(map, "response", NULL);
+    small = mmv_lookup_value_desc(map, "small", NULL);
+    requests = mmv_lookup_value_desc(map, "requests", NULL);
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    ids = calloc(nthreads, sizeof(int));
+    if (threads == NULL || ids == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    pmtimevalNow(&start);
+    for (i = 0; i < nthreads; i++) {
+	ids[i] = i;
+	if ((sts = pthread_create(&threads[i], NULL, observe, &ids[i])) != 0) {
+	    fprintf(stderr, "pthread_create: %s\n", pmErrStr(-sts));
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    pmtimevalNow(&end);
+
+    printf("mmv.histogram: %d threads, %d observations each\n", nthreads, count);
+    printf("value counts: latency %" FMT_UINT64 " response %" FMT_UINT64
+	   " small %" FMT_UINT64 "\n", latency->ull, response->ull, small->ull);
+    if (vflag) {
+	double	secs = pmtimevalSub(&end, &start);
+	double	nops = 3.0 * nthreads * count;
+
+	fprintf(stderr, "histogram: %.3f sec, %.1f nsec/observation\n",
+		secs, secs > 0 ? secs * 1e9 / nops : 0);
+    }
+    free(threads);
+    free(ids);
+    return 0;
+}
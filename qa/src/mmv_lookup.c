@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Look up every value in a large MMV file by name (metric, and
+ * instance where there is one), checking each handle returned by
+ * mmv_lookup_value_desc against the position of that value in the
+ * values section - lookups go through the hashed name index, so this
+ * exercises both the index written by mmv_init and its probing.
+ * Lookup timings are only reported with -t, so the output is stable.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/mmv_stats.h>
+#include <pcp/mmv_dev.h>
+
+static int	nmetrics = 1000;	/* -n */
+static int	ninstances = 100;	/* -i */
+static int	tflag;			/* -t */
+static int	errors;
+
+static char **
+names(const char *prefix, int count)
+{
+    char	**list, buffer[MMV_NAMEMAX];
+    int		i;
+
+    if ((list = (char **)calloc(count, sizeof(char *))) == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    for (i = 0; i < count; i++) {
+	pmsprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+	if ((list[i] = strdup(buffer)) == NULL) {
+	    perror("strdup");
+	    exit(1);
+	}
+    }
+    return list;
+}
+
+static void *
+create(int version, char **mnames, char **inames)
+{
+    mmv_metric_t	*metrics1;
+    mmv_metric2_t	*metrics2;
+    mmv_instances_t	*instances1;
+    mmv_instances2_t	*instances2;
+    mmv_indom_t		indom1 = { .serial = 1, .count = ninstances };
+    mmv_indom2_t	indom2 = { .serial = 1, .count = ninstances };
+    void		*map;
+    int			i;
+
+    metrics1 = (mmv_metric_t *)calloc(nmetrics, sizeof(mmv_metric_t));
+    metrics2 = (mmv_metric2_t *)calloc(nmetrics, sizeof(mmv_metric2_t));
+    instances1 = (mmv_instances_t *)calloc(ninstances, sizeof(mmv_instances_t));
+    instances2 = (mmv_instances2_t *)calloc(ninstances, sizeof(mmv_instances2_t));
+    if (!metrics1 || !metrics2 || !instances1 || !instances2) {
+	perror("calloc");
+	exit(1);
+    }
+    for (i = 0; i < ninstances; i++) {
+	instances1[i].internal = instances2[i].internal = i;
+	strncpy(instances1[i].external, inames[i], MMV_NAMEMAX-1);
+	instances2[i].external = inames[i];
+    }
+    indom1.instances = instances1;
+    indom2.instances = instances2;
+
+    /* all singular, except the one in the middle which has instances */
+    for (i = 0; i < nmetrics; i++) {
+	strncpy(metrics1[i].name, mnames[i], MMV_NAMEMAX-1);
+	metrics2[i].name = mnames[i];
+	metrics1[i].item = metrics2[i].item = i + 1;
+	metrics1[i].type = metrics2[i].type = MMV_TYPE_U64;
+	metrics1[i].semantics = metrics2[i].semantics = MMV_SEM_COUNTER;
+	metrics1[i].indom = metrics2[i].indom = (i == nmetrics / 2);
+    }
+
+    if (version == MMV_VERSION1)
+	map = mmv_stats_init("lookup", 42, 0,
+			metrics1, nmetrics, &indom1, 1);
+    else
+	map = mmv_stats2_init("lookup2", 43, 0,
+			metrics2, nmetrics, &indom2, 1);
+    if (!map) {
+	fprintf(stderr, "mmv_stats_init failed: %s\n", osstrerror());
+	exit(1);
+    }
+    free(metrics1);
+    free(metrics2);
+    free(instances1);
+    free(instances2);
+    return map;
+}
+
+static mmv_disk_toc_t *
+lookup_toc(void *map, int type)
+{
+    mmv_disk_header_t	*hdr = (mmv_disk_header_t *)map;
+    mmv_disk_toc_t	*toc = (mmv_disk_toc_t *)(hdr + 1);
+    int			i;
+
+    for (i = 0; i < hdr->tocs; i++)
+	if (toc[i].type == type)
+	    return &toc[i];
+    return NULL;
+}
+
+static void
+check(const char *what, pmAtomValue *value, pmAtomValue *expect)
+{
+    if (value != expect) {
+	printf("%s: handle %p, expected %p\n", what, value, expect);
+	errors++;
+    }
+}
+
+static void
+lookups(int version)
+{
+    mmv_disk_toc_t	*toc, *hash;
+    mmv_disk_value_t	*values;
+    struct timeval	start, end;
+    char		**mnames, **inames;
+    void		*map;
+    int			i, j, k, before = errors;
+
+    mnames = names("metric.", nmetrics);
+    inames = names("instance ", ninstances);
+    map = create(version, mnames, inames);
+
+    if ((toc = lookup_toc(map, MMV_TOC_VALUES)) == NULL) {
+	printf("version %d: no values section\n", version);
+	errors++;
+	return;
+    }
+    values = (mmv_disk_value_t *)((char *)map + toc->offset);
+    if ((hash = lookup_toc(map, MMV_TOC_HASH)) == NULL) {
+	printf("version %d: no name index\n", version);
+	errors++;
+	return;
+    }
+
+    /* values are laid out in metric order, then instance order */
+    for (i = k = 0; i < nmetrics; i++) {
+	if (i != nmetrics / 2) {
+	    check(mnames[i],
+		    mmv_lookup_value_desc(map, mnames[i], NULL), &values[k++].value);
+	    continue;
+	}
+	for (j = 0; j < ninstances; j++)
+	    check(inames[j],
+		    mmv_lookup_value_desc(map, mnames[i], inames[j]), &values[k++].value);
+    }
+
+    /* instance names are ignored for singular metrics, as always */
+    check("singular", mmv_lookup_value_desc(map, mnames[0], "none"),
+		&values[0].value);
+    check("no instance",
+		mmv_lookup_value_desc(map, mnames[nmetrics / 2], NULL), NULL);
+    check("bad instance",
+		mmv_lookup_value_desc(map, mnames[nmetrics / 2], "none"), NULL);
+    check("bad metric", mmv_lookup_value_desc(map, "none", NULL), NULL);
+
+    printf("version %d: %d values, %d buckets, %d lookups%s\n",
+		version, toc->count, hash->count, k + 4,
+		errors == before ? " ok" : " FAILED");
+
+    if (tflag) {
+	pmtimevalNow(&start);
+	for (i = 0; i < nmetrics; i++)
+	    mmv_stats_inc(map, mnames[i], i == nmetrics / 2 ? inames[0] : NULL);
+	pmtimevalNow(&end);
+	fprintf(stderr, "version %d: %.1f nsec/update by name\n", version,
+		pmtimevalSub(&end, &start) * 1e9 / nmetrics);
+    }
+
+    mmv_stats_stop(version == MMV_VERSION1 ? "lookup" : "lookup2", map);
+    for (i = 0; i < nmetrics; i++)
+	free(mnames[i]);
+    for (i = 0; i < ninstances; i++)
+	free(inames[i]);
+    free(mnames);
+    free(inames);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		c;
+    int		errflag = 0;
+    char	*endnum;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "i:n:t?")) != EOF) {
+	switch (c) {
+
+	case 'i':	/* instances of the one metric with an indom */
+	    ninstances = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || ninstances < 1) {
+		fprintf(stderr, "%s: -i requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'n':	/* number of metrics */
+	    nmetrics = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nmetrics < 2) {
+		fprintf(stderr, "%s: -n requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* report timings on stderr */
+	    tflag++;
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [-t] [-i instances] [-n metrics]\n", pmGetProgname());
+	exit(1);
+    }
+
+    lookups(MMV_VERSION1);
+    lookups(MMV_VERSION2);
+
+    exit(errors != 0);
+}
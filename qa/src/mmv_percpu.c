@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Many threads updating the same MMV values concurrently, either
+ * through per-CPU value slots (default) or lock-free updates of the
+ * shared values themselves (-a).  Nothing may be lost either way -
+ * the totals fetched through pmdammv must be exact.
+ */
+
+#include <pcp/pmapi.h>
+#include <pcp/mmv_stats.h>
+#include <pthread.h>
+
+static mmv_instances2_t instances[] = {
+    {	.internal = 0, .external = "even" },
+    {	.internal = 1, .external = "odd" },
+};
+
+static mmv_indom2_t indoms[] = {
+    {	.serial = 1,
+	.count = 2,
+	.instances = instances,
+	.shorttext = "Parity of the updating thread",
+    },
+};
+
+static mmv_metric2_t metrics[] = {
+    {	.name = "counter",
+	.item = 1,
+	.type = MMV_TYPE_U64,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,1,0,0,PM_COUNT_ONE),
+	.shorttext = "Updates made by all threads",
+    },
+    {	.name = "bytes",
+	.item = 2,
+	.type = MMV_TYPE_U32,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(1,0,0,PM_SPACE_BYTE,0,0),
+	.indom = 1,
+	.shorttext = "Two bytes per update, by thread parity",
+    },
+    {	.name = "total",
+	.item = 3,
+	.type = MMV_TYPE_DOUBLE,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "One half per update, double precision",
+    },
+    {	.name = "share",
+	.item = 4,
+	.type = MMV_TYPE_FLOAT,
+	.semantics = MMV_SEM_COUNTER,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "One quarter per update, single precision",
+    },
+    {	.name = "balance",
+	.item = 5,
+	.type = MMV_TYPE_I64,
+	.semantics = MMV_SEM_INSTANT,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "Decremented once per update",
+    },
+    {	.name = "gauge",
+	.item = 6,
+	.type = MMV_TYPE_I32,
+	.semantics = MMV_SEM_INSTANT,
+	.dimension = MMV_UNITS(0,0,0,0,0,0),
+	.shorttext = "Set (not incremented) by every thread",
+    },
+};
+
+static void		*map;
+static pmAtomValue	*counter, *bytes[2], *total, *share, *balance, *gauge;
+static int		count = 100000;		/* -c */
+
+static void *
+update(void *arg)
+{
+    int		parity = *(int *)arg % 2;
+    int		i;
+
+    for (i = 0; i < count; i++) {
+	mmv_inc_atomvalue(map, counter, 1);
+	mmv_inc_atomvalue(map, bytes[parity], 2);
+	mmv_inc_atomvalue(map, total, 0.5);
+	mmv_inc_atomvalue(map, share, 0.25);
+	mmv_inc_atomvalue(map, balance, -1);
+	if (i % 1000 == 0)
+	    mmv_set_atomvalue(map, gauge, 42);
+    }
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    pthread_t		*threads;
+    int			*ids;
+    struct timeval	start, end;
+    mmv_stats_flags_t	flags = MMV_FLAG_PERCPU;
+    const char		*file = "percpu";
+    char		*endnum;
+    int			cluster = 40;
+    int			nthreads = 8;
+    int			vflag = 0;
+    int			errflag = 0;
+    int			c, i, sts;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "ac:t:v?")) != EOF) {
+	switch (c) {
+
+	case 'a':	/* shared values, no per-CPU slots */
+	    flags &= ~MMV_FLAG_PERCPU;
+	    file = "atomic";
+	    cluster = 41;
+	    break;
+
+	case 'c':	/* updates per thread */
+	    count = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || count < 1) {
+		fprintf(stderr, "%s: -c requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* number of updating threads */
+	    nthreads = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nthreads < 1) {
+		fprintf(stderr, "%s: -t requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'v':	/* report update rate on stderr */
+	    vflag++;
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [-av] [-c count] [-t threads]\n", pmGetProgname());
+	exit(1);
+    }
+
+    map = mmv_stats2_init(file, cluster, flags,
+			metrics, sizeof(metrics) / sizeof(metrics[0]),
+			indoms, sizeof(indoms) / sizeof(indoms[0]));
+    if (!map) {
+	fprintf(stderr, "mmv_stats2_init failed: %s\n", osstrerror());
+	exit(1);
+    }
+
+    counter = mmv_lookup_value_desc(map, "counter", NULL);
+    bytes[0] = mmv_lookup_value_desc(map, "bytes", "even");
+    bytes[1] = mmv_lookup_value_desc(map, "bytes", "odd");
+    total = mmv_lookup_value_desc(map, "total", NULL);
+    share = mmv_lookup_value_desc(map, "share", NULL);
+    balance = mmv_lookup_value_desc(map, "balance", NULL);
+    gauge = mmv_lookup_value_desc(map, "gauge", NULL);
+
+    /* setting a value must discard anything added before it */
+    mmv_inc_value(map, gauge, 5);
+    mmv_stats_inc_atomic(map, "gauge", NULL);
+
+    threads = calloc(nthreads, sizeof(pthread_t));
+    ids = calloc(nthreads, sizeof(int));
+    if (threads == NULL || ids == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    pmtimevalNow(&start);
+    for (i = 0; i < nthreads; i++) {
+	ids[i] = i;
+	if ((sts = pthread_create(&threads[i], NULL, update, &ids[i])) != 0) {
+	    fprintf(stderr, "pthread_create: %s\n", pmErrStr(-sts));
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    pmtimevalNow(&end);
+
+    printf("mmv.%s: %d threads, %d updates each\n", file, nthreads, count);
+    if (vflag) {
+	double	secs = pmtimevalSub(&end, &start);
+	double	nops = 5.0 * nthreads * count;
+
+	fprintf(stderr, "%s: %.3f sec, %.1f nsec/update, %.0f updates/sec\n",
+		file, secs, secs > 0 ? secs * 1e9 / nops : 0,
+		secs > 0 ? nops / secs : 0);
+    }
+    free(threads);
+    free(ids);
+    return 0;
+}
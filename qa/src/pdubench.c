@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Exercise and time the libpcp PDU buffer pool (__pmFindPDUBuf et al).
+ *
+ * Workloads follow the buffer traffic of pmcd and pmproxy: a mix of
+ * small request PDUs and PDU_CHUNK sized reads with many buffers in
+ * use at once, pmResult encode and
+ * decode (two pinned buffers per result, values referenced from the
+ * inside of one of them), and the same again from several threads at
+ * once.  Results are checked as we go and __pmCountPDUBuf() must show
+ * nothing left pinned; timings are only reported with -t, so the
+ * output is stable.
+ */
+
+#include <pcp/pmapi.h>
+#include "libpcp.h"
+#include <pthread.h>
+
+static int	niter = 20000;		/* -i */
+static int	nmetrics = 50;		/* -n */
+static int	ninst = 8;		/* -v */
+static int	nthreads = 4;		/* -T */
+static int	nring = 64;		/* -r */
+static int	tflag;			/* -t */
+static int	errors;
+
+static struct timeval	start;
+
+static void
+timer_start(void)
+{
+    pmtimevalNow(&start);
+}
+
+static void
+timer_stop(const char *what, double nops)
+{
+    struct timeval	now;
+    double		secs;
+
+    pmtimevalNow(&now);
+    secs = pmtimevalSub(&now, &start);
+    if (tflag)
+	fprintf(stderr, "%s: %.3f sec, %.1f nsec/op, %.0f op/sec\n",
+		what, secs, nops > 0 ? secs * 1e9 / nops : 0,
+		secs > 0 ? nops / secs : 0);
+}
+
+static void
+check(const char *what, int ok)
+{
+    if (!ok) {
+	printf("%s: FAILED\n", what);
+	errors++;
+    }
+}
+
+static int
+pinned(void)
+{
+    int		alloc, nfree;
+
+    __pmCountPDUBuf(0, &alloc, &nfree);
+    return alloc;
+}
+
+/* request sizes, roughly as a busy pmcd sees them */
+static const int sizes[] = {
+    16, 24, 40, 64, 100, PDU_CHUNK, PDU_CHUNK, PDU_CHUNK, 200, 2000,
+    PDU_CHUNK, 4096, 12, PDU_CHUNK, 700, 9000, PDU_CHUNK, 70000,
+};
+#define NSIZES	(sizeof(sizes) / sizeof(sizes[0]))
+
+/*
+ * A window of nring buffers in use at once, like pmcd with a crowd
+ * of clients; the oldest is released (with an extra pin and unpin
+ * from inside the buffer, as pmFreeResult does) as each new one is
+ * found.
+ */
+static void
+alloc(void)
+{
+    __pmPDU	**ring;
+    char	*cp;
+    long	i;
+    int		r, need, ok = 1;
+
+    if ((ring = (__pmPDU **)calloc(nring, sizeof(__pmPDU *))) == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+
+    timer_start();
+    for (i = 0; i < niter + nring; i++) {
+	r = i % nring;
+	if (ring[r] != NULL) {
+	    need = sizes[(i - nring) % NSIZES];
+	    cp = (char *)ring[r] + ((need / 2) & ~(sizeof(int) - 1));
+	    __pmPinPDUBuf(cp);
+	    if (__pmUnpinPDUBuf(cp) != 1 || __pmUnpinPDUBuf(ring[r]) != 1)
+		ok = 0;
+	    if (__pmUnpinPDUBuf(ring[r]) != 0)
+		ok = 0;
+	    ring[r] = NULL;
+	}
+	if (i >= niter)
+	    continue;
+	need = sizes[i % NSIZES];
+	if ((ring[r] = __pmFindPDUBuf(need)) == NULL) {
+	    ok = 0;
+	    break;
+	}
+	cp = (char *)ring[r];
+	cp[0] = cp[need - 1] = (char)r;
+    }
+    timer_stop("alloc", niter);
+    check("alloc", ok);
+    check("alloc pinned", pinned() == 0);
+
+    timer_start();
+    for (i = 0; i < niter + nring; i++) {
+	r = i % nring;
+	if (ring[r] != NULL) {
+	    free(ring[r]);
+	    ring[r] = NULL;
+	}
+	if (i >= niter)
+	    continue;
+	need = sizes[i % NSIZES];
+	if ((ring[r] = (__pmPDU *)malloc(need)) == NULL)
+	    break;
+	cp = (char *)ring[r];
+	cp[0] = cp[need - 1] = (char)r;
+    }
+    timer_stop("alloc (malloc)", niter);
+    free(ring);
+
+    printf("alloc: %d iterations, %d in use, %d sizes\n",
+	    niter, nring, (int)NSIZES);
+}
+
+static pmResult *
+mkresult(void)
+{
+    pmResult	*rp;
+    pmValueSet	*vsp;
+    pmAtomValue	av;
+    int		i, j, sts;
+
+    if ((rp = (pmResult *)calloc(1, sizeof(pmResult) + (nmetrics - 1) * sizeof(pmValueSet *))) == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    rp->timestamp.tv_sec = 1500000000;
+    rp->numpmid = nmetrics;
+    for (i = 0; i < nmetrics; i++) {
+	if ((vsp = (pmValueSet *)calloc(1, sizeof(pmValueSet) + (ninst - 1) * sizeof(pmValue))) == NULL) {
+	    perror("calloc");
+	    exit(1);
+	}
+	vsp->pmid = pmID_build(60, i / 16, i % 16);
+	vsp->numval = ninst;
+	for (j = 0; j < ninst; j++) {
+	    vsp->vlist[j].inst = j;
+	    if (i % 2) {
+		/* 64-bit counters, in pmValueBlocks */
+		av.ull = (__uint64_t)i * 1000000007ULL + j;
+		sts = __pmStuffValue(&av, &vsp->vlist[j], PM_TYPE_U64);
+	    }
+	    else {
+		av.ul = i * 1000 + j;
+		sts = __pmStuffValue(&av, &vsp->vlist[j], PM_TYPE_U32);
+	    }
+	    if (sts < 0) {
+		fprintf(stderr, "__pmStuffValue: %s\n", pmErrStr(sts));
+		exit(1);
+	    }
+	    vsp->valfmt = sts;
+	}
+	rp->vset[i] = vsp;
+    }
+    return rp;
+}
+
+static int
+sameresult(const pmResult *a, const pmResult *b)
+{
+    pmAtomValue	ava, avb;
+    int		i, j, type;
+
+    if (a->numpmid != b->numpmid ||
+	a->timestamp.tv_sec != b->timestamp.tv_sec)
+	return 0;
+    for (i = 0; i < a->numpmid; i++) {
+	if (a->vset[i]->pmid != b->vset[i]->pmid ||
+	    a->vset[i]->numval != b->vset[i]->numval ||
+	    a->vset[i]->valfmt != b->vset[i]->valfmt)
+	    return 0;
+	type = (i % 2) ? PM_TYPE_U64 : PM_TYPE_U32;
+	for (j = 0; j < a->vset[i]->numval; j++) {
+	    if (a->vset[i]->vlist[j].inst != b->vset[i]->vlist[j].inst)
+		return 0;
+	    pmExtractValue(a->vset[i]->valfmt, &a->vset[i]->vlist[j], type, &ava, type);
+	    pmExtractValue(b->vset[i]->valfmt, &b->vset[i]->vlist[j], type, &avb, type);
+	    if (memcmp(&ava, &avb, sizeof(ava)) != 0)
+		return 0;
+	}
+    }
+    return 1;
+}
+
+/* encode and decode rp niter times, return the number of failures */
+static long
+encdec(const pmResult *rp)
+{
+    pmResult	*nrp;
+    __pmPDU	*pb;
+    long	i, bad = 0;
+
+    for (i = 0; i < niter; i++) {
+	if (__pmEncodeResult(-1, rp, &pb) < 0) {
+	    bad++;
+	    continue;
+	}
+	if (__pmDecodeResult(pb, &nrp) < 0) {
+	    __pmUnpinPDUBuf(pb);
+	    bad++;
+	    continue;
+	}
+	/* full check now and then, it costs more than the decode */
+	if (i % 64 == 0 && !sameresult(rp, nrp))
+	    bad++;
+	pmFreeResult(nrp);
+	__pmUnpinPDUBuf(pb);
+    }
+    return bad;
+}
+
+static void
+result(const pmResult *rp)
+{
+    timer_start();
+    check("result", encdec(rp) == 0);
+    timer_stop("result encode+decode", niter);
+    check("result pinned", pinned() == 0);
+
+    printf("result: %d iterations, %d metrics x %d instances\n",
+	    niter, nmetrics, ninst);
+}
+
+static void *
+worker(void *arg)
+{
+    return (void *)encdec((const pmResult *)arg);
+}
+
+static void
+threads(const pmResult *rp)
+{
+    pthread_t	*tid;
+    void	*bad;
+    long	nbad = 0;
+    int		i;
+
+    if ((tid = (pthread_t *)malloc(nthreads * sizeof(pthread_t))) == NULL) {
+	perror("malloc");
+	exit(1);
+    }
+    timer_start();
+    for (i = 0; i < nthreads; i++) {
+	if (pthread_create(&tid[i], NULL, worker, (void *)rp) != 0) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nthreads; i++) {
+	pthread_join(tid[i], &bad);
+	nbad += (long)bad;
+    }
+    timer_stop("threads encode+decode", (double)niter * nthreads);
+    check("threads", nbad == 0);
+    check("threads pinned", pinned() == 0);
+    free(tid);
+
+    printf("threads: %d x %d iterations\n", nthreads, niter);
+}
+
+int
+main(int argc, char **argv)
+{
+    int		c;
+    int		errflag = 0;
+    char	*endnum;
+    pmResult	*rp;
+
+    pmSetProgname(argv[0]);
+
+    while ((c = getopt(argc, argv, "i:n:r:T:tv:?")) != EOF) {
+	switch (c) {
+
+	case 'i':	/* iterations */
+	    niter = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || niter < 1) {
+		fprintf(stderr, "%s: -i requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'n':	/* metrics per pmResult */
+	    nmetrics = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nmetrics < 1) {
+		fprintf(stderr, "%s: -n requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'r':	/* buffers in use at once */
+	    nring = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nring < 1) {
+		fprintf(stderr, "%s: -r requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 'T':	/* threads */
+	    nthreads = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || nthreads < 1) {
+		fprintf(stderr, "%s: -T requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case 't':	/* report timings on stderr */
+	    tflag++;
+	    break;
+
+	case 'v':	/* values (instances) per metric */
+	    ninst = (int)strtol(optarg, &endnum, 10);
+	    if (*endnum != '\0' || ninst < 1) {
+		fprintf(stderr, "%s: -v requires numeric argument\n", pmGetProgname());
+		errflag++;
+	    }
+	    break;
+
+	case '?':
+	default:
+	    errflag++;
+	    break;
+	}
+    }
+
+    if (errflag || optind != argc) {
+	fprintf(stderr, "Usage: %s [-t] [-i iterations] [-n metrics] [-r inuse] [-T threads] [-v instances]\n", pmGetProgname());
+	exit(1);
+    }
+
+    alloc();
+    rp = mkresult();
+    result(rp);
+    threads(rp);
+    pmFreeResult(rp);
+
+    exit(errors != 0);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * Exercise libpcp __pmPollSet interfaces, optionally with descriptors
+ * beyond FD_SETSIZE, for input and for output.
+ */
+
+#include <pcp/pmapi.h>
+#include "libpcp.h"
+
+#define NPIPES	3
+
+static void
+report_output(__pmPollSet *set, int rfd, int wfd, const char *what)
+{
+    struct timeval	timeout = { 0, 0 };
+
+    __pmPollSetWait(set, NULL, &timeout);
+    printf("%s: readable=%d writable=%d\n", what,
+		__pmPollSetIsReady(set, rfd) != 0,
+		__pmPollSetIsWritable(set, wfd) != 0);
+}
+
+static void
+report(__pmPollSet *set, int *fds, int n, const char *what)
+{
+    struct timeval	timeout = { 0, 0 };
+    int			*ready;
+    int			i, sts;
+
+    sts = __pmPollSetWait(set, &ready, &timeout);
+    printf("%s: wait -> %d\n", what, sts);
+    for (i = 0; i < n; i++)
+	printf("  pipe[%d] member=%d ready=%d\n", i,
+		__pmPollSetIsMember(set, fds[i]) != 0,
+		__pmPollSetIsReady(set, fds[i]) != 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    __pmPollSet	*set;
+    int		rfd[NPIPES+1], wfd[NPIPES+1];
+    int		i, sts, n = NPIPES;
+    int		pfd[2];
+    char	c = 'x';
+    char	buf[4096];
+
+    pmSetProgname(argv[0]);
+
+    if ((set = __pmPollSetCreate()) == NULL) {
+	fprintf(stderr, "%s: __pmPollSetCreate failed\n", pmGetProgname());
+	exit(1);
+    }
+    for (i = 0; i < NPIPES; i++) {
+	if (pipe(pfd) < 0) {
+	    perror("pipe");
+	    exit(1);
+	}
+	rfd[i] = pfd[0];
+	wfd[i] = pfd[1];
+	if ((sts = __pmPollSetAdd(set, rfd[i])) < 0)
+	    printf("add pipe[%d]: %s\n", i, pmErrStr(sts));
+    }
+    if (argc > 1 && strcmp(argv[1], "high") == 0) {
+	/* move one descriptor well past the select(2) limits */
+	if (pipe(pfd) < 0) {
+	    perror("pipe");
+	    exit(1);
+	}
+	rfd[n] = FD_SETSIZE + 100;
+	if (dup2(pfd[0], rfd[n]) < 0) {
+	    perror("dup2");
+	    exit(1);
+	}
+	close(pfd[0]);
+	wfd[n] = pfd[1];
+	if ((sts = __pmPollSetAdd(set, rfd[n])) < 0)
+	    printf("add pipe[%d]: %s\n", n, pmErrStr(sts));
+	n++;
+    }
+
+    report(set, rfd, n, "idle");
+
+    if (write(wfd[1], &c, 1) != 1)
+	perror("write");
+    if (n > NPIPES && write(wfd[NPIPES], &c, 1) != 1)
+	perror("write");
+    report(set, rfd, n, "written");
+
+    /* adding again must be harmless, and deletion must hide readiness */
+    __pmPollSetAdd(set, rfd[1]);
+    __pmPollSetDel(set, rfd[1]);
+    printf("deleted pipe[1]: member=%d ready=%d\n",
+		__pmPollSetIsMember(set, rfd[1]) != 0,
+		__pmPollSetIsReady(set, rfd[1]) != 0);
+    report(set, rfd, n, "after delete");
+
+    /* end-of-file is reported as readable too */
+    close(wfd[2]);
+    report(set, rfd, n, "closed");
+
+    /* output: writable while the pipe has room, independent of input */
+    __pmPollSetAddWrite(set, wfd[0]);
+    __pmPollSetAddWrite(set, wfd[0]);
+    report_output(set, rfd[0], wfd[0], "output pipe[0]");
+    fcntl(wfd[0], F_SETFL, fcntl(wfd[0], F_GETFL) | O_NONBLOCK);
+    memset(buf, c, sizeof(buf));
+    while (write(wfd[0], buf, sizeof(buf)) > 0)
+	;
+    report_output(set, rfd[0], wfd[0], "filled pipe[0]");
+    fcntl(rfd[0], F_SETFL, fcntl(rfd[0], F_GETFL) | O_NONBLOCK);
+    while (read(rfd[0], buf, sizeof(buf)) > 0)
+	;
+    report_output(set, rfd[0], wfd[0], "drained pipe[0]");
+    __pmPollSetDelWrite(set, wfd[0]);
+    report_output(set, rfd[0], wfd[0], "no output pipe[0]");
+
+    __pmPollSetDestroy(set);
+    return 0;
+}
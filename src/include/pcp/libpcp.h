@@ -458,6 +458,20 @@ PCP_CALL extern void __pmFD_ZERO(__pmFdSet *);
 PCP_CALL extern void __pmFD_COPY(__pmFdSet *, const __pmFdSet *);
 PCP_CALL extern int __pmSelectRead(int, __pmFdSet *, struct timeval *);
 PCP_CALL extern int __pmSelectWrite(int, __pmFdSet *, struct timeval *);
+
+/* scalable read (and write) readiness sets, not bounded by FD_SETSIZE */
+typedef struct __pmPollSet __pmPollSet;
+PCP_CALL extern __pmPollSet *__pmPollSetCreate(void);
+PCP_CALL extern void __pmPollSetDestroy(__pmPollSet *);
+PCP_CALL extern int __pmPollSetAdd(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetDel(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetAddWrite(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetDelWrite(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetIsMember(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetIsReady(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetIsWritable(__pmPollSet *, int);
+PCP_CALL extern int __pmPollSetWait(__pmPollSet *, int **, struct timeval *);
+
 PCP_CALL extern __pmSockAddr *__pmSockAddrAlloc(void);
 PCP_CALL extern void	     __pmSockAddrFree(__pmSockAddr *);
 PCP_CALL extern size_t	     __pmSockAddrSize(void);
@@ -487,12 +501,20 @@ typedef struct __pmHashNode {
     unsigned int	key;
     void		*data;
 } __pmHashNode;
+typedef struct __pmHashSlot {
+    unsigned int	key;
+    unsigned int	dist;		/* 1 + distance from home, 0 if empty */
+    __pmHashNode	*node;		/* first node on hash chain with key */
+} __pmHashSlot;
 typedef struct __pmHashCtl {
     int			nodes;
     int			hsize;
     __pmHashNode	**hash;
     __pmHashNode	*next;
     unsigned int	index;
+    unsigned int	nslots;		/* size of slots[], 0 or a power of 2 */
+    unsigned int	nkeys;		/* distinct keys in slots[] */
+    __pmHashSlot	*slots;		/* open addressed lookup index */
 } __pmHashCtl;
 typedef enum {
     PM_HASH_WALK_START = 0,
@@ -507,6 +529,8 @@ PCP_CALL extern void __pmHashWalkCB(__pmHashWalkCallback, void *, const __pmHash
 PCP_CALL extern __pmHashNode *__pmHashWalk(__pmHashCtl *, __pmHashWalkState);
 PCP_CALL extern __pmHashNode *__pmHashSearch(unsigned int, __pmHashCtl *);
 PCP_CALL extern int __pmHashAdd(unsigned int, void *, __pmHashCtl *);
+PCP_CALL extern int __pmHashAddBulk(int, const unsigned int *, void * const *, __pmHashCtl *);
+PCP_CALL extern int __pmHashReserve(int, __pmHashCtl *);
 PCP_CALL extern int __pmHashDel(unsigned int, void *, __pmHashCtl *);
 PCP_CALL extern void __pmHashClear(__pmHashCtl *);
 
@@ -559,6 +583,8 @@ typedef struct __pm_fops {
     void	(*__pmclearerr)(__pmFILE *);
     int         (*__pmsetvbuf)(__pmFILE *, char *, int, size_t);
     int		(*__pmclose)(__pmFILE *);
+    void	*(*__pmmap)(__pmFILE *, size_t);	/* optional, see __pmFmap */
+    int		(*__pmreadahead)(__pmFILE *, int, int); /* optional, see __pmFreadahead */
 } __pm_fops;
 
 /* Provide a stdio-like API for __pmFILE */
@@ -580,6 +606,8 @@ PCP_CALL extern int __pmFerror(__pmFILE *);
 PCP_CALL extern void __pmClearerr(__pmFILE *);
 PCP_CALL extern int __pmSetvbuf(__pmFILE *, char *, int, size_t);
 PCP_CALL extern int __pmFclose(__pmFILE *);
+PCP_CALL extern void *__pmFmap(__pmFILE *, size_t);
+PCP_CALL extern int __pmFreadahead(__pmFILE *, int, int);
 
 /* Control for connection to a PMCD */
 typedef struct {
@@ -753,8 +781,10 @@ typedef struct {
     pmTimeval	l_endtime;	/* (when reading) timestamp at logical EOF */
     int		l_numti;	/* (when reading) no. temporal index entries */
     __pmLogTI	*l_ti;		/* (when reading) temporal index */
+    int		l_tisorted;	/* (when reading) l_ti[] in time order */
     struct __pmnsTree	*l_pmns;        /* namespace from meta data */
     int		l_multi;	/* part of a multi-archive context */
+    void	*l_metaidx;	/* (when reading) .metaidx for lazy InDoms */
 } __pmLogCtl;
 
 /* l_state values */
@@ -797,6 +827,8 @@ typedef struct {
     int			ac_num_logs;	/* The number of archives */
     int			ac_cur_log;	/* The currently open archive */
     __pmMultiLogCtl	**ac_log_list;	/* Current set of archives */
+    int			ac_readahead;	/* blocks to decode ahead, 0 for none */
+    int			ac_rathreads;	/* read ahead threads, 0 for auto */
 } __pmArchCtl;
 
 /*
@@ -840,11 +872,15 @@ PCP_CALL extern int __pmLogPutText(__pmArchCtl *, unsigned int , unsigned int, c
 PCP_CALL extern int __pmLogWriteLabel(__pmFILE *, const __pmLogLabel *);
 PCP_CALL extern int __pmLogLoadLabel(__pmArchCtl *, const char *);
 PCP_CALL extern int __pmLogLoadMeta(__pmArchCtl *);
+PCP_CALL extern int __pmLogLoadInDoms(__pmArchCtl *);
+PCP_CALL extern int __pmLogWriteMetaIndex(const char *);
 #define PMLOGREAD_NEXT		0
 #define PMLOGREAD_TO_EOF	1
+#define PMLOGREAD_AHEAD		2	/* as NEXT, reading ahead in interp.c */
 PCP_CALL extern int __pmLogRead(__pmArchCtl *, int, __pmFILE *, pmResult **, int);
 PCP_CALL extern int __pmLogRead_ctx(__pmContext *, int, __pmFILE *, pmResult **, int);
 PCP_CALL extern int __pmLogChangeVol(__pmArchCtl *, int);
+PCP_CALL extern int __pmSetArchiveReadAhead(int, int);
 PCP_CALL extern int __pmLogFetch(__pmContext *, int, pmID *, pmResult **);
 PCP_CALL extern int __pmLogGetInDom(__pmArchCtl *, pmInDom, pmTimeval *, int **, char ***);
 PCP_CALL extern int __pmGetArchiveEnd(__pmArchCtl *, struct timeval *);
@@ -26,8 +26,37 @@ typedef enum mmv_toc_type {
     MMV_TOC_METRICS	= 3,	/* mmv_disk_{metric,metric2}_t */
     MMV_TOC_VALUES	= 4,	/* mmv_disk_value_t */
     MMV_TOC_STRINGS	= 5,	/* mmv_disk_string_t */
+    MMV_TOC_SLOTS	= 6,	/* mmv_disk_slot_t (MMV_FLAG_PERCPU) */
+    MMV_TOC_HASH	= 7,	/* mmv_disk_hash_t */
+    MMV_TOC_BUCKETS	= 8,	/* 64-bit histogram and sketch counts */
 } mmv_toc_type_t;
 
+#define MMV_SLOTSIZE	64	/* one cache line per value slot */
+#define MMV_SLOTMAX	256	/* upper bound on slots per value */
+
+/*
+ * Bucket layout of histogram and sketch values (fixed, so that the
+ * same metric from different processes or times can be merged).
+ *
+ * Histograms are log-linear: values below MMV_HISTOGRAM_SUB have a
+ * bucket each, above that each power of two is split into
+ * MMV_HISTOGRAM_SUB equal buckets - 64-bit unsigned integers with at
+ * most 1/MMV_HISTOGRAM_SUB relative error.
+ *
+ * Sketches are logarithmic with relative accuracy MMV_SKETCH_ALPHA:
+ * bucket 0 counts values of zero (or less), bucket i counts values
+ * in (gamma^(i-1-MMV_SKETCH_OFFSET), gamma^(i-MMV_SKETCH_OFFSET)],
+ * gamma being (1+alpha)/(1-alpha); the first and last buckets also
+ * count all values below and above their range.
+ */
+#define MMV_HISTOGRAM_SUBBITS	3
+#define MMV_HISTOGRAM_SUB	(1 << MMV_HISTOGRAM_SUBBITS)
+#define MMV_HISTOGRAM_BUCKETS	((64 - MMV_HISTOGRAM_SUBBITS + 1) * MMV_HISTOGRAM_SUB)
+#define MMV_SKETCH_ALPHA	0.02
+#define MMV_SKETCH_GAMMA	((1.0 + MMV_SKETCH_ALPHA) / (1.0 - MMV_SKETCH_ALPHA))
+#define MMV_SKETCH_OFFSET	1024
+#define MMV_SKETCH_BUCKETS	(2 * MMV_SKETCH_OFFSET)
+
 /* The way the Table Of Contents is written into the file */
 typedef struct mmv_disk_toc {
     mmv_toc_type_t	type;		/* What is it? */
@@ -92,6 +121,30 @@ typedef struct mmv_disk_value {
     __uint64_t		instance;	/* Offset into the instance section */
 } mmv_disk_value_t;
 
+/*
+ * With MMV_FLAG_PERCPU each value has a run of slots, one per CPU (or
+ * per MMV_SLOTMAX CPUs), laid out value-major in the slots section.
+ * Writers update the slot of the CPU they run on, the PMDA reports
+ * the value plus the sum of its slots.
+ */
+typedef struct mmv_disk_slot {
+    pmAtomValue		value;		/* this CPU's share of the value */
+    char		padding[MMV_SLOTSIZE - sizeof(pmAtomValue)];
+} mmv_disk_slot_t;
+
+/*
+ * Name index for value lookups - an open addressing hash table, with
+ * a power of two number of buckets (at least twice the number of
+ * values) and linear probing.  The hash is 32-bit FNV-1a over the
+ * metric name, or for metrics with instances, over the metric name,
+ * a zero byte, and the external instance name.
+ */
+typedef struct mmv_disk_hash {
+    __uint32_t		hash;		/* FNV-1a hash of the names */
+    __uint32_t		padding;	/* zero filled, alignment bits */
+    __uint64_t		value;		/* Offset into the values section */
+} mmv_disk_hash_t;			/* (zero offset: empty bucket) */
+
 typedef struct mmv_disk_header {
     char		magic[4];	/* MMV\0 */
     __int32_t		version;	/* version */
@@ -33,6 +33,8 @@ typedef enum mmv_metric_type {
     MMV_TYPE_DOUBLE    = PM_TYPE_DOUBLE,/* 64-bit floating point */
     MMV_TYPE_STRING    = PM_TYPE_STRING,/* NULL-terminate string */
     MMV_TYPE_ELAPSED   = 9,		/* 64-bit elapsed time */
+    MMV_TYPE_HISTOGRAM = 10,		/* log-linear bucket counts */
+    MMV_TYPE_SKETCH    = 11,		/* mergeable quantile sketch */
 } mmv_metric_type_t;
 
 typedef enum mmv_metric_sem {
@@ -99,6 +101,7 @@ typedef enum mmv_stats_flags {
     MMV_FLAG_NOPREFIX	= 0x1,	/* Don't prefix metric names by filename */
     MMV_FLAG_PROCESS	= 0x2,	/* Indicates process check on PID needed */
     MMV_FLAG_SENTINEL	= 0x4,	/* Sentinel values == no-value-available */
+    MMV_FLAG_PERCPU	= 0x8,	/* Per-CPU value slots, summed on fetch */
 } mmv_stats_flags_t;
 
 extern void * mmv_stats_init(const char *, int, mmv_stats_flags_t,
@@ -113,10 +116,16 @@ extern pmAtomValue * mmv_lookup_value_desc(void *, const char *, const char *);
 extern void mmv_inc_value(void *, pmAtomValue *, double);
 extern void mmv_set_value(void *, pmAtomValue *, double);
 extern void mmv_set_string(void *, pmAtomValue *, const char *, int);
+extern void mmv_inc_atomvalue(void *, pmAtomValue *, double);
+extern void mmv_set_atomvalue(void *, pmAtomValue *, double);
+extern void mmv_observe_value(void *, pmAtomValue *, double);
 
 extern void mmv_stats_add(void *, const char *, const char *, double);
 extern void mmv_stats_inc(void *, const char *, const char *);
 extern void mmv_stats_set(void *, const char *, const char *, double);
+extern void mmv_stats_add_atomic(void *, const char *, const char *, double);
+extern void mmv_stats_inc_atomic(void *, const char *, const char *);
+extern void mmv_stats_observe(void *, const char *, const char *, double);
 extern void mmv_stats_add_fallback(void *, const char *, const char *,
 				const char *, double);
 extern void mmv_stats_inc_fallback(void *, const char *, const char *,
@@ -288,6 +288,21 @@ typedef struct pmdaInterface {
 
 } pmdaInterface;
 
+/*
+ * comm.flags for DSO PMDAs.  The low bits are reserved for PDU_FLAG_*
+ * connection features, so these are allocated from the top down.
+ *
+ * PMDA_FLAG_THREADSAFE - the fetch callback may be called from one of
+ *	pmcd's worker threads (pmcd -w), concurrently with the callbacks of
+ *	other PMDAs.  Calls into the one PMDA are never concurrent.  The PMDA
+ *	must not share unprotected state with other PMDAs or with pmcd, nor
+ *	change process-wide credentials in its fetch path.  The pmdaCache,
+ *	per-PMDA indom and pmdaEvent* array helpers, and pmdaGetContext(),
+ *	are safe here; the event queues (pmdaEventNewQueue and friends) are
+ *	shared by all PMDAs in the process and are not.
+ */
+#define PMDA_FLAG_THREADSAFE	(1U<<15)
+
 /*
  * PM_CONTEXT_LOCAL support
  */
@@ -21,6 +21,12 @@
 #ifdef HAVE_IPHLPAPI_H
 #include <iphlpapi.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #define SOCKET_INTERNAL
 #include "internal.h"
 
@@ -845,6 +851,341 @@ __pmSelectWrite(int nfds, __pmFdSet *writefds, struct timeval *timeout)
     return select(nfds, NULL, writefds, NULL, timeout);
 }
 
+/*
+ * Readiness sets.
+ *
+ * These serve the same purpose as a __pmFdSet and __pmSelectRead(), but
+ * membership persists across calls (so there is no set to rebuild each
+ * time around a server's main loop), descriptors are not bounded by
+ * FD_SETSIZE, and where epoll(7) is available the cost of waiting is
+ * proportional to the number of ready descriptors, not the number of
+ * descriptors being watched.  Without epoll(7) we fall back to select.
+ *
+ * Descriptors are members of a set when watched for input, and may also
+ * be watched for output (__pmPollSetAddWrite) independently of that,
+ * e.g. while a non-blocking socket has output queued for it.
+ *
+ * Membership and readiness are also tracked here, indexed by descriptor,
+ * so that adding and deleting are idempotent and so that
+ * __pmPollSetIsReady is an O(1) replacement for __pmFD_ISSET.
+ *
+ * A set is not protected by any lock - callers sharing one between
+ * threads must provide their own serialization.
+ */
+#define POLLSET_MEMBER	0x1	/* watched for input */
+#define POLLSET_READY	0x2	/* ... and readable after the last wait */
+#define POLLSET_OUTPUT	0x4	/* watched for output */
+#define POLLSET_WRITABLE 0x8	/* ... and writable after the last wait */
+#define POLLSET_WATCH	(POLLSET_MEMBER|POLLSET_OUTPUT)
+
+struct __pmPollSet {
+    int			epfd;		/* epoll descriptor, -1 for select */
+    int			nmember;	/* number of watched descriptors */
+    int			maxfd;		/* largest watched descriptor */
+    int			size;		/* allocated entries in state[] */
+    unsigned char	*state;		/* POLLSET_* bits, indexed by fd */
+    int			nready;		/* valid entries in ready[] */
+    int			maxready;	/* allocated entries in ready[] */
+    int			*ready;		/* descriptors from last wait */
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event	*events;	/* epoll_wait(2) results buffer */
+#endif
+    __pmFdSet		fds;		/* input members, select fallback */
+    __pmFdSet		wfds;		/* ... and output members */
+};
+
+__pmPollSet *
+__pmPollSetCreate(void)
+{
+    __pmPollSet	*set;
+
+    if ((set = (__pmPollSet *)calloc(1, sizeof(*set))) == NULL)
+	return NULL;
+    set->maxfd = -1;
+    __pmFD_ZERO(&set->fds);
+    __pmFD_ZERO(&set->wfds);
+#ifdef HAVE_SYS_EPOLL_H
+    if ((set->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+	if (pmDebugOptions.desperate)
+	    fprintf(stderr, "__pmPollSetCreate: epoll_create1: %s, "
+			"using select\n", osstrerror());
+	set->epfd = -1;
+    }
+#else
+    set->epfd = -1;
+#endif
+    return set;
+}
+
+void
+__pmPollSetDestroy(__pmPollSet *set)
+{
+    if (set == NULL)
+	return;
+    if (set->epfd >= 0)
+	close(set->epfd);
+#ifdef HAVE_SYS_EPOLL_H
+    free(set->events);
+#endif
+    free(set->ready);
+    free(set->state);
+    free(set);
+}
+
+static int
+pollset_resize(__pmPollSet *set, int fd)
+{
+    unsigned char	*state;
+    int			*ready;
+    int			size;
+
+    if (fd >= set->size) {
+	for (size = set->size ? set->size : 64; size <= fd; size *= 2)
+	    ;
+	if ((state = (unsigned char *)realloc(set->state, size)) == NULL)
+	    return -ENOMEM;
+	memset(state + set->size, 0, size - set->size);
+	set->state = state;
+	set->size = size;
+    }
+    /* one spare ready slot for every member, so one wait reports all */
+    if (set->nmember + 1 > set->maxready) {
+	size = set->maxready ? set->maxready * 2 : 16;
+	if ((ready = (int *)realloc(set->ready, size * sizeof(int))) == NULL)
+	    return -ENOMEM;
+	set->ready = ready;
+#ifdef HAVE_SYS_EPOLL_H
+	{
+	    struct epoll_event	*events;
+
+	    events = (struct epoll_event *)realloc(set->events,
+				size * sizeof(struct epoll_event));
+	    if (events == NULL)
+		return -ENOMEM;
+	    set->events = events;
+	}
+#endif
+	set->maxready = size;
+    }
+    return 0;
+}
+
+static int
+pollset_watched(__pmPollSet *set, int fd)
+{
+    if (fd < 0 || fd >= set->size)
+	return 0;
+    return set->state[fd] & POLLSET_WATCH;
+}
+
+/*
+ * Change what a descriptor is watched for (POLLSET_WATCH bits, none
+ * to remove it from the set).  Readiness for anything no longer being
+ * watched for is forgotten.
+ */
+static int
+pollset_watch(__pmPollSet *set, int fd, int watch)
+{
+    int		old, sts;
+
+    if (fd < 0)
+	return -EBADF;
+    if ((old = pollset_watched(set, fd)) == watch)
+	return 0;
+    if (old == 0) {
+	if (set->epfd < 0 && fd >= FD_SETSIZE)
+	    return -EMFILE;
+	if ((sts = pollset_resize(set, fd)) < 0)
+	    return sts;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (set->epfd >= 0) {
+	struct epoll_event	event;
+
+	memset(&event, 0, sizeof(event));
+	if (watch & POLLSET_MEMBER)
+	    event.events |= EPOLLIN;
+	if (watch & POLLSET_OUTPUT)
+	    event.events |= EPOLLOUT;
+	event.data.fd = fd;
+	if (watch == 0) {
+	    /*
+	     * Failure is expected (and harmless) if the descriptor was
+	     * closed already, as closing removes it from the epoll set
+	     * implicitly.
+	     */
+	    epoll_ctl(set->epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	else if (old == 0) {
+	    if (epoll_ctl(set->epfd, EPOLL_CTL_ADD, fd, &event) < 0 &&
+		(oserror() != EEXIST ||
+		 epoll_ctl(set->epfd, EPOLL_CTL_MOD, fd, &event) < 0))
+		return -oserror();
+	}
+	else if (epoll_ctl(set->epfd, EPOLL_CTL_MOD, fd, &event) < 0)
+	    return -oserror();
+    }
+#endif
+    if (set->epfd < 0) {
+	if (watch & POLLSET_MEMBER)
+	    __pmFD_SET(fd, &set->fds);
+	else
+	    __pmFD_CLR(fd, &set->fds);
+	if (watch & POLLSET_OUTPUT)
+	    __pmFD_SET(fd, &set->wfds);
+	else
+	    __pmFD_CLR(fd, &set->wfds);
+    }
+
+    if (!(watch & POLLSET_MEMBER))
+	set->state[fd] &= ~POLLSET_READY;
+    if (!(watch & POLLSET_OUTPUT))
+	set->state[fd] &= ~POLLSET_WRITABLE;
+    set->state[fd] = (set->state[fd] & ~POLLSET_WATCH) | watch;
+
+    if (old == 0) {
+	set->nmember++;
+	if (fd > set->maxfd)
+	    set->maxfd = fd;
+    }
+    else if (watch == 0) {
+	set->nmember--;
+	if (fd == set->maxfd) {
+	    while (set->maxfd >= 0 && !pollset_watched(set, set->maxfd))
+		set->maxfd--;
+	}
+    }
+    return 0;
+}
+
+int
+__pmPollSetAdd(__pmPollSet *set, int fd)
+{
+    return pollset_watch(set, fd, pollset_watched(set, fd) | POLLSET_MEMBER);
+}
+
+int
+__pmPollSetDel(__pmPollSet *set, int fd)
+{
+    if (!pollset_watched(set, fd))
+	return 0;
+    return pollset_watch(set, fd, pollset_watched(set, fd) & ~POLLSET_MEMBER);
+}
+
+int
+__pmPollSetAddWrite(__pmPollSet *set, int fd)
+{
+    return pollset_watch(set, fd, pollset_watched(set, fd) | POLLSET_OUTPUT);
+}
+
+int
+__pmPollSetDelWrite(__pmPollSet *set, int fd)
+{
+    if (!pollset_watched(set, fd))
+	return 0;
+    return pollset_watch(set, fd, pollset_watched(set, fd) & ~POLLSET_OUTPUT);
+}
+
+int
+__pmPollSetIsMember(__pmPollSet *set, int fd)
+{
+    return fd >= 0 && fd < set->size && (set->state[fd] & POLLSET_MEMBER);
+}
+
+int
+__pmPollSetIsReady(__pmPollSet *set, int fd)
+{
+    return fd >= 0 && fd < set->size && (set->state[fd] & POLLSET_READY);
+}
+
+int
+__pmPollSetIsWritable(__pmPollSet *set, int fd)
+{
+    return fd >= 0 && fd < set->size && (set->state[fd] & POLLSET_WRITABLE);
+}
+
+/*
+ * Wait for input on any member descriptor (or for room to write on any
+ * descriptor watched for output), with the same timeout and return
+ * value semantics as __pmSelectRead.  On success, *ready is set to the
+ * list of ready descriptors (each one once, whether readable, writable
+ * or both), valid until the next call.  Entries for descriptors removed
+ * from the set in the meantime are not cleared from that list, so use
+ * __pmPollSetIsReady and __pmPollSetIsWritable when walking it.
+ */
+int
+__pmPollSetWait(__pmPollSet *set, int **ready, struct timeval *timeout)
+{
+    int		i, fd, sts, bits;
+
+    for (i = 0; i < set->nready; i++) {
+	if ((fd = set->ready[i]) < set->size)
+	    set->state[fd] &= ~(POLLSET_READY|POLLSET_WRITABLE);
+    }
+    set->nready = 0;
+    if (ready)
+	*ready = set->ready;
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (set->epfd >= 0) {
+	int	msec = -1;
+	int	events;
+
+	if (timeout != NULL)
+	    msec = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+	if ((sts = epoll_wait(set->epfd, set->events,
+				set->maxready, msec)) <= 0)
+	    return sts;
+	for (i = 0; i < sts; i++) {
+	    fd = set->events[i].data.fd;
+	    events = set->events[i].events;
+	    if (!pollset_watched(set, fd))
+		continue;
+	    bits = 0;
+	    /* errors and hangups are for the reader or writer to find */
+	    if ((set->state[fd] & POLLSET_MEMBER) &&
+		(events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
+		bits |= POLLSET_READY;
+	    if ((set->state[fd] & POLLSET_OUTPUT) &&
+		(events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
+		bits |= POLLSET_WRITABLE;
+	    if (bits == 0)
+		continue;
+	    set->state[fd] |= bits;
+	    set->ready[set->nready++] = fd;
+	}
+	return set->nready;
+    }
+#endif
+
+    {
+	__pmFdSet	readyFds;
+	__pmFdSet	writeFds;
+	int		found = 0;
+
+	__pmFD_COPY(&readyFds, &set->fds);
+	__pmFD_COPY(&writeFds, &set->wfds);
+	if ((sts = select(set->maxfd + 1, &readyFds, &writeFds, NULL, timeout)) <= 0)
+	    return sts;
+	for (fd = 0; fd <= set->maxfd && found < sts; fd++) {
+	    bits = 0;
+	    if (__pmFD_ISSET(fd, &readyFds)) {
+		bits |= POLLSET_READY;
+		found++;
+	    }
+	    if (__pmFD_ISSET(fd, &writeFds)) {
+		bits |= POLLSET_WRITABLE;
+		found++;
+	    }
+	    if (bits == 0)
+		continue;
+	    set->state[fd] |= bits;
+	    set->ready[set->nready++] = fd;
+	}
+	return set->nready;
+    }
+}
+
 /*
  * This interface is old and mouldy (exposed via impl.h many years ago)
  * and very much deprecated.  It was replaced by __pmAuxConnectPMCDPort.
@@ -1552,11 +1893,24 @@ __pmRecv(int socket, void *buffer, size_t length, int flags)
 int
 __pmSocketReady(int fd, struct timeval *timeout)
 {
+#ifdef HAVE_POLL
+    struct pollfd	onefd;
+    int			msec = -1;
+
+    /* poll(2) is not limited by FD_SETSIZE, unlike select */
+    onefd.fd = fd;
+    onefd.events = POLLIN;
+    onefd.revents = 0;
+    if (timeout != NULL)
+	msec = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+    return poll(&onefd, 1, msec);
+#else
     __pmFdSet	onefd;
 
     FD_ZERO(&onefd);
     FD_SET(fd, &onefd);
     return select(fd+1, &onefd, NULL, NULL, timeout);
+#endif
 }
 
 #endif /* !HAVE_SECURE_SOCKETS */
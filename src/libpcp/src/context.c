@@ -798,6 +798,7 @@ initarchive(__pmContext	*ctxp, const char *name)
     acp->ac_log_list = NULL;
     acp->ac_log = NULL;
     acp->ac_mark_done = 0;
+    __pmLogReadAheadInit(acp);
 
     /*
      * The list of names may contain one or more directories. Examine the
@@ -937,8 +938,7 @@ initarchive(__pmContext	*ctxp, const char *name)
     acp->ac_offset = sizeof(__pmLogLabel) + 2*sizeof(int);
     acp->ac_vol = acp->ac_curvol;
     acp->ac_serial = 0;		/* not serial access, yet */
-    acp->ac_pmid_hc.nodes = 0;	/* empty hash list */
-    acp->ac_pmid_hc.hsize = 0;
+    __pmHashInit(&acp->ac_pmid_hc);	/* empty hash list */
     acp->ac_end = 0.0;
     acp->ac_want = NULL;
     acp->ac_unbound = NULL;
@@ -1448,8 +1448,7 @@ pmDupContext(void)
 	 * __pmFreeInterpData() to trash our hash list and read cache.
 	 * Start with an empty hash list and read cache for the dup'd context.
 	 */
-	newcon->c_archctl->ac_pmid_hc.nodes = 0;
-	newcon->c_archctl->ac_pmid_hc.hsize = 0;
+	__pmHashInit(&newcon->c_archctl->ac_pmid_hc);
 	newcon->c_archctl->ac_cache = NULL;
 
 	/*
@@ -1,12 +1,12 @@
 /*
  * Copyright (c) 1995-2002 Silicon Graphics, Inc.  All Rights Reserved.
- * Copyright (c) 2013-2017 Red Hat, Inc.
- * 
+ * Copyright (c) 2013-2018 Red Hat, Inc.
+ *
  * This library is free software; you can redistribute it and/or modify it
  * under the terms of the GNU Lesser General Public License as published
  * by the Free Software Foundation; either version 2.1 of the License, or
  * (at your option) any later version.
- * 
+ *
  * This library is distributed in the hope that it will be useful, but
  * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
  * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
@@ -17,6 +17,164 @@
 #include "libpcp.h"
 #include <stddef.h>
 
+/*
+ * Lookups go through slots[], an open addressed table with linear
+ * probing and Robin Hood insertion: an entry that is further from its
+ * home slot than the current occupant takes the slot, and the occupant
+ * moves on.  This keeps probe sequences short and lets a search stop as
+ * soon as it meets an entry closer to home than the key being sought.
+ * Deletion shifts the following entries back, so there are no
+ * tombstones.  A slot is just the key and a node pointer, so a search
+ * usually touches a single cache line.
+ *
+ * The nodes themselves stay on the hash[] chains, which are only used
+ * for walking the table and for deletion.  Walk order is visible in the
+ * output of pmdumplog, pmlogcheck, pmlogrewrite and friends, so the
+ * chains are maintained exactly as they always have been.
+ */
+
+#define MIN_NSLOTS	8	/* smallest non-empty slots[] */
+
+static inline unsigned int
+hashmix(unsigned int key)
+{
+    /* keys are PMIDs, InDoms, instances ... spread the low bits */
+    key ^= key >> 16;
+    key *= 0x85ebca6bU;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35U;
+    key ^= key >> 16;
+    return key;
+}
+
+/* slot holding key, or -1 */
+static int
+findslot(unsigned int key, const __pmHashCtl *hcp)
+{
+    const __pmHashSlot	*sp;
+    unsigned int	mask, dist, i;
+
+    if (hcp->nslots == 0)
+	return -1;
+    mask = hcp->nslots - 1;
+    for (i = hashmix(key) & mask, dist = 1; ; i = (i + 1) & mask, dist++) {
+	sp = &hcp->slots[i];
+	/* empty (dist 0), or closer to home than key could be */
+	if (sp->dist < dist)
+	    return -1;
+	if (sp->key == key)
+	    return i;
+    }
+}
+
+/* key is known not to be present, and there is a free slot */
+static void
+putslot(unsigned int key, __pmHashNode *node, __pmHashCtl *hcp)
+{
+    unsigned int	mask = hcp->nslots - 1;
+    unsigned int	i;
+    __pmHashSlot	entry, swap;
+
+    entry.key = key;
+    entry.dist = 1;
+    entry.node = node;
+    for (i = hashmix(key) & mask; ; i = (i + 1) & mask, entry.dist++) {
+	if (hcp->slots[i].dist == 0) {
+	    hcp->slots[i] = entry;
+	    return;
+	}
+	if (hcp->slots[i].dist < entry.dist) {
+	    swap = hcp->slots[i];
+	    hcp->slots[i] = entry;
+	    entry = swap;
+	}
+    }
+}
+
+static void
+dropslot(unsigned int i, __pmHashCtl *hcp)
+{
+    unsigned int	mask = hcp->nslots - 1;
+    unsigned int	j;
+
+    for (j = (i + 1) & mask; hcp->slots[j].dist > 1; i = j, j = (j + 1) & mask) {
+	hcp->slots[i] = hcp->slots[j];
+	hcp->slots[i].dist--;
+    }
+    hcp->slots[i].dist = 0;
+    hcp->slots[i].node = NULL;
+    hcp->nkeys--;
+}
+
+/* make room for nkeys distinct keys, at a load factor of at most 3/4 */
+static int
+reserve(unsigned int nkeys, __pmHashCtl *hcp)
+{
+    __pmHashSlot	*old = hcp->slots;
+    unsigned int	oldsize = hcp->nslots;
+    unsigned int	nslots, i;
+
+    if (nkeys * 4 <= oldsize * 3)
+	return 0;
+    for (nslots = oldsize ? oldsize : MIN_NSLOTS; nkeys * 4 > nslots * 3; )
+	nslots *= 2;
+    if ((hcp->slots = (__pmHashSlot *)calloc(nslots, sizeof(__pmHashSlot))) == NULL) {
+	hcp->slots = old;
+	return -oserror();
+    }
+    hcp->nslots = nslots;
+    for (i = 0; i < oldsize; i++) {
+	if (old[i].dist != 0)
+	    putslot(old[i].key, old[i].node, hcp);
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * Each slot points at the first node with that key on its hash chain,
+ * which is the node the chained search has always returned.  Relinking
+ * the chains reverses nodes sharing a key, so point the slots afresh.
+ */
+static void
+reindex(__pmHashCtl *hcp)
+{
+    __pmHashNode	*hp;
+    unsigned int	i;
+    int			k;
+
+    for (i = 0; i < hcp->nslots; i++)
+	hcp->slots[i].node = NULL;
+    for (k = 0; k < hcp->hsize; k++) {
+	for (hp = hcp->hash[k]; hp != NULL; hp = hp->next) {
+	    i = findslot(hp->key, hcp);
+	    if (hcp->slots[i].node == NULL)
+		hcp->slots[i].node = hp;
+	}
+    }
+}
+
+/* *tpp is the chain link pointing at hp */
+static void
+unlinknode(__pmHashNode *hp, __pmHashNode **tpp, __pmHashCtl *hcp)
+{
+    __pmHashNode	*tp;
+    int			i;
+
+    *tpp = hp->next;
+    if ((i = findslot(hp->key, hcp)) >= 0 && hcp->slots[i].node == hp) {
+	for (tp = hp->next; tp != NULL; tp = tp->next) {
+	    if (tp->key == hp->key)
+		break;
+	}
+	if (tp != NULL)
+	    hcp->slots[i].node = tp;
+	else
+	    dropslot(i, hcp);
+    }
+    free(hp);
+}
+
 void
 __pmHashInit(__pmHashCtl *hcp)
 {
@@ -32,6 +190,10 @@ __pmHashInit(__pmHashCtl *hcp)
 int
 __pmHashPreAlloc(int hsize, __pmHashCtl *hcp)
 {
+    int		sts;
+
+    if ((sts = __pmHashReserve(hsize, hcp)) < 0)
+	return sts;
     if ((hcp->hash = (__pmHashNode **)calloc(hsize, sizeof(__pmHashNode *))) == NULL)
 	return -oserror();
 
@@ -39,26 +201,39 @@ __pmHashPreAlloc(int hsize, __pmHashCtl *hcp)
     return 0; /* ok */
 }
 
+/*
+ * Make room in the lookup index for at least nkeys distinct keys, so
+ * that adding them later does not have to grow it again.  Unlike
+ * __pmHashPreAlloc this does not change the order of a table walk.
+ */
+int
+__pmHashReserve(int nkeys, __pmHashCtl *hcp)
+{
+    if (nkeys <= 0)
+	return 0;
+    return reserve(nkeys, hcp);
+}
+
 __pmHashNode *
 __pmHashSearch(unsigned int key, __pmHashCtl *hcp)
 {
-    __pmHashNode	*hp;
+    int		i;
 
-    if (hcp->hsize == 0)
+    if ((i = findslot(key, hcp)) < 0)
 	return NULL;
-
-    for (hp = hcp->hash[key % hcp->hsize]; hp != NULL; hp = hp->next) {
-	if (hp->key == key)
-	    return hp;
-    }
-    return NULL;
+    return hcp->slots[i].node;
 }
 
 int
 __pmHashAdd(unsigned int key, void *data, __pmHashCtl *hcp)
 {
     __pmHashNode    *hp;
-    int		k;
+    int		i, k, sts;
+
+    if ((i = findslot(key, hcp)) < 0) {
+	if ((sts = reserve(hcp->nkeys + 1, hcp)) < 0)
+	    return sts;
+    }
 
     hcp->nodes++;
 
@@ -96,6 +271,8 @@ __pmHashAdd(unsigned int key, void *data, __pmHashCtl *hcp)
 	    }
 	}
 	free(old);
+	reindex(hcp);
+	i = findslot(key, hcp);
     }
 
     if ((hp = (__pmHashNode *)malloc(sizeof(__pmHashNode))) == NULL)
@@ -107,28 +284,53 @@ __pmHashAdd(unsigned int key, void *data, __pmHashCtl *hcp)
     hp->next = hcp->hash[k];
     hcp->hash[k] = hp;
 
+    if (i < 0) {
+	putslot(key, hp, hcp);
+	hcp->nkeys++;
+    }
+    else
+	hcp->slots[i].node = hp;
+
     return 1;
 }
 
+/*
+ * Add nkeys entries, as if by __pmHashAdd for each in turn, but growing
+ * the lookup index at most once.  data may be NULL.  Returns nkeys, or
+ * a negative error code (in which case some entries may have been added).
+ */
+int
+__pmHashAddBulk(int nkeys, const unsigned int *keys, void * const *data,
+		__pmHashCtl *hcp)
+{
+    int		i, sts;
+
+    if (nkeys <= 0)
+	return 0;
+    if ((sts = reserve(hcp->nkeys + nkeys, hcp)) < 0)
+	return sts;
+    for (i = 0; i < nkeys; i++) {
+	if ((sts = __pmHashAdd(keys[i], data ? data[i] : NULL, hcp)) < 0)
+	    return sts;
+    }
+    return nkeys;
+}
+
 int
 __pmHashDel(unsigned int key, void *data, __pmHashCtl *hcp)
 {
     __pmHashNode    *hp;
-    __pmHashNode    *lhp = NULL;
+    __pmHashNode    **tpp;
 
     if (hcp->hsize == 0)
 	return 0;
 
-    for (hp = hcp->hash[key % hcp->hsize]; hp != NULL; hp = hp->next) {
+    tpp = &hcp->hash[key % hcp->hsize];
+    for (hp = *tpp; hp != NULL; tpp = &hp->next, hp = *tpp) {
 	if (hp->key == key && hp->data == data) {
-	    if (lhp == NULL)
-		hcp->hash[key % hcp->hsize] = hp->next;
-	    else
-		lhp->next = hp->next;
-	    free(hp);
+	    unlinknode(hp, tpp, hcp);
 	    return 1;
 	}
-	lhp = hp;
     }
 
     return 0;
@@ -142,6 +344,11 @@ __pmHashClear(__pmHashCtl *hcp)
 	hcp->hash = NULL;
 	hcp->hsize = 0;
     }
+    if (hcp->nslots != 0) {
+	free(hcp->slots);
+	hcp->slots = NULL;
+	hcp->nslots = hcp->nkeys = 0;
+    }
 }
 
 /*
@@ -153,6 +360,7 @@ __pmHashClear(__pmHashCtl *hcp)
 void
 __pmHashWalkCB(__pmHashWalkCallback cb, void *cdata, const __pmHashCtl *hcp)
 {
+    __pmHashCtl	*hc = (__pmHashCtl *)hcp;	/* for deletion */
     int n;
 
     for (n = 0; n < hcp->hsize; n++) {
@@ -164,9 +372,8 @@ __pmHashWalkCB(__pmHashWalkCallback cb, void *cdata, const __pmHashCtl *hcp)
 
             switch (state) {
             case PM_HASH_WALK_DELETE_STOP:
-                *tpp = tp->next;  /* unlink */
-                free(tp);         /* delete */
-                return;           /* & stop */
+                unlinknode(tp, tpp, hc);  /* unlink & delete */
+                return;                   /* & stop */
 
             case PM_HASH_WALK_NEXT:
                 tpp = &tp->next;
@@ -174,11 +381,10 @@ __pmHashWalkCB(__pmHashWalkCallback cb, void *cdata, const __pmHashCtl *hcp)
                 break;
 
             case PM_HASH_WALK_DELETE_NEXT:
-                *tpp = tp->next;  /* unlink */
+                unlinknode(tp, tpp, hc);  /* unlink & delete */
                 /* NB: do not change tpp.  It will still point at the previous
                  * node's "next" pointer.  Consider consecutive CONTINUE_DELETEs.
                  */
-                free(tp);         /* delete */
                 tp = *tpp; /* == tp->next, except that tp is already freed. */
                 break;            /* & next */
 
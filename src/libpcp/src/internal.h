@@ -317,9 +317,14 @@ extern int pmGetInDomArchive_ctx(__pmContext *, pmInDom, int **, char ***) _PCP_
 extern int pmFetch_ctx(__pmContext *, int, pmID *, pmResult **) _PCP_HIDDEN;
 extern int pmStore_ctx(__pmContext *, const pmResult *) _PCP_HIDDEN;
 extern int __pmDecodeResult_ctx(__pmContext *, __pmPDU *, pmResult **) _PCP_HIDDEN;
+#if defined(HAVE_64BIT_PTR)
+extern int __pmDecodeLogResult_ctx(__pmContext *, const __pmPDU *, int, pmResult **) _PCP_HIDDEN;
+#endif
 extern int __pmSendResult_ctx(__pmContext *, int, int, const pmResult *) _PCP_HIDDEN;
 extern void __pmDumpResult_ctx(__pmContext *, FILE *, const pmResult *) _PCP_HIDDEN;
 extern int pmGetArchiveEnd_ctx(__pmContext *, struct timeval *) _PCP_HIDDEN;
+extern void __pmLogReadAheadInit(__pmArchCtl *) _PCP_HIDDEN;
+extern void __pmLogFreeMetaIndex(__pmLogCtl *) _PCP_HIDDEN;
 extern int __pmGetArchiveEnd_ctx(__pmContext *, struct timeval *) _PCP_HIDDEN;
 extern int __pmLogGenerateMark_ctx(__pmContext *, int, pmResult **) _PCP_HIDDEN;
 extern int __pmLogCheckForNextArchive(__pmLogCtl *, int, pmResult **);
@@ -14,9 +14,9 @@
  *
  * Thread-safe notes:
  *
- * nr[] and nr_cache[] are diagnostic counters that are maintained with
- * non-atomic updates ... we've decided that it is acceptable for their
- * values to be subject to possible (but unlikely) missed updates
+ * nr[], nr_cache[] and nr_ahead[] are diagnostic counters that are
+ * maintained with non-atomic updates ... we've decided that it is
+ * acceptable for their values to be subject to possible (but unlikely) missed updates
  *
  * the one-trip initialization of ignore_mark_records and ignore_mark_gap
  * is not guarded as the same value would result from concurrent repeated
@@ -105,25 +105,247 @@ typedef struct pmidcntl {		/* metric control */
     __pmHashCtl		hc;		/* metric-instances */
 } pmidcntl_t;
 
+/*
+ * Read cache for __pmLogRead results ... interpolation moves back and
+ * forth over the same few records (positioning, then searching for
+ * bounds in each direction), so records are cached by their position
+ * in the archive, being (archive, volume, offset).  An entry is found
+ * by the offset at its head when reading forwards, and by the offset
+ * at its tail when reading backwards.
+ *
+ * Entries are replaced using the clock algorithm, with ac_cache_idx
+ * as the hand.  Optionally, once a miss follows on from the previous
+ * read in the same direction, the next few records in that direction
+ * are read ahead into the cache as well.
+ */
 typedef struct {
     pmResult	*rp;		/* cached pmResult from __pmLogRead */
     int		sts;		/* from __pmLogRead */
-    char	*c_name;	/* log name */
+    int		arch;		/* log, index into ac_log_list[] */
     int		vol;		/* log volume */
     long	head_posn;	/* posn in file before forwards __pmLogRead */
     long	tail_posn;	/* posn in file after forwards __pmLogRead */
     int		mode;		/* PM_MODE_FORW or PM_MODE_BACK */
-    int		used;		/* used count for LFU replacement */
+    int		used;		/* referenced since the clock hand passed */
+    int		valid;		/* in head_hc and tail_hc */
 } cache_t;
 
-#define NUMCACHE 4
+typedef struct {
+    int		arch;		/* log, index into ac_log_list[] */
+    int		vol;		/* log volume */
+    long	posn;		/* posn in file, or -1 if unknown */
+} cache_posn_t;
+
+typedef struct {
+    int		nentry;		/* number of entries in cache[] */
+    int		readahead;	/* max records to read ahead */
+    cache_posn_t last[PM_MODE_BACK+1];	/* where each direction left off */
+    __pmHashCtl	head_hc;	/* valid entries by head_posn */
+    __pmHashCtl	tail_hc;	/* valid entries by tail_posn */
+    cache_t	*cache;
+} readcache_t;
+
+#define DEF_NUMCACHE	16	/* default, $PCP_INTERP_CACHE */
+#define MIN_NUMCACHE	4	/* results must outlive the next few reads */
+#define DEF_READAHEAD	0	/* default, $PCP_INTERP_READAHEAD */
 
 /*
  * diagnostic counters ... indexed by PM_MODE_FORW (2) and
- * PM_MODE_BACK	(3), hence 4 elts for cached and non-cached reads
+ * PM_MODE_BACK	(3), hence 4 elts for cached and non-cached reads,
+ * and for the subset of the non-cached reads that were read ahead
  */
 static long	nr_cache[PM_MODE_BACK+1];
 static long	nr[PM_MODE_BACK+1];
+static long	nr_ahead[PM_MODE_BACK+1];
+
+static int
+cache_env(const char *name, int dflt)
+{
+    char	*val;
+    char	*end;
+    long	n;
+
+    PM_LOCK(__pmLock_extcall);
+    val = getenv(name);		/* THREADSAFE */
+    if (val != NULL && *val != '\0') {
+	n = strtol(val, &end, 10);
+	if (*end != '\0' || n < 0 || n > INT_MAX / 2) {
+	    if (pmDebugOptions.interp)
+		fprintf(stderr, "cache_env: ignoring bad %s=\"%s\"\n", name, val);
+	}
+	else
+	    dflt = (int)n;
+    }
+    PM_UNLOCK(__pmLock_extcall);
+    return dflt;
+}
+
+static readcache_t *
+cache_init(__pmArchCtl *acp)
+{
+    readcache_t	*rcp;
+    int		i;
+
+    if ((rcp = (readcache_t *)calloc(1, sizeof(readcache_t))) == NULL)
+	return NULL;
+    rcp->nentry = cache_env("PCP_INTERP_CACHE", DEF_NUMCACHE);
+    if (rcp->nentry < MIN_NUMCACHE)
+	rcp->nentry = MIN_NUMCACHE;
+    rcp->readahead = cache_env("PCP_INTERP_READAHEAD", DEF_READAHEAD);
+    /* read ahead must not evict the result about to be returned */
+    if (rcp->readahead > rcp->nentry / 2)
+	rcp->readahead = rcp->nentry / 2;
+    if ((rcp->cache = (cache_t *)calloc(rcp->nentry, sizeof(cache_t))) == NULL) {
+	free(rcp);
+	return NULL;
+    }
+    __pmHashInit(&rcp->head_hc);
+    __pmHashInit(&rcp->tail_hc);
+    for (i = 0; i <= PM_MODE_BACK; i++)
+	rcp->last[i].posn = -1;
+    acp->ac_cache = (void *)rcp;
+    acp->ac_cache_idx = 0;
+    if (pmDebugOptions.interp)
+	fprintf(stderr, "cache_init: %d entries, read ahead %d\n",
+		rcp->nentry, rcp->readahead);
+    return rcp;
+}
+
+static unsigned int
+cache_key(int arch, int vol, long posn)
+{
+    return (unsigned int)posn ^ ((unsigned int)vol << 16) ^ ((unsigned int)arch << 24);
+}
+
+/* valid entry for the record at posn, read in the given direction */
+static cache_t *
+cache_find(readcache_t *rcp, int mode, int arch, int vol, long posn)
+{
+    __pmHashCtl		*hcp;
+    __pmHashNode	*hp;
+    unsigned int	key = cache_key(arch, vol, posn);
+    cache_t		*cp;
+
+    hcp = mode == PM_MODE_FORW ? &rcp->head_hc : &rcp->tail_hc;
+    for (hp = __pmHashSearch(key, hcp); hp != NULL; hp = hp->next) {
+	if (hp->key != key)
+	    continue;
+	cp = (cache_t *)hp->data;
+	if (cp->arch == arch && cp->vol == vol &&
+	    (mode == PM_MODE_FORW ? cp->head_posn : cp->tail_posn) == posn)
+	    return cp;
+    }
+    return NULL;
+}
+
+static void
+cache_invalidate(readcache_t *rcp, cache_t *cp)
+{
+    if (cp->valid) {
+	__pmHashDel(cache_key(cp->arch, cp->vol, cp->head_posn), (void *)cp, &rcp->head_hc);
+	__pmHashDel(cache_key(cp->arch, cp->vol, cp->tail_posn), (void *)cp, &rcp->tail_hc);
+	cp->valid = 0;
+    }
+}
+
+static void
+cache_validate(readcache_t *rcp, cache_t *cp)
+{
+    if (__pmHashAdd(cache_key(cp->arch, cp->vol, cp->head_posn), (void *)cp, &rcp->head_hc) < 0)
+	return;
+    if (__pmHashAdd(cache_key(cp->arch, cp->vol, cp->tail_posn), (void *)cp, &rcp->tail_hc) < 0) {
+	__pmHashDel(cache_key(cp->arch, cp->vol, cp->head_posn), (void *)cp, &rcp->head_hc);
+	return;
+    }
+    cp->valid = 1;
+}
+
+/*
+ * choose an entry to be reused, skipping (and clearing) those that
+ * have been referenced since the hand last passed
+ */
+static cache_t *
+cache_victim(__pmArchCtl *acp, readcache_t *rcp)
+{
+    cache_t	*cp;
+
+    for ( ; ; ) {
+	cp = &rcp->cache[acp->ac_cache_idx];
+	acp->ac_cache_idx = (acp->ac_cache_idx + 1) % rcp->nentry;
+	if (cp->used == 0)
+	    break;
+	cp->used = 0;
+    }
+    cache_invalidate(rcp, cp);
+    if (cp->rp != NULL) {
+	pmFreeResult(cp->rp);
+	cp->rp = NULL;
+    }
+    return cp;
+}
+
+/*
+ * read ahead from the current position in the current volume, leaving
+ * the position unchanged ... stop at the end of the volume, or at a
+ * record that is already cached ... the ends are checked before reading,
+ * so read ahead never adds a failed read past the end of the archive
+ */
+static void
+cache_readahead(__pmContext *ctxp, readcache_t *rcp, int mode)
+{
+    __pmArchCtl	*acp = ctxp->c_archctl;
+    cache_t	*cp;
+    struct stat	sbuf;
+    long	save_posn;
+    long	posn;
+    long	end;
+    int		i;
+
+    if (mode == PM_MODE_FORW) {
+	if (__pmFstat(acp->ac_mfp, &sbuf) < 0)
+	    return;
+	end = (long)sbuf.st_size;
+    }
+    else
+	end = sizeof(__pmLogLabel) + 2 * sizeof(int);
+
+    save_posn = posn = __pmFtell(acp->ac_mfp);
+    assert(save_posn >= 0);
+    for (i = 0; i < rcp->readahead; i++) {
+	if (mode == PM_MODE_FORW ? posn >= end : posn <= end)
+	    break;
+	if (cache_find(rcp, mode, acp->ac_cur_log, acp->ac_curvol, posn) != NULL)
+	    break;
+	cp = cache_victim(acp, rcp);
+	cp->sts = __pmLogRead_ctx(ctxp, mode, acp->ac_mfp, &cp->rp, PMLOGREAD_AHEAD);
+	if (cp->sts < 0) {
+	    cp->rp = NULL;
+	    break;
+	}
+	nr[mode]++;
+	nr_ahead[mode]++;
+	cp->mode = mode;
+	cp->arch = acp->ac_cur_log;
+	cp->vol = acp->ac_curvol;
+	cp->used = 1;
+	if (mode == PM_MODE_FORW) {
+	    cp->head_posn = posn;
+	    cp->tail_posn = posn = __pmFtell(acp->ac_mfp);
+	}
+	else {
+	    cp->tail_posn = posn;
+	    cp->head_posn = posn = __pmFtell(acp->ac_mfp);
+	}
+	assert(posn >= 0);
+	cache_validate(rcp, cp);
+	if (pmDebugOptions.log && pmDebugOptions.desperate) {
+	    fprintf(stderr, "cache_readahead: cache[%d] vol=%d head=%ld tail=%ld\n",
+		(int)(cp - rcp->cache), cp->vol,
+		(long)cp->head_posn, (long)cp->tail_posn);
+	}
+    }
+    __pmFseek(acp->ac_mfp, save_posn, SEEK_SET);
+}
 
 /*
  * called with the context lock held
@@ -135,11 +357,12 @@ cache_read(__pmContext *ctxp, int mode, pmResult **rp)
     long	posn;
     cache_t	*cp;
     cache_t	*lfup;
-    cache_t	*cache;
-    char	*save_curlog_name;
+    readcache_t	*rcp;
+    cache_posn_t *lastp;
     int		sts;
     int		save_curvol;
-    int		archive_changed;
+    int		save_curlog;
+    int		sequential;
 
     /*
      * If the previous __pmLogRead generated a virtual MARK record and we have
@@ -159,15 +382,12 @@ cache_read(__pmContext *ctxp, int mode, pmResult **rp)
     else
 	posn = 0;
 
-    if (acp->ac_cache == NULL) {
+    if ((rcp = (readcache_t *)acp->ac_cache) == NULL) {
 	/* cache initialization */
-	acp->ac_cache = cache = (cache_t *)calloc(NUMCACHE, sizeof(cache_t));
-	if (!cache)
+	if ((rcp = cache_init(acp)) == NULL)
 	    return -ENOMEM;
-	acp->ac_cache_idx = 0;
     }
-    else
-	cache = acp->ac_cache;
+    lastp = &rcp->last[mode];
 
     if (pmDebugOptions.log && pmDebugOptions.desperate) {
 	fprintf(stderr, "cache_read: fd=%d mode=%s vol=%d (curvol=%d) %s_posn=%ld ",
@@ -178,52 +398,46 @@ cache_read(__pmContext *ctxp, int mode, pmResult **rp)
 	    (long)posn);
     }
 
-    acp->ac_cache_idx = (acp->ac_cache_idx + 1) % NUMCACHE;
-    lfup = &cache[acp->ac_cache_idx];
-    for (cp = cache; cp < &cache[NUMCACHE]; cp++) {
-	if (cp->c_name != NULL && strcmp(cp->c_name, acp->ac_log->l_name) == 0 &&
-	    cp->vol == acp->ac_vol &&
-	    ((mode == PM_MODE_FORW && cp->head_posn == posn) ||
-	     (mode == PM_MODE_BACK && cp->tail_posn == posn)) &&
-	    cp->rp != NULL) {
-	    *rp = cp->rp;
-	    cp->used++;
-	    if (mode == PM_MODE_FORW)
-		__pmFseek(acp->ac_mfp, cp->tail_posn, SEEK_SET);
-	    else
-		__pmFseek(acp->ac_mfp, cp->head_posn, SEEK_SET);
-	    if (pmDebugOptions.log && pmDebugOptions.desperate) {
-		pmTimeval	tmp;
-		double		t_this;
-		tmp.tv_sec = (__int32_t)cp->rp->timestamp.tv_sec;
-		tmp.tv_usec = (__int32_t)cp->rp->timestamp.tv_usec;
-		t_this = __pmTimevalSub(&tmp, __pmLogStartTime(acp));
-		fprintf(stderr, "hit cache[%d] t=%.6f\n",
-		    (int)(cp - cache), t_this);
-		nr_cache[mode]++;
-	    }
-	    acp->ac_mark_done = 0;
-	    sts = cp->sts;
-	    return sts;
+    if (posn != 0 &&
+	(cp = cache_find(rcp, mode, acp->ac_cur_log, acp->ac_vol, posn)) != NULL) {
+	*rp = cp->rp;
+	cp->used = 1;
+	if (mode == PM_MODE_FORW)
+	    lastp->posn = cp->tail_posn;
+	else
+	    lastp->posn = cp->head_posn;
+	lastp->arch = cp->arch;
+	lastp->vol = cp->vol;
+	__pmFseek(acp->ac_mfp, lastp->posn, SEEK_SET);
+	if (pmDebugOptions.log && pmDebugOptions.desperate) {
+	    pmTimeval	tmp;
+	    double	t_this;
+	    tmp.tv_sec = (__int32_t)cp->rp->timestamp.tv_sec;
+	    tmp.tv_usec = (__int32_t)cp->rp->timestamp.tv_usec;
+	    t_this = __pmTimevalSub(&tmp, __pmLogStartTime(acp));
+	    fprintf(stderr, "hit cache[%d] t=%.6f\n",
+		(int)(cp - rcp->cache), t_this);
 	}
+	nr_cache[mode]++;
+	acp->ac_mark_done = 0;
+	return cp->sts;
     }
 
     if (pmDebugOptions.log && pmDebugOptions.desperate)
 	fprintf(stderr, "miss\n");
     nr[mode]++;
 
-    if (lfup->rp != NULL)
-	pmFreeResult(lfup->rp);
+    /* carrying on from the last read in this direction? */
+    sequential = posn != 0 && lastp->posn == posn &&
+		 lastp->arch == acp->ac_cur_log && lastp->vol == acp->ac_vol;
+    lastp->posn = -1;
+
+    lfup = cache_victim(acp, rcp);
 
     /*
      * We need to know when we cross archive or volume boundaries.
-     * The only way to know if the archive has changed is to check whether the
-     * archive name has changed.
      */
-    if ((save_curlog_name = strdup(acp->ac_log->l_name)) == NULL) {
-	pmNoMem("__pmLogFetchInterp.save_curlog_name",
-		  strlen(acp->ac_log->l_name) + 1, PM_FATAL_ERR);
-    }
+    save_curlog = acp->ac_cur_log;
     save_curvol = acp->ac_curvol;
 
     lfup->sts = __pmLogRead_ctx(ctxp, mode, NULL, &lfup->rp, PMLOGREAD_NEXT);
@@ -231,53 +445,40 @@ cache_read(__pmContext *ctxp, int mode, pmResult **rp)
 	lfup->rp = NULL;
     *rp = lfup->rp;
 
-    archive_changed = strcmp(save_curlog_name, acp->ac_log->l_name) != 0;
-    free(save_curlog_name);
-
     /*
      * vol/arch switch since last time, or vol/arch switch or virtual mark
      * record generated in __pmLogRead_ctx() ...
      * new vol/arch, stdio stream and we don't know where we started from
      * ... don't cache
      */
-    if (posn == 0 || save_curvol != acp->ac_curvol || archive_changed ||
-	acp->ac_mark_done) {
-	if (lfup->c_name) {
-	    free(lfup->c_name);
-	    lfup->c_name = NULL;
-	}
+    if (posn == 0 || save_curvol != acp->ac_curvol ||
+	save_curlog != acp->ac_cur_log || acp->ac_mark_done ||
+	lfup->sts < 0) {
 	if (pmDebugOptions.log && pmDebugOptions.desperate)
 	    fprintf(stderr, "cache_read: reload vol switch, mark cache[%d] unused\n",
-		(int)(lfup - cache));
+		(int)(lfup - rcp->cache));
     }
     else {
 	lfup->mode = mode;
+	lfup->arch = acp->ac_cur_log;
 	lfup->vol = acp->ac_vol;
 	lfup->used = 1;
-	/* Try to avoid excessive copying/freeing of the archive name. */
-	if (lfup->c_name != NULL && strcmp(lfup->c_name, acp->ac_log->l_name) != 0) {
-	    free(lfup->c_name);
-	    lfup->c_name = NULL;
-	}
-	if (lfup->c_name == NULL) {
-	    if ((lfup->c_name = strdup(acp->ac_log->l_name)) == NULL) {
-		pmNoMem("__pmLogFetchInterp.l_name",
-			  strlen(acp->ac_log->l_name) + 1, PM_FATAL_ERR);
-	    }
-	}
 	if (mode == PM_MODE_FORW) {
 	    lfup->head_posn = posn;
-	    lfup->tail_posn = __pmFtell(acp->ac_mfp);
+	    lfup->tail_posn = lastp->posn = __pmFtell(acp->ac_mfp);
 	    assert(lfup->tail_posn >= 0);
 	}
 	else {
 	    lfup->tail_posn = posn;
-	    lfup->head_posn = __pmFtell(acp->ac_mfp);
+	    lfup->head_posn = lastp->posn = __pmFtell(acp->ac_mfp);
 	    assert(lfup->head_posn >= 0);
 	}
+	lastp->arch = lfup->arch;
+	lastp->vol = lfup->vol;
+	cache_validate(rcp, lfup);
 	if (pmDebugOptions.log && pmDebugOptions.desperate) {
 	    fprintf(stderr, "cache_read: reload cache[%d] vol=%d (curvol=%d) head=%ld tail=%ld ",
-		(int)(lfup - cache), lfup->vol, acp->ac_curvol,
+		(int)(lfup - rcp->cache), lfup->vol, acp->ac_curvol,
 		(long)lfup->head_posn, (long)lfup->tail_posn);
 	    if (lfup->sts == 0)
 		fprintf(stderr, "sts=%d\n", lfup->sts);
@@ -286,6 +487,8 @@ cache_read(__pmContext *ctxp, int mode, pmResult **rp)
 		fprintf(stderr, "sts=%s\n", pmErrStr_r(lfup->sts, errmsg, sizeof(errmsg)));
 	    }
 	}
+	if (sequential && rcp->readahead > 0)
+	    cache_readahead(ctxp, rcp, mode);
     }
 
     return lfup->sts;
@@ -915,8 +1118,8 @@ __pmLogFetchInterp(__pmContext *ctxp, int numpmid, pmID pmidlist[], pmResult **r
 	    t_req, ctxp->c_archctl->ac_curvol,
 	    (long)ctxp->c_archctl->ac_offset, ctxp->c_archctl->ac_vol,
 	    ctxp->c_archctl->ac_serial);
-	nr_cache[PM_MODE_FORW] = nr[PM_MODE_FORW] = 0;
-	nr_cache[PM_MODE_BACK] = nr[PM_MODE_BACK] = 0;
+	nr_cache[PM_MODE_FORW] = nr[PM_MODE_FORW] = nr_ahead[PM_MODE_FORW] = 0;
+	nr_cache[PM_MODE_BACK] = nr[PM_MODE_BACK] = nr_ahead[PM_MODE_BACK] = 0;
     }
 
     /*
@@ -1921,14 +2124,15 @@ all_done:
     }
 
     if (pmDebugOptions.interp) {
-	fprintf(stderr, "__pmLogFetchInterp: log reads: forward %ld",
-	    nr[PM_MODE_FORW]);
-	if (nr_cache[PM_MODE_FORW])
-	    fprintf(stderr, " (+%ld cached)", nr_cache[PM_MODE_FORW]);
-	fprintf(stderr, " backwards %ld",
-	    nr[PM_MODE_BACK]);
-	if (nr_cache[PM_MODE_BACK])
-	    fprintf(stderr, " (+%ld cached)", nr_cache[PM_MODE_BACK]);
+	/* cache counts go last, QA scripts pick out read counts by field */
+	fprintf(stderr, "__pmLogFetchInterp: log reads: forward %ld backwards %ld",
+	    nr[PM_MODE_FORW], nr[PM_MODE_BACK]);
+	if (nr_cache[PM_MODE_FORW] || nr_cache[PM_MODE_BACK])
+	    fprintf(stderr, " cached: forward %ld backwards %ld",
+		nr_cache[PM_MODE_FORW], nr_cache[PM_MODE_BACK]);
+	if (nr_ahead[PM_MODE_FORW] || nr_ahead[PM_MODE_BACK])
+	    fprintf(stderr, " read ahead: forward %ld backwards %ld",
+		nr_ahead[PM_MODE_FORW], nr_ahead[PM_MODE_BACK]);
 	fprintf(stderr, "\n");
     }
 
@@ -2059,12 +2263,7 @@ __pmFreeInterpData(__pmContext *ctxp)
 			free(last_ihp);
 		    }
 		}
-		if (pcp->hc.hash) {
-		    free(pcp->hc.hash);
-		    /* just being paranoid here */
-		    pcp->hc.hash = NULL;
-		}
-		pcp->hc.hsize = 0;
+		__pmHashClear(&pcp->hc);
 		if (last_hp != NULL) {
 		    if (last_hp->data != NULL)
 			free(last_hp->data);
@@ -2078,36 +2277,29 @@ __pmFreeInterpData(__pmContext *ctxp)
 		free(last_hp);
 	    }
 	}
-	if (hcp->hash) {
-	    free(hcp->hash);
-	    /* just being paranoid here */
-	    hcp->hash = NULL;
-	}
-	hcp->hsize = 0;
+	__pmHashClear(hcp);
     }
 
     if (ctxp->c_archctl->ac_cache != NULL) {
 	/* read cache allocated, work to be done */
-	cache_t		*cache = (cache_t *)ctxp->c_archctl->ac_cache;
+	readcache_t	*rcp = (readcache_t *)ctxp->c_archctl->ac_cache;
 	cache_t		*cp;
 
-	for (cp = cache; cp < &cache[NUMCACHE]; cp++) {
+	for (cp = rcp->cache; cp < &rcp->cache[rcp->nentry]; cp++) {
 	    if (pmDebugOptions.log && pmDebugOptions.interp) {
 		fprintf(stderr, "read cache entry "
-			PRINTF_P_PFX "%p: c_name=%s rp="
+			PRINTF_P_PFX "%p: arch=%d vol=%d valid=%d rp="
 			PRINTF_P_PFX "%p\n",
-			cp, cp->c_name ? cp->c_name : "(none)",
-			cp->rp);
-	    }
-	    if (cp->c_name != NULL) {
-		free(cp->c_name);
-		cp->c_name = NULL;
+			cp, cp->arch, cp->vol, cp->valid, cp->rp);
 	    }
-	    if (cp->rp != NULL) {
+	    cache_invalidate(rcp, cp);
+	    if (cp->rp != NULL)
 		pmFreeResult(cp->rp);
-		cp->rp = NULL;
-	    }
-	    cp->used = 0;
 	}
+	__pmHashClear(&rcp->head_hc);
+	__pmHashClear(&rcp->tail_hc);
+	free(rcp->cache);
+	free(rcp);
+	ctxp->c_archctl->ac_cache = NULL;
     }
 }
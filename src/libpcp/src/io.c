@@ -24,6 +24,9 @@
 #include "internal.h"
 
 extern __pm_fops __pm_stdio;
+#if defined(HAVE_SYS_MMAN_H)
+extern __pm_fops __pm_mmap;
+#endif
 #if HAVE_TRANSPARENT_DECOMPRESSION && HAVE_LZMA_DECOMPRESSION
 extern __pm_fops __pm_xz;
 #endif
@@ -61,9 +64,9 @@ static const struct {
 static const int ncompress = sizeof(compress_ctl) / sizeof(compress_ctl[0]);
 
 /*
- * If name contains '.' and the suffix is "index", "meta" or a string of
- * digits, all optionally followed by one of the compression suffixes,
- * strip the suffix.
+ * If name contains '.' and the suffix is "index", "meta", "metaidx" or a
+ * string of digits, all optionally followed by one of the compression
+ * suffixes, strip the suffix.
  *
  * Modifications are performed on the argument string in-place. If modifications
  * are made, a pointer to the start of the modified string is returned.
@@ -103,6 +106,10 @@ __pmLogBaseName(char *name)
 	    strip = 1;
 	    goto done;
 	}
+	if (strcmp(q, ".metaidx") == 0) {
+	    strip = 1;
+	    goto done;
+	}
 	/*
 	 * Check for a string of digits as the suffix.
 	 */
@@ -349,10 +356,33 @@ index_compress(char *fname, size_t flen)
     return -1;
 }
 
+#if defined(HAVE_SYS_MMAN_H)
+/*
+ * Uncompressed files opened read-only are mapped only if $PCP_MMAP is
+ * set in the environment ... a mapped file that is truncated while we
+ * read it (a live archive volume, or .meta being rewritten) would raise
+ * SIGBUS in place of a short read.
+ */
+static int
+use_mmap(const char *mode)
+{
+    char	*val;
+
+    if (mode[0] != 'r' || mode[1] != '\0')
+	return 0;
+    PM_LOCK(__pmLock_extcall);
+    val = getenv("PCP_MMAP");		/* THREADSAFE */
+    PM_UNLOCK(__pmLock_extcall);
+    return val != NULL;
+}
+#endif
+
 /*
  * Open a PCP file with given mode and return a __pmFILE. An i/o
  * handler is automatically chosen based on filename suffix, e.g. .xz, .gz,
- * etc. The stdio pass-thru handler will be chosen for other files.
+ * etc. The mmap handler will be chosen for other files opened read-only
+ * when $PCP_MMAP is set, and the stdio pass-thru handler otherwise (or
+ * if the mmap fails).
  * The stdio handler is the only handler currently supporting write operations.
  * Return a valid __pmFILE pointer on success or NULL on failure.
  */
@@ -401,10 +431,16 @@ __pmFopen(const char *path, const char *mode)
 
     /*
      * The file is either not compressed, or we can not decompress it directly.
-     * Default to the stdio handler if one has not yet been chosen.
+     * Default to the mmap or stdio handler if one has not yet been chosen.
      */
-    if (handler == NULL)
-	handler = &__pm_stdio;
+    if (handler == NULL) {
+#if defined(HAVE_SYS_MMAN_H)
+	if (use_mmap(mode))
+	    handler = &__pm_mmap;
+	else
+#endif
+	    handler = &__pm_stdio;
+    }
 
     /* Now allocate and open the __pmFile. */
     if ((f = (__pmFILE *)malloc(sizeof(__pmFILE))) == NULL)
@@ -419,6 +455,19 @@ __pmFopen(const char *path, const char *mode)
      * be used to deallocate and close, see __pmClose() below.
      */
     if (f->fops->__pmopen(f, path, mode) == NULL) {
+#if defined(HAVE_SYS_MMAN_H)
+	if (handler == &__pm_mmap && oserror() != ENOENT && oserror() != EACCES) {
+	    /* could not map it (address space?), fall back to stdio */
+	    if (pmDebugOptions.log) {
+		char	errmsg[PM_MAXERRMSGLEN];
+		fprintf(stderr, "__pmFopen: mmap %s failed: %s\n", path, osstrerror_r(errmsg, sizeof(errmsg)));
+	    }
+	    memset(f, 0, sizeof(__pmFILE));
+	    f->fops = &__pm_stdio;
+	    if (f->fops->__pmopen(f, path, mode) != NULL)
+		return f;
+	}
+#endif
 	free(f);
     	return NULL;
     }
@@ -551,6 +600,34 @@ __pmSetvbuf(__pmFILE *f, char *buf, int mode, size_t size)
     return f->fops->__pmsetvbuf(f, buf, mode, size);
 }
 
+/*
+ * Return a pointer to the next len bytes of the file and advance past
+ * them, without copying, or NULL if the handler cannot do this (only
+ * the mmap handler can) or fewer than len bytes remain.  The bytes are
+ * read-only, and only valid until the next operation on f.
+ */
+void *
+__pmFmap(__pmFILE *f, size_t len)
+{
+    if (f->fops->__pmmap == NULL)
+	return NULL;
+    return f->fops->__pmmap(f, len);
+}
+
+/*
+ * Have the handler decode up to depth blocks ahead of the reader with
+ * nthreads worker threads (0 for a default), or stop if depth is 0.
+ * Only meaningful for compressed files made up of independent blocks,
+ * for everything else this quietly does nothing.
+ */
+int
+__pmFreadahead(__pmFILE *f, int depth, int nthreads)
+{
+    if (f->fops->__pmreadahead == NULL)
+	return 0;
+    return f->fops->__pmreadahead(f, depth, nthreads);
+}
+
 /*
  * Deallocate and close a PCP file that was previously opened
  * with __pmFopen(). Return 0 for success.
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This library is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * Read-only i/o handler for uncompressed files, using mmap(2) in place
+ * of stdio.  Reads are a memcpy from the mapped pages, and __pmFmap()
+ * hands out the mapped bytes themselves, so replaying a large archive
+ * volume needs no read(2) calls and no copying into PDU buffers.
+ *
+ * Archives being written by pmlogger grow while we read them, so when
+ * a read runs off the end of the mapping the file is checked and, if
+ * it has grown, mapped again.  A file that shrinks under the mapping
+ * cannot be handled this way (the access faults), which is why this
+ * handler is only used when $PCP_MMAP is set, see __pmFopen().
+ */
+#include "config.h"
+#if defined(HAVE_SYS_MMAN_H)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include "pmapi.h"
+#include "libpcp.h"
+#include "internal.h"
+
+typedef struct {
+    int		fd;
+    char	*base;		/* mapped file, NULL when file is empty */
+    size_t	size;		/* bytes mapped */
+    off_t	offset;		/* current position */
+    int		eof;		/* like feof(3) */
+    int		err;		/* like ferror(3) */
+} mmapfile;
+
+/*
+ * (Re)map the whole file if it is larger than the current mapping.
+ * Returns 0 on success, else -1 with errno set.
+ */
+static int
+mmap_map(mmapfile *mf)
+{
+    struct stat	sbuf;
+    void	*base;
+
+    if (fstat(mf->fd, &sbuf) < 0)
+	return -1;
+    if (sbuf.st_size <= (off_t)mf->size)
+	return 0;
+    if ((off_t)(size_t)sbuf.st_size != sbuf.st_size) {
+	/* larger than our address space */
+	errno = EFBIG;
+	return -1;
+    }
+    base = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, mf->fd, 0);
+    if (base == MAP_FAILED)
+	return -1;
+    if (mf->base != NULL)
+	munmap(mf->base, mf->size);
+    mf->base = base;
+    mf->size = sbuf.st_size;
+    return 0;
+}
+
+/*
+ * Make sure [offset, offset+len) is mapped, remapping if the file
+ * has grown.  Returns the number of those bytes available.
+ */
+static size_t
+mmap_avail(mmapfile *mf, size_t len)
+{
+    if (mf->offset >= (off_t)mf->size || len > mf->size - mf->offset) {
+	if (mmap_map(mf) < 0) {
+	    mf->err = 1;
+	    return 0;
+	}
+	if (mf->offset >= (off_t)mf->size)
+	    return 0;
+	if (len > mf->size - mf->offset)
+	    return mf->size - mf->offset;
+    }
+    return len;
+}
+
+static void *
+mmap_fdopen(__pmFILE *f, int fd, const char *mode)
+{
+    mmapfile	*mf;
+
+    if (mode[0] != 'r' || mode[1] != '\0') {
+	/* read-only, by design */
+	errno = EINVAL;
+	return NULL;
+    }
+    if ((mf = (mmapfile *)calloc(1, sizeof(*mf))) == NULL)
+	return NULL;
+    mf->fd = fd;
+    if (mmap_map(mf) < 0) {
+	free(mf);
+	return NULL;
+    }
+
+    f->priv = (void *)mf;
+    f->position = 0;
+
+    return f;
+}
+
+static void *
+mmap_open(__pmFILE *f, const char *path, const char *mode)
+{
+    int		fd;
+    int		sts;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return NULL;
+    if (mmap_fdopen(f, fd, mode) == NULL) {
+	sts = oserror();
+	close(fd);
+	setoserror(sts);
+	return NULL;
+    }
+    return f;
+}
+
+static int
+mmap_seek(__pmFILE *f, off_t offset, int whence)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    off_t	new_offset;
+
+    switch (whence) {
+    case SEEK_SET:
+	new_offset = offset;
+	break;
+    case SEEK_CUR:
+	new_offset = mf->offset + offset;
+	break;
+    case SEEK_END:
+	/* the file may have grown since it was mapped */
+	if (mmap_map(mf) < 0)
+	    return -1;
+	new_offset = mf->size + offset;
+	break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+    if (new_offset < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    /* as for fseek(3), beyond the end is allowed */
+    mf->offset = new_offset;
+    mf->eof = 0;
+    f->position = new_offset;
+    return 0;
+}
+
+static void
+mmap_rewind(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+
+    mmap_seek(f, 0, SEEK_SET);
+    mf->err = 0;
+}
+
+static off_t
+mmap_tell(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    return mf->offset;
+}
+
+static int
+mmap_getc(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    int		c;
+
+    if (mmap_avail(mf, 1) != 1) {
+	mf->eof = 1;
+	return EOF;
+    }
+    c = (unsigned char)mf->base[mf->offset++];
+    f->position = mf->offset;
+    return c;
+}
+
+static size_t
+mmap_read(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    size_t	len, n;
+
+    if (size == 0 || nmemb == 0)
+	return 0;
+    len = size * nmemb;
+    if ((n = mmap_avail(mf, len)) < len)
+	mf->eof = 1;
+    if (n > 0) {
+	memcpy(ptr, &mf->base[mf->offset], n);
+	mf->offset += n;
+	f->position = mf->offset;
+    }
+    return n / size;
+}
+
+/*
+ * Return the next len bytes in place, and move past them.  NULL if
+ * fewer than len bytes remain, and then the position is unchanged.
+ */
+static void *
+mmap_map_read(__pmFILE *f, size_t len)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    char	*p;
+
+    if (len == 0 || mmap_avail(mf, len) < len)
+	return NULL;
+    p = &mf->base[mf->offset];
+    mf->offset += len;
+    f->position = mf->offset;
+    return (void *)p;
+}
+
+static size_t
+mmap_write(void *ptr, size_t size, size_t nmemb, __pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+
+    mf->err = 1;
+    errno = EBADF;
+    return 0;
+}
+
+static int
+mmap_flush(__pmFILE *f)
+{
+    return 0;
+}
+
+static int
+mmap_fsync(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    return fsync(mf->fd);
+}
+
+static int
+mmap_fileno(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    return mf->fd;
+}
+
+static off_t
+mmap_lseek(__pmFILE *f, off_t offset, int whence)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+
+    /* there is no buffering, so this is the same as mmap_seek */
+    if (mmap_seek(f, offset, whence) < 0)
+	return (off_t)-1;
+    return mf->offset;
+}
+
+static int
+mmap_fstat(__pmFILE *f, struct stat *buf)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    return fstat(mf->fd, buf);
+}
+
+static int
+mmap_feof(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    return mf->eof;
+}
+
+static int
+mmap_ferror(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    return mf->err;
+}
+
+static void
+mmap_clearerr(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    mf->eof = mf->err = 0;
+}
+
+static int
+mmap_setvbuf(__pmFILE *f, char *buf, int mode, size_t size)
+{
+    /* nothing is buffered */
+    return 0;
+}
+
+static int
+mmap_close(__pmFILE *f)
+{
+    mmapfile	*mf = (mmapfile *)f->priv;
+    int		sts;
+
+    if (mf->base != NULL)
+	munmap(mf->base, mf->size);
+    sts = close(mf->fd);
+    free(mf);
+    return sts;
+}
+
+__pm_fops __pm_mmap = {
+    /*
+     * mmap - read-only, no compression
+     */
+    .__pmopen = mmap_open,
+    .__pmfdopen = mmap_fdopen,
+    .__pmseek = mmap_seek,
+    .__pmrewind = mmap_rewind,
+    .__pmtell = mmap_tell,
+    .__pmfgetc = mmap_getc,
+    .__pmread = mmap_read,
+    .__pmwrite = mmap_write,
+    .__pmflush = mmap_flush,
+    .__pmfsync = mmap_fsync,
+    .__pmfileno = mmap_fileno,
+    .__pmlseek = mmap_lseek,
+    .__pmfstat = mmap_fstat,
+    .__pmfeof = mmap_feof,
+    .__pmferror = mmap_ferror,
+    .__pmclearerr = mmap_clearerr,
+    .__pmsetvbuf = mmap_setvbuf,
+    .__pmclose = mmap_close,
+    .__pmmap = mmap_map_read
+};
+#endif /* HAVE_SYS_MMAN_H */
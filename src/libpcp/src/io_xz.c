@@ -41,6 +41,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <lzma.h>
 #include "pmapi.h"
 #include "libpcp.h"
@@ -78,6 +79,42 @@ typedef struct blkcache {
 #endif
 } blkcache;
 
+/*
+ * Read ahead.  Sequential scans, forwards or backwards, of a volume
+ * with more than one block (xz -T or --block-size) have the next
+ * blocks in the direction of travel decoded by a pool of worker
+ * threads, and these are moved into the blkcache as they are needed.
+ * Only the reader (under the context lock) schedules and takes jobs;
+ * the workers only decode, and everything shared is guarded by lock.
+ */
+enum { JOB_FREE, JOB_QUEUED, JOB_BUSY, JOB_DONE };
+
+typedef struct xzjob {
+    int state;
+    int cancel;		/* BUSY, but no longer wanted */
+    unsigned int seq;	/* QUEUED jobs are decoded in seq order */
+    uint64_t start;
+    uint64_t size;
+    char *data;		/* DONE, NULL if the decode failed */
+} xzjob;
+
+typedef struct xzahead {
+    struct xzfile *xz;
+    int depth;		/* blocks decoded ahead */
+    int nthreads;
+    uint64_t last;	/* start of the last block used */
+    unsigned int seq;
+#ifdef PM_MULTI_THREAD
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;	/* a job has been queued, or shutdown */
+    pthread_cond_t done;	/* a job has been decoded */
+#endif
+    int shutdown;
+    xzjob *jobs;	/* depth of these */
+    uint64_t *want;	/* starts of the next depth blocks */
+} xzahead;
+
 /* The file handle */
 typedef struct xzfile {
     FILE *f;
@@ -86,6 +123,7 @@ typedef struct xzfile {
     size_t nr_streams;
     size_t nr_blocks;
     blkcache *cache;
+    xzahead *ahead;
     off_t uncompressed_offset;
   __uint64_t uncompressed_size;
   __uint64_t max_uncompressed_block_size;
@@ -429,6 +467,7 @@ init(xzfile *xz)
   xz->uncompressed_size = lzma_index_uncompressed_size(xz->idx);
   xz->uncompressed_offset = 0;
   xz->cache = new_blkcache(PCP_XZ_CACHE_BLOCKS);
+  xz->ahead = NULL;
   
   return 0; /* ok */
 }
@@ -571,6 +610,7 @@ read_block(xzfile *xz, uint64_t offset,
   lzma_ret r;
   lzma_stream strm = LZMA_STREAM_INIT;
   char *data;
+  off_t pos;
   ssize_t n;
   size_t i;
 
@@ -588,15 +628,15 @@ read_block(xzfile *xz, uint64_t offset,
                 (int) iter.block.number_in_file,
                 (uint64_t) iter.block.compressed_file_offset);
 
-  if (lseek(xz->fd, iter.block.compressed_file_offset, SEEK_SET) == -1) {
-    xz_debug("lseek: %m");
-    return NULL;
-  }
+  /* pread(2) rather than lseek(2) and read(2), so that read ahead
+   * workers can decode blocks concurrently.
+   */
+  pos = iter.block.compressed_file_offset;
 
   /* Read the block header.  Start by reading a single byte which
    * tell us how big the block header is.
    */
-  n = read(xz->fd, header, 1);
+  n = pread(xz->fd, header, 1, pos);
   if (n == 0) {
     xz_debug("read: unexpected end of file reading block header byte");
     return NULL;
@@ -616,8 +656,10 @@ read_block(xzfile *xz, uint64_t offset,
   block.filters = filters;
   block.header_size = lzma_block_header_size_decode(header[0]);
 
+  pos += n;
+
   /* Now read and decode the block header. */
-  n = read(xz->fd, &header[1], block.header_size-1);
+  n = pread(xz->fd, &header[1], block.header_size-1, pos);
   if (n >= 0 && n != block.header_size-1) {
     xz_debug("read: unexpected end of file reading block header");
     return NULL;
@@ -627,6 +669,8 @@ read_block(xzfile *xz, uint64_t offset,
     return NULL;
   }
 
+  pos += n;
+
   r = lzma_block_header_decode(&block, NULL, header);
   if (r != LZMA_OK) {
     xz_debug("invalid block header (error %d)", r);
@@ -668,11 +712,12 @@ read_block(xzfile *xz, uint64_t offset,
 
     if (strm.avail_in == 0) {
       strm.next_in = buf;
-      n = read(xz->fd, buf, sizeof buf);
+      n = pread(xz->fd, buf, sizeof buf, pos);
       if (n == -1) {
         xz_debug("read: %m");
         goto err2;
       }
+      pos += n;
       strm.avail_in = n;
       if (n == 0)
         action = LZMA_FINISH;
@@ -705,6 +750,262 @@ read_block(xzfile *xz, uint64_t offset,
   return NULL;
 }
 
+#ifdef PM_MULTI_THREAD
+static void *
+ahead_worker(void *arg)
+{
+    xzahead *ra = (xzahead *)arg;
+    xzjob *job;
+    char *data;
+    uint64_t start, size;
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    for ( ; ; ) {
+	/* the queued job nearest the reader goes first */
+	job = NULL;
+	for (i = 0; i < ra->depth; i++) {
+	    if (ra->jobs[i].state == JOB_QUEUED &&
+		(job == NULL || ra->jobs[i].seq - job->seq > UINT_MAX / 2))
+		job = &ra->jobs[i];
+	}
+	if (job == NULL) {
+	    if (ra->shutdown)
+		break;
+	    pthread_cond_wait(&ra->work, &ra->lock);
+	    continue;
+	}
+	job->state = JOB_BUSY;
+	pthread_mutex_unlock(&ra->lock);
+
+	data = read_block(ra->xz, job->start, &start, &size);
+
+	pthread_mutex_lock(&ra->lock);
+	if (job->cancel) {
+	    free(data);
+	    job->cancel = 0;
+	    job->state = JOB_FREE;
+	}
+	else {
+	    job->data = data;
+	    job->state = JOB_DONE;
+	}
+	pthread_cond_broadcast(&ra->done);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+/*
+ * The start of the block before or after the one at start (of size
+ * bytes), or -1 at either end of the volume.
+ */
+static int
+ahead_next(xzfile *xz, int backward, uint64_t *start, uint64_t *size)
+{
+    lzma_index_iter iter;
+    uint64_t offset;
+
+    if (backward) {
+	if (*start == 0)
+	    return -1;
+	offset = *start - 1;
+    }
+    else {
+	offset = *start + *size;
+	if (offset >= xz->uncompressed_size)
+	    return -1;
+    }
+    lzma_index_iter_init(&iter, xz->idx);
+    if (lzma_index_iter_locate(&iter, offset))
+	return -1;
+    *start = iter.block.uncompressed_file_offset;
+    *size = iter.block.uncompressed_size;
+    return 0;
+}
+
+/*
+ * The reader has just started using blk ... make sure the next depth
+ * blocks in the same direction are cached, decoded or queued, and
+ * drop any other read ahead.
+ */
+static void
+ahead_schedule(xzahead *ra, const block *blk)
+{
+    xzfile *xz = ra->xz;
+    blkcache *cache = xz->cache;
+    uint64_t start = blk->start, size = blk->size;
+    int backward = (blk->start < ra->last);
+    int nwant, i, j;
+
+    ra->last = blk->start;
+    for (nwant = 0; nwant < ra->depth; ) {
+	if (ahead_next(xz, backward, &start, &size) < 0)
+	    break;
+	for (i = 0; i < cache->maxdepth; i++) {
+	    if (cache->blocks[i].data != NULL && cache->blocks[i].start == start)
+		break;
+	}
+	if (i == cache->maxdepth)
+	    ra->want[nwant++] = start;
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    /* drop the jobs we no longer want, keep the others */
+    for (i = 0; i < ra->depth; i++) {
+	xzjob *job = &ra->jobs[i];
+
+	if (job->state == JOB_FREE || job->cancel)
+	    continue;
+	for (j = 0; j < nwant; j++) {
+	    if (ra->want[j] == job->start)
+		break;
+	}
+	if (j < nwant) {
+	    ra->want[j] = ra->want[--nwant];	/* already in hand */
+	    continue;
+	}
+	if (job->state == JOB_BUSY)
+	    job->cancel = 1;
+	else {
+	    free(job->data);
+	    job->data = NULL;
+	    job->state = JOB_FREE;
+	}
+    }
+    /* and queue the rest, nearest first */
+    for (i = 0, j = 0; j < nwant; j++) {
+	for ( ; i < ra->depth; i++) {
+	    if (ra->jobs[i].state == JOB_FREE)
+		break;
+	}
+	if (i == ra->depth)
+	    break;
+	ra->jobs[i].state = JOB_QUEUED;
+	ra->jobs[i].seq = ra->seq++;
+	ra->jobs[i].start = ra->want[j];
+	ra->jobs[i].size = 0;
+	ra->jobs[i].data = NULL;
+    }
+    if (j > 0)
+	pthread_cond_broadcast(&ra->work);
+    pthread_mutex_unlock(&ra->lock);
+}
+
+/*
+ * Return the decoded block containing offset if read ahead has it,
+ * waiting if a worker is decoding it now.  Otherwise NULL, and the
+ * caller decodes the block itself.
+ */
+static char *
+ahead_take(xzahead *ra, uint64_t offset, uint64_t *start_rtn, uint64_t *size_rtn)
+{
+    lzma_index_iter iter;
+    xzjob *job = NULL;
+    char *data = NULL;
+    int i;
+
+    lzma_index_iter_init(&iter, ra->xz->idx);
+    if (lzma_index_iter_locate(&iter, offset))
+	return NULL;
+
+    pthread_mutex_lock(&ra->lock);
+    for (i = 0; i < ra->depth; i++) {
+	if (ra->jobs[i].state != JOB_FREE && !ra->jobs[i].cancel &&
+	    ra->jobs[i].start == iter.block.uncompressed_file_offset) {
+	    job = &ra->jobs[i];
+	    break;
+	}
+    }
+    if (job != NULL) {
+	while (job->state == JOB_BUSY)
+	    pthread_cond_wait(&ra->done, &ra->lock);
+	if (job->state == JOB_DONE) {
+	    data = job->data;
+	    *start_rtn = iter.block.uncompressed_file_offset;
+	    *size_rtn = iter.block.uncompressed_size;
+	}
+	/* a QUEUED job is quicker to decode here than wait for */
+	job->data = NULL;
+	job->state = JOB_FREE;
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return data;
+}
+
+static void
+ahead_stop(xzfile *xz)
+{
+    xzahead *ra = xz->ahead;
+    int i;
+
+    if (ra == NULL)
+	return;
+    pthread_mutex_lock(&ra->lock);
+    ra->shutdown = 1;
+    for (i = 0; i < ra->depth; i++) {
+	if (ra->jobs[i].state == JOB_QUEUED)
+	    ra->jobs[i].state = JOB_FREE;
+    }
+    pthread_cond_broadcast(&ra->work);
+    pthread_mutex_unlock(&ra->lock);
+    for (i = 0; i < ra->nthreads; i++)
+	pthread_join(ra->threads[i], NULL);
+    for (i = 0; i < ra->depth; i++)
+	free(ra->jobs[i].data);
+    pthread_cond_destroy(&ra->done);
+    pthread_cond_destroy(&ra->work);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra->threads);
+    free(ra->want);
+    free(ra->jobs);
+    free(ra);
+    xz->ahead = NULL;
+}
+
+static int
+ahead_start(xzfile *xz, int depth, int nthreads)
+{
+    xzahead *ra;
+    int sts;
+
+    if ((ra = (xzahead *)calloc(1, sizeof(*ra))) == NULL)
+	return -oserror();
+    ra->xz = xz;
+    ra->depth = depth;
+    ra->last = xz->uncompressed_offset;
+    if ((ra->jobs = (xzjob *)calloc(depth, sizeof(xzjob))) == NULL ||
+	(ra->want = (uint64_t *)calloc(depth, sizeof(uint64_t))) == NULL ||
+	(ra->threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) == NULL) {
+	sts = -oserror();
+	free(ra->jobs);
+	free(ra->want);
+	free(ra);
+	return sts;
+    }
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->work, NULL);
+    pthread_cond_init(&ra->done, NULL);
+    xz->ahead = ra;
+    for (ra->nthreads = 0; ra->nthreads < nthreads; ra->nthreads++) {
+	sts = pthread_create(&ra->threads[ra->nthreads], NULL, ahead_worker, ra);
+	if (sts != 0)
+	    break;
+    }
+    if (ra->nthreads == 0) {
+	/* no threads, no read ahead */
+	ahead_stop(xz);
+	return -sts;
+    }
+    return 0;
+}
+#else
+/* without threads, blocks are only ever decoded on demand */
+#define ahead_schedule(ra, blk)		do { } while (0)
+#define ahead_take(ra, offset, start, size)	NULL
+#define ahead_stop(xz)			do { } while (0)
+#endif
+
 static block *
 read_new_block(xzfile *xz, int slot)
 {
@@ -713,8 +1014,10 @@ read_new_block(xzfile *xz, int slot)
     char *data;
     uint64_t start = 0, size = 0; /* silence coverity */
 
-    /* Decompress a new block into the given slot. */
-    data = read_block(xz, xz->uncompressed_offset, &start, &size);
+    /* Decompress a new block into the given slot, unless read ahead has. */
+    if (xz->ahead == NULL ||
+	(data = ahead_take(xz->ahead, xz->uncompressed_offset, &start, &size)) == NULL)
+	data = read_block(xz, xz->uncompressed_offset, &start, &size);
     if (data == NULL)
 	return NULL;
 
@@ -774,6 +1077,13 @@ reposition(xzfile *xz)
     if (slot >= cache->maxdepth)
 	slot = cache->maxdepth - 1;
     blk = read_new_block(xz, slot);
+    /*
+     * Read ahead from here.  Only on a miss, as records straddling
+     * a block boundary bounce between cached blocks when reading
+     * backwards, and that is not a change of direction.
+     */
+    if (blk != NULL && xz->ahead != NULL)
+	ahead_schedule(xz->ahead, blk);
 
     return blk;
 }
@@ -887,12 +1197,44 @@ xz_setvbuf(__pmFILE *f, char *buf, int mode, size_t size)
     return -1;
 }
 
+/*
+ * Decode up to depth blocks ahead of the reader using nthreads workers
+ * (at most depth, and by default one per CPU), or stop if depth is 0.
+ */
+static int
+xz_readahead(__pmFILE *f, int depth, int nthreads)
+{
+#ifdef PM_MULTI_THREAD
+    xzfile *xz = f->priv;
+    long ncpu;
+
+    if (xz->ahead != NULL) {
+	if (xz->ahead->depth == depth &&
+	    (nthreads <= 0 || xz->ahead->nthreads == nthreads))
+	    return 0;
+	ahead_stop(xz);
+    }
+    if (depth <= 0 || xz->nr_blocks < 2)
+	return 0;
+    if (nthreads <= 0) {
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? (int)ncpu : 1;
+    }
+    if (nthreads > depth)
+	nthreads = depth;
+    return ahead_start(xz, depth, nthreads);
+#else
+    return 0;
+#endif
+}
+
 static int
 xz_close(__pmFILE *f)
 {
     xzfile *xz = f->priv;
     int sts;
     
+    ahead_stop(xz);
     lzma_index_end (xz->idx, NULL);
     sts = fclose(xz->f);
     free_blkcache(xz->cache);
@@ -921,6 +1263,7 @@ __pm_fops __pm_xz = {
     .__pmferror = xz_ferror,
     .__pmclearerr = xz_clearerr,
     .__pmsetvbuf = xz_setvbuf,
-    .__pmclose = xz_close
+    .__pmclose = xz_close,
+    .__pmreadahead = xz_readahead
 };
 #endif /* HAVE_LZMA_DECOMPRESSION */
@@ -70,46 +70,35 @@ sameindom(const __pmLogInDom *idp1, const __pmLogInDom *idp2)
     return 1; /* duplicate */
 }
 
-/*
- * Add the given instance domain to the hashed instance domain.
- * Filter out duplicates.
- */
-static int
-addindom(__pmLogCtl *lcp, pmInDom indom, const pmTimeval *tp, int numinst, 
-         int *instlist, char **namelist, int *indom_buf, int allinbuf)
+static __pmLogInDom *
+newindom(const pmTimeval *tp, int numinst, int *instlist, char **namelist,
+	 int *indom_buf, int allinbuf)
 {
-    __pmLogInDom	*idp, *idp_prev;
-    __pmLogInDom	*idp_cached, *idp_time;
-    __pmHashNode	*hp;
-    int			timecmp;
-    int			sts;
+    __pmLogInDom	*idp;
 
 PM_FAULT_POINT("libpcp/" __FILE__ ":1", PM_FAULT_ALLOC);
     if ((idp = (__pmLogInDom *)malloc(sizeof(__pmLogInDom))) == NULL)
-	return -oserror();
+	return NULL;
+    idp->next = NULL;
     idp->stamp = *tp;		/* struct assignment */
     idp->numinst = numinst;
     idp->instlist = instlist;
     idp->namelist = namelist;
     idp->buf = indom_buf;
     idp->allinbuf = allinbuf;
+    return idp;
+}
 
-    if (pmDebugOptions.logmeta) {
-	char    strbuf[20];
-	fprintf(stderr, "addindom( ..., %s, ", pmInDomStr_r(indom, strbuf, sizeof(strbuf)));
-	StrTimeval((pmTimeval *)tp);
-	fprintf(stderr, ", numinst=%d)\n", numinst);
-    }
-
-    if ((hp = __pmHashSearch((unsigned int)indom, &lcp->l_hashindom)) == NULL) {
-	idp->next = NULL;
-	sts = __pmHashAdd((unsigned int)indom, (void *)idp, &lcp->l_hashindom);
-	if (sts > 0) {
-	    /* __pmHashAdd returns 1 for success, but we want 0. */
-	    sts = 0;
-	}
-	return sts;
-    }
+/*
+ * Link idp into the time ordered list at *head, filtering out duplicates.
+ */
+static int
+linkindom(__pmLogInDom **head, __pmLogInDom *idp, pmInDom indom)
+{
+    __pmLogInDom	*idp_prev;
+    __pmLogInDom	*idp_cached, *idp_time;
+    int			timecmp;
+    int			sts;
 
     /*
      * Filter out identical indoms. This is very common in multi-archive
@@ -123,7 +112,7 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":1", PM_FAULT_ALLOC);
      */
     sts = 0;
     idp_prev = NULL;
-    for (idp_cached = (__pmLogInDom *)hp->data; idp_cached; idp_cached = idp_cached->next) {
+    for (idp_cached = *head; idp_cached; idp_cached = idp_cached->next) {
 	timecmp = __pmTimevalCmp(&idp_cached->stamp, &idp->stamp);
 
 	/*
@@ -188,7 +177,7 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":1", PM_FAULT_ALLOC);
 		if (idp_prev)
 		    idp_prev->next = idp_cached->next;
 		else
-		    hp->data = (void *)idp_cached->next;
+		    *head = idp_cached->next;
 		idp = idp_cached;
 	    }
 
@@ -209,8 +198,8 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":1", PM_FAULT_ALLOC);
 
     /* Insert at the identified insertion point. */
     if (idp_prev == NULL) {
-	idp->next = (__pmLogInDom *)hp->data;
-	hp->data = (void *)idp;
+	idp->next = *head;
+	*head = idp;
     }
     else {
 	idp->next = idp_prev->next;
@@ -220,6 +209,44 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":1", PM_FAULT_ALLOC);
     return sts;
 }
 
+/*
+ * Add the given instance domain to the hashed instance domain.
+ * Filter out duplicates.
+ */
+static int
+addindom(__pmLogCtl *lcp, pmInDom indom, const pmTimeval *tp, int numinst, 
+         int *instlist, char **namelist, int *indom_buf, int allinbuf)
+{
+    __pmLogInDom	*idp;
+    __pmLogInDom	*head;
+    __pmHashNode	*hp;
+    int			sts;
+
+    if ((idp = newindom(tp, numinst, instlist, namelist, indom_buf, allinbuf)) == NULL)
+	return -oserror();
+
+    if (pmDebugOptions.logmeta) {
+	char    strbuf[20];
+	fprintf(stderr, "addindom( ..., %s, ", pmInDomStr_r(indom, strbuf, sizeof(strbuf)));
+	StrTimeval((pmTimeval *)tp);
+	fprintf(stderr, ", numinst=%d)\n", numinst);
+    }
+
+    if ((hp = __pmHashSearch((unsigned int)indom, &lcp->l_hashindom)) == NULL) {
+	sts = __pmHashAdd((unsigned int)indom, (void *)idp, &lcp->l_hashindom);
+	if (sts > 0) {
+	    /* __pmHashAdd returns 1 for success, but we want 0. */
+	    sts = 0;
+	}
+	return sts;
+    }
+
+    head = (__pmLogInDom *)hp->data;
+    sts = linkindom(&head, idp, indom);
+    hp->data = (void *)head;
+    return sts;
+}
+
 static int
 addlabel(__pmArchCtl *acp, unsigned int type, unsigned int ident, int nsets,
 		pmLabelSet *labelsets, const pmTimeval *tp)
@@ -349,6 +376,740 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":15", PM_FAULT_ALLOC);
     return sts;
 }
 
+/*
+ * Decode the body of a TYPE_INDOM record in place, swabbing as we go.
+ * The namelist pointers need a separate allocation unless they fit
+ * in the buffer (allinbuf).
+ */
+static int
+decodeindom(int *tbuf, pmInDom *indom, pmTimeval **when, int *numinst,
+	    int **instlist, char ***namelist, int *allinbuf)
+{
+    char		*namebase;
+    int			*stridx;
+    int			i;
+    int			k;
+
+    k = 0;
+    *when = (pmTimeval *)&tbuf[k];
+    (*when)->tv_sec = ntohl((*when)->tv_sec);
+    (*when)->tv_usec = ntohl((*when)->tv_usec);
+    k += sizeof(**when)/sizeof(int);
+    *indom = __ntohpmInDom((unsigned int)tbuf[k++]);
+    *numinst = ntohl(tbuf[k++]);
+    *allinbuf = 0;
+    if (*numinst > 0) {
+	*instlist = &tbuf[k];
+	k += *numinst;
+	stridx = &tbuf[k];
+#if defined(HAVE_32BIT_PTR)
+	*namelist = (char **)stridx;
+	*allinbuf = 1; /* allocation is all in tbuf */
+#else
+	/* need to allocate to hold the pointers */
+PM_FAULT_POINT("libpcp/" __FILE__ ":4", PM_FAULT_ALLOC);
+	*namelist = (char **)malloc(*numinst*sizeof(char*));
+	if (*namelist == NULL)
+	    return -oserror();
+#endif
+	k += *numinst;
+	namebase = (char *)&tbuf[k];
+	for (i = 0; i < *numinst; i++) {
+	    (*instlist)[i] = ntohl((*instlist)[i]);
+	    (*namelist)[i] = &namebase[ntohl(stridx[i])];
+	}
+    }
+    else {
+	/* no instances, or an error */
+	*instlist = NULL;
+	*namelist = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Binary index for the metadata file, "<base>.metaidx", written by
+ * __pmLogWriteMetaIndex() when an archive is complete.  With the index,
+ * __pmLogLoadMeta() seeks straight to the metric descriptors, labels
+ * and help text, and the instance domains (often by far the bulk of
+ * the metadata) are read from the .meta file on demand ... just the
+ * one record needed for a lookup at a given time, or the whole history
+ * of an InDom when that is what the caller wants.
+ *
+ * All fields are in network byte order.  The index is only used if it
+ * matches the archive label and the size and modification time of the
+ * .meta file, i.e. the metadata has not changed since it was written,
+ * and never for multi-archive contexts, where the metadata of each
+ * archive is merged into the context as the archive is opened.
+ */
+#define METAIDX_MAGIC	0x504d4958	/* "PMIX" */
+#define METAIDX_VERSION	1
+
+typedef struct {
+    __int32_t	magic;
+    __int32_t	version;
+    __int32_t	pid;		/* from the archive label */
+    pmTimeval	start;		/* ditto */
+    __int32_t	size[2];	/* of .meta, high and low 32 bits */
+    __int32_t	mtime[2];	/* of .meta, ditto */
+    __int32_t	nrec;		/* metaidx_rec entries that follow */
+    __int32_t	nindom;		/* then this many metaidx_indom entries */
+} metaidx_hdr;
+
+/*
+ * One per .meta record ... all but TYPE_INDOM first, in file order,
+ * then TYPE_INDOM sorted by InDom, then time stamp, then file order.
+ */
+typedef struct {
+    __int32_t	type;		/* TYPE_DESC, TYPE_INDOM, ... */
+    __int32_t	ident;		/* pmID or pmInDom, else 0 */
+    __int32_t	offset[2];	/* in .meta, high and low 32 bits */
+    pmTimeval	stamp;		/* for TYPE_INDOM and TYPE_LABEL */
+} metaidx_rec;
+
+typedef struct {
+    __uint32_t	indom;		/* sorted on this */
+    __int32_t	first;		/* its first metaidx_rec entry */
+    __int32_t	count;		/* and the number of them */
+} metaidx_indom;
+
+#define IDX_GET64(x) \
+	(((__int64_t)(__uint32_t)ntohl((x)[0]) << 32) | (__uint32_t)ntohl((x)[1]))
+#define IDX_PUT64(x, v) \
+	do { (x)[0] = htonl((__uint32_t)((__uint64_t)(v) >> 32)); \
+	     (x)[1] = htonl((__uint32_t)(v)); } while (0)
+
+typedef struct {
+    int			loaded;		/* whole history in l_hashindom */
+    __pmLogInDom	**rec;		/* records read for lookups by time */
+} lazyindom;
+
+/* lcp->l_metaidx, the index in use for an archive being read */
+typedef struct {
+    __pmFILE		*f;
+    char		*buf;		/* index contents, unless mapped */
+    const metaidx_rec	*rec;
+    const metaidx_indom	*indom;
+    int			nrec;
+    int			nindom;
+    lazyindom		*lazy;		/* one per indom[] */
+} metaidx;
+
+static void
+freeindom(__pmLogInDom *idp)
+{
+    if (idp == NULL)
+	return;
+    free(idp->buf);
+    if (idp->allinbuf == 0)
+	free(idp->namelist);
+    free(idp);
+}
+
+/*
+ * Open and check the index for the archive being read, or NULL if
+ * there is none we can use.
+ */
+static metaidx *
+metaidx_open(__pmLogCtl *lcp)
+{
+    char		fname[MAXPATHLEN];
+    const char		*bad = NULL;
+    metaidx_hdr		hdr;
+    metaidx		*mip;
+    struct stat		sbuf;
+    struct stat		mbuf;
+    __pmFILE		*f;
+    size_t		len;
+    char		*p = NULL;
+    int			j;
+    int			skip;
+
+    if (lcp->l_multi || lcp->l_name == NULL)
+	return NULL;
+    PM_LOCK(__pmLock_extcall);
+    skip = (getenv("PCP_NO_METAIDX") != NULL);		/* THREADSAFE */
+    PM_UNLOCK(__pmLock_extcall);
+    if (skip)
+	return NULL;
+
+    pmsprintf(fname, sizeof(fname), "%s.metaidx", lcp->l_name);
+    if (access(fname, R_OK) < 0 || (f = __pmFopen(fname, "r")) == NULL)
+	return NULL;
+
+    if (__pmFstat(f, &sbuf) < 0 || __pmFstat(lcp->l_mdfp, &mbuf) < 0)
+	bad = "stat failed";
+    else if (__pmFread(&hdr, 1, sizeof(hdr), f) != sizeof(hdr))
+	bad = "short header";
+    else {
+	hdr.magic = ntohl(hdr.magic);
+	hdr.version = ntohl(hdr.version);
+	hdr.nrec = ntohl(hdr.nrec);
+	hdr.nindom = ntohl(hdr.nindom);
+	if (hdr.magic != METAIDX_MAGIC || hdr.version != METAIDX_VERSION)
+	    bad = "bad magic or version";
+	else if (ntohl(hdr.pid) != lcp->l_label.ill_pid ||
+		 ntohl(hdr.start.tv_sec) != lcp->l_label.ill_start.tv_sec ||
+		 ntohl(hdr.start.tv_usec) != lcp->l_label.ill_start.tv_usec)
+	    bad = "label mismatch";
+	else if (IDX_GET64(hdr.size) != (__int64_t)mbuf.st_size ||
+		 IDX_GET64(hdr.mtime) != (__int64_t)mbuf.st_mtime)
+	    bad = ".meta changed";
+	else if (hdr.nrec < 0 || hdr.nindom < 0 || hdr.nindom > hdr.nrec ||
+		 (__int64_t)sbuf.st_size != (__int64_t)sizeof(hdr) +
+			(__int64_t)hdr.nrec * sizeof(metaidx_rec) +
+			(__int64_t)hdr.nindom * sizeof(metaidx_indom))
+	    bad = "bad size";
+    }
+    if (bad != NULL) {
+	if (pmDebugOptions.logmeta)
+	    fprintf(stderr, "metaidx_open: %s: not used, %s\n", fname, bad);
+	__pmFclose(f);
+	return NULL;
+    }
+
+    if ((mip = (metaidx *)calloc(1, sizeof(metaidx))) == NULL ||
+	(mip->lazy = (lazyindom *)calloc(hdr.nindom + 1, sizeof(lazyindom))) == NULL)
+	goto fail;
+    mip->f = f;
+    mip->nrec = hdr.nrec;
+    mip->nindom = hdr.nindom;
+    len = sbuf.st_size - sizeof(hdr);
+    if (len > 0 && (p = (char *)__pmFmap(f, len)) == NULL) {
+	if ((mip->buf = (char *)malloc(len)) == NULL)
+	    goto fail;
+	if (__pmFread(mip->buf, 1, len, f) != len)
+	    goto fail;
+	p = mip->buf;
+    }
+    mip->rec = (const metaidx_rec *)p;
+    mip->indom = (const metaidx_indom *)&mip->rec[mip->nrec];
+    for (j = 0; j < mip->nindom; j++) {
+	int	first = ntohl(mip->indom[j].first);
+	int	count = ntohl(mip->indom[j].count);
+
+	if (first < 0 || count <= 0 || first > mip->nrec - count)
+	    break;
+	if (j > 0 && ntohl(mip->indom[j].indom) <= ntohl(mip->indom[j-1].indom))
+	    break;
+    }
+    if (j < mip->nindom) {
+	if (pmDebugOptions.logmeta)
+	    fprintf(stderr, "metaidx_open: %s: not used, bad InDom table\n", fname);
+	goto fail;
+    }
+    if (pmDebugOptions.logmeta)
+	fprintf(stderr, "metaidx_open: %s: %d records, %d InDoms\n",
+		fname, mip->nrec, mip->nindom);
+    return mip;
+
+fail:
+    if (mip != NULL) {
+	free(mip->lazy);
+	free(mip->buf);
+	free(mip);
+    }
+    __pmFclose(f);
+    return NULL;
+}
+
+void
+__pmLogFreeMetaIndex(__pmLogCtl *lcp)
+{
+    metaidx	*mip = (metaidx *)lcp->l_metaidx;
+    int		j, k;
+
+    if (mip == NULL)
+	return;
+    for (j = 0; j < mip->nindom; j++) {
+	if (mip->lazy[j].rec == NULL)
+	    continue;
+	for (k = 0; k < ntohl(mip->indom[j].count); k++)
+	    freeindom(mip->lazy[j].rec[k]);
+	free(mip->lazy[j].rec);
+    }
+    free(mip->lazy);
+    free(mip->buf);
+    __pmFclose(mip->f);
+    free(mip);
+    lcp->l_metaidx = NULL;
+}
+
+/* index into mip->indom[] for indom, else -1 */
+static int
+metaidx_find(const metaidx *mip, pmInDom indom)
+{
+    int		lo = 0;
+    int		hi = mip->nindom - 1;
+    int		mid;
+    __uint32_t	key;
+
+    while (lo <= hi) {
+	mid = lo + (hi - lo) / 2;
+	key = ntohl(mip->indom[mid].indom);
+	if (key == (__uint32_t)indom)
+	    return mid;
+	if (key < (__uint32_t)indom)
+	    lo = mid + 1;
+	else
+	    hi = mid - 1;
+    }
+    return -1;
+}
+
+/*
+ * Read the TYPE_INDOM record for index entry rp from .meta, checking
+ * it is the record the index says it is.
+ */
+static __pmLogInDom *
+metaidx_readindom(__pmLogCtl *lcp, const metaidx_rec *rp)
+{
+    __pmFILE		*f = lcp->l_mdfp;
+    __pmLogHdr		h;
+    __pmLogInDom	*idp;
+    pmInDom		indom;
+    pmTimeval		*when;
+    int			numinst;
+    int			*instlist;
+    char		**namelist;
+    int			allinbuf;
+    int			*tbuf;
+    int			check;
+    int			rlen;
+
+    if (__pmFseek(f, (long)IDX_GET64(rp->offset), SEEK_SET) < 0 ||
+	__pmFread(&h, 1, sizeof(h), f) != sizeof(h))
+	goto bad;
+    h.len = ntohl(h.len);
+    h.type = ntohl(h.type);
+    rlen = h.len - (int)sizeof(__pmLogHdr) - (int)sizeof(int);
+    if (h.type != TYPE_INDOM || rlen < (int)(sizeof(pmTimeval) + 2*sizeof(int)))
+	goto bad;
+PM_FAULT_POINT("libpcp/" __FILE__ ":17", PM_FAULT_ALLOC);
+    if ((tbuf = (int *)malloc(rlen)) == NULL)
+	return NULL;
+    if (__pmFread(tbuf, 1, rlen, f) != rlen ||
+	__pmFread(&check, 1, sizeof(check), f) != sizeof(check) ||
+	ntohl(check) != h.len) {
+	free(tbuf);
+	goto bad;
+    }
+    if (decodeindom(tbuf, &indom, &when, &numinst, &instlist, &namelist, &allinbuf) < 0) {
+	free(tbuf);
+	return NULL;
+    }
+    if (indom != (pmInDom)ntohl(rp->ident) ||
+	when->tv_sec != ntohl(rp->stamp.tv_sec) ||
+	when->tv_usec != ntohl(rp->stamp.tv_usec)) {
+	if (!allinbuf)
+	    free(namelist);
+	free(tbuf);
+	goto bad;
+    }
+    if ((idp = newindom(when, numinst, instlist, namelist, tbuf, allinbuf)) == NULL) {
+	if (!allinbuf)
+	    free(namelist);
+	free(tbuf);
+    }
+    return idp;
+
+bad:
+    if (pmDebugOptions.logmeta)
+	fprintf(stderr, "metaidx_readindom: bad InDom record @ offset=%lld\n",
+		(long long)IDX_GET64(rp->offset));
+    return NULL;
+}
+
+typedef struct {
+    __int64_t	offset;
+    int		rec;
+} offsetorder;
+
+static int
+offsetcmp(const void *a, const void *b)
+{
+    const offsetorder	*oa = (const offsetorder *)a;
+    const offsetorder	*ob = (const offsetorder *)b;
+
+    if (oa->offset != ob->offset)
+	return oa->offset < ob->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Read the whole history of indom mip->indom[j] into l_hashindom, in
+ * file order so the list is the same as __pmLogLoadMeta() would build.
+ * Called with l_lock held.
+ */
+static int
+metaidx_loadall(__pmLogCtl *lcp, metaidx *mip, int j)
+{
+    pmInDom		indom = ntohl(mip->indom[j].indom);
+    int			first = ntohl(mip->indom[j].first);
+    int			count = ntohl(mip->indom[j].count);
+    offsetorder		*order;
+    __pmLogInDom	*head = NULL;
+    __pmLogInDom	*idp;
+    __pmHashNode	*hp;
+    int			*buf;
+    char		**namelist;
+    int			allinbuf;
+    int			sts = 0;
+    int			k;
+
+    if ((hp = __pmHashSearch((unsigned int)indom, &lcp->l_hashindom)) == NULL)
+	return PM_ERR_INDOM_LOG;
+    if ((order = (offsetorder *)malloc(count * sizeof(offsetorder))) == NULL)
+	return -oserror();
+    for (k = 0; k < count; k++) {
+	order[k].offset = IDX_GET64(mip->rec[first + k].offset);
+	order[k].rec = first + k;
+    }
+    qsort(order, count, sizeof(offsetorder), offsetcmp);
+
+    for (k = 0; k < count; k++) {
+	if ((idp = metaidx_readindom(lcp, &mip->rec[order[k].rec])) == NULL) {
+	    sts = PM_ERR_LOGREC;
+	    break;
+	}
+	buf = idp->buf;
+	namelist = idp->namelist;
+	allinbuf = idp->allinbuf;
+	if (linkindom(&head, idp, indom) == PMLOGPUTINDOM_DUP) {
+	    free(buf);
+	    if (!allinbuf)
+		free(namelist);
+	}
+    }
+    free(order);
+
+    if (sts < 0) {
+	while ((idp = head) != NULL) {
+	    head = idp->next;
+	    freeindom(idp);
+	}
+	return sts;
+    }
+    hp->data = (void *)head;
+    mip->lazy[j].loaded = 1;
+    if (pmDebugOptions.logmeta) {
+	char	strbuf[20];
+	fprintf(stderr, "metaidx_loadall: %s: %d records\n",
+		pmInDomStr_r(indom, strbuf, sizeof(strbuf)), count);
+    }
+    return 0;
+}
+
+/*
+ * If indom is still to be read from .meta, return 1 and set *idpp to
+ * the record in force at time *tp (the latest if tp is NULL), or NULL
+ * if there is none.  Return 0 if the caller should use l_hashindom.
+ */
+static int
+metaidx_search(__pmLogCtl *lcp, pmInDom indom, const pmTimeval *tp, __pmLogInDom **idpp)
+{
+    metaidx		*mip = (metaidx *)lcp->l_metaidx;
+    const metaidx_rec	*rp;
+    lazyindom		*lp;
+    pmTimeval		stamp;
+    int			first, count;
+    int			lo, hi, mid;
+    int			j;
+
+    PM_LOCK(lcp->l_lock);
+    if ((j = metaidx_find(mip, indom)) < 0 || mip->lazy[j].loaded) {
+	PM_UNLOCK(lcp->l_lock);
+	return 0;
+    }
+    lp = &mip->lazy[j];
+    first = ntohl(mip->indom[j].first);
+    count = ntohl(mip->indom[j].count);
+    rp = &mip->rec[first];
+
+    /* the last record at or before *tp, as records are in time order */
+    if (tp == NULL)
+	lo = count;
+    else {
+	for (lo = 0, hi = count; lo < hi; ) {
+	    mid = lo + (hi - lo) / 2;
+	    stamp.tv_sec = ntohl(rp[mid].stamp.tv_sec);
+	    stamp.tv_usec = ntohl(rp[mid].stamp.tv_usec);
+	    if (__pmTimevalCmp(&stamp, tp) <= 0)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+    }
+    *idpp = NULL;
+    if (lo > 0) {
+	if (lp->rec == NULL)
+	    lp->rec = (__pmLogInDom **)calloc(count, sizeof(__pmLogInDom *));
+	if (lp->rec != NULL) {
+	    if (lp->rec[lo - 1] == NULL)
+		lp->rec[lo - 1] = metaidx_readindom(lcp, &rp[lo - 1]);
+	    *idpp = lp->rec[lo - 1];
+	}
+    }
+    PM_UNLOCK(lcp->l_lock);
+    return 1;
+}
+
+/*
+ * The l_hashindom entry for indom, reading its history from .meta
+ * first if we have not done so yet.
+ */
+static __pmHashNode *
+lookupindom(__pmLogCtl *lcp, pmInDom indom)
+{
+    metaidx	*mip = (metaidx *)lcp->l_metaidx;
+    int		j;
+
+    if (mip != NULL) {
+	PM_LOCK(lcp->l_lock);
+	if ((j = metaidx_find(mip, indom)) >= 0 && !mip->lazy[j].loaded)
+	    metaidx_loadall(lcp, mip, j);
+	PM_UNLOCK(lcp->l_lock);
+    }
+    return __pmHashSearch((unsigned int)indom, &lcp->l_hashindom);
+}
+
+/*
+ * Read any instance domains not yet loaded, for callers that walk
+ * l_hashindom themselves.
+ */
+int
+__pmLogLoadInDoms(__pmArchCtl *acp)
+{
+    __pmLogCtl	*lcp = acp->ac_log;
+    metaidx	*mip = (metaidx *)lcp->l_metaidx;
+    int		sts = 0;
+    int		j;
+
+    if (mip == NULL)
+	return 0;
+    PM_LOCK(lcp->l_lock);
+    for (j = 0; j < mip->nindom; j++) {
+	if (!mip->lazy[j].loaded && (sts = metaidx_loadall(lcp, mip, j)) < 0)
+	    break;
+    }
+    PM_UNLOCK(lcp->l_lock);
+    return sts;
+}
+
+typedef struct {
+    int		type;
+    pmInDom	ident;
+    __int64_t	offset;
+    pmTimeval	stamp;
+} scanrec;
+
+static int
+scancmp(const void *a, const void *b)
+{
+    const scanrec	*ra = (const scanrec *)a;
+    const scanrec	*rb = (const scanrec *)b;
+    int			sts;
+
+    if (ra->type == TYPE_INDOM && rb->type == TYPE_INDOM) {
+	if (ra->ident != rb->ident)
+	    return ra->ident < rb->ident ? -1 : 1;
+	if ((sts = __pmTimevalCmp(&ra->stamp, &rb->stamp)) != 0)
+	    return sts;
+    }
+    else if (ra->type == TYPE_INDOM)
+	return 1;
+    else if (rb->type == TYPE_INDOM)
+	return -1;
+    if (ra->offset != rb->offset)
+	return ra->offset < rb->offset ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Write the binary index "<base>.metaidx" for the metadata file of
+ * the archive base.  Call this once the .meta file is complete and
+ * flushed; if the metadata changes afterwards the index is ignored.
+ * The index is written to a temporary file and renamed into place,
+ * so readers never see a partial index.
+ */
+int
+__pmLogWriteMetaIndex(const char *base)
+{
+    char		fname[MAXPATHLEN];
+    char		tmpname[MAXPATHLEN];
+    __pmFILE		*f;
+    __pmFILE		*out = NULL;
+    struct stat		sbuf;
+    __pmLogLabel	label;
+    __pmLogHdr		h;
+    metaidx_hdr		hdr;
+    metaidx_rec		rec;
+    metaidx_indom	idx;
+    scanrec		*recs = NULL;
+    int			nrec = 0;
+    int			maxrec = 0;
+    int			nindom = 0;
+    __int64_t		offset;
+    __int32_t		body[4];
+    int			blen;
+    int			check;
+    int			n;
+    int			i;
+    int			sts = 0;
+
+    pmsprintf(fname, sizeof(fname), "%s.meta", base);
+    if ((f = __pmFopen(fname, "r")) == NULL)
+	return -oserror();
+    if (__pmFstat(f, &sbuf) < 0) {
+	sts = -oserror();
+	goto done;
+    }
+    if (__pmFread(&check, 1, sizeof(check), f) != sizeof(check) ||
+	__pmFread(&label, 1, sizeof(label), f) != sizeof(label)) {
+	sts = PM_ERR_LABEL;
+	goto done;
+    }
+
+    /* one pass over the record headers, and the start of each body */
+    offset = sizeof(__pmLogLabel) + 2*sizeof(int);
+    for ( ; ; ) {
+	__pmFseek(f, (long)offset, SEEK_SET);
+	if ((n = (int)__pmFread(&h, 1, sizeof(h), f)) != sizeof(h) &&
+	    __pmFeof(f))
+	    /* as for __pmLogLoadMeta, a partial header is end of file */
+	    break;
+	h.len = ntohl(h.len);
+	h.type = ntohl(h.type);
+	blen = h.len - (int)(sizeof(h) + sizeof(check));
+	if (n != sizeof(h) || blen < 2 * (int)sizeof(__int32_t)) {
+	    /* every record type has at least this much body */
+	    sts = PM_ERR_LOGREC;
+	    goto done;
+	}
+	if (blen > (int)sizeof(body))
+	    blen = sizeof(body);
+	memset(body, 0, sizeof(body));
+	if ((int)__pmFread(body, 1, blen, f) != blen ||
+	    __pmFseek(f, (long)(offset + h.len - sizeof(check)), SEEK_SET) < 0 ||
+	    __pmFread(&check, 1, sizeof(check), f) != sizeof(check) ||
+	    ntohl(check) != h.len) {
+	    sts = PM_ERR_LOGREC;
+	    goto done;
+	}
+	if (nrec == maxrec) {
+	    scanrec	*tmp;
+
+	    maxrec = maxrec ? 2 * maxrec : 1024;
+	    if ((tmp = (scanrec *)realloc(recs, maxrec * sizeof(scanrec))) == NULL) {
+		sts = -oserror();
+		goto done;
+	    }
+	    recs = tmp;
+	}
+	memset(&recs[nrec], 0, sizeof(scanrec));
+	recs[nrec].type = h.type;
+	recs[nrec].offset = offset;
+	if (h.type == TYPE_DESC) {
+	    recs[nrec].ident = __ntohpmID(body[0]);
+	}
+	else if (h.type == TYPE_INDOM) {
+	    recs[nrec].stamp.tv_sec = ntohl(body[0]);
+	    recs[nrec].stamp.tv_usec = ntohl(body[1]);
+	    recs[nrec].ident = __ntohpmInDom(body[2]);
+	}
+	else if (h.type == TYPE_LABEL) {
+	    recs[nrec].stamp.tv_sec = ntohl(body[0]);
+	    recs[nrec].stamp.tv_usec = ntohl(body[1]);
+	    recs[nrec].ident = ntohl(body[3]);
+	}
+	else if (h.type == TYPE_TEXT) {
+	    recs[nrec].ident = ntohl(body[1]);
+	}
+	nrec++;
+	offset += h.len;
+    }
+
+    qsort(recs, nrec, sizeof(scanrec), scancmp);
+    for (i = 0; i < nrec; i++) {
+	if (recs[i].type == TYPE_INDOM &&
+	    (nindom == 0 || recs[i].ident != recs[i-1].ident ||
+	     recs[i-1].type != TYPE_INDOM))
+	    nindom++;
+    }
+
+    pmsprintf(tmpname, sizeof(tmpname), "%s.metaidx.%d", base, (int)getpid());
+    if ((out = __pmFopen(tmpname, "w")) == NULL) {
+	sts = -oserror();
+	goto done;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = htonl(METAIDX_MAGIC);
+    hdr.version = htonl(METAIDX_VERSION);
+    hdr.pid = label.ill_pid;			/* already network order */
+    hdr.start = label.ill_start;		/* ditto */
+    IDX_PUT64(hdr.size, sbuf.st_size);
+    IDX_PUT64(hdr.mtime, sbuf.st_mtime);
+    hdr.nrec = htonl(nrec);
+    hdr.nindom = htonl(nindom);
+    if (__pmFwrite(&hdr, 1, sizeof(hdr), out) != sizeof(hdr))
+	goto werr;
+    for (i = 0; i < nrec; i++) {
+	rec.type = htonl(recs[i].type);
+	rec.ident = htonl(recs[i].ident);
+	IDX_PUT64(rec.offset, recs[i].offset);
+	rec.stamp.tv_sec = htonl(recs[i].stamp.tv_sec);
+	rec.stamp.tv_usec = htonl(recs[i].stamp.tv_usec);
+	if (__pmFwrite(&rec, 1, sizeof(rec), out) != sizeof(rec))
+	    goto werr;
+    }
+    for (i = 0; i < nrec; i++) {
+	if (recs[i].type != TYPE_INDOM)
+	    continue;
+	if (i > 0 && recs[i-1].type == TYPE_INDOM &&
+	    recs[i].ident == recs[i-1].ident)
+	    continue;
+	idx.indom = htonl(recs[i].ident);
+	idx.first = htonl(i);
+	for (n = i + 1; n < nrec && recs[n].ident == recs[i].ident; n++)
+	    ;
+	idx.count = htonl(n - i);
+	if (__pmFwrite(&idx, 1, sizeof(idx), out) != sizeof(idx))
+	    goto werr;
+    }
+    if (__pmFflush(out) != 0)
+	goto werr;
+    sts = __pmFclose(out);
+    out = NULL;
+    if (sts != 0) {
+	sts = -oserror();
+	unlink(tmpname);
+    }
+    else {
+	pmsprintf(fname, sizeof(fname), "%s.metaidx", base);
+	if (rename(tmpname, fname) < 0) {
+	    sts = -oserror();
+	    unlink(tmpname);
+	}
+    }
+    goto done;
+
+werr:
+    sts = -oserror();
+    if (sts == 0)
+	sts = -EIO;
+    __pmFclose(out);
+    out = NULL;
+    unlink(tmpname);
+
+done:
+    if (pmDebugOptions.logmeta)
+	fprintf(stderr, "__pmLogWriteMetaIndex(%s): %d records, %d InDoms -> %d\n",
+		base, nrec, nindom, sts);
+    free(recs);
+    __pmFclose(f);
+    return sts;
+}
+
 /*
  * Load _all_ of the hashed pmDesc and __pmLogInDom structures from the metadata
  * log file -- used at the initialization (NewContext) of an archive.
@@ -373,14 +1134,68 @@ __pmLogLoadMeta(__pmArchCtl *acp)
     int			i;
     int			len;
     char		name[MAXPATHLEN];
+    metaidx		*mip = NULL;
+    int			nidx = 0;
     
     if (lcp->l_pmns == NULL) {
 	if ((sts = __pmNewPMNS(&(lcp->l_pmns))) < 0)
 	    goto end;
     }
 
+    /*
+     * With an index, the instance domains are read later and only as
+     * needed, but the hash table entries for them are made now, and in
+     * the order each is first seen in the file, so walking l_hashindom
+     * goes the same way as it would without the index.
+     */
+    if (lcp->l_metaidx == NULL && (mip = metaidx_open(lcp)) != NULL) {
+	offsetorder	*order;
+	unsigned int	*keys;
+	__int64_t	offset;
+	int		first;
+	int		k;
+
+	lcp->l_metaidx = (void *)mip;
+	order = (offsetorder *)malloc((mip->nindom + 1) * sizeof(offsetorder));
+	keys = (unsigned int *)malloc((mip->nindom + 1) * sizeof(unsigned int));
+	if (order == NULL || keys == NULL) {
+	    sts = -oserror();
+	    free(order);
+	    free(keys);
+	    goto end;
+	}
+	for (i = 0; i < mip->nindom; i++) {
+	    first = ntohl(mip->indom[i].first);
+	    order[i].offset = IDX_GET64(mip->rec[first].offset);
+	    for (k = 1; k < ntohl(mip->indom[i].count); k++) {
+		offset = IDX_GET64(mip->rec[first + k].offset);
+		if (offset < order[i].offset)
+		    order[i].offset = offset;
+	    }
+	    order[i].rec = i;
+	}
+	qsort(order, mip->nindom, sizeof(offsetorder), offsetcmp);
+	for (i = 0; i < mip->nindom; i++)
+	    keys[i] = ntohl(mip->indom[order[i].rec].indom);
+	sts = __pmHashAddBulk(mip->nindom, keys, NULL, &lcp->l_hashindom);
+	free(order);
+	free(keys);
+	if (sts < 0)
+	    goto end;
+	sts = 0;
+    }
+
     __pmFseek(f, (long)(sizeof(__pmLogLabel) + 2*sizeof(int)), SEEK_SET);
     for ( ; ; ) {
+	if (mip != NULL) {
+	    /* everything but the InDoms, which are last in the index */
+	    if (nidx >= mip->nrec || ntohl(mip->rec[nidx].type) == TYPE_INDOM) {
+		sts = 0;
+		goto end;
+	    }
+	    __pmFseek(f, (long)IDX_GET64(mip->rec[nidx].offset), SEEK_SET);
+	    nidx++;
+	}
 	n = (int)__pmFread(&h, 1, sizeof(__pmLogHdr), f);
 
 	/* swab hdr */
@@ -565,10 +1380,6 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":2", PM_FAULT_ALLOC);
 	    int			numinst;
 	    int			*instlist;
 	    char		**namelist;
-	    char		*namebase;
-	    int			*stridx;
-	    int			i;
-	    int			k;
 	    int			allinbuf = 0;
 
 PM_FAULT_POINT("libpcp/" __FILE__ ":3", PM_FAULT_ALLOC);
@@ -591,42 +1402,9 @@ PM_FAULT_POINT("libpcp/" __FILE__ ":3", PM_FAULT_ALLOC);
 		goto end;
 	    }
 
-	    k = 0;
-	    when = (pmTimeval *)&tbuf[k];
-	    when->tv_sec = ntohl(when->tv_sec);
-	    when->tv_usec = ntohl(when->tv_usec);
-	    k += sizeof(*when)/sizeof(int);
-	    indom = __ntohpmInDom((unsigned int)tbuf[k++]);
-	    numinst = ntohl(tbuf[k++]);
-	    if (numinst > 0) {
-		instlist = &tbuf[k];
-		k += numinst;
-		stridx = &tbuf[k];
-#if defined(HAVE_32BIT_PTR)
-		namelist = (char **)stridx;
-		allinbuf = 1; /* allocation is all in tbuf */
-#else
-		allinbuf = 0; /* allocation for namelist + tbuf */
-		/* need to allocate to hold the pointers */
-PM_FAULT_POINT("libpcp/" __FILE__ ":4", PM_FAULT_ALLOC);
-		namelist = (char **)malloc(numinst*sizeof(char*));
-		if (namelist == NULL) {
-		    sts = -oserror();
-		    free(tbuf);
-		    goto end;
-		}
-#endif
-		k += numinst;
-		namebase = (char *)&tbuf[k];
-	        for (i = 0; i < numinst; i++) {
-		    instlist[i] = ntohl(instlist[i]);
-	            namelist[i] = &namebase[ntohl(stridx[i])];
-		}
-	    }
-	    else {
-		/* no instances, or an error */
-		instlist = NULL;
-		namelist = NULL;
+	    if ((sts = decodeindom(tbuf, &indom, &when, &numinst, &instlist, &namelist, &allinbuf)) < 0) {
+		free(tbuf);
+		goto end;
 	    }
 	    if ((sts = addindom(lcp, indom, when, numinst, instlist, namelist, tbuf, allinbuf)) < 0)
 		goto end;
@@ -945,6 +1723,13 @@ searchindom(__pmLogCtl *lcp, pmInDom indom, pmTimeval *tp)
 	fprintf(stderr, ")\n");
     }
 
+    if (lcp->l_metaidx != NULL && metaidx_search(lcp, indom, tp, &idp)) {
+	/* read from .meta, as far as is needed for this lookup */
+	if (idp == NULL)
+	    return NULL;
+	goto done;
+    }
+
     if ((hp = __pmHashSearch((unsigned int)indom, &lcp->l_hashindom)) == NULL)
 	return NULL;
 
@@ -968,6 +1753,7 @@ searchindom(__pmLogCtl *lcp, pmInDom indom, pmTimeval *tp)
 	    return NULL;
     }
 
+done:
     if (pmDebugOptions.logmeta) {
 	fprintf(stderr, "success for indom @ ");
 	StrTimeval(&idp->stamp);
@@ -1353,7 +2139,7 @@ pmLookupInDomArchive(pmInDom indom, const char *name)
 	    return PM_ERR_NOTARCHIVE;
 	}
 
-	if ((hp = __pmHashSearch((unsigned int)indom, &ctxp->c_archctl->ac_log->l_hashindom)) == NULL) {
+	if ((hp = lookupindom(ctxp->c_archctl->ac_log, indom)) == NULL) {
 	    PM_UNLOCK(ctxp->c_lock);
 	    return PM_ERR_INDOM_LOG;
 	}
@@ -1407,7 +2193,7 @@ pmNameInDomArchive(pmInDom indom, int inst, char **name)
 	    return PM_ERR_NOTARCHIVE;
 	}
 
-	if ((hp = __pmHashSearch((unsigned int)indom, &ctxp->c_archctl->ac_log->l_hashindom)) == NULL) {
+	if ((hp = lookupindom(ctxp->c_archctl->ac_log, indom)) == NULL) {
 	    PM_UNLOCK(ctxp->c_lock);
 	    return PM_ERR_INDOM_LOG;
 	}
@@ -1523,7 +2309,7 @@ pmGetInDomArchive_ctx(__pmContext *ctxp, pmInDom indom, int **instlist, char ***
 	return PM_ERR_NOTARCHIVE;
     }
 
-    if ((hp = __pmHashSearch((unsigned int)indom, &ctxp->c_archctl->ac_log->l_hashindom)) == NULL) {
+    if ((hp = lookupindom(ctxp->c_archctl->ac_log, indom)) == NULL) {
 	if (need_unlock)
 	    PM_UNLOCK(ctxp->c_lock);
 	return PM_ERR_INDOM_LOG;
@@ -20,6 +20,7 @@
  */
 
 #include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
 #include <sys/stat.h>
 #include "pmapi.h"
@@ -322,30 +323,117 @@ __pmLogChangeVol(__pmArchCtl *acp, int vol)
     }
     acp->ac_curvol = vol;
 
+    if (acp->ac_readahead > 0)
+	__pmFreadahead(acp->ac_mfp, acp->ac_readahead, acp->ac_rathreads);
+
     if (pmDebugOptions.log)
 	fprintf(stderr, "__pmLogChangeVol: change to volume %d\n", vol);
 
     return sts;
 }
 
+static int
+readahead_env(const char *name)
+{
+    char	*val;
+    char	*end;
+    long	n;
+    int		sts = 0;
+
+    PM_LOCK(__pmLock_extcall);
+    val = getenv(name);		/* THREADSAFE */
+    if (val != NULL && *val != '\0') {
+	n = strtol(val, &end, 10);
+	if (*end != '\0' || n < 0 || n > INT_MAX / 2) {
+	    if (pmDebugOptions.log)
+		fprintf(stderr, "readahead_env: ignoring bad %s=\"%s\"\n", name, val);
+	}
+	else
+	    sts = (int)n;
+    }
+    PM_UNLOCK(__pmLock_extcall);
+    return sts;
+}
+
+/*
+ * Default read ahead for compressed volumes of a new archive context,
+ * from $PCP_XZ_READAHEAD (blocks, off by default) and $PCP_XZ_THREADS
+ * (0 for one per CPU).
+ */
+void
+__pmLogReadAheadInit(__pmArchCtl *acp)
+{
+    acp->ac_readahead = readahead_env("PCP_XZ_READAHEAD");
+    acp->ac_rathreads = readahead_env("PCP_XZ_THREADS");
+}
+
+/*
+ * Set read ahead for compressed volumes of the current archive context,
+ * taking effect immediately.  depth 0 turns read ahead off, nthreads 0
+ * chooses one thread per CPU.
+ */
+int
+__pmSetArchiveReadAhead(int depth, int nthreads)
+{
+    __pmContext	*ctxp;
+    __pmArchCtl	*acp;
+    int		sts = 0;
+
+    if (depth < 0 || nthreads < 0)
+	return -EINVAL;
+    ctxp = __pmHandleToPtr(pmWhichContext());
+    if (ctxp == NULL)
+	return PM_ERR_NOCONTEXT;
+    if (ctxp->c_type != PM_CONTEXT_ARCHIVE) {
+	PM_UNLOCK(ctxp->c_lock);
+	return PM_ERR_NOTARCHIVE;
+    }
+    acp = ctxp->c_archctl;
+    acp->ac_readahead = depth;
+    acp->ac_rathreads = nthreads;
+    if (acp->ac_mfp != NULL)
+	sts = __pmFreadahead(acp->ac_mfp, depth, nthreads);
+    PM_UNLOCK(ctxp->c_lock);
+    return sts;
+}
+
 static int
 __pmLogLoadIndex(__pmLogCtl *lcp)
 {
     int		sts = 0;
     __pmFILE	*f = lcp->l_tifp;
     int		n;
+    int		maxti = 0;
     __pmLogTI	*tip;
+    __pmLogTI	*tmp;
+    struct stat	sbuf;
 
     lcp->l_numti = 0;
     lcp->l_ti = NULL;
+    lcp->l_tisorted = 1;
 
     if (lcp->l_tifp != NULL) {
+	/*
+	 * pmlogger may write many index entries (-I), so size the array
+	 * from the file, and grow it geometrically if the file grows
+	 */
+	if (__pmFstat(f, &sbuf) == 0 &&
+	    sbuf.st_size > (off_t)(sizeof(__pmLogLabel) + 2*sizeof(int)))
+	    maxti = (sbuf.st_size - sizeof(__pmLogLabel) - 2*sizeof(int)) / sizeof(__pmLogTI);
 	__pmFseek(f, (long)(sizeof(__pmLogLabel) + 2*sizeof(int)), SEEK_SET);
 	for ( ; ; ) {
-	    lcp->l_ti = (__pmLogTI *)realloc(lcp->l_ti, (1 + lcp->l_numti) * sizeof(__pmLogTI));
-	    if (lcp->l_ti == NULL) {
-		sts = -oserror();
-		break;
+	    if (lcp->l_ti == NULL || lcp->l_numti > maxti) {
+		/* room for maxti entries, plus one to read EOF into */
+		if (lcp->l_ti != NULL)
+		    maxti *= 2;
+		if (maxti < 16)
+		    maxti = 16;
+		tmp = (__pmLogTI *)realloc(lcp->l_ti, (1 + maxti) * sizeof(__pmLogTI));
+		if (tmp == NULL) {
+		    sts = -oserror();
+		    break;
+		}
+		lcp->l_ti = tmp;
 	    }
 	    tip = &lcp->l_ti[lcp->l_numti];
 	    n = (int)__pmFread(tip, 1, sizeof(__pmLogTI), f);
@@ -378,6 +466,19 @@ __pmLogLoadIndex(__pmLogCtl *lcp)
 		tip->ti_log = ntohl(tip->ti_log);
 	    }
 
+	    /*
+	     * __pmLogSetTime can binary search the index if entries are
+	     * in time order, volume order, and file order within a volume
+	     */
+	    if (lcp->l_numti > 0 && lcp->l_tisorted) {
+		__pmLogTI	*prev = tip - 1;
+
+		if (__pmTimevalCmp(&tip->ti_stamp, &prev->ti_stamp) < 0 ||
+		    tip->ti_vol < prev->ti_vol ||
+		    (tip->ti_vol == prev->ti_vol && tip->ti_log < prev->ti_log))
+		    lcp->l_tisorted = 0;
+	    }
+
 	    lcp->l_numti++;
 	}/*for*/
     }/*not null*/
@@ -501,10 +602,10 @@ __pmLogCreate(const char *host, const char *base, int log_version,
     char	fname[MAXPATHLEN];
 
     lcp->l_minvol = lcp->l_maxvol = acp->ac_curvol = 0;
-    lcp->l_hashpmid.nodes = lcp->l_hashpmid.hsize = 0;
-    lcp->l_hashindom.nodes = lcp->l_hashindom.hsize = 0;
-    lcp->l_hashlabels.nodes = lcp->l_hashlabels.hsize = 0;
-    lcp->l_hashtext.nodes = lcp->l_hashtext.hsize = 0;
+    __pmHashInit(&lcp->l_hashpmid);
+    __pmHashInit(&lcp->l_hashindom);
+    __pmHashInit(&lcp->l_hashlabels);
+    __pmHashInit(&lcp->l_hashtext);
     lcp->l_tifp = lcp->l_mdfp = acp->ac_mfp = NULL;
 
     if ((lcp->l_tifp = __pmLogNewFile(base, PM_LOG_VOL_TI)) != NULL) {
@@ -579,7 +680,7 @@ logFreeHashPMID(__pmHashCtl *hcp)
 	if (prior_hp != NULL)
 	    free(prior_hp);
     }
-    free(hcp->hash);
+    __pmHashClear(hcp);
 }
 
 static void
@@ -612,7 +713,7 @@ logFreeHashInDom(__pmHashCtl *hcp)
 	if (prior_hp != NULL)
 	    free(prior_hp);
     }
-    free(hcp->hash);
+    __pmHashClear(hcp);
 }
 
 static void
@@ -655,12 +756,12 @@ logFreeHashLabels(__pmHashCtl *type_ctl)
 
 	    curr_type_node = type_node;
 	    type_node = type_node->next;
-	    free(ident_ctl->hash);
+	    __pmHashClear(ident_ctl);
 	    free(ident_ctl);
 	    free(curr_type_node);
 	}
     }
-    free(type_ctl->hash);
+    __pmHashClear(type_ctl);
 }
 
 static void
@@ -691,12 +792,12 @@ logFreeHashText(__pmHashCtl *type_ctl)
 
 	    curr_type_node = type_node;
 	    type_node = type_node->next;
-	    free(ident_ctl->hash);
+	    __pmHashClear(ident_ctl);
 	    free(ident_ctl);
 	    free(curr_type_node);
 	}
     }
-    free(type_ctl->hash);
+    __pmHashClear(type_ctl);
 }
 
 static void
@@ -740,6 +841,7 @@ __pmLogClose(__pmArchCtl *acp)
 	__pmFclose(lcp->l_tifp);
 	lcp->l_tifp = NULL;
     }
+    __pmLogFreeMetaIndex(lcp);
     if (lcp->l_mdfp != NULL) {
 	__pmResetIPC(__pmFileno(lcp->l_mdfp));
 	__pmFclose(lcp->l_mdfp);
@@ -1308,7 +1410,7 @@ paranoidCheck(int len, __pmPDU *pb)
 	    if (valfmt != PM_VAL_INSITU) {
 		for (j = 0; j < numval; j++) {
 		    int			index = (int)ntohl((long)vlp->vlist[j].value.lval);
-		    pmValueBlock	*pduvbp;
+		    pmValueBlock	vbhdr;
 		    int			vlen;
 		    
 		    if (index < 0 || index * sizeof(__pmPDU) > len) {
@@ -1319,10 +1421,9 @@ paranoidCheck(int len, __pmPDU *pb)
 			}
 			return -1;
 		    }
-		    pduvbp = (pmValueBlock *)&pb[index];
-		    __ntohpmValueBlock(pduvbp);
-		    vlen = pduvbp->vlen;
-		    __htonpmValueBlock(pduvbp);		/* restore pdubuf! */
+		    /* swab a copy of the header, pb may be read-only */
+		    *(__pmPDU *)&vbhdr = ntohl(pb[index]);
+		    vlen = vbhdr.vlen;
 		    if (vlen < sizeof(__pmPDU)) {
 			if (pmDebugOptions.log) {
 			    fprintf(stderr, "\nparanoidCheck: vset[%d] val[%d], bad vlen=%d\n",
@@ -1454,6 +1555,7 @@ __pmLogRead_ctx(__pmContext *ctxp, int mode, __pmFILE *peekf, pmResult **result,
     int		sts;
     long	offset;
     __pmPDU	*pb;
+    char	*rec = NULL;	/* record in mmap'd volume, if any */
     __pmFILE	*f;
     int		n;
     ctx_ctl_t	ctx_ctl = { NULL, 0 };
@@ -1479,7 +1581,8 @@ __pmLogRead_ctx(__pmContext *ctxp, int mode, __pmFILE *peekf, pmResult **result,
     assert(offset >= 0);
     if (pmDebugOptions.log) {
 	fprintf(stderr, "__pmLogRead: fd=%d%s mode=%s vol=%d posn=%ld ",
-	    __pmFileno(f), peekf == NULL ? "" : " (peek)",
+	    __pmFileno(f), option == PMLOGREAD_AHEAD ? " (ahead)" :
+			   peekf == NULL ? "" : " (peek)",
 	    mode == PM_MODE_FORW ? "forw" : "back",
 	    acp->ac_curvol, (long)offset);
     }
@@ -1657,6 +1760,45 @@ again:
 	sts = PM_ERR_LOGREC;
 	goto func_return;
     }
+    if (mode == PM_MODE_BACK)
+	__pmFseek(f, -(long)(sizeof(head) + rlen), SEEK_CUR);
+
+#if defined(HAVE_64BIT_PTR)
+    /*
+     * If the volume is mmap'd (see io_mmap.c) the record is used in
+     * place, and decoded from the mapped pages without reading it into
+     * a PDU buffer.  Going forwards the trailer follows the record, and
+     * going backwards the "trailer" is the header before the record.
+     */
+    if (f->fops->__pmmap != NULL) {
+	char	*p = NULL;
+	long	posn = __pmFtell(f);	/* start of record data */
+
+	if (mode == PM_MODE_FORW)
+	    p = (char *)__pmFmap(f, rlen + sizeof(trail));
+	else if (posn >= (long)sizeof(trail) &&
+		 __pmFseek(f, -(long)sizeof(trail), SEEK_CUR) == 0)
+	    p = (char *)__pmFmap(f, sizeof(trail) + rlen);
+	if (p != NULL && ((__psint_t)p % sizeof(__pmPDU)) == 0) {
+	    if (mode == PM_MODE_FORW) {
+		rec = p;
+		memcpy(&trail, &p[rlen], sizeof(trail));
+	    }
+	    else {
+		rec = &p[sizeof(trail)];
+		memcpy(&trail, p, sizeof(trail));
+		__pmFseek(f, posn, SEEK_SET);
+	    }
+	    trail = ntohl(trail);
+	    /* pretend there is a __pmPDUHdr before the record, as below */
+	    pb = (__pmPDU *)rec - sizeof(__pmPDUHdr) / sizeof(__pmPDU);
+	    goto check;
+	}
+	/* short or not aligned, so take the long way round */
+	__pmFseek(f, posn, SEEK_SET);
+    }
+#endif
+
     /*
      * need to add int at end for trailer in case buffer is used
      * subsequently by __pmLogPutResult2()
@@ -1673,9 +1815,6 @@ again:
 	goto func_return;
     }
 
-    if (mode == PM_MODE_BACK)
-	__pmFseek(f, -(long)(sizeof(head) + rlen), SEEK_CUR);
-
     if ((n = (int)__pmFread(&pb[3], 1, rlen, f)) != rlen) {
 	/* data read failed */
 	__pmUnpinPDUBuf(pb);
@@ -1746,16 +1885,19 @@ again:
 	trail = ntohl(trail);
     }
 
+check:
     if (trail != head) {
 	if (pmDebugOptions.log)
 	    fprintf(stderr, "\nError: record length mismatch: header (%d) != trailer (%d)\n", head, trail);
-	__pmUnpinPDUBuf(pb);
+	if (rec == NULL)
+	    __pmUnpinPDUBuf(pb);
 	sts = PM_ERR_LOGREC;
 	goto func_return;
     }
 
     if (option == PMLOGREAD_TO_EOF && paranoidCheck(head, pb) == -1) {
-	__pmUnpinPDUBuf(pb);
+	if (rec == NULL)
+	    __pmUnpinPDUBuf(pb);
 	sts = PM_ERR_LOGREC;
 	goto func_return;
     }
@@ -1764,7 +1906,12 @@ again:
 	__pmFseek(f, -(long)sizeof(trail), SEEK_CUR);
 
     __pmOverrideLastFd(__pmFileno(f));
-    sts = __pmDecodeResult_ctx(ctxp, pb, result); /* also swabs the result */
+#if defined(HAVE_64BIT_PTR)
+    if (rec != NULL)
+	sts = __pmDecodeLogResult_ctx(ctxp, (__pmPDU *)rec, rlen, result);
+    else
+#endif
+	sts = __pmDecodeResult_ctx(ctxp, pb, result); /* also swabs the result */
 
     if (pmDebugOptions.log) {
 	head -= sizeof(head) + sizeof(trail);
@@ -1788,7 +1935,8 @@ again:
     __pmLogReads++;
 
     if (sts < 0) {
-	__pmUnpinPDUBuf(pb);
+	if (rec == NULL)
+	    __pmUnpinPDUBuf(pb);
 	sts = PM_ERR_LOGREC;
 	goto func_return;
     }
@@ -1801,7 +1949,8 @@ again:
 	dumpbuf(rlen, &pb[3]);		/* see above to explain "3" */
     }
 
-    __pmUnpinPDUBuf(pb);
+    if (rec == NULL)
+	__pmUnpinPDUBuf(pb);
     sts = 0;
 
 func_return:
@@ -2192,6 +2341,124 @@ VolSkip(__pmArchCtl *acp, int mode,  int j)
     return PM_ERR_EOL;
 }
 
+/*
+ * Size of the last volume, for checking the temporal index against
+ * an archive that is truncated or still being written.
+ */
+static off_t
+LastVolSize(__pmArchCtl *acp)
+{
+    __pmLogCtl	*lcp = acp->ac_log;
+    __pmFILE	*f;
+    struct stat	sbuf;
+    int		vol = lcp->l_maxvol;
+
+    sbuf.st_size = 0;
+    if (vol >= 0 && vol < lcp->l_numseen && lcp->l_seen[vol])
+	__pmFstat(acp->ac_mfp, &sbuf);
+    else if ((f = _logpeek(acp, lcp->l_maxvol)) != NULL) {
+	__pmFstat(f, &sbuf);
+	__pmFclose(f);
+    }
+    return sbuf.st_size;
+}
+
+/*
+ * Find the first lcp->l_ti[] entry at or after the time origin, ignoring
+ * entries for missing preliminary volumes.  *match is set if the time
+ * stamp is equal to origin, and *toobig if the entry is beyond the end
+ * of a truncated last volume (and so not usable).  Returns l_numti if
+ * all entries are before origin.
+ *
+ * The index is normally in time order, and then a binary search finds
+ * the entry in O(log n), which matters for archives where pmlogger has
+ * been asked for frequent index entries (-I); otherwise fall back to
+ * a linear scan.
+ */
+static int
+TiLocate(__pmArchCtl *acp, const pmTimeval *origin, int *match, int *toobig)
+{
+    __pmLogCtl	*lcp = acp->ac_log;
+    __pmLogTI	*tip = lcp->l_ti;
+    int		numti = lcp->l_numti;
+    off_t	size = -1;
+    double	t_hi;
+    int		lo, hi, mid;
+    int		start, end;
+    int		i;
+
+    *match = *toobig = 0;
+
+    if (!lcp->l_tisorted) {
+	for (i = 0; i < numti; i++, tip++) {
+	    if (tip->ti_vol < lcp->l_minvol)
+		/* skip missing preliminary volumes */
+		continue;
+	    if (tip->ti_vol == lcp->l_maxvol) {
+		/* truncated check for last volume */
+		if (size < 0)
+		    size = LastVolSize(acp);
+		if (tip->ti_log > size) {
+		    *toobig = 1;
+		    return i;
+		}
+	    }
+	    t_hi = __pmTimevalSub(&tip->ti_stamp, origin);
+	    if (t_hi >= 0) {
+		*match = (t_hi == 0);
+		return i;
+	    }
+	}
+	return numti;
+    }
+
+    /* skip missing preliminary volumes */
+    for (lo = 0, hi = numti; lo < hi; ) {
+	mid = lo + (hi - lo) / 2;
+	if (tip[mid].ti_vol < lcp->l_minvol)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    start = lo;
+
+    /* first entry at or after origin */
+    for (hi = numti; lo < hi; ) {
+	mid = lo + (hi - lo) / 2;
+	if (__pmTimevalCmp(&tip[mid].ti_stamp, origin) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    /*
+     * truncated check for last volume ... the entries past the end of
+     * the file are at the end of those for the last volume, so look
+     * back from there for the first of them
+     */
+    for (end = start, hi = numti; end < hi; ) {
+	mid = end + (hi - end) / 2;
+	if (tip[mid].ti_vol <= lcp->l_maxvol)
+	    end = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (i = end; i > start && tip[i-1].ti_vol == lcp->l_maxvol; i--) {
+	if (size < 0)
+	    size = LastVolSize(acp);
+	if (tip[i-1].ti_log <= size)
+	    break;
+    }
+    if (i < end && i <= lo) {
+	*toobig = 1;
+	return i;
+    }
+
+    if (lo < numti)
+	*match = (__pmTimevalCmp(&tip[lo].ti_stamp, origin) == 0);
+    return lo;
+}
+
 void
 __pmLogSetTime(__pmContext *ctxp)
 {
@@ -2249,53 +2516,13 @@ __pmLogSetTime(__pmContext *ctxp)
 
     if (lcp->l_numti) {
 	/* we have a temporal index, use it! */
-	int		j = -1;
+	int		j;
 	int		toobig = 0;
 	int		match = 0;
-	int		vol;
 	int		numti = lcp->l_numti;
-	__pmFILE		*f;
-	__pmLogTI	*tip = lcp->l_ti;
 	double		t_lo;
-	struct stat	sbuf;
 
-	sbuf.st_size = -1;
-
-	for (i = 0; i < numti; i++, tip++) {
-	    if (tip->ti_vol < lcp->l_minvol)
-		/* skip missing preliminary volumes */
-		continue;
-	    if (tip->ti_vol == lcp->l_maxvol) {
-		/* truncated check for last volume */
-		if (sbuf.st_size < 0) {
-		    sbuf.st_size = 0;
-		    vol = lcp->l_maxvol;
-		    if (vol >= 0 && vol < lcp->l_numseen && lcp->l_seen[vol])
-			__pmFstat(acp->ac_mfp, &sbuf);
-		    else if ((f = _logpeek(acp, lcp->l_maxvol)) != NULL) {
-			__pmFstat(f, &sbuf);
-			__pmFclose(f);
-		    }
-		}
-		if (tip->ti_log > sbuf.st_size) {
-		    j = i;
-		    toobig++;
-		    break;
-		}
-	    }
-	    t_hi = __pmTimevalSub(&tip->ti_stamp, &ctxp->c_origin);
-	    if (t_hi > 0) {
-		j = i;
-		break;
-	    }
-	    else if (t_hi == 0) {
-		j = i;
-		match = 1;
-		break;
-	    }
-	}
-	if (i == numti)
-	    j = numti;
+	j = TiLocate(acp, &ctxp->c_origin, &match, &toobig);
 
 	acp->ac_serial = 1;
 
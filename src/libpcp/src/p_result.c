@@ -182,13 +182,13 @@ __pmSendResult(int fd, int from, const pmResult *result)
 }
 
 /*
- * Internal variant of __pmDecodeResult() with current context.
- *
- * Enter here with pdubuf already pinned ... result may point into
- * _another_ pdu buffer that is pinned on exit
+ * Decode the len bytes of PDU at pdubuf, whose header need not be
+ * filled in.  For 64-bit pointers nothing in pdubuf is modified (the
+ * pmValueBlocks are swabbed after they have been copied), so pdubuf
+ * may be read-only.
  */
-int
-__pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
+static int
+decode_result(__pmContext *ctxp, __pmPDU *pdubuf, int len, pmResult **result)
 {
     int		numpmid;	/* number of metrics */
     int		i;		/* range of metrics */
@@ -213,6 +213,7 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
     int		offset;		/* differences in sizes */
     int		vbsize;		/* size of pmValueBlocks */
     pmValueSet	*nvsp;
+    pmValueBlock vbhdr;		/* swabbed pmValueBlock header */
 #elif defined(HAVE_32BIT_PTR)
     pmValueSet	*vsp;		/* vlist_t == pmValueSet */
 #else
@@ -223,18 +224,18 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 	PM_ASSERT_IS_LOCKED(ctxp->c_lock);
 
     pp = (result_t *)pdubuf;
-    pduend = (char *)pdubuf + pp->hdr.len;
+    pduend = (char *)pdubuf + len;
     if (pduend - (char *)pdubuf < sizeof(result_t) - sizeof(__pmPDU)) {
 	if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
-	    fprintf(stderr, "__pmDecodeResult: Bad: len=%d smaller than min %d\n", pp->hdr.len, (int)(sizeof(result_t) - sizeof(__pmPDU)));
+	    fprintf(stderr, "__pmDecodeResult: Bad: len=%d smaller than min %d\n", len, (int)(sizeof(result_t) - sizeof(__pmPDU)));
 	}
 	return PM_ERR_IPC;
     }
 
     numpmid = ntohl(pp->numpmid);
-    if (numpmid < 0 || numpmid > pp->hdr.len) {
+    if (numpmid < 0 || numpmid > len) {
 	if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
-	    fprintf(stderr, "__pmDecodeResult: Bad: numpmid=%d negative or not smaller than PDU len %d\n", numpmid, pp->hdr.len);
+	    fprintf(stderr, "__pmDecodeResult: Bad: numpmid=%d negative or not smaller than PDU len %d\n", numpmid, len);
 	}
 	return PM_ERR_IPC;
     }
@@ -276,9 +277,9 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 			i, pmIDStr_r(pmid, strbuf, sizeof(strbuf)), numval);
 	}
 	/* numval may be negative - it holds an error code in that case */
-	if (numval > pp->hdr.len) {
+	if (numval > len) {
 	    if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
-		fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] numval=%d > len=%d\n", i, numval, pp->hdr.len);
+		fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] numval=%d > len=%d\n", i, numval, len);
 	    }
 	    goto corrupt;
 	}
@@ -314,7 +315,7 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 			goto corrupt;
 		    }
 		    index = ntohl(pduvp->value.lval);
-		    if (index < 0 || index > pp->hdr.len) {
+		    if (index < 0 || index > len) {
 			if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 			    fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] value[%d] index=%d\n", i, j, index);
 			}
@@ -329,23 +330,23 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 			}
 			goto corrupt;
 		    }
-		    __ntohpmValueBlock(pduvbp);
-		    if (pduvbp->vlen < PM_VAL_HDR_SIZE || pduvbp->vlen > pp->hdr.len) {
+		    *(__pmPDU *)&vbhdr = ntohl(*(__pmPDU *)pduvbp);
+		    if (vbhdr.vlen < PM_VAL_HDR_SIZE || vbhdr.vlen > len) {
 			if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
-			    fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] value[%d] vlen=%d\n", i, j, pduvbp->vlen);
+			    fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] value[%d] vlen=%d\n", i, j, vbhdr.vlen);
 			}
 			goto corrupt;
 		    }
-		    if (pduvbp->vlen > (size_t)(pduend - (char *)pduvbp)) {
+		    if (vbhdr.vlen > (size_t)(pduend - (char *)pduvbp)) {
 			if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 			    fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] value[%d] third pduvp past end of PDU buffer\n", i, j);
 			}
 			goto corrupt;
 		    }
-		    vbsize += PM_PDU_SIZE_BYTES(pduvbp->vlen);
+		    vbsize += PM_PDU_SIZE_BYTES(vbhdr.vlen);
 		    if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 			fprintf(stderr, " len: %d type: %d",
-			    pduvbp->vlen - PM_VAL_HDR_SIZE, pduvbp->vtype);
+			    vbhdr.vlen - PM_VAL_HDR_SIZE, vbhdr.vtype);
 		    }
 		}
 	    }
@@ -359,13 +360,13 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
     offset = sizeof(result_t) - sizeof(__pmPDU) + vsize;
 
     if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
-	fprintf(stderr, "need: %d vsize: %d nvsize: %d vbsize: %d offset: %d hdr.len: %d pduend: %p vsplit: %p (diff %d) pdubuf: %p (diff %d)\n", need, vsize, nvsize, vbsize, offset, pp->hdr.len, pduend, vsplit, (int)(pduend-vsplit), pdubuf, (int)(pduend-(char *)pdubuf));
+	fprintf(stderr, "need: %d vsize: %d nvsize: %d vbsize: %d offset: %d hdr.len: %d pduend: %p vsplit: %p (diff %d) pdubuf: %p (diff %d)\n", need, vsize, nvsize, vbsize, offset, len, pduend, vsplit, (int)(pduend-vsplit), pdubuf, (int)(pduend-(char *)pdubuf));
     }
 
     if (need < 0 ||
 	vsize > INT_MAX / sizeof(__pmPDU) ||
 	vbsize > INT_MAX / sizeof(pmValueBlock) ||
-	offset != pp->hdr.len - (pduend - vsplit) ||
+	offset != len - (pduend - vsplit) ||
 	offset + vbsize != pduend - (char *)pdubuf) {
 	goto corrupt;
     }
@@ -450,6 +451,7 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 		     */
 		    index = sizeof(__pmPDU) * ntohl(vp->value.lval) + offset;
 		    nvp->value.pval = (pmValueBlock *)&newbuf[index];
+		    __ntohpmValueBlock(nvp->value.pval);
 		    if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 			int		k, len;
 			len = nvp->value.pval->vlen - PM_VAL_HDR_SIZE;
@@ -498,9 +500,9 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 	vsp->pmid = __ntohpmID(vsp->pmid);
 	vsp->numval = ntohl(vsp->numval);
 	/* numval may be negative - it holds an error code in that case */
-	if (vsp->numval > pp->hdr.len) {
+	if (vsp->numval > len) {
 	    if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
-		fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] numval=%d > len=%d\n", i, vsp->numval, pp->hdr.len);
+		fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] numval=%d > len=%d\n", i, vsp->numval, len);
 	    }
 	    goto corrupt;
 	}
@@ -539,7 +541,7 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 		} else {
 		    /* salvage pmValueBlocks from end of PDU */
 		    index = ntohl(pduvp->value.lval);
-		    if (index < 0 || index > pp->hdr.len) {
+		    if (index < 0 || index > len) {
 			if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 			    fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] value[%d] index=%d\n", i, j, index);
 			}
@@ -555,7 +557,7 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 			goto corrupt;
 		    }
 		    __ntohpmValueBlock(pduvbp);
-		    if (pduvbp->vlen < PM_VAL_HDR_SIZE || pduvbp->vlen > pp->hdr.len) {
+		    if (pduvbp->vlen < PM_VAL_HDR_SIZE || pduvbp->vlen > len) {
 			if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 			    fprintf(stderr, "__pmDecodeResult: Bad: pmid[%d] value[%d] vlen=%d\n", i, j, pduvbp->vlen);
 			}
@@ -577,7 +579,7 @@ __pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
 	}
     }
     if (numpmid > 0) {
-	if (sizeof(result_t) - sizeof(__pmPDU) + vsize != pp->hdr.len - (pduend - vsplit)) {
+	if (sizeof(result_t) - sizeof(__pmPDU) + vsize != len - (pduend - vsplit)) {
 	    if (pmDebugOptions.pdu && pmDebugOptions.desperate) {
 		fprintf(stderr, "__pmDecodeResult: Bad: vsplit past end of PDU buffer\n");
 	    }
@@ -608,6 +610,38 @@ corrupt:
     return PM_ERR_IPC;
 }
 
+/*
+ * Internal variant of __pmDecodeResult() with current context.
+ *
+ * Enter here with pdubuf already pinned ... result may point into
+ * _another_ pdu buffer that is pinned on exit
+ */
+int
+__pmDecodeResult_ctx(__pmContext *ctxp, __pmPDU *pdubuf, pmResult **result)
+{
+    return decode_result(ctxp, pdubuf, ((__pmPDUHdr *)pdubuf)->len, result);
+}
+
+#if defined(HAVE_64BIT_PTR)
+/*
+ * Decode a pmResult from an archive record, without a PDU buffer.
+ * rec points to the rlen bytes of the record after its header length,
+ * i.e. where a PDU's timestamp would be, and may be read-only (e.g.
+ * the mmap'd pages of an archive volume) because decode_result() does
+ * not change its input for 64-bit pointers.  The pmValueSets are built
+ * in a new pinned PDU buffer, as for __pmDecodeResult_ctx(), so rec is
+ * not referenced once we return.
+ */
+int
+__pmDecodeLogResult_ctx(__pmContext *ctxp, const __pmPDU *rec, int rlen, pmResult **result)
+{
+    /* indices in the record are relative to the (absent) __pmPDUHdr */
+    __pmPDU	*pdubuf = (__pmPDU *)rec - sizeof(__pmPDUHdr) / sizeof(__pmPDU);
+
+    return decode_result(ctxp, pdubuf, rlen + (int)sizeof(__pmPDUHdr), result);
+}
+#endif
+
 int
 __pmDecodeResult(__pmPDU *pdubuf, pmResult **result)
 {
@@ -17,28 +17,70 @@
  * To avoid buffer trampling, on success __pmFindPDUBuf() now returns
  * a pinned PDU buffer.  It is the caller's responsibility to unpin the
  * PDU buffer when safe to do so.
+ *
+ * Buffers come in power-of-two size classes.  Each class is the whole
+ * allocation, a bufctl_t header followed by the buffer itself, aligned
+ * on the class size, so any address inside a buffer maps back to its
+ * header by masking and nothing is allocated beyond the class size.
+ * A registry of header addresses (open addressing, guarded by
+ * pdubuf_lock) tells our buffers apart from anyone else's memory, so
+ * pin and unpin are O(1).  Released buffers are kept on per-class free
+ * lists, first in a small per-thread cache that is used without taking
+ * any lock, then on global lists guarded by pdubuf_lock.
+ *
+ * A buffer in a per-thread cache belongs to that thread alone; its
+ * bc_pincnt is reset without holding pdubuf_lock when it is handed
+ * out again, so __pmCountPDUBuf() and the debug dump may see a
+ * slightly stale count for such a buffer.
  */
 
 #include "pmapi.h"
 #include "libpcp.h"
 #include "compiler.h"
 #include <assert.h>
-#include <search.h>
 #include <stdint.h>
 
 typedef struct bufctl
 {
-    int		bc_pincnt;
-    int		bc_size;
-    char	*bc_buf;
-    /* The actual buffer happens to follow this struct. */
+    int			bc_pincnt;
+    int			bc_size;	/* bytes requested */
+    int			bc_shift;	/* allocation is 1 << bc_shift bytes */
+    struct bufctl	*bc_next;	/* free list linkage */
+    void		*bc_raw;	/* pointer to hand to free() */
+    /* The actual buffer follows this struct, at BC_HDRSIZE. */
 } bufctl_t;
 
+#define BC_HDRSIZE	((sizeof(bufctl_t) + 15) & ~(size_t)15)
+#define BC_BUF(pcp)	((char *)(pcp) + BC_HDRSIZE)
+#define BC_CAPACITY(shift) (((size_t)1 << (shift)) - BC_HDRSIZE)
+
+#define BC_MINSHIFT	7		/* smallest class, 128 bytes */
+#define BC_MAXSHIFT	17		/* largest class kept for reuse, 128K */
+#define BC_NCLASS	(BC_MAXSHIFT - BC_MINSHIFT + 1)
+#define BC_TCACHE	8		/* max buffers per class per thread */
+#define BC_TCACHEBYTES	(64*1024)	/* ... and max bytes per class */
+#define BC_MAXFREE	64		/* max buffers per class, global */
+#define BC_FREEBYTES	(128*1024)	/* ... and max bytes per class */
+
+/* per-thread cache of released buffers, one list per size class */
+typedef struct {
+    bufctl_t	*tc_free[BC_NCLASS];
+    int		tc_count[BC_NCLASS];
+} bufcache_t;
+
 /* Protected by the pdubuf_lock mutex. */
-static void *buf_tree;
+static bufctl_t		**reg_tab;	/* registry of all our buffers */
+static unsigned int	reg_size;	/* slots in reg_tab[], power of 2 */
+static unsigned int	reg_count;	/* buffers in reg_tab[] */
+static unsigned int	reg_shifts;	/* bitmap of bc_shift values seen */
+static bufctl_t		*free_list[BC_NCLASS];
+static int		free_count[BC_NCLASS];
 
 #ifdef PM_MULTI_THREAD
 static pthread_mutex_t	pdubuf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	cache_key;
+static int		cache_ok;	/* set once, in cache_init() */
 #else
 void			*pdubuf_lock;
 #endif
@@ -54,56 +96,316 @@ __pmIsPdubufLock(void *lock)
 }
 #endif
 
+static int
+tcache_limit(int shift)
+{
+    int		n = BC_TCACHEBYTES >> shift;
+
+    return n < 1 ? 1 : (n > BC_TCACHE ? BC_TCACHE : n);
+}
+
+static int
+maxfree_limit(int shift)
+{
+    int		n = BC_FREEBYTES >> shift;
+
+    return n < 2 ? 2 : (n > BC_MAXFREE ? BC_MAXFREE : n);
+}
+
+/*
+ * Registry of bufctl_t header addresses, open addressing with linear
+ * probing.  All callers hold pdubuf_lock.
+ */
+static unsigned int
+reg_hash(uintptr_t addr, unsigned int size)
+{
+    __uint64_t	k = (__uint64_t)addr >> BC_MINSHIFT;
+
+    k ^= k >> 29;
+    k *= 0xbf58476d1ce4e5b9ULL;
+    k ^= k >> 32;
+    return (unsigned int)k & (size - 1);
+}
+
+static bufctl_t *
+reg_find(uintptr_t addr)
+{
+    unsigned int	i;
+    bufctl_t		*pcp;
+
+    if (reg_count == 0)
+	return NULL;
+    for (i = reg_hash(addr, reg_size); (pcp = reg_tab[i]) != NULL;
+	 i = (i + 1) & (reg_size - 1)) {
+	if ((uintptr_t)pcp == addr)
+	    return pcp;
+    }
+    return NULL;
+}
+
+static int
+reg_add(bufctl_t *pcp)
+{
+    unsigned int	i;
+
+    if (2 * (reg_count + 1) > reg_size) {
+	unsigned int	size = reg_size ? 2 * reg_size : 64;
+	unsigned int	j;
+	bufctl_t	**tab;
+
+	if ((tab = (bufctl_t **)calloc(size, sizeof(*tab))) == NULL)
+	    return -ENOMEM;
+	for (j = 0; j < reg_size; j++) {
+	    if (reg_tab[j] == NULL)
+		continue;
+	    for (i = reg_hash((uintptr_t)reg_tab[j], size); tab[i] != NULL;
+		 i = (i + 1) & (size - 1))
+		;
+	    tab[i] = reg_tab[j];
+	}
+	free(reg_tab);
+	reg_tab = tab;
+	reg_size = size;
+    }
+    for (i = reg_hash((uintptr_t)pcp, reg_size); reg_tab[i] != NULL;
+	 i = (i + 1) & (reg_size - 1))
+	;
+    reg_tab[i] = pcp;
+    reg_count++;
+    reg_shifts |= 1U << pcp->bc_shift;
+    return 0;
+}
+
 static void
-pdubufdump1(const void *nodep, const VISIT which, const int depth)
+reg_del(bufctl_t *pcp)
 {
-    const bufctl_t	*pcp = *(bufctl_t **)nodep;
+    unsigned int	mask = reg_size - 1;
+    unsigned int	i, j, k;
+
+    for (i = reg_hash((uintptr_t)pcp, reg_size); reg_tab[i] != pcp;
+	 i = (i + 1) & mask)
+	assert(reg_tab[i] != NULL);
+    reg_tab[i] = NULL;
+    reg_count--;
+
+    /* close the gap, so later probe sequences stay unbroken */
+    for (j = (i + 1) & mask; reg_tab[j] != NULL; j = (j + 1) & mask) {
+	k = reg_hash((uintptr_t)reg_tab[j], reg_size);
+	if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+	    reg_tab[i] = reg_tab[j];
+	    reg_tab[j] = NULL;
+	    i = j;
+	}
+    }
+}
 
-    if (which == postorder || which == leaf)	/* called once per node */
-	fprintf(stderr, " " PRINTF_P_PFX "%p...%p[%d](%d)",
-		pcp->bc_buf, &pcp->bc_buf[pcp->bc_size - 1], pcp->bc_size,
-		pcp->bc_pincnt);
+/*
+ * Map an address to the pinned buffer containing it, or NULL.
+ * Caller holds pdubuf_lock.
+ */
+static bufctl_t *
+bufctl_lookup(const char *handle)
+{
+    uintptr_t	addr = (uintptr_t)handle - BC_HDRSIZE;
+    bufctl_t	*pcp;
+    int		shift;
+
+    /* common case, handle is the start of the buffer */
+    if ((pcp = reg_find(addr)) == NULL) {
+	for (shift = BC_MINSHIFT; shift < 32; shift++) {
+	    if ((reg_shifts & (1U << shift)) == 0)
+		continue;
+	    pcp = reg_find(addr & ~(((uintptr_t)1 << shift) - 1));
+	    if (pcp != NULL && pcp->bc_shift == shift)
+		break;
+	    pcp = NULL;
+	}
+    }
+    /* NB: valid range is bc_buf[0 .. bc_size-1] */
+    if (pcp == NULL || pcp->bc_pincnt <= 0 ||
+	handle < BC_BUF(pcp) || handle >= BC_BUF(pcp) + pcp->bc_size)
+	return NULL;
+    return pcp;
 }
 
+/*
+ * Allocate and register a new buffer of 1 << shift bytes, header
+ * included, aligned on that same boundary.
+ */
+static bufctl_t *
+bufctl_alloc(int shift)
+{
+    size_t	align = (size_t)1 << shift;
+    size_t	size = align;
+    bufctl_t	*pcp;
+    void	*raw = NULL;
+    int		sts;
+
+#ifdef HAVE_POSIX_MEMALIGN
+    if ((sts = posix_memalign(&raw, align, size)) != 0) {
+	setoserror(sts);
+	return NULL;
+    }
+    pcp = (bufctl_t *)raw;
+#else
+#ifdef HAVE_MEMALIGN
+    if ((raw = memalign(align, size)) == NULL)
+	return NULL;
+    pcp = (bufctl_t *)raw;
+#else
+    if ((raw = malloc(size + align)) == NULL)
+	return NULL;
+    pcp = (bufctl_t *)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+#endif
+#endif
+
+    pcp->bc_pincnt = 0;
+    pcp->bc_size = 0;
+    pcp->bc_shift = shift;
+    pcp->bc_next = NULL;
+    pcp->bc_raw = raw;
+
+    PM_LOCK(pdubuf_lock);
+    sts = reg_add(pcp);
+    PM_UNLOCK(pdubuf_lock);
+    if (unlikely(sts < 0)) {
+	free(raw);
+	setoserror(-sts);
+	return NULL;
+    }
+    return pcp;
+}
+
+/*
+ * Return a buffer to the global free list for its class, or give it
+ * back to the system if that list is full.  Caller holds pdubuf_lock.
+ */
 static void
-pdubufdump(void)
+bufctl_putfree(bufctl_t *pcp)
 {
-    /*
-     * There is no longer a pdubuf free list, ergo no
-     * fprintf(stderr, "   free pdubuf[size]:\n");
-     */
+    int		c = pcp->bc_shift - BC_MINSHIFT;
+
+    if (pcp->bc_shift <= BC_MAXSHIFT &&
+	free_count[c] < maxfree_limit(pcp->bc_shift)) {
+	pcp->bc_next = free_list[c];
+	free_list[c] = pcp;
+	free_count[c]++;
+    }
+    else {
+	reg_del(pcp);
+	free(pcp->bc_raw);
+    }
+}
+
+#ifdef PM_MULTI_THREAD
+/*
+ * Thread exit, hand anything left in the thread's cache back to the
+ * global free lists.
+ */
+static void
+cache_flush(void *arg)
+{
+    bufcache_t	*tcp = (bufcache_t *)arg;
+    bufctl_t	*pcp;
+    int		c;
+
     PM_LOCK(pdubuf_lock);
-    if (buf_tree != NULL) {
-	fprintf(stderr, "   pinned pdubuf[size](pincnt):");
-	/* THREADSAFE - no locks acquired in pdubufdump1() */
-	twalk(buf_tree, &pdubufdump1);
-	fprintf(stderr, "\n");
+    for (c = 0; c < BC_NCLASS; c++) {
+	while ((pcp = tcp->tc_free[c]) != NULL) {
+	    tcp->tc_free[c] = pcp->bc_next;
+	    bufctl_putfree(pcp);
+	}
     }
     PM_UNLOCK(pdubuf_lock);
+    free(tcp);
+}
+
+static void
+cache_init(void)
+{
+    cache_ok = (pthread_key_create(&cache_key, cache_flush) == 0);
+}
+#endif
+
+static bufcache_t *
+cache_get(void)
+{
+#ifdef PM_MULTI_THREAD
+    bufcache_t	*tcp;
+
+    pthread_once(&cache_once, cache_init);
+    if (!cache_ok)
+	return NULL;
+    if ((tcp = (bufcache_t *)pthread_getspecific(cache_key)) == NULL) {
+	if ((tcp = (bufcache_t *)calloc(1, sizeof(*tcp))) == NULL)
+	    return NULL;
+	if (pthread_setspecific(cache_key, tcp) != 0) {
+	    free(tcp);
+	    return NULL;
+	}
+    }
+    return tcp;
+#else
+    return NULL;
+#endif
 }
 
 /*
- * A tsearch(3) comparison function for the buffer-segments used here.
+ * Pin count has just dropped to zero.  Caller holds pdubuf_lock,
+ * which is released here.
  */
-static int
-bufctl_t_compare(const void *a, const void *b)
+static void
+bufctl_release(bufctl_t *pcp, bufcache_t *tcp)
 {
-    const bufctl_t *aa = (const bufctl_t *)a;
-    const bufctl_t *bb = (const bufctl_t *)b;
+    int		c = pcp->bc_shift - BC_MINSHIFT;
 
-    /* NB: valid range is bc_buf[0 .. bc_size-1] */
-    if ((uintptr_t)&aa->bc_buf[aa->bc_size-1] < (uintptr_t)&bb->bc_buf[0])
-	return -1;
-    if ((uintptr_t)&bb->bc_buf[bb->bc_size-1] < (uintptr_t)&aa->bc_buf[0])
-	return 1;
-    return 0;		/* overlap */
+    if (tcp != NULL && pcp->bc_shift <= BC_MAXSHIFT &&
+	tcp->tc_count[c] < tcache_limit(pcp->bc_shift)) {
+	PM_UNLOCK(pdubuf_lock);
+	pcp->bc_next = tcp->tc_free[c];
+	tcp->tc_free[c] = pcp;
+	tcp->tc_count[c]++;
+	return;
+    }
+    bufctl_putfree(pcp);
+    PM_UNLOCK(pdubuf_lock);
+}
+
+static void
+pdubufdump(void)
+{
+    bufctl_t		*pcp;
+    unsigned int	i;
+    int			first = 1;
+
+    /*
+     * Only pinned buffers are reported, free ones are of no interest
+     * to anyone chasing a leak.
+     */
+    PM_LOCK(pdubuf_lock);
+    for (i = 0; i < reg_size; i++) {
+	if ((pcp = reg_tab[i]) == NULL || pcp->bc_pincnt <= 0)
+	    continue;
+	if (first) {
+	    fprintf(stderr, "   pinned pdubuf[size](pincnt):");
+	    first = 0;
+	}
+	fprintf(stderr, " " PRINTF_P_PFX "%p...%p[%d](%d)",
+		BC_BUF(pcp), &BC_BUF(pcp)[pcp->bc_size - 1], pcp->bc_size,
+		pcp->bc_pincnt);
+    }
+    if (!first)
+	fprintf(stderr, "\n");
+    PM_UNLOCK(pdubuf_lock);
 }
 
 __pmPDU *
 __pmFindPDUBuf(int need)
 {
-    bufctl_t	*pcp;
-    void	*bcp;
+    bufctl_t	*pcp = NULL;
+    bufcache_t	*tcp;
+    int		shift;
+    int		c;
 
     if (unlikely(need < 0)) {
 	/* special diagnostic case ... dump buffer state */
@@ -112,60 +414,54 @@ __pmFindPDUBuf(int need)
 	return NULL;
     }
 
-    if ((pcp = (bufctl_t *)malloc(sizeof(*pcp) + need)) == NULL) {
-	return NULL;
+    for (shift = BC_MINSHIFT; BC_CAPACITY(shift) < (size_t)need; shift++)
+	;
+
+    if (shift <= BC_MAXSHIFT) {
+	c = shift - BC_MINSHIFT;
+	if ((tcp = cache_get()) != NULL && (pcp = tcp->tc_free[c]) != NULL) {
+	    /* no lock needed, this buffer belongs to this thread */
+	    tcp->tc_free[c] = pcp->bc_next;
+	    tcp->tc_count[c]--;
+	}
+	else {
+	    PM_LOCK(pdubuf_lock);
+	    if ((pcp = free_list[c]) != NULL) {
+		free_list[c] = pcp->bc_next;
+		free_count[c]--;
+	    }
+	    PM_UNLOCK(pdubuf_lock);
+	}
     }
+    if (pcp == NULL && (pcp = bufctl_alloc(shift)) == NULL)
+	return NULL;
 
-    pcp->bc_pincnt = 1;
+    pcp->bc_next = NULL;
     pcp->bc_size = need;
-    pcp->bc_buf = ((char *)pcp) + sizeof(*pcp);
-
-    PM_LOCK(pdubuf_lock);
-    /* Insert the node in the tree. */
-    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
-    bcp = tsearch((void *)pcp, &buf_tree, &bufctl_t_compare);
-    if (unlikely(bcp == NULL)) {	/* ENOMEM */
-	PM_UNLOCK(pdubuf_lock);
-	free(pcp);
-	return NULL;
-    }
-    PM_UNLOCK(pdubuf_lock);
+    pcp->bc_pincnt = 1;
 
     if (unlikely(pmDebugOptions.pdubuf)) {
 	fprintf(stderr, "__pmFindPDUBuf(%d) -> " PRINTF_P_PFX "%p\n",
-		need, pcp->bc_buf);
+		need, BC_BUF(pcp));
 	pdubufdump();
     }
 
-    return (__pmPDU *)pcp->bc_buf;
+    return (__pmPDU *)BC_BUF(pcp);
 }
 
 void
 __pmPinPDUBuf(void *handle)
 {
-    bufctl_t	*pcp, pcp_search;
-    void	*bcp;
+    bufctl_t	*pcp;
 
     assert(((__psint_t)handle % sizeof(int)) == 0);
-    /*
-     * Initialize a dummy bufctl_t to use only as search key;
-     * only its bc_buf & bc_size fields need to be set, as that's
-     * all that bufctl_t_compare will look at.
-     */
-    pcp_search.bc_buf = handle;
-    pcp_search.bc_size = 1;
 
     PM_LOCK(pdubuf_lock);
-    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
-    bcp = tfind(&pcp_search, &buf_tree, &bufctl_t_compare);
     /*
      * NB: don't release the lock until final disposition of this object;
      * we don't want to play TOCTOU.
      */
-    if (likely(bcp != NULL)) {
-	pcp = *(bufctl_t **)bcp;
-	assert((&pcp->bc_buf[0] <= (char *)handle) &&
-	       ((char *)handle < &pcp->bc_buf[pcp->bc_size]));
+    if (likely((pcp = bufctl_lookup((char *)handle)) != NULL)) {
 	pcp->bc_pincnt++;
     } else {
 	PM_UNLOCK(pdubuf_lock);
@@ -178,7 +474,7 @@ __pmPinPDUBuf(void *handle)
     if (unlikely(pmDebugOptions.pdubuf))
 	fprintf(stderr, "__pmPinPDUBuf(" PRINTF_P_PFX "%p) -> pdubuf="
 			PRINTF_P_PFX "%p, pincnt=%d\n", handle,
-		pcp->bc_buf, pcp->bc_pincnt);
+		BC_BUF(pcp), pcp->bc_pincnt);
 
     PM_UNLOCK(pdubuf_lock);
 }
@@ -186,29 +482,18 @@ __pmPinPDUBuf(void *handle)
 int
 __pmUnpinPDUBuf(void *handle)
 {
-    bufctl_t	*pcp, pcp_search;
-    void	*bcp;
+    bufctl_t	*pcp;
+    bufcache_t	*tcp;
 
     assert(((__psint_t)handle % sizeof(int)) == 0);
-    PM_LOCK(pdubuf_lock);
 
-    /*
-     * Initialize a dummy bufctl_t to use only as search key;
-     * only its bc_buf & bc_size fields need to be set, as that's
-     * all that bufctl_t_compare will look at.
-     */
-    pcp_search.bc_buf = handle;
-    pcp_search.bc_size = 1;
-
-    /* THREADSAFE - no locks acquired in bufctl_t_compare() */
-    bcp = tfind(&pcp_search, &buf_tree, &bufctl_t_compare);
+    tcp = cache_get();
+    PM_LOCK(pdubuf_lock);
     /*
      * NB: don't release the lock until final disposition of this object;
      * we don't want to play TOCTOU.
      */
-    if (likely(bcp != NULL)) {
-	pcp = *(bufctl_t **)bcp;
-    } else {
+    if (unlikely((pcp = bufctl_lookup((char *)handle)) == NULL)) {
 	PM_UNLOCK(pdubuf_lock);
 	if (pmDebugOptions.pdubuf) {
 	    fprintf(stderr, "__pmUnpinPDUBuf(" PRINTF_P_PFX "%p) -> fails\n",
@@ -221,53 +506,37 @@ __pmUnpinPDUBuf(void *handle)
     if (unlikely(pmDebugOptions.pdubuf))
 	fprintf(stderr, "__pmUnpinPDUBuf(" PRINTF_P_PFX "%p) -> pdubuf="
 			PRINTF_P_PFX "%p, pincnt=%d\n", handle,
-		pcp->bc_buf, pcp->bc_pincnt - 1);
+		BC_BUF(pcp), pcp->bc_pincnt - 1);
 
-    assert((&pcp->bc_buf[0] <= (char*)handle) &&
-	   ((char*)handle < &pcp->bc_buf[pcp->bc_size]));
-
-    if (likely(--pcp->bc_pincnt == 0)) {
-	/* THREADSAFE - no locks acquired in bufctl_t_compare() */
-	tdelete(pcp, &buf_tree, &bufctl_t_compare);
+    if (likely(--pcp->bc_pincnt == 0))
+	bufctl_release(pcp, tcp);	/* drops pdubuf_lock */
+    else
 	PM_UNLOCK(pdubuf_lock);
-	free(pcp);
-    }
-    else {
-	PM_UNLOCK(pdubuf_lock);
-    }
 
     return 1;
 }
 
 /*
- * Used to pass context from __pmCountPDUBuf to the pdubufcount callback.
- * They are protected by the pdubuf_lock mutex.
+ * Count the buffers whose capacity is at least need bytes, those in
+ * use (pinned) and those held for reuse (free).
  */
-static int	pdu_bufcnt_need;
-static unsigned	pdu_bufcnt;
-
-static void
-pdubufcount(const void *nodep, const VISIT which, const int depth)
-{
-    const bufctl_t	*pcp = *(bufctl_t **)nodep;
-
-    if (which == postorder || which == leaf)	/* called once per node */
-	if (pcp->bc_size >= pdu_bufcnt_need)
-	    pdu_bufcnt++;
-}
-
 void
 __pmCountPDUBuf(int need, int *alloc, int *free)
 {
-    PM_LOCK(pdubuf_lock);
-
-    pdu_bufcnt_need = need;
-    pdu_bufcnt = 0;
-    /* THREADSAFE - no locks acquired in pdubufcount() */
-    twalk(buf_tree, &pdubufcount);
-    *alloc = pdu_bufcnt;
+    bufctl_t		*pcp;
+    unsigned int	i;
 
-    *free = 0;			/* We don't retain freed nodes. */
+    *alloc = *free = 0;
 
+    PM_LOCK(pdubuf_lock);
+    for (i = 0; i < reg_size; i++) {
+	if ((pcp = reg_tab[i]) == NULL ||
+	    BC_CAPACITY(pcp->bc_shift) < (size_t)need)
+	    continue;
+	if (pcp->bc_pincnt > 0)
+	    (*alloc)++;
+	else
+	    (*free)++;
+    }
     PM_UNLOCK(pdubuf_lock);
 }
@@ -17,6 +17,10 @@
  */
 #include "pmapi.h"
 #include <sys/stat.h>
+#include <math.h>
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
 #include "mmv_stats.h"
 #include "mmv_dev.h"
 #include "libpcp.h"
@@ -108,6 +112,106 @@ mmv_generation(void)
     return (((__uint64_t)gen1 << 32) | (__uint64_t)gen2);
 }
 
+/* value slots per CPU - beyond MMV_SLOTMAX some CPUs will share */
+static int
+mmv_nslots(mmv_stats_flags_t fl)
+{
+    long ncpus = 1;
+
+    if (!(fl & MMV_FLAG_PERCPU))
+	return 0;
+#ifdef _SC_NPROCESSORS_CONF
+    if ((ncpus = sysconf(_SC_NPROCESSORS_CONF)) < 1)
+	ncpus = 1;
+#endif
+    return ncpus > MMV_SLOTMAX ? MMV_SLOTMAX : (int)ncpus;
+}
+
+/*
+ * 32-bit FNV-1a hash of a metric name, and for metrics with instances
+ * a zero byte and the external instance name - the name index key.
+ */
+static __uint32_t
+mmv_hash(const char *metric, const char *inst)
+{
+    const unsigned char *p;
+    __uint32_t hash = 2166136261U;
+
+    for (p = (const unsigned char *)metric; *p; p++) {
+	hash ^= *p;
+	hash *= 16777619U;
+    }
+    if (inst) {
+	hash *= 16777619U;	/* separator (zero byte) */
+	for (p = (const unsigned char *)inst; *p; p++) {
+	    hash ^= *p;
+	    hash *= 16777619U;
+	}
+    }
+    return hash;
+}
+
+/*
+ * Metric and instance names of a value, as stored in the file
+ * (the instance name is NULL for singular metrics).
+ */
+static const char *
+mmv_value_names(void *addr, int version, mmv_disk_value_t *v,
+		const char **inst)
+{
+    mmv_disk_metric_t *m1;
+    mmv_disk_metric2_t *m2;
+    mmv_disk_instance_t *in1;
+    mmv_disk_instance2_t *in2;
+    mmv_disk_string_t *s;
+
+    if (version == MMV_VERSION1) {
+	m1 = (mmv_disk_metric_t *)((char *)addr + v->metric);
+	if (mmv_singular(m1->indom)) {
+	    *inst = NULL;
+	} else {
+	    in1 = (mmv_disk_instance_t *)((char *)addr + v->instance);
+	    *inst = in1->external;
+	}
+	return m1->name;
+    }
+
+    m2 = (mmv_disk_metric2_t *)((char *)addr + v->metric);
+    if (mmv_singular(m2->indom)) {
+	*inst = NULL;
+    } else {
+	in2 = (mmv_disk_instance2_t *)((char *)addr + v->instance);
+	s = (mmv_disk_string_t *)((char *)addr + in2->external);
+	*inst = s->payload;
+    }
+    s = (mmv_disk_string_t *)((char *)addr + m2->name);
+    return s->payload;
+}
+
+/* Number of bucket counts for histogram and sketch values */
+static int
+mmv_type_buckets(int type)
+{
+    if (type == MMV_TYPE_HISTOGRAM)
+	return MMV_HISTOGRAM_BUCKETS;
+    if (type == MMV_TYPE_SKETCH)
+	return MMV_SKETCH_BUCKETS;
+    return 0;
+}
+
+/* Buckets in the name index - a power of two, at most half full */
+static int
+mmv_nbuckets(int nvalues)
+{
+    int nbuckets = 1;
+
+    if (nvalues == 0)
+	return 0;
+    while (nbuckets < 2 * nvalues)
+	nbuckets <<= 1;
+    return nbuckets;
+}
+
 static void * 
 mmv_init(const char *fname, int version,
 		int cluster, mmv_stats_flags_t fl,
@@ -132,6 +236,12 @@ mmv_init(const char *fname, int version,
     __uint64_t metrics_offset;		/* anchor start of metrics section */
     __uint64_t values_offset;		/* anchor start of values section */
     __uint64_t strings_offset;		/* anchor start of any/all strings */
+    __uint64_t hash_offset;		/* anchor start of the name index */
+    __uint64_t buckets_offset;		/* anchor start of bucket counts */
+    __uint64_t slots_offset;		/* anchor start of per-CPU slots */
+    mmv_disk_hash_t *hlist;
+    const char *name, *inst;
+    __uint32_t hash, mask;
     void *addr;
     size_t size;
     __uint64_t offset;
@@ -139,6 +249,9 @@ mmv_init(const char *fname, int version,
     int ninstances = 0;
     int nstrings = 0;
     int nvalues = 0;
+    int nbuckets;
+    int ncounts = 0;
+    int nslots = mmv_nslots(fl);
 
     for (i = 0; i < nindom1; i++) {
 	ninstances += in1[i].count;
@@ -171,6 +284,7 @@ mmv_init(const char *fname, int version,
 	} else {
 	    if (st1[i].type == MMV_TYPE_STRING)
 		nstrings++;
+	    ncounts += mmv_type_buckets(st1[i].type);
 	    nvalues++;
 	}
     }
@@ -190,17 +304,27 @@ mmv_init(const char *fname, int version,
 	} else {
 	    if (st2[i].type == MMV_TYPE_STRING)
 		nstrings++;
+	    ncounts += mmv_type_buckets(st2[i].type);
 	    nvalues++;
 	}
     }
 
+    nbuckets = mmv_nbuckets(nvalues);
+
     /* TOC follows header, with enough entries to hold */
-    /* indoms, instances, metrics, values, and strings */
+    /* indoms, instances, metrics, values, strings, index, */
+    /* and histogram buckets */
     size = sizeof(mmv_disk_toc_t) * 2;
     if (nindom1 || nindom2)
 	size += sizeof(mmv_disk_toc_t) * 2;
     if (nstrings)
 	size += sizeof(mmv_disk_toc_t) * 1;
+    if (nbuckets)
+	size += sizeof(mmv_disk_toc_t) * 1;
+    if (ncounts)
+	size += sizeof(mmv_disk_toc_t) * 1;
+    if (nslots)
+	size += sizeof(mmv_disk_toc_t) * 1;
     indoms_offset = sizeof(mmv_disk_header_t) + size;
 
     /* Following the indom definitions are the actual instances */
@@ -241,8 +365,23 @@ mmv_init(const char *fname, int version,
     size = nvalues * sizeof(mmv_disk_value_t);
     strings_offset = values_offset + size;
 
-    /* End of file follows all of the actual strings */
-    size = strings_offset + nstrings * sizeof(mmv_disk_string_t);
+    /* Following the strings is the name index for value lookups */
+    hash_offset = strings_offset + nstrings * sizeof(mmv_disk_string_t);
+
+    /* Following the index are any histogram and sketch bucket */
+    /* counts, which start on a cache line boundary */
+    size = hash_offset + nbuckets * sizeof(mmv_disk_hash_t);
+    buckets_offset = (size + MMV_SLOTSIZE - 1) & ~(MMV_SLOTSIZE - 1);
+    if (ncounts)
+	size = buckets_offset + (size_t)ncounts * sizeof(__uint64_t);
+
+    /* Following the buckets are any per-CPU value slots, which */
+    /* start on a cache line boundary so no two CPUs share lines */
+    slots_offset = (size + MMV_SLOTSIZE - 1) & ~(MMV_SLOTSIZE - 1);
+
+    /* End of file follows the strings, index, buckets (or slots) */
+    if (nslots)
+	size = slots_offset + (size_t)nvalues * nslots * sizeof(mmv_disk_slot_t);
 
     if ((addr = mmv_mapping_init(fname, size)) == NULL)
 	return NULL;
@@ -268,6 +407,12 @@ mmv_init(const char *fname, int version,
 	hdr->tocs += 2;
     if (nstrings)
 	hdr->tocs += 1;
+    if (nbuckets)
+	hdr->tocs += 1;
+    if (ncounts)
+	hdr->tocs += 1;
+    if (nslots)
+	hdr->tocs += 1;
     hdr->flags = fl;
     hdr->cluster = cluster;
     hdr->process = (__int32_t)getpid();
@@ -299,6 +444,24 @@ mmv_init(const char *fname, int version,
 	toc[tocidx].offset = strings_offset;
 	tocidx++;
     }
+    if (nbuckets) {
+	toc[tocidx].type = MMV_TOC_HASH;
+	toc[tocidx].count = nbuckets;
+	toc[tocidx].offset = hash_offset;
+	tocidx++;
+    }
+    if (ncounts) {
+	toc[tocidx].type = MMV_TOC_BUCKETS;
+	toc[tocidx].count = ncounts;
+	toc[tocidx].offset = buckets_offset;
+	tocidx++;
+    }
+    if (nslots) {
+	toc[tocidx].type = MMV_TOC_SLOTS;
+	toc[tocidx].count = nvalues * nslots;
+	toc[tocidx].offset = slots_offset;
+	tocidx++;
+    }
 
     /* Indom section */
     domlist = (mmv_disk_indom_t *)((char *)addr + indoms_offset);
@@ -496,6 +659,9 @@ mmv_init(const char *fname, int version,
 	    vlist[i].extra = strings_offset +
 				(stridx * sizeof(mmv_disk_string_t));
 	    stridx++;
+	} else if (mmv_type_buckets(type)) {
+	    vlist[i].extra = buckets_offset;
+	    buckets_offset += mmv_type_buckets(type) * sizeof(__uint64_t);
 	}
     }
     for (i = 0; i < nmetric1; i++) {
@@ -570,6 +736,18 @@ mmv_init(const char *fname, int version,
 	}
     }
 
+    /* Name index section - keyed on the names as stored above */
+    hlist = (mmv_disk_hash_t *)((char *)addr + hash_offset);
+    mask = nbuckets - 1;
+    for (i = 0; i < nvalues; i++) {
+	name = mmv_value_names(addr, version, &vlist[i], &inst);
+	hash = mmv_hash(name, inst);
+	for (j = hash & mask; hlist[j].value != 0; j = (j + 1) & mask)
+	    ;	/* linear probing, table is never more than half full */
+	hlist[j].hash = hash;
+	hlist[j].value = values_offset + i * sizeof(mmv_disk_value_t);
+    }
+
     /* Complete - unlock the header, PMDA can read now */
     hdr->g2 = hdr->g1;
 
@@ -611,10 +789,14 @@ mmv_check(const mmv_metric_t *st, int nmetrics,
 	metric = &st[i];
 	size = strlen(metric->name);
 	if (metric->type < MMV_TYPE_NOSUPPORT ||
-	    metric->type > MMV_TYPE_ELAPSED || size == 0) {
+	    metric->type > MMV_TYPE_SKETCH || size == 0) {
 	    setoserror(EINVAL);
 	    return -1;
 	}
+	if (mmv_type_buckets(metric->type) && !mmv_singular(metric->indom)) {
+	    setoserror(EINVAL);	/* buckets are the instances */
+	    return -1;
+	}
 	if (size >= MMV_STRINGMAX) {
 	    setoserror(E2BIG);
 	    return -1;
@@ -693,10 +875,14 @@ mmv_check2(const mmv_metric2_t *st, int nmetrics,
 	metric = &st[i];
 	size = strlen(metric->name);
 	if (metric->type < MMV_TYPE_NOSUPPORT ||
-	    metric->type > MMV_TYPE_ELAPSED || size == 0) {
+	    metric->type > MMV_TYPE_SKETCH || size == 0) {
 	    setoserror(EINVAL);
 	    return -1;
 	}
+	if (mmv_type_buckets(metric->type) && !mmv_singular(metric->indom)) {
+	    setoserror(EINVAL);	/* buckets are the instances */
+	    return -1;
+	}
 	if (size >= MMV_STRINGMAX) {
 	    setoserror(E2BIG);
 	    return -1;
@@ -808,6 +994,35 @@ mmv_lookup_value_desc2(void *addr, const char *metric, const char *inst,
     return NULL;
 }
 
+static pmAtomValue *
+mmv_lookup_value_hash(void *addr, int version,
+			const char *metric, const char *inst,
+			mmv_disk_toc_t *toc)
+{
+    mmv_disk_hash_t *hlist = (mmv_disk_hash_t *)((char *)addr + toc->offset);
+    mmv_disk_value_t *v;
+    const char *name, *iname;
+    __uint32_t hash = mmv_hash(metric, inst);
+    __uint32_t mask = toc->count - 1;
+    __uint32_t i, n;
+
+    for (i = hash & mask, n = 0; n < toc->count; i = (i + 1) & mask, n++) {
+	if (hlist[i].value == 0)	/* empty bucket, end of the chain */
+	    break;
+	if (hlist[i].hash != hash)
+	    continue;
+	v = (mmv_disk_value_t *)((char *)addr + hlist[i].value);
+	name = mmv_value_names(addr, version, v, &iname);
+	if (strcmp(name, metric) != 0)
+	    continue;
+	if (inst == NULL && iname == NULL)
+	    return &v->value;
+	if (inst != NULL && iname != NULL && strcmp(iname, inst) == 0)
+	    return &v->value;
+    }
+    return NULL;
+}
+
 pmAtomValue *
 mmv_lookup_value_desc(void *addr, const char *metric, const char *inst)
 {
@@ -816,6 +1031,21 @@ mmv_lookup_value_desc(void *addr, const char *metric, const char *inst)
 	mmv_disk_header_t *hdr = (mmv_disk_header_t *)addr;
 	mmv_disk_toc_t *toc = (mmv_disk_toc_t *)
 			((char *)addr + sizeof(mmv_disk_header_t));
+	pmAtomValue *value;
+
+	/* use the name index where there is one, in constant time */
+	for (i = 0; i < hdr->tocs; i++) {
+	    if (toc[i].type != MMV_TOC_HASH || toc[i].count == 0 ||
+		(toc[i].count & (toc[i].count - 1)) != 0)
+		continue;
+	    value = mmv_lookup_value_hash(addr, hdr->version,
+					metric, inst, &toc[i]);
+	    /* instance names are ignored for singular metrics */
+	    if (value == NULL && inst != NULL)
+		value = mmv_lookup_value_hash(addr, hdr->version,
+					metric, NULL, &toc[i]);
+	    return value;
+	}
 
 	if (hdr->version == MMV_VERSION1) {
 	    for (i = 0; i < hdr->tocs; i++)
@@ -830,22 +1060,167 @@ mmv_lookup_value_desc(void *addr, const char *metric, const char *inst)
     return NULL;
 }
 
+static int
+mmv_value_type(void *addr, mmv_disk_value_t *v)
+{
+    mmv_disk_header_t *hdr = (mmv_disk_header_t *)addr;
+
+    if (hdr->version == MMV_VERSION1) {
+	mmv_disk_metric_t *m = (mmv_disk_metric_t *)
+					((char *)addr + v->metric);
+	return m->type;
+    } else {
+	mmv_disk_metric2_t *m = (mmv_disk_metric2_t *)
+					((char *)addr + v->metric);
+	return m->type;
+    }
+}
+
+static int
+mmv_cpu(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+    int cpu = sched_getcpu();
+
+    if (cpu > 0)
+	return cpu;
+#endif
+    return 0;
+}
+
+/*
+ * Find the per-CPU slots of a value (MMV_FLAG_PERCPU), returning
+ * the first slot and setting the number of slots for each value.
+ * Elapsed time and string values are never split across slots.
+ */
+static mmv_disk_slot_t *
+mmv_lookup_slots(void *addr, mmv_disk_value_t *v, int type, int *nslots)
+{
+    mmv_disk_header_t *hdr = (mmv_disk_header_t *)addr;
+    mmv_disk_toc_t *toc = (mmv_disk_toc_t *)
+			((char *)addr + sizeof(mmv_disk_header_t));
+    __uint64_t values = 0, slots = 0, index;
+    int i, nvalues = 0, count = 0;
+
+    if (!(hdr->flags & MMV_FLAG_PERCPU) ||
+	type == MMV_TYPE_ELAPSED || type == MMV_TYPE_STRING ||
+	mmv_type_buckets(type))
+	return NULL;
+
+    for (i = 0; i < hdr->tocs; i++) {
+	if (toc[i].type == MMV_TOC_VALUES) {
+	    values = toc[i].offset;
+	    nvalues = toc[i].count;
+	} else if (toc[i].type == MMV_TOC_SLOTS) {
+	    slots = toc[i].offset;
+	    count = toc[i].count;
+	}
+    }
+    if (slots == 0 || nvalues <= 0 || count < nvalues)
+	return NULL;
+
+    *nslots = count / nvalues;
+    index = ((char *)v - (char *)addr - values) / sizeof(mmv_disk_value_t);
+    return (mmv_disk_slot_t *)((char *)addr + slots) + index * *nslots;
+}
+
+/*
+ * Lock-free updates - integers are added in place, floating point
+ * values swapped in with a compare-and-exchange on their bit pattern
+ * (retrying if another thread got in between).
+ */
+static void
+mmv_atomic_add(pmAtomValue *ap, int type, double inc)
+{
+    pmAtomValue old, new;
+
+    switch (type) {
+    case MMV_TYPE_I32:
+	__atomic_fetch_add(&ap->l, (__int32_t)inc, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_U32:
+	__atomic_fetch_add(&ap->ul, (__uint32_t)inc, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_I64:
+    case MMV_TYPE_ELAPSED:
+	__atomic_fetch_add(&ap->ll, (__int64_t)inc, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_U64:
+	__atomic_fetch_add(&ap->ull, (__uint64_t)inc, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_FLOAT:
+	old.ul = __atomic_load_n(&ap->ul, __ATOMIC_RELAXED);
+	do {
+	    new.f = old.f + (float)inc;
+	} while (!__atomic_compare_exchange_n(&ap->ul, &old.ul, new.ul,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	break;
+    case MMV_TYPE_DOUBLE:
+	old.ull = __atomic_load_n(&ap->ull, __ATOMIC_RELAXED);
+	do {
+	    new.d = old.d + inc;
+	} while (!__atomic_compare_exchange_n(&ap->ull, &old.ull, new.ull,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	break;
+    default:
+	break;
+    }
+}
+
+static void
+mmv_atomic_set(pmAtomValue *ap, int type, double val)
+{
+    pmAtomValue new;
+
+    switch (type) {
+    case MMV_TYPE_I32:
+	__atomic_store_n(&ap->l, (__int32_t)val, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_U32:
+	__atomic_store_n(&ap->ul, (__uint32_t)val, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_I64:
+    case MMV_TYPE_ELAPSED:
+	__atomic_store_n(&ap->ll, (__int64_t)val, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_U64:
+	__atomic_store_n(&ap->ull, (__uint64_t)val, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_FLOAT:
+	new.f = (float)val;
+	__atomic_store_n(&ap->ul, new.ul, __ATOMIC_RELAXED);
+	break;
+    case MMV_TYPE_DOUBLE:
+	new.d = val;
+	__atomic_store_n(&ap->ull, new.ull, __ATOMIC_RELAXED);
+	break;
+    default:
+	break;
+    }
+}
+
+/* setting a value discards whatever had accumulated in its slots */
+static void
+mmv_clear_slots(mmv_disk_slot_t *slot, int nslots)
+{
+    int i;
+
+    for (i = 0; i < nslots; i++)
+	__atomic_store_n(&slot[i].value.ull, 0, __ATOMIC_RELAXED);
+}
+
 void
 mmv_inc_value(void *addr, pmAtomValue *av, double inc)
 {
     if (av != NULL && addr != NULL) {
-	mmv_disk_header_t *hdr = (mmv_disk_header_t *)addr;
 	mmv_disk_value_t *v = (mmv_disk_value_t *)av;
-	int type;
+	mmv_disk_slot_t *slot;
+	int type, nslots;
 
-	if (hdr->version == MMV_VERSION1) {
-	    mmv_disk_metric_t *m = (mmv_disk_metric_t *)
-					((char *)addr + v->metric);
-	    type = m->type;
-	} else {
-	    mmv_disk_metric2_t *m = (mmv_disk_metric2_t *)
-					((char *)addr + v->metric);
-	    type = m->type;
+	type = mmv_value_type(addr, v);
+	if ((slot = mmv_lookup_slots(addr, v, type, &nslots)) != NULL) {
+	    mmv_atomic_add(&slot[mmv_cpu() % nslots].value, type, inc);
+	    return;
 	}
 	switch (type) {
 	case MMV_TYPE_I32:
@@ -884,19 +1259,13 @@ void
 mmv_set_value(void *addr, pmAtomValue *av, double val)
 {
     if (av != NULL && addr != NULL) {
-	mmv_disk_header_t *hdr = (mmv_disk_header_t *)addr;
 	mmv_disk_value_t *v = (mmv_disk_value_t *)av;
-	int type;
+	mmv_disk_slot_t *slot;
+	int type, nslots;
 
-	if (hdr->version == MMV_VERSION1) {
-	    mmv_disk_metric_t *m = (mmv_disk_metric_t *)
-					((char *)addr + v->metric);
-	    type = m->type;
-	} else {
-	    mmv_disk_metric2_t *m = (mmv_disk_metric2_t *)
-					((char *)addr + v->metric);
-	    type = m->type;
-	}
+	type = mmv_value_type(addr, v);
+	if ((slot = mmv_lookup_slots(addr, v, type, &nslots)) != NULL)
+	    mmv_clear_slots(slot, nslots);
 	switch (type) {
 	case MMV_TYPE_I32:
 	    v->value.l = (__int32_t)val;
@@ -926,24 +1295,137 @@ mmv_set_value(void *addr, pmAtomValue *av, double val)
     }
 }
 
+/*
+ * Thread-safe variants of mmv_inc_value and mmv_set_value, for
+ * values updated by several threads without further locking.
+ */
+void
+mmv_inc_atomvalue(void *addr, pmAtomValue *av, double inc)
+{
+    if (av != NULL && addr != NULL) {
+	mmv_disk_value_t *v = (mmv_disk_value_t *)av;
+	mmv_disk_slot_t *slot;
+	__int64_t extra;
+	int type, nslots;
+
+	type = mmv_value_type(addr, v);
+	if ((slot = mmv_lookup_slots(addr, v, type, &nslots)) != NULL) {
+	    mmv_atomic_add(&slot[mmv_cpu() % nslots].value, type, inc);
+	} else if (type == MMV_TYPE_ELAPSED) {
+	    if (inc < 0)
+		__atomic_store_n(&v->extra, (__int64_t)inc, __ATOMIC_RELAXED);
+	    else {
+		extra = __atomic_exchange_n(&v->extra, 0, __ATOMIC_RELAXED);
+		mmv_atomic_add(&v->value, type, extra + (__int64_t)inc);
+	    }
+	} else {
+	    mmv_atomic_add(&v->value, type, inc);
+	}
+    }
+}
+
+void
+mmv_set_atomvalue(void *addr, pmAtomValue *av, double val)
+{
+    if (av != NULL && addr != NULL) {
+	mmv_disk_value_t *v = (mmv_disk_value_t *)av;
+	mmv_disk_slot_t *slot;
+	int type, nslots;
+
+	type = mmv_value_type(addr, v);
+	if ((slot = mmv_lookup_slots(addr, v, type, &nslots)) != NULL)
+	    mmv_clear_slots(slot, nslots);
+	if (type == MMV_TYPE_ELAPSED)
+	    __atomic_store_n(&v->extra, 0, __ATOMIC_RELAXED);
+	mmv_atomic_set(&v->value, type, val);
+    }
+}
+
+static unsigned int
+mmv_leading_zeros(__uint64_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(bits);
+#else
+    unsigned int n = 0;
+
+    for (; !(bits & (1ULL << 63)); bits <<= 1)
+	n++;
+    return n;
+#endif
+}
+
+/* Log-linear histogram bucket for a value (layout in mmv_dev.h) */
+static unsigned int
+mmv_histogram_bucket(double value)
+{
+    __uint64_t v;
+    unsigned int m;
+
+    if (!(value > 0))		/* negative, zero or not-a-number */
+	return 0;
+    if (value >= 18446744073709551616.0)
+	return MMV_HISTOGRAM_BUCKETS - 1;
+    v = (__uint64_t)value;
+    if (v < MMV_HISTOGRAM_SUB)
+	return (unsigned int)v;
+    m = 63 - mmv_leading_zeros(v);	/* highest bit set */
+    return (m - MMV_HISTOGRAM_SUBBITS + 1) * MMV_HISTOGRAM_SUB +
+	   ((v >> (m - MMV_HISTOGRAM_SUBBITS)) & (MMV_HISTOGRAM_SUB - 1));
+}
+
+/* Logarithmic sketch bucket for a value (layout in mmv_dev.h) */
+static unsigned int
+mmv_sketch_bucket(double value)
+{
+    double index;
+
+    if (!(value > 0))		/* negative, zero or not-a-number */
+	return 0;
+    index = ceil(log(value) / log(MMV_SKETCH_GAMMA)) + MMV_SKETCH_OFFSET;
+    if (index < 1)
+	return 1;
+    if (index > MMV_SKETCH_BUCKETS - 1)
+	return MMV_SKETCH_BUCKETS - 1;
+    return (unsigned int)index;
+}
+
+/*
+ * Count one observation in a histogram or sketch value, lock-free;
+ * the value itself counts all observations, and the bucket counts
+ * are summed up into quantiles by the PMDA.
+ */
+void
+mmv_observe_value(void *addr, pmAtomValue *av, double value)
+{
+    if (av != NULL && addr != NULL) {
+	mmv_disk_value_t *v = (mmv_disk_value_t *)av;
+	__uint64_t *buckets;
+	unsigned int i;
+
+	switch (mmv_value_type(addr, v)) {
+	case MMV_TYPE_HISTOGRAM:
+	    i = mmv_histogram_bucket(value);
+	    break;
+	case MMV_TYPE_SKETCH:
+	    i = mmv_sketch_bucket(value);
+	    break;
+	default:
+	    return;
+	}
+	buckets = (__uint64_t *)((char *)addr + v->extra);
+	__atomic_fetch_add(&buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&v->value.ull, 1, __ATOMIC_RELAXED);
+    }
+}
+
 void
 mmv_set_string(void *addr, pmAtomValue *av, const char *string, int size)
 {
     if (av != NULL && addr != NULL && string != NULL) {
-	mmv_disk_header_t *hdr = (mmv_disk_header_t *)addr;
 	mmv_disk_value_t *v = (mmv_disk_value_t *)av;
-	int type;
+	int type = mmv_value_type(addr, v);
 
-	if (hdr->version == MMV_VERSION1) {
-	    mmv_disk_metric_t *m = (mmv_disk_metric_t *)
-					((char *)addr + v->metric);
-	    type = m->type;
-	} else {
-	    mmv_disk_metric2_t *m = (mmv_disk_metric2_t *)
-					((char *)addr + v->metric);
-	    type = m->type;
-	}
- 
 	if (type == MMV_TYPE_STRING &&
 	    (size >= 0 && size < MMV_STRINGMAX - 1)) {
 	    __uint64_t soffset = v->extra;
@@ -994,6 +1476,36 @@ mmv_stats_set(void *addr,
     }
 }
 
+void
+mmv_stats_add_atomic(void *addr,
+	const char *metric, const char *instance, double count)
+{
+    if (addr) {
+	pmAtomValue *mmv_metric;
+	mmv_metric = mmv_lookup_value_desc(addr, metric, instance);
+	if (mmv_metric)
+	    mmv_inc_atomvalue(addr, mmv_metric, count);
+    }
+}
+
+void
+mmv_stats_inc_atomic(void *addr, const char *metric, const char *instance)
+{
+    mmv_stats_add_atomic(addr, metric, instance, 1);
+}
+
+void
+mmv_stats_observe(void *addr,
+	const char *metric, const char *instance, double value)
+{
+    if (addr) {
+	pmAtomValue *mmv_metric;
+	mmv_metric = mmv_lookup_value_desc(addr, metric, instance);
+	if (mmv_metric)
+	    mmv_observe_value(addr, mmv_metric, value);
+    }
+}
+
 void
 mmv_stats_add_fallback(void *addr, const char *metric,
 	const char *instance, const char *instance2, double count)
@@ -71,8 +71,11 @@ typedef struct hdr {
 #define CACHE_STRINGS	0x4
 
 static hdr_t	*base;		/* start of cache headers */
-static char 	filename[MAXPATHLEN];
-				/* for load/save ops */
+#ifdef PM_MULTI_THREAD
+static pthread_mutex_t	cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static void		*cache_lock;
+#endif
 static char	*vdp;		/* first trip mkdir for load/save */
 
 /*
@@ -166,21 +169,28 @@ find_cache(pmInDom indom, int *sts)
     hdr_t	*h;
     int		i;
 
+    /*
+     * DSO PMDAs flagged PMDA_FLAG_THREADSAFE may get here concurrently
+     * from pmcd worker threads; each PMDA has its own indoms, so only
+     * the list of cache headers is shared.
+     */
+    PM_LOCK(cache_lock);
     for (h = base; h != NULL; h = h->next) {
-	if (h->indom == indom)
+	if (h->indom == indom) {
+	    PM_UNLOCK(cache_lock);
 	    return h;
+	}
     }
 
     if ((h = (hdr_t *)malloc(sizeof(hdr_t))) == NULL) {
 	char	strbuf[20];
+	PM_UNLOCK(cache_lock);
 	pmNotifyErr(LOG_ERR, 
 	     "find_cache: indom %s: unable to allocate memory for hdr_t",
 	     pmInDomStr_r(indom, strbuf, sizeof(strbuf)));
 	*sts = PM_ERR_GENERIC;
 	return NULL;
     }
-    h->next = base;
-    base = h;
     h->first = NULL;
     h->last = NULL;
     h->hsize = 16;
@@ -194,6 +204,9 @@ find_cache(pmInDom indom, int *sts)
     for (i = 0; i < MAX_HASH_TRY; i++)
 	h->keyhash_cnt[i] = 0;
     h->maxinst = DEFAULT_MAXINST;
+    h->next = base;
+    base = h;
+    PM_UNLOCK(cache_lock);
     return h;
 }
 
@@ -709,6 +722,34 @@ retry:
     return e;
 }
 
+/*
+ * Path to the external file for an indom's cache - the callers may be
+ * in concurrent fetches, so the buffer is theirs and the first trip
+ * directory setup happens once, under the lock.
+ */
+static int
+cache_filename(pmInDom indom, char *filename, size_t size)
+{
+    int		sep = pmPathSeparator();
+    char	strbuf[20];
+
+    PM_LOCK(cache_lock);
+    if (vdp == NULL) {
+	if ((vdp = pmGetOptionalConfig("PCP_VAR_DIR")) == NULL) {
+	    PM_UNLOCK(cache_lock);
+	    return PM_ERR_GENERIC;
+	}
+	pmsprintf(filename, size,
+		"%s%c" "config" "%c" "pmda", vdp, sep, sep);
+	mkdir2(filename, 0755);
+    }
+    PM_UNLOCK(cache_lock);
+
+    pmsprintf(filename, size, "%s%cconfig%cpmda%c%s",
+		vdp, sep, sep, sep, pmInDomStr_r(indom, strbuf, sizeof(strbuf)));
+    return 0;
+}
+
 static int
 load_cache(hdr_t *h)
 {
@@ -723,20 +764,10 @@ load_cache(hdr_t *h)
     char	buf[1024];	/* input line buffer, is this big enough? */
     char	*p;
     int		sts;
-    int		sep = pmPathSeparator();
-    char	strbuf[20];
-
-    if (vdp == NULL) {
-	if ((vdp = pmGetOptionalConfig("PCP_VAR_DIR")) == NULL)
-	    return PM_ERR_GENERIC;
-	pmsprintf(filename, sizeof(filename),
-		"%s%c" "config" "%c" "pmda", vdp, sep, sep);
-	mkdir2(filename, 0755);
-    }
+    char	filename[MAXPATHLEN];
 
-    pmsprintf(filename, sizeof(filename), "%s%cconfig%cpmda%c%s",
-		vdp, sep, sep, sep,
-		pmInDomStr_r(h->indom, strbuf, sizeof(strbuf)));
+    if ((sts = cache_filename(h->indom, filename, sizeof(filename))) < 0)
+	return sts;
     if ((fp = fopen(filename, "r")) == NULL)
 	return -oserror();
     if (fgets(buf, sizeof(buf), fp) == NULL) {
@@ -878,26 +909,17 @@ save_cache(hdr_t *h, int hstate)
     entry_t	*e;
     int		cnt;
     time_t	now;
-    int		sep = pmPathSeparator();
+    int		sts;
     int		state = h->hstate & ~CACHE_STRINGS;
-    char	strbuf[20];
+    char	filename[MAXPATHLEN];
 
     if ((state & hstate) == 0) {
 	/* nothing to be done */
 	return 0;
     }
 
-    if (vdp == NULL) {
-	if ((vdp = pmGetOptionalConfig("PCP_VAR_DIR")) == NULL)
-	    return PM_ERR_GENERIC;
-	pmsprintf(filename, sizeof(filename),
-		"%s%c" "config" "%c" "pmda", vdp, sep, sep);
-	mkdir2(filename, 0755);
-    }
-
-    pmsprintf(filename, sizeof(filename), "%s%cconfig%cpmda%c%s",
-		vdp, sep, sep, sep,
-		pmInDomStr_r(h->indom, strbuf, sizeof(strbuf)));
+    if ((sts = cache_filename(h->indom, filename, sizeof(filename))) < 0)
+	return sts;
     if ((fp = fopen(filename, "w")) == NULL)
 	return -oserror();
     fprintf(fp, "%d %d %d\n", CACHE_VERSION, h->ins_mode, h->maxinst);
@@ -58,8 +58,6 @@ __pmdaCntInst(pmInDom indom, pmdaExt *pmda)
  * Commence a new round of instance selection
  */
 
-static pmdaIndom	last;
-
 /*
  * State between here and __pmdaNextInst is a little strange
  *
@@ -68,8 +66,9 @@ static pmdaIndom	last;
  *      pmda->e_idp->it_indom is used in __pmdaNextInst
  *
  * for the cache method
- *    - pmda->e_idp is set here (points into last) which is also set
- *      up with the it_indom field (other fields in last are not used),
+ *    - pmda->e_idp is set here (points into the per-PMDA cacheindom in
+ *      e_ext_t) which is also set up with the it_indom field (other fields
+ *      are not used),
  *      and pmda->e_idp->it_indom in __pmdaNextInst
  *
  * In both cases, pmda->e_ordinal and pmda->e_singular are set here
@@ -85,6 +84,7 @@ static pmdaIndom	last;
 void
 __pmdaStartInst(pmInDom indom, pmdaExt *pmda)
 {
+    e_ext_t	*extp = (e_ext_t *)pmda->e_ext;
     int		i;
 
     pmda->e_ordinal = pmda->e_singular = -1;
@@ -95,8 +95,8 @@ __pmdaStartInst(pmInDom indom, pmdaExt *pmda)
     else {
 	if (pmdaCacheOp(indom, PMDA_CACHE_CHECK)) {
 	    pmdaCacheOp(indom, PMDA_CACHE_WALK_REWIND);
-	    last.it_indom = indom;
-	    pmda->e_idp = &last;
+	    extp->cacheindom.it_indom = indom;
+	    pmda->e_idp = &extp->cacheindom;
 	    pmda->e_ordinal = 0;
 	}
 	else {
@@ -126,6 +126,7 @@ __pmdaStartInst(pmInDom indom, pmdaExt *pmda)
 int
 __pmdaNextInst(int *inst, pmdaExt *pmda)
 {
+    e_ext_t	*extp = (e_ext_t *)pmda->e_ext;
     int		j;
     int		myinst;
 
@@ -137,7 +138,7 @@ __pmdaNextInst(int *inst, pmdaExt *pmda)
     }
     if (pmda->e_ordinal >= 0) {
 	/* scan for next value in the profile */
-	if (pmda->e_idp == &last) {
+	if (pmda->e_idp == &extp->cacheindom) {
 	    /* cache-driven */
 	    while ((myinst = pmdaCacheOp(pmda->e_idp->it_indom, PMDA_CACHE_WALK_NEXT)) != -1) {
 		pmda->e_ordinal++;
@@ -1,4 +1,5 @@
 /*
+ * Copyright (c) 2018 Red Hat.
  * Copyright (c) 2010 Ken McDonell.  All Rights Reserved.
  * 
  * This library is free software; you can redistribute it and/or modify it
@@ -13,18 +14,50 @@
  */
 
 #include "pmapi.h"
+#include "libpcp.h"
 #include "pmda.h"
 
-static int	last_ctx = -1;	/* not thread safe! */
+/*
+ * The client context of the PMDA callback in progress.  DSO PMDAs that
+ * set PMDA_FLAG_THREADSAFE are called on pmcd's worker threads (pmcd -w),
+ * concurrently with other PMDAs, so this is private to each thread.
+ */
+#ifdef PM_MULTI_THREAD
+#ifdef HAVE___THREAD
+static __thread int	last_ctx = -1;
+#else
+static pthread_key_t	last_ctx_key;
+static pthread_once_t	last_ctx_once = PTHREAD_ONCE_INIT;
+
+static void
+last_ctx_init(void)
+{
+    pthread_key_create(&last_ctx_key, NULL);
+}
+#endif
+#else
+static int	last_ctx = -1;
+#endif
 
 void
 __pmdaSetContext(int ctx)
 {
+#if defined(PM_MULTI_THREAD) && !defined(HAVE___THREAD)
+    /* stored off by one, so that a thread's initial NULL is -1 */
+    pthread_once(&last_ctx_once, last_ctx_init);
+    pthread_setspecific(last_ctx_key, (void *)(__psint_t)(ctx + 1));
+#else
     last_ctx = ctx;
+#endif
 }
 
 int
 pmdaGetContext(void)
 {
+#if defined(PM_MULTI_THREAD) && !defined(HAVE___THREAD)
+    pthread_once(&last_ctx_once, last_ctx_init);
+    return (int)(__psint_t)pthread_getspecific(last_ctx_key) - 1;
+#else
     return last_ctx;
+#endif
 }
@@ -1,6 +1,7 @@
 /*
  * Service routines for managing a packed array of event records
  *
+ * Copyright (c) 2018 Red Hat.
  * Copyright (c) 2010 Ken McDonell.  All Rights Reserved.
  * 
  * This library is free software; you can redistribute it and/or modify it
@@ -29,8 +30,32 @@ typedef struct {
 #define B_FREE	0
 #define B_INUSE	1
 
+/*
+ * The table of arrays is shared by every PMDA in the process, so it
+ * is locked, and each bufctl_t is allocated separately so that it does
+ * not move when the table grows.  An array belongs to the one PMDA that
+ * created it, which is never called concurrently, so array contents
+ * need no lock.
+ */
 static int	nbuf;
-static bufctl_t	*bufs;
+static bufctl_t	**bufs;
+#ifdef PM_MULTI_THREAD
+static pthread_mutex_t	events_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static void		*events_lock;
+#endif
+
+static bufctl_t *
+lookup_buf(int idx)
+{
+    bufctl_t	*bp = NULL;
+
+    PM_LOCK(events_lock);
+    if (idx >= 0 && idx < nbuf && bufs[idx]->bstate != B_FREE)
+	bp = bufs[idx];
+    PM_UNLOCK(events_lock);
+    return bp;
+}
 
 static int
 check_buf(bufctl_t *bp, int need)
@@ -60,29 +85,38 @@ check_buf(bufctl_t *bp, int need)
 static int
 event_array(void)
 {
-    int		i;
-    bufctl_t	*tmp_bufs;
+    int		i, sts;
+    bufctl_t	**tmp_bufs;
+    bufctl_t	*bp;
 
+    PM_LOCK(events_lock);
     for (i = 0; i < nbuf; i++) {
-	if (bufs[i].bstate == B_FREE)
+	if (bufs[i]->bstate == B_FREE)
 	    break;
     }
 
     if (i == nbuf) {
-	nbuf++;
-	tmp_bufs = (bufctl_t *)realloc(bufs, nbuf*sizeof(bufs[0]));
+	if ((bp = (bufctl_t *)malloc(sizeof(bufctl_t))) == NULL) {
+	    sts = -oserror();
+	    PM_UNLOCK(events_lock);
+	    return sts;
+	}
+	tmp_bufs = (bufctl_t **)realloc(bufs, (nbuf+1)*sizeof(bufs[0]));
 	if (tmp_bufs == NULL) {
-	    free(bufs);
-	    bufs = NULL;
-	    nbuf = 0;
-	    return -oserror();
+	    sts = -oserror();
+	    free(bp);
+	    PM_UNLOCK(events_lock);
+	    return sts;
 	}
 	bufs = tmp_bufs;
+	bufs[nbuf++] = bp;
     }
 
-    bufs[i].bptr = bufs[i].baddr = NULL;
-    bufs[i].blen = 0;
-    bufs[i].bstate = B_INUSE;
+    bp = bufs[i];
+    bp->bptr = bp->baddr = NULL;
+    bp->blen = 0;
+    bp->bstate = B_INUSE;
+    PM_UNLOCK(events_lock);
     return i;
 }
 
@@ -114,9 +148,8 @@ pmdaEventResetArray(int idx)
     pmEventArray	*eap;
     int			sts;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
     if ((sts = check_buf(bp, sizeof(pmEventArray) - sizeof(pmEventRecord))) < 0)
 	return sts;
 
@@ -133,9 +166,8 @@ pmdaEventResetHighResArray(int idx)
     pmHighResEventArray	*hreap;
     int			sts;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
     if ((sts = check_buf(bp, sizeof(*hreap) - sizeof(pmHighResEventRecord))) < 0)
 	return sts;
 
@@ -149,11 +181,16 @@ pmdaEventResetHighResArray(int idx)
 int
 pmdaEventReleaseArray(int idx)
 {
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    bufctl_t	*bp;
+
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
 
-    free(bufs[idx].baddr);
-    bufs[idx].bstate = B_FREE;
+    free(bp->baddr);
+    bp->baddr = NULL;
+    PM_LOCK(events_lock);
+    bp->bstate = B_FREE;
+    PM_UNLOCK(events_lock);
     return 0;
 }
 
@@ -171,9 +208,8 @@ pmdaEventAddRecord(int idx, struct timeval *tp, int flags)
     pmEventArray	*eap;
     pmEventRecord	*erp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
 
     /* use pmdaEventAddMissedRecord for missed records ... */
     if (flags & PM_EVENT_FLAG_MISSED)
@@ -201,9 +237,8 @@ pmdaEventAddHighResRecord(int idx, struct timespec *ts, int flags)
     pmHighResEventArray	*hreap;
     pmHighResEventRecord *hrerp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
 
     /* use pmdaEventAddMissedRecord for missed records ... */
     if (flags & PM_EVENT_FLAG_MISSED)
@@ -231,9 +266,8 @@ pmdaEventAddMissedRecord(int idx, struct timeval *tp, int missed)
     pmEventArray	*eap;
     pmEventRecord	*erp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
 
     if ((sts = check_buf(bp, sizeof(*erp) - sizeof(pmEventParameter))) < 0)
 	return sts;
@@ -257,9 +291,8 @@ pmdaEventAddHighResMissedRecord(int idx, struct timespec *ts, int missed)
     pmHighResEventArray	*hreap;
     pmHighResEventRecord *hrerp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
 
     if ((sts = check_buf(bp, sizeof(*hrerp) - sizeof(pmEventParameter))) < 0)
 	return sts;
@@ -285,9 +318,8 @@ add_param(int idx, pmID pmid, int type, pmAtomValue *avp, bufctl_t **bpp)
     pmEventParameter	*epp;
     bufctl_t		*bp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return PM_ERR_NOCONTEXT;
-    bp = &bufs[idx];
 
     need = sizeof(pmEventParameter);
     switch (type) {
@@ -375,13 +407,14 @@ pmEventArray *
 pmdaEventGetAddr(int idx)
 {
     pmEventArray	*eap;
+    bufctl_t		*bp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return NULL;
 
-    eap = (pmEventArray *)bufs[idx].baddr;
+    eap = (pmEventArray *)bp->baddr;
     eap->ea_type = PM_TYPE_EVENT;
-    eap->ea_len = bufs[idx].bptr - bufs[idx].baddr;
+    eap->ea_len = bp->bptr - bp->baddr;
     return eap;
 }
 
@@ -389,12 +422,13 @@ pmHighResEventArray *
 pmdaEventHighResGetAddr(int idx)
 {
     pmHighResEventArray	*hreap;
+    bufctl_t		*bp;
 
-    if (idx < 0 || idx >= nbuf || bufs[idx].bstate == B_FREE)
+    if ((bp = lookup_buf(idx)) == NULL)
 	return NULL;
 
-    hreap = (pmHighResEventArray *)bufs[idx].baddr;
+    hreap = (pmHighResEventArray *)bp->baddr;
     hreap->ea_type = PM_TYPE_HIGHRES_EVENT;
-    hreap->ea_len = bufs[idx].bptr - bufs[idx].baddr;
+    hreap->ea_len = bp->bptr - bp->baddr;
     return hreap;
 }
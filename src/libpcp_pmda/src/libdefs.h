@@ -36,6 +36,7 @@ typedef struct {
     __pmHashCtl		hashpmids;	/* hashed metrictab lookups */
     int			ndynamics;	/* number of dynamics entries, below */
     struct dynamic	*dynamics;	/* dynamic metric manipulation table */
+    pmdaIndom		cacheindom;	/* e_idp for cache-driven indoms */
 } e_ext_t;
 
 /*
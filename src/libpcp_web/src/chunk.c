@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chunk.h"
+
+/*
+ * Chunk layout - a six byte header (format version, value type and a
+ * big-endian sample count) followed by the bit stream.  The first
+ * sample is stored in full (64-bit timestamp and value), then each
+ * later timestamp is coded from its delta-of-delta:
+ *	'0'			same interval as before
+ *	'10'   + 12 bits	within 2 milliseconds (archive jitter)
+ *	'110'  + 20 bits	within half a second
+ *	'1110' + 32 bits	within 35 minutes
+ *	'1111' + 64 bits	anything else
+ * and each later value from its XOR with the previous value:
+ *	'0'			same value
+ *	'10'   + bits		differing bits fit within the previous
+ *				leading and trailing zero bounds
+ *	'11'   + 6 bits leading zeros, 6 bits (length - 1), then bits
+ */
+#define CHUNK_VERSION	1
+#define CHUNK_HEADER	6			/* bytes */
+#define NO_LEADING	(~0U)			/* no XOR bounds set yet */
+
+int
+chunk_type(int type)
+{
+    switch (type) {
+    case PM_TYPE_32:
+    case PM_TYPE_U32:
+    case PM_TYPE_64:
+    case PM_TYPE_U64:
+    case PM_TYPE_FLOAT:
+    case PM_TYPE_DOUBLE:
+	return 1;
+    default:
+	break;
+    }
+    return 0;
+}
+
+static __uint64_t
+atom_bits(int type, pmAtomValue *atom)
+{
+    __uint32_t		u32;
+    __uint64_t		u64;
+
+    switch (type) {
+    case PM_TYPE_32:
+    case PM_TYPE_U32:
+	return atom->ul;
+    case PM_TYPE_FLOAT:
+	memcpy(&u32, &atom->f, sizeof(u32));
+	return u32;
+    case PM_TYPE_DOUBLE:
+	memcpy(&u64, &atom->d, sizeof(u64));
+	return u64;
+    default:
+	break;
+    }
+    return atom->ull;
+}
+
+static void
+bits_atom(int type, __uint64_t bits, pmAtomValue *atom)
+{
+    __uint32_t		u32 = (__uint32_t)bits;
+
+    switch (type) {
+    case PM_TYPE_32:
+    case PM_TYPE_U32:
+	atom->ul = u32;
+	break;
+    case PM_TYPE_FLOAT:
+	memcpy(&atom->f, &u32, sizeof(u32));
+	break;
+    case PM_TYPE_DOUBLE:
+	memcpy(&atom->d, &bits, sizeof(bits));
+	break;
+    default:
+	atom->ull = bits;
+	break;
+    }
+}
+
+static unsigned int
+leading_zeros(__uint64_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_clzll(bits);
+#else
+    unsigned int	n = 0;
+
+    for (; !(bits & (1ULL << 63)); bits <<= 1)
+	n++;
+    return n;
+#endif
+}
+
+static unsigned int
+trailing_zeros(__uint64_t bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(bits);
+#else
+    unsigned int	n = 0;
+
+    for (; !(bits & 1); bits >>= 1)
+	n++;
+    return n;
+#endif
+}
+
+/* append the low nbits of bits to the stream, most significant first */
+static int
+chunk_write(chunk_t *cp, __uint64_t bits, unsigned int nbits)
+{
+    unsigned char	*buffer;
+    unsigned int	room, n;
+    size_t		need = (cp->length + nbits + 7) / 8;
+    size_t		size;
+
+    if (need > cp->size) {
+	for (size = cp->size ? cp->size * 2 : 64; size < need; size *= 2)
+	    ;
+	if ((buffer = realloc(cp->buffer, size)) == NULL)
+	    return -ENOMEM;
+	memset(buffer + cp->size, 0, size - cp->size);
+	cp->buffer = buffer;
+	cp->size = size;
+    }
+    while (nbits > 0) {
+	room = 8 - (cp->length & 7);
+	n = nbits < room ? nbits : room;
+	cp->buffer[cp->length >> 3] |=
+		((bits >> (nbits - n)) & ((1U << n) - 1)) << (room - n);
+	cp->length += n;
+	nbits -= n;
+    }
+    return 0;
+}
+
+static int
+chunk_stamp(chunk_t *cp, __int64_t stamp)
+{
+    __int64_t		delta = stamp - cp->stamp;
+    __int64_t		dod = delta - cp->delta;
+    int			sts;
+
+    if (dod == 0)
+	sts = chunk_write(cp, 0x0, 1);
+    else if (dod >= -(1LL << 11) && dod < (1LL << 11)) {
+	if ((sts = chunk_write(cp, 0x2, 2)) == 0)
+	    sts = chunk_write(cp, (__uint64_t)dod, 12);
+    } else if (dod >= -(1LL << 19) && dod < (1LL << 19)) {
+	if ((sts = chunk_write(cp, 0x6, 3)) == 0)
+	    sts = chunk_write(cp, (__uint64_t)dod, 20);
+    } else if (dod >= -(1LL << 31) && dod < (1LL << 31)) {
+	if ((sts = chunk_write(cp, 0xe, 4)) == 0)
+	    sts = chunk_write(cp, (__uint64_t)dod, 32);
+    } else {
+	if ((sts = chunk_write(cp, 0xf, 4)) == 0)
+	    sts = chunk_write(cp, (__uint64_t)dod, 64);
+    }
+    cp->delta = delta;
+    cp->stamp = stamp;
+    return sts;
+}
+
+static int
+chunk_value(chunk_t *cp, __uint64_t value)
+{
+    __uint64_t		xor = value ^ cp->value;
+    unsigned int	leading, trailing, length;
+    int			sts;
+
+    cp->value = value;
+    if (xor == 0)
+	return chunk_write(cp, 0x0, 1);
+
+    leading = leading_zeros(xor);
+    trailing = trailing_zeros(xor);
+    if (cp->leading != NO_LEADING &&
+	leading >= cp->leading && trailing >= cp->trailing) {
+	length = 64 - cp->leading - cp->trailing;
+	if ((sts = chunk_write(cp, 0x2, 2)) == 0)
+	    sts = chunk_write(cp, xor >> cp->trailing, length);
+	return sts;
+    }
+    length = 64 - leading - trailing;
+    if ((sts = chunk_write(cp, 0x3, 2)) < 0 ||
+	(sts = chunk_write(cp, leading, 6)) < 0 ||
+	(sts = chunk_write(cp, length - 1, 6)) < 0)
+	return sts;
+    cp->leading = leading;
+    cp->trailing = trailing;
+    return chunk_write(cp, xor >> trailing, length);
+}
+
+/*
+ * Add one sample, stamped in microseconds, to the end of a chunk;
+ * timestamps are expected in ascending order (any order decodes
+ * correctly, just less compactly).
+ */
+int
+chunk_append(chunk_t *cp, int type, __int64_t stamp, pmAtomValue *atom)
+{
+    __uint64_t		value = atom_bits(type, atom);
+    int			sts;
+
+    if (!chunk_type(type))
+	return -EINVAL;
+    if (cp->count == 0) {
+	cp->type = type;
+	cp->length = 0;
+	cp->delta = 0;
+	cp->leading = NO_LEADING;
+	cp->trailing = 0;
+	if ((sts = chunk_write(cp, CHUNK_VERSION, 8)) < 0 ||
+	    (sts = chunk_write(cp, type, 8)) < 0 ||
+	    (sts = chunk_write(cp, 0, 32)) < 0 ||	/* count, see below */
+	    (sts = chunk_write(cp, (__uint64_t)stamp, 64)) < 0 ||
+	    (sts = chunk_write(cp, value, 64)) < 0)
+	    return sts;
+	cp->stamp = stamp;
+	cp->value = value;
+    } else if (type != cp->type) {
+	return -EINVAL;
+    } else if ((sts = chunk_stamp(cp, stamp)) < 0 ||
+	       (sts = chunk_value(cp, value)) < 0) {
+	return sts;
+    }
+    cp->count++;
+    return 0;
+}
+
+/* encoded form of a chunk, valid until the next append or reset */
+const void *
+chunk_bytes(chunk_t *cp, size_t *length)
+{
+    if (cp->count == 0) {
+	*length = 0;
+	return NULL;
+    }
+    cp->buffer[2] = (cp->count >> 24) & 0xff;
+    cp->buffer[3] = (cp->count >> 16) & 0xff;
+    cp->buffer[4] = (cp->count >> 8) & 0xff;
+    cp->buffer[5] = cp->count & 0xff;
+    *length = (cp->length + 7) / 8;
+    return cp->buffer;
+}
+
+void
+chunk_reset(chunk_t *cp)
+{
+    if (cp->buffer)
+	memset(cp->buffer, 0, (cp->length + 7) / 8);
+    cp->length = 0;
+    cp->count = 0;
+}
+
+void
+chunk_free(chunk_t *cp)
+{
+    if (cp->buffer)
+	free(cp->buffer);
+    memset(cp, 0, sizeof(*cp));
+}
+
+static int
+chunk_read(chunkReader *rp, unsigned int nbits, __uint64_t *bits)
+{
+    __uint64_t		value = 0;
+    unsigned int	room, n;
+
+    if (rp->offset + nbits > rp->length)
+	return -EPROTO;
+    while (nbits > 0) {
+	room = 8 - (rp->offset & 7);
+	n = nbits < room ? nbits : room;
+	value = (value << n) |
+		((rp->buffer[rp->offset >> 3] >> (room - n)) & ((1U << n) - 1));
+	rp->offset += n;
+	nbits -= n;
+    }
+    *bits = value;
+    return 0;
+}
+
+/* read an nbits two's complement field */
+static int
+chunk_read_signed(chunkReader *rp, unsigned int nbits, __int64_t *value)
+{
+    __uint64_t		bits;
+    int			sts;
+
+    if ((sts = chunk_read(rp, nbits, &bits)) < 0)
+	return sts;
+    if (nbits < 64 && (bits & (1ULL << (nbits - 1))))
+	bits |= ~0ULL << nbits;
+    *value = (__int64_t)bits;
+    return 0;
+}
+
+/*
+ * Prepare to decode an encoded chunk, returning its sample count or
+ * a negative error code if the header is not understood.
+ */
+int
+chunk_reader(chunkReader *rp, const void *buffer, size_t length)
+{
+    const unsigned char	*header = (const unsigned char *)buffer;
+
+    memset(rp, 0, sizeof(*rp));
+    if (length < CHUNK_HEADER || header[0] != CHUNK_VERSION ||
+	!chunk_type(header[1]))
+	return -EPROTO;
+    rp->buffer = header;
+    rp->length = length * 8;
+    rp->offset = CHUNK_HEADER * 8;
+    rp->type = header[1];
+    rp->count = ((unsigned int)header[2] << 24) |
+		((unsigned int)header[3] << 16) |
+		((unsigned int)header[4] << 8) | header[5];
+    rp->leading = NO_LEADING;
+    return rp->count;
+}
+
+/*
+ * Decode the next sample - returns one if a sample was extracted,
+ * zero at the end of the chunk, or a negative error code.
+ */
+int
+chunk_next(chunkReader *rp, __int64_t *stamp, pmAtomValue *atom)
+{
+    __uint64_t		bits;
+    __int64_t		dod;
+    unsigned int	nbits, length;
+    int			sts;
+
+    if (rp->next == rp->count)
+	return 0;
+
+    if (rp->next == 0) {
+	if ((sts = chunk_read(rp, 64, &bits)) < 0)
+	    return sts;
+	rp->stamp = (__int64_t)bits;
+	if ((sts = chunk_read(rp, 64, &rp->value)) < 0)
+	    return sts;
+    } else {
+	/* timestamp: count leading one bits (at most four) for the width */
+	for (nbits = 0; nbits < 4; nbits++) {
+	    if ((sts = chunk_read(rp, 1, &bits)) < 0)
+		return sts;
+	    if (bits == 0)
+		break;
+	}
+	dod = 0;
+	if (nbits > 0) {
+	    static const unsigned int widths[] = { 0, 12, 20, 32, 64 };
+
+	    if ((sts = chunk_read_signed(rp, widths[nbits], &dod)) < 0)
+		return sts;
+	}
+	rp->delta += dod;
+	rp->stamp += rp->delta;
+
+	/* value: XOR with the previous value, if it differs */
+	if ((sts = chunk_read(rp, 1, &bits)) < 0)
+	    return sts;
+	if (bits) {
+	    if ((sts = chunk_read(rp, 1, &bits)) < 0)
+		return sts;
+	    if (bits) {
+		if ((sts = chunk_read(rp, 6, &bits)) < 0)
+		    return sts;
+		rp->leading = (unsigned int)bits;
+		if ((sts = chunk_read(rp, 6, &bits)) < 0)
+		    return sts;
+		length = (unsigned int)bits + 1;
+		if (rp->leading + length > 64)
+		    return -EPROTO;
+		rp->trailing = 64 - rp->leading - length;
+	    } else if (rp->leading == NO_LEADING) {
+		return -EPROTO;
+	    } else {
+		length = 64 - rp->leading - rp->trailing;
+	    }
+	    if ((sts = chunk_read(rp, length, &bits)) < 0)
+		return sts;
+	    rp->value ^= bits << rp->trailing;
+	}
+    }
+    rp->next++;
+    *stamp = rp->stamp;
+    bits_atom(rp->type, rp->value, atom);
+    return 1;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+#ifndef SERIES_CHUNK_H
+#define SERIES_CHUNK_H
+
+#include "pmapi.h"
+
+/*
+ * Samples of one series over a fixed time window, packed into a bit
+ * stream - timestamps (microseconds) as delta-of-deltas and values as
+ * the XOR of each with the previous one, as in the Facebook "Gorilla"
+ * time series store.  Values are encoded as their 64-bit patterns so
+ * every numeric PCP type survives the round trip exactly.
+ */
+typedef struct chunk {
+    int			type;		/* PM_TYPE_* of the values */
+    unsigned int	count;		/* samples in the chunk */
+    long long		window;		/* chunk start (window index) */
+    __int64_t		stamp;		/* previous timestamp */
+    __int64_t		delta;		/* previous timestamp delta */
+    __uint64_t		value;		/* previous value bit pattern */
+    unsigned int	leading;	/* previous XOR leading zero bits */
+    unsigned int	trailing;	/* previous XOR trailing zero bits */
+    unsigned char	*buffer;	/* encoded header and samples */
+    size_t		length;		/* bits used in buffer */
+    size_t		size;		/* bytes allocated for buffer */
+} chunk_t;
+
+typedef struct chunkReader {
+    const unsigned char	*buffer;
+    size_t		length;		/* bits in buffer */
+    size_t		offset;		/* next bit to be read */
+    int			type;
+    unsigned int	count;
+    unsigned int	next;		/* samples decoded so far */
+    __int64_t		stamp;
+    __int64_t		delta;
+    __uint64_t		value;
+    unsigned int	leading;
+    unsigned int	trailing;
+} chunkReader;
+
+extern int chunk_type(int);
+extern int chunk_append(chunk_t *, int, __int64_t, pmAtomValue *);
+extern const void *chunk_bytes(chunk_t *, size_t *);
+extern void chunk_reset(chunk_t *);
+extern void chunk_free(chunk_t *);
+
+extern int chunk_reader(chunkReader *, const void *, size_t);
+extern int chunk_next(chunkReader *, __int64_t *, pmAtomValue *);
+
+#endif	/* SERIES_CHUNK_H */
@@ -17,24 +17,35 @@
 #include <limits.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "series.h"
 #include "query.h"
 #include "redis.h"
 #include "load.h"
 #include "util.h"
+#include "chunk.h"
 #include "sha1.h"
 
 #include "libpcp.h"
 
 typedef struct {
-    redisContext	*redis;
+    int			type;		/* PM_CONTEXT_ARCHIVE, etc */
+    const char		*name;		/* archive, or host specification */
+} source_t;
+
+typedef struct {
+    redisSlots		*redis;
+    redisBatch		*batch;		/* pipelined updates to redis */
+    unsigned long long	nvalues;	/* values sent, for throughput */
 
     settings_t		*settings;
     void		*arg;
 
     int			verbose;
     context_t		context;
+    source_t		*sources;	/* all named in the load request */
+    int			nsources;
 
     __pmHashCtl		clusterhash;
     __pmHashCtl		domainhash;
@@ -45,21 +56,69 @@ typedef struct {
     __pmHashCtl		wanthash;	/* PMIDs from query whitelist */
 } SOURCE;
 
+/*
+ * Several sources may be loaded at once, one per thread (see
+ * series_source below).  Each thread has its own SOURCE - libpcp
+ * context, Redis connection and metadata caches - and they share
+ * only the request, the string map cache and the callbacks.
+ */
+typedef struct {
+    settings_t		*settings;
+    void		*arg;
+    timing_t		*timing;
+    flags_t		flags;
+    const char		**metrics;
+    int			nmetrics;
+    source_t		*sources;
+    int			nsources;
+    redisMap		*strmap;	/* string map identifiers, shared */
+    pthread_mutex_t	lock;		/* guards next and sts */
+    int			next;		/* next source to be loaded */
+    int			sts;		/* first failure, if any */
+} LOADER;
+
 #define ERRSIZE		PM_MAXERRMSGLEN
 #define MSGSIZE		(ERRSIZE + 128)
-#define loadmsg(SP, level, message)		\
-	((SP)->settings->on_info((level), (message), (SP)->arg))
+
+static pthread_mutex_t	loadmsg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+loadmsg(SOURCE *sp, pmseries_level level, const char *message)
+{
+    pthread_mutex_lock(&loadmsg_lock);
+    sp->settings->on_info(level, message, sp->arg);
+    pthread_mutex_unlock(&loadmsg_lock);
+}
 
 static void
 series_cache_addvalue(SOURCE *sp, metric_t *metric, value_t *value)
 {
-    redis_series_addvalue(sp->redis, metric, value);
+    redis_series_addvalue(sp->batch, metric, value);
+    sp->nvalues++;
+}
+
+/* store any partly filled chunks, at the end of a source */
+static void
+series_cache_flush(SOURCE *sp)
+{
+    __pmHashNode	*hp;
+    metric_t		*metric;
+    int			i, j;
+
+    for (i = 0; i < sp->pmidhash.hsize; i++) {
+	for (hp = sp->pmidhash.hash[i]; hp != NULL; hp = hp->next) {
+	    if ((metric = (metric_t *)hp->data) == NULL)
+		continue;
+	    for (j = 0; j < metric->listsize; j++)
+		redis_series_flush(sp->batch, metric->vlist[j]);
+	}
+    }
 }
 
 static void
 series_cache_metadata(SOURCE *sp, metric_t *metric, value_t *value)
 {
-    redis_series_metadata(sp->redis, metric, value);
+    redis_series_metadata(sp->batch, metric, value);
 }
 
 static void
@@ -68,6 +127,7 @@ pmiderr(SOURCE *sp, pmID pmid, const char *msg, ...)
     va_list	arg;
     int		numnames;
     char	**names;
+    char	pmidmsg[20];
 
     if (sp->verbose == 0)
 	return;
@@ -76,7 +136,7 @@ pmiderr(SOURCE *sp, pmID pmid, const char *msg, ...)
 	numnames = pmNameAll(pmid, &names);
 	fprintf(stderr, "%s: ", pmGetProgname());
 	__pmPrintMetricNames(stderr, numnames, names, " or ");
-	fprintf(stderr, "(%s) - ", pmIDStr(pmid));
+	fprintf(stderr, "(%s) - ", pmIDStr_r(pmid, pmidmsg, sizeof(pmidmsg)));
 	va_start(arg, msg);
 	vfprintf(stderr, msg, arg);
 	va_end(arg);
@@ -92,6 +152,7 @@ cache_prepare(const char *name, void *arg)
     char		*hname;
     char		msg[MSGSIZE];
     char		pmmsg[ERRSIZE];
+    char		pmidmsg[20];
     pmID		pmid;
     int			sts;
 
@@ -107,7 +168,7 @@ cache_prepare(const char *name, void *arg)
     } else {
 	if (sp->verbose || pmDebugOptions.series)
 	    fprintf(stderr, "cache_prepare: caching PMID=%s name=%s\n",
-			pmIDStr(pmid), hname);
+			pmIDStr_r(pmid, pmidmsg, sizeof(pmidmsg)), hname);
 	__pmHashAdd(pmid, hname, &sp->wanthash);
     }
 }
@@ -118,6 +179,8 @@ cache_value_metadata(SOURCE *sp, metric_t *metric, value_t *value)
     pmDesc		*desc = &metric->desc;
     pmID		pmid = desc->pmid;
     char		identifier[BUFSIZ+PM_MAXLABELJSONLEN];
+    char		labels[PM_MAXLABELJSONLEN];
+    char		name[2048];
     unsigned char	hash[20];
     SHA1_CTX		shactx;
     int			nbytes, off;
@@ -130,7 +193,7 @@ cache_value_metadata(SOURCE *sp, metric_t *metric, value_t *value)
 		"\"label\":%s}",
 		pmID_domain(pmid), pmID_cluster(pmid), pmID_item(pmid),
 		desc->sem, desc->type, *(unsigned int *)&desc->units,
-		value_labels(metric, value))
+		value_labels(metric, value, labels, sizeof(labels)))
 	:
 	pmsprintf(identifier, sizeof(identifier), "{"
 		"\"desc\":{\"domain\":%u,\"cluster\":%u,\"item\":%u,"
@@ -140,7 +203,8 @@ cache_value_metadata(SOURCE *sp, metric_t *metric, value_t *value)
 		pmID_domain(pmid), pmID_cluster(pmid), pmID_item(pmid),
 		desc->sem, pmInDom_serial(desc->indom), desc->type,
 		*(unsigned int *)&desc->units, value_instid(value),
-		value_instname(value), value_labels(metric, value));
+		value_instname(value, name, sizeof(name)),
+		value_labels(metric, value, labels, sizeof(labels)));
 
     SHA1Init(&shactx);
     SHA1Update(&shactx, (unsigned char *)identifier, nbytes);
@@ -315,7 +379,9 @@ new_values_names(SOURCE *sp, metric_t *metric)
 	if ((sts = pmGetInstancesLabels(indom, &labelset)) < 0) {
 	    if (sp->verbose)
 		fprintf(stderr, "%s: failed to get PMID %s labels: %s\n",
-			pmGetProgname(), pmInDomStr(indom), pmErrStr(sts));
+			pmGetProgname(),
+			pmInDomStr_r(indom, indommsg, sizeof(indommsg)),
+			pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	    /* continue on with no labels for this value */
 	    sts = 0;
 	}
@@ -403,7 +469,8 @@ new_domain(SOURCE *sp, int domain, context_t *context)
     if ((sts = pmGetDomainLabels(domain, &domainp->labels)) < 0) {
 	if (sp->verbose)
 	    fprintf(stderr, "%s: failed to get domain (%d) labels: %s\n",
-		    pmGetProgname(), domain, pmErrStr(sts));
+		    pmGetProgname(), domain,
+		    pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	/* continue on with no labels for this domain */
     }
     if (__pmHashAdd(domain, (void *)domainp, &sp->domainhash) < 0) {
@@ -455,6 +522,7 @@ new_indom(SOURCE *sp, pmInDom indom, domain_t *domain)
     indom_t		*indomp;
     char		msg[MSGSIZE];
     char		pmmsg[ERRSIZE];
+    char		indommsg[20];
     int			sts;
 
     if ((indomp = calloc(1, sizeof(indom_t))) == NULL) {
@@ -468,12 +536,15 @@ new_indom(SOURCE *sp, pmInDom indom, domain_t *domain)
     if ((sts = pmGetInDomLabels(indom, &indomp->labels)) < 0) {
 	if (sp->verbose)
 	    fprintf(stderr, "%s: failed to get indom (%s) labels: %s\n",
-		    pmGetProgname(), pmInDomStr(indom), pmErrStr(sts));
+		    pmGetProgname(),
+		    pmInDomStr_r(indom, indommsg, sizeof(indommsg)),
+		    pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	/* continue on with no labels for this indom */
     }
     if (__pmHashAdd(indom, (void *)indomp, &sp->indomhash) < 0) {
 	pmsprintf(msg, sizeof(msg), "failed to store indom (%s) labels: %s",
-		pmInDomStr(indom), pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
+		pmInDomStr_r(indom, indommsg, sizeof(indommsg)),
+		pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	loadmsg(sp, PMSERIES_WARNING, msg);
     }
     return indomp;
@@ -494,6 +565,7 @@ new_metric(SOURCE	*sp,
     pmID		pmid = desc->pmid;
     char		msg[MSGSIZE];
     char		pmmsg[ERRSIZE];
+    char		pmidmsg[20];
     char		**names;
     int			*mapids;
     int			cluster, domain, sts, i;
@@ -512,7 +584,8 @@ new_metric(SOURCE	*sp,
 
     if ((sts = pmNameAll(pmid, &names)) < 0) {
 	pmsprintf(msg, sizeof(msg), "failed to lookup metric %s names: %s",
-		pmIDStr(pmid), pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
+		pmIDStr_r(pmid, pmidmsg, sizeof(pmidmsg)),
+		pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	loadmsg(sp, PMSERIES_WARNING, msg);
     } else if ((mapids = calloc(sts, sizeof(int))) == NULL) {
 	pmsprintf(msg, sizeof(msg), "out of memory (%s, %lld bytes)",
@@ -529,7 +602,8 @@ new_metric(SOURCE	*sp,
     metric->numnames = sts;
 
     if (pmDebugOptions.appl0) {
-	fprintf(stderr, "Metric [%s] ", pmIDStr(pmid));
+	fprintf(stderr, "Metric [%s] ",
+		pmIDStr_r(pmid, pmidmsg, sizeof(pmidmsg)));
 	__pmPrintMetricNames(stderr, sts, names, " or ");
     }
 
@@ -557,7 +631,8 @@ new_metric(SOURCE	*sp,
     if ((sts = pmGetItemLabels(pmid, &metric->labels)) < 0) {
 	if (sp->verbose)
 	    fprintf(stderr, "%s: failed to get metric %s labels: %s\n",
-		    pmGetProgname(), pmIDStr(pmid), pmErrStr(sts));
+		    pmGetProgname(), pmIDStr_r(pmid, pmidmsg, sizeof(pmidmsg)),
+		    pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	/* continue on with no labels for this PMID */
     }
 
@@ -630,10 +705,17 @@ free_metric(metric_t *metric)
     for (i = 0; i < metric->listsize; i++) {
 	value = metric->vlist[i];
 	if (value->name) free(value->name);
+	if (value->labels) pmFreeLabelSets(value->labels, 1);
+	if (value->chunk) {
+	    chunk_free(value->chunk);
+	    free(value->chunk);
+	}
 	if (value) free(value);
     }
     if (metric->vlist) free(metric->vlist);
     if (metric->names) free(metric->names);
+    if (metric->mapids) free(metric->mapids);
+    if (metric->labels) pmFreeLabelSets(metric->labels, 1);
     free(metric);
 }
 
@@ -643,6 +725,7 @@ series_cache_update(SOURCE *sp, pmResult *result, pmseries_flags flags)
     int			i, j, k;
     int			sts;
     int			wrap;
+    char		pmmsg[ERRSIZE];
     int			refresh;
     double		val;
     pmDesc		desc;
@@ -667,7 +750,7 @@ series_cache_update(SOURCE *sp, pmResult *result, pmseries_flags flags)
 	    continue;
 	if (vsp->numval < 0) {
 	    pmiderr(sp, vsp->pmid, "failed in archive value fetch: %s\n",
-		    pmErrStr(vsp->numval));
+		    pmErrStr_r(vsp->numval, pmmsg, sizeof(pmmsg)));
 	    continue;
 	}
 
@@ -680,7 +763,7 @@ series_cache_update(SOURCE *sp, pmResult *result, pmseries_flags flags)
 	if ((hptr = __pmHashSearch(vsp->pmid, &sp->pmidhash)) == NULL) {
 	    if ((sts = pmLookupDesc(vsp->pmid, &desc)) < 0) {
 		pmiderr(sp, vsp->pmid, "cannot find descriptor: %s\n",
-			pmErrStr(sts));
+			pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 		continue;
 	    }
 
@@ -842,9 +925,11 @@ static int
 series_cache_load(SOURCE *sp, timing_t *tp, pmseries_flags flags)
 {
     struct timeval	*finish = &tp->end;
+    struct timeval	started, now;
     pmResult		*result;
     char		msg[MSGSIZE];
     char		pmmsg[ERRSIZE];
+    double		elapsed;
     int			sts, count = 0;
 
     if ((sts = pmSetMode(PM_MODE_FORW, &tp->start, 0)) < 0) {
@@ -861,6 +946,7 @@ series_cache_load(SOURCE *sp, timing_t *tp, pmseries_flags flags)
     /* TODO: support fetch interpolation (if tp->delta) */
     /* TODO: support a tail-f-mode of operation as well */
 
+    pmtimevalNow(&started);
     for ( ; ; ) {
 	if ((sts = pmFetchArchive(&result)) < 0)
 	    break;
@@ -879,9 +965,18 @@ series_cache_load(SOURCE *sp, timing_t *tp, pmseries_flags flags)
 	}
     }
 
+    /* wait for the last replies, so the rate covers the server work */
+    series_cache_flush(sp);
+    redis_batch_flush(sp->batch);
+    pmtimevalNow(&now);
+    elapsed = pmtimevalSub(&now, &started);
+
     pmsprintf(msg, sizeof(msg), "processed %d archive records from %s",
 		count, sp->context.source);
     loadmsg(sp, PMSERIES_INFO, msg);
+    pmsprintf(msg, sizeof(msg), "loaded %llu values in %.2f sec (%.0f values/sec)",
+		sp->nvalues, elapsed, elapsed > 0 ? sp->nvalues / elapsed : 0);
+    loadmsg(sp, PMSERIES_INFO, msg);
 
     if (sts == PM_ERR_EOL)
 	sts = 0;
@@ -912,21 +1007,45 @@ default_labelset(int ctx, pmLabelSet **sets)
     return sts;
 }
 
+static int
+source_type(const char *name)
+{
+    if (strcmp(name, "source.local") == 0)
+	return PM_CONTEXT_LOCAL;
+    if (strcmp(name, "source.archive") == 0)
+	return PM_CONTEXT_ARCHIVE;
+    if (strcmp(name, "source.hostspec") == 0)
+	return PM_CONTEXT_HOST;
+    return 0;
+}
+
 static void
-set_context_source(SOURCE *sp, const char *source)
+set_context_source(SOURCE *sp, const char *name, const char *source)
 {
+    size_t	length = (sp->nsources + 1) * sizeof(source_t);
+    source_t	*sources;
+    int		type;
+
     sp->context.source = source;
+
+    /* every source named is loaded, e.g. source.archive:"a", ... */
+    if ((type = source_type(name)) == 0)
+	return;
+    if ((sources = (source_t *)realloc(sp->sources, length)) == NULL)
+	return;
+    sources[sp->nsources].type = type;
+    sources[sp->nsources].name = source;
+    sp->sources = sources;
+    sp->nsources++;
 }
 
 static void
 set_context_type(SOURCE *sp, const char *name)
 {
-    if (strcmp(name, "source.local") == 0)
-	sp->context.type = PM_CONTEXT_LOCAL;
-    else if (strcmp(name, "source.archive") == 0)
-	sp->context.type = PM_CONTEXT_ARCHIVE;
-    else if (strcmp(name, "source.hostspec") == 0)
-	sp->context.type = PM_CONTEXT_HOST;
+    int		type;
+
+    if ((type = source_type(name)) != 0)
+	sp->context.type = type;
 }
 
 static int
@@ -967,6 +1086,10 @@ static int
 load_prepare_timing(SOURCE *sp, timing_t *tp)
 {
     /* TODO - handle timezones and so on correctly */
+
+    /* no finish time given - load through to the end of the source */
+    if (tp->end.tv_sec == 0 && tp->end.tv_usec == 0)
+	tp->end.tv_sec = INT_MAX;
     return 0;
 }
 
@@ -1004,8 +1127,12 @@ load_prepare_source(SOURCE *sp, node_t *np, int level)
 	    break;
 	if (np->left->type == N_NAME || np->left->type == N_STRING) {
 	    subtype = np->left->subtype;
-	    if (subtype == N_LABEL)
-		 set_context_source(sp, np->right->value);
+	    if (subtype == N_LABEL) {
+		length = strlen(np->left->value);
+		if ((name = series_label_name(np->left->value, length)) == NULL)
+		    name = np->left->value;
+		set_context_source(sp, name, np->right->value);
+	    }
 	}
 	if (np->left->type == N_METRIC)
 	    add_source_metric(sp, np->right->value);
@@ -1041,7 +1168,7 @@ load_resolve_source(SOURCE *sp)
 	if ((sts = pmGetContextLabels(&cp->labels)) <= 0 &&
 	    (default_labelset(cp->context, &cp->labels) < 0)) {
 	    pmsprintf(msg, sizeof(msg), "failed to get context labels: %s",
-		    pmErrStr(sts));
+		    pmErrStr_r(sts, pmmsg, sizeof(pmmsg)));
 	    loadmsg(sp, PMSERIES_ERROR, msg);
 	    sts = -ESRCH;
 	}
@@ -1058,32 +1185,205 @@ load_destroy_source(SOURCE *sp)
     cp->context = -1;
 }
 
+static void
+free_hash(__pmHashCtl *hcp, void (*freedata)(void *))
+{
+    __pmHashNode	*hp, *next;
+    int			i;
+
+    for (i = 0; i < hcp->hsize; i++) {
+	for (hp = hcp->hash[i]; hp != NULL; hp = next) {
+	    next = hp->next;
+	    if (freedata && hp->data)
+		freedata(hp->data);
+	    free(hp);
+	}
+    }
+    __pmHashClear(hcp);
+}
+
+static void
+free_domain(void *data)
+{
+    domain_t	*dp = (domain_t *)data;
+
+    if (dp->labels)
+	pmFreeLabelSets(dp->labels, 1);
+    free(dp);
+}
+
+static void
+free_cluster(void *data)
+{
+    cluster_t	*cp = (cluster_t *)data;
+
+    if (cp->labels)
+	pmFreeLabelSets(cp->labels, 1);
+    free(cp);
+}
+
+static void
+free_indom(void *data)
+{
+    indom_t	*ip = (indom_t *)data;
+
+    if (ip->labels)
+	pmFreeLabelSets(ip->labels, 1);
+    free(ip);
+}
+
+static void
+free_metric_data(void *data)
+{
+    free_metric((metric_t *)data);
+}
+
+/* release the per-source caches, once a source has been loaded */
+static void
+load_free_source(SOURCE *sp)
+{
+    free_hash(&sp->pmidhash, free_metric_data);
+    free_hash(&sp->indomhash, free_indom);
+    free_hash(&sp->clusterhash, free_cluster);
+    free_hash(&sp->domainhash, free_domain);
+    free_hash(&sp->wanthash, free);
+    free_hash(&sp->errorhash, NULL);
+    if (sp->context.labels) {
+	pmFreeLabelSets(sp->context.labels, 1);
+	sp->context.labels = NULL;
+    }
+}
+
+/*
+ * Load one source, start to finish, with its own libpcp context and
+ * Redis connection - so this may run in several threads at once.
+ */
+static int
+load_one_source(LOADER *lp, source_t *src)
+{
+    SOURCE	source = { .settings = lp->settings, .arg = lp->arg };
+    int		sts;
+
+    source.context.type = src->type;
+    source.context.source = src->name;
+    source.context.metrics = lp->metrics;
+    source.context.nmetrics = lp->nmetrics;
+
+    source.redis = redis_init();
+    source.batch = redis_batch_init(source.redis, lp->strmap);
+
+    if ((sts = load_resolve_source(&source)) >= 0) {
+	/* metric and time-based filtering */
+	if ((sts = load_prepare_metrics(&source)) >= 0 &&
+	    (sts = load_prepare_timing(&source, lp->timing)) >= 0) {
+	    series_cache_load(&source, lp->timing, lp->flags);
+	    sts = 0;
+	}
+	load_destroy_source(&source);
+    }
+
+    redis_batch_free(source.batch);
+    redis_stop(source.redis);
+    load_free_source(&source);
+    return sts;
+}
+
+static void *
+load_worker(void *arg)
+{
+    LOADER	*lp = (LOADER *)arg;
+    int		i, sts;
+
+    for (;;) {
+	pthread_mutex_lock(&lp->lock);
+	i = lp->next++;
+	pthread_mutex_unlock(&lp->lock);
+	if (i >= lp->nsources)
+	    break;
+	if ((sts = load_one_source(lp, &lp->sources[i])) < 0) {
+	    pthread_mutex_lock(&lp->lock);
+	    if (lp->sts == 0)
+		lp->sts = sts;
+	    pthread_mutex_unlock(&lp->lock);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Threads to use for a load - $PCP_SERIES_LOAD_THREADS, else one
+ * per CPU - but no more than there are sources to load.
+ */
+static int
+load_threads(int nsources)
+{
+    char	*value, *endnum;
+    long	nthreads = 0;
+
+    if ((value = getenv("PCP_SERIES_LOAD_THREADS")) != NULL) {
+	nthreads = strtol(value, &endnum, 10);
+	if (*endnum != '\0')
+	    nthreads = 0;
+    }
+    if (nthreads <= 0)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+	nthreads = 1;
+    return nthreads < nsources ? (int)nthreads : nsources;
+}
+
 int
 series_source(pmSeriesSettings *settings,
 	node_t *root, timing_t *timing, pmseries_flags flags, void *arg)
 {
     SOURCE	source = { .settings = settings, .arg = arg };
+    LOADER	loader = { .settings = settings, .arg = arg,
+			   .timing = timing, .flags = flags };
+    pthread_t	*threads;
     char	msg[MSGSIZE];
-    int		sts;
-
-    source.redis = redis_init();
+    int		i, nthreads;
 
     load_prepare_source(&source, root, 0);
-    if (!source.context.type) {
+    if (!source.context.type || source.nsources == 0) {
 	pmsprintf(msg, sizeof(msg), "found no context to load");
 	loadmsg(&source, PMSERIES_ERROR, msg);
+	if (source.sources) free(source.sources);
+	if (source.context.metrics) free(source.context.metrics);
 	return -ESRCH;
     }
-    if ((sts = load_resolve_source(&source)) < 0)
-	return sts;
 
-    /* metric and time-based filtering */
-    if ((sts = load_prepare_metrics(&source)) < 0 ||
-	(sts = load_prepare_timing(&source, timing)) < 0) {
-	load_destroy_source(&source);
-	return sts;
+    loader.metrics = source.context.metrics;
+    loader.nmetrics = source.context.nmetrics;
+    loader.sources = source.sources;
+    loader.nsources = source.nsources;
+    loader.strmap = redis_map_init();
+    pthread_mutex_init(&loader.lock, NULL);
+
+    /*
+     * Sources are independent of each other (series identifiers are
+     * hashes of the metadata alone) so a request naming several of
+     * them is spread across a pool of threads, each loading the next
+     * source not yet taken until none remain.
+     */
+    nthreads = load_threads(loader.nsources);
+    threads = NULL;
+    if (nthreads > 1 &&
+	(threads = (pthread_t *)calloc(nthreads, sizeof(pthread_t))) != NULL) {
+	for (i = 0; i < nthreads; i++) {
+	    if (pthread_create(&threads[i], NULL, load_worker, &loader) != 0)
+		break;
+	}
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+	    pthread_join(threads[i], NULL);
+	free(threads);
     }
-
-    series_cache_load(&source, timing, flags);
-    return 0;
+    /* serial loading, or whatever remains if threads were unavailable */
+    load_worker(&loader);
+
+    pthread_mutex_destroy(&loader.lock);
+    redis_map_free(loader.strmap);
+    free(source.sources);
+    if (source.context.metrics) free(source.context.metrics);
+    return loader.sts;
 }
@@ -64,6 +64,13 @@ pmSeriesLoad(pmSeriesSettings *s, const char *q, pmseries_flags f, void *a)
     noseries(s, a);
 }
 
+void
+pmSeriesVacuum(pmSeriesSettings *s, const char *q, pmseries_flags f, void *a)
+{
+    (void)q; (void)f;
+    noseries(s, a);
+}
+
 const char *
 pmSeriesLevelStr(pmseries_level level)
 {
@@ -13,21 +13,37 @@
  */
 
 #include <ctype.h>
+#include <math.h>
 #include "util.h"
 #include "redis.h"
 #include "query.h"
+#include "chunk.h"
 #include "series.h"
 #include "libpcp.h"
 
 typedef struct {
-    redisContext	*redis;
+    redisSlots		*slots;
 
     settings_t		*settings;
     void		*arg;
 
-    unsigned int	index;
-    unsigned int	count;
-    redisReply		**replies;
+    int			status;		/* first error encountered */
+    unsigned int	window;		/* chunked values window, seconds */
+
+    node_t		*function;	/* reduction applied to values */
+    timing_t		*timing;
+    char		start[64];	/* time window, as ZSET scores */
+    char		end[64];
+    char		chunks[64];	/* earliest chunk in the window */
+    double		from;		/* ... and the window in seconds */
+    double		until;
+
+    char		*series;	/* vacuum - identifiers to be trimmed */
+    int			nseries;
+    int			next;		/* next series to be started */
+    int			inflight;	/* trimming requests outstanding */
+    unsigned long long	removed;	/* values trimmed so far */
+    unsigned long long	nchunks;	/* value chunks trimmed so far */
 } SOLVER;
 
 typedef __pmHashCtl	reverseMap;
@@ -153,7 +169,6 @@ series_values_reply(SOLVER *sp, pmSeriesID *seriesid,
 /*--		printf("      \"%.*s\": \"%s\"",
 				15, score->str, value->str);--*TODO*/
 		solvervalue(sp, seriesid, score->str, value->str);
-		sp->settings->on_value(seriesid, score->str, value->str, sp->arg);
 	    } else {
 		pmsprintf(msg, sizeof(msg),
 			"expected string stamp for series %.*s (type=%s)",
@@ -367,205 +382,199 @@ node_series_union(node_t *np, node_t *left, node_t *right)
 }
 
 /*
- * Map human names to internal redis identifiers.
+ * Leaf nodes are resolved independently of one another, each by a
+ * chain of non-blocking requests - label name map (when needed), then
+ * value map, then series set - with each step issued from the reply
+ * callback of the one before it.  All chains are in flight together
+ * and may be served by different Redis nodes.
  */
-static int
-series_prepare_maps(SOLVER *sp, node_t *np, int level)
-{
-    int		length, sts;
-    char	*name, *cmd;
-    char	msg[MSGSIZE];
+typedef struct seriesSample seriesSample;
 
-    if (np == NULL)
-	return 0;
-
-    if ((sts = series_prepare_maps(sp, np->left, level+1)) < 0)
-	return sts;
+typedef struct seriesBaton {
+    SOLVER		*sp;
+    node_t		*np;
+    pmSeriesID		seriesid;
+    int			eval;		/* script sent in full */
+    int			type;		/* type of chunked values */
+    seriesSample	*samples;	/* values gathered from chunks */
+    unsigned int	nsamples;
+    unsigned int	nchunks;	/* chunks requested so far */
+} seriesBaton;
 
-    switch (np->type) {
-    case N_STRING:
-	// may need string quoting with regex escapes? (for MATCH)
-	// - or should we rewrite this earlier perhaps?  (see also KEYS docs)
-	break;
+static void
+series_fail(SOLVER *sp, pmseries_level level, const char *msg, int sts)
+{
+    solvermsg(sp, level, msg);
+    if (sp->status == 0)
+	sp->status = sts;
+}
 
-    case N_NAME:
-	// setup any label name map identifiers needed by direct children
-	length = strlen(np->value);
-	if ((name = series_instance_name(np->value, length)) != NULL) {
-	    np->subtype = N_INSTANCE;
-	    np->key = strdup("pcp:map:inst.name");
-	} else if ((name = series_metric_name(np->value, length)) != NULL) {
-	    np->subtype = N_METRIC;
-	    np->key = strdup("pcp:map:metric.name");
-	} else {
-	    np->subtype = N_LABEL;
-	    if ((name = series_label_name(np->value, length)) == NULL)
-		name = np->value;
-	    length = redisFormatCommand(&cmd, "HGET pcp:map:label.name %s", name);
-	    if (redisAppendFormattedCommand(sp->redis, cmd, length) != REDIS_OK) {
-		pmsprintf(msg, sizeof(msg),
-			"failed to setup label name lookup command");
-		solvermsg(sp, PMSERIES_REQUEST, msg);
-		sts = -EAGAIN;
-	    }
-	    sp->count++;
-	    free(cmd);
-	}
-	break;
+static void
+series_expr_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    node_t		*np = baton->np;
+    char		msg[MSGSIZE];
+    int			sts;
 
-    case N_LT:  case N_LEQ: case N_EQ:  case N_GEQ: case N_GT:  case N_NEQ:
-    case N_AND: case N_OR:  case N_RNE: case N_REQ: case N_NEG:
-    default:
-	break;
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg),
+		    "map table %s key %s not found (%s)",
+		    np->left->key, np->right->value, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_CORRUPT, msg, -EPROTO);
+    } else if (reply->type != REDIS_REPLY_ARRAY) {
+	pmsprintf(msg, sizeof(msg),
+		    "expected array for %s set \"%s\" (type=%s)",
+		    node_subtype(np->left), np->right->value,
+		    redis_reply(reply->type));
+	series_fail(sp, PMSERIES_CORRUPT, msg, -EPROTO);
+    } else {
+	if (pmDebugOptions.series)
+	    printf("%s %s\n", node_subtype(np->left), np->key);
+	if ((sts = node_series_reply(sp, np, reply->elements, reply->element)) < 0)
+	    sp->status = sp->status ? sp->status : sts;
     }
-    if (sts < 0)
-	return sts;
-
-    return series_prepare_maps(sp, np->right, level+1);
+    free(baton);
 }
 
-/*
- * Find the sets of series corresponding to leaf search parameters.
- */
-static int
-series_resolve_maps(SOLVER *sp, node_t *np, int level)
+static void
+series_eval_reply(redisSlots *slots, redisReply *reply, void *arg)
 {
-    redisReply	*reply;
-    char	msg[MSGSIZE];
-    char	id[128];
-    int		sts = 0;
-
-    if (np == NULL)
-	return 0;
-
-    series_resolve_maps(sp, np->left, level+1);
-
-    switch (np->type) {
-    case N_NAME:
-	/* TODO: need to handle JSONB label name nesting. */
-
-	/* setup any label name map identifiers needed */
-	if (np->subtype == N_LABEL) {
-	    if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
-		pmsprintf(msg, sizeof(msg),
-			"no %s named \"%s\" found (error=%d)",
-			node_subtype(np), np->value, sp->redis->err);
-		solvermsg(sp, PMSERIES_RESPONSE, msg);
-		sts = -EPROTO;
-	    } else if (reply->type != REDIS_REPLY_STRING) {
-		pmsprintf(msg, sizeof(msg),
-			"expected string for %s map \"%s\" (type=%s)",
-			node_subtype(np), np->value, redis_reply(reply->type));
-		solvermsg(sp, PMSERIES_RESPONSE, msg);
-		sts = -EPROTO;
-	    } else {
-		sp->replies[sp->index++] = reply;
-		pmsprintf(id, sizeof(id), "pcp:map:%s.%s.value",
-			node_subtype(np), reply->str);
-		np->key = strdup(id);
-	    }
-	}
-	break;
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    node_t		*np = baton->np;
+    node_t		*left = np->left;
+    char		*name = left->key + sizeof("pcp:map:") - 1;
+    char		msg[MSGSIZE];
+    char		id[128];
 
-    case N_LT:  case N_LEQ: case N_EQ:  case N_GEQ: case N_GT:  case N_NEQ:
-    case N_AND: case N_OR:  case N_RNE: case N_REQ: case N_NEG:
-    default:
-	break;
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg), "map table %s key %s not found (%s)",
+		    left->key, np->right->value, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if (reply->type != REDIS_REPLY_STRING) {
+	pmsprintf(msg, sizeof(msg),
+		    "expected string for %s key \"%s\" (type=%s)",
+		    node_subtype(left), left->key, redis_reply(reply->type));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else {
+	pmsprintf(id, sizeof(id), "pcp:series:%s:%s", name, reply->str);
+	if (np->key)
+	    free(np->key);
+	np->key = strdup(id);
+	if (redisSlotsRequest(slots, np->key, series_expr_reply, baton,
+				"SMEMBERS %s", np->key) == REDIS_OK)
+	    return;
+	pmsprintf(msg, sizeof(msg), "failed SMEMBERS (key=%s)", np->key);
+	series_fail(sp, PMSERIES_REQUEST, msg, -EPROTO);
     }
-    if (sts < 0)
-	return sts;
-
-    return series_resolve_maps(sp, np->right, level+1);
+    free(baton);
 }
 
-/*
- * Prepare evaluation of leaf nodes.
- */
 static int
-series_prepare_eval(SOLVER *sp, node_t *np, int level)
+series_eval_request(SOLVER *sp, seriesBaton *baton)
 {
-    int		length, sts;
-    char	msg[MSGSIZE];
-    char	*key, *value, *cmd;
+    node_t		*np = baton->np;
+    char		msg[MSGSIZE];
 
-    if (np == NULL)
+    if (redisSlotsRequest(sp->slots, np->left->key, series_eval_reply, baton,
+		"HGET %s %s", np->left->key, np->right->value) == REDIS_OK)
 	return 0;
+    pmsprintf(msg, sizeof(msg),
+		"failed setup equality test on %s:%s (key %s)\n",
+		np->left->value, np->right->value, np->left->key);
+    series_fail(sp, PMSERIES_REQUEST, msg, -EPROTO);
+    free(baton);
+    return -EPROTO;
+}
 
-    if ((sts = series_prepare_eval(sp, np->left, level+1)) < 0)
-	return sts;
-
-    switch (np->type) {
-    case N_EQ:	/* direct hash lookup */
-	key = np->left->key;
-	value = np->right->value;
-	length = redisFormatCommand(&cmd, "HGET %s %s", key, value);
-	if (redisAppendFormattedCommand(sp->redis, cmd, length) == REDIS_OK) {
-	    sp->count++;
-	} else {
-	    pmsprintf(msg, sizeof(msg),
-		    "failed setup equality test on %s:%s (key %s)\n",
-		    np->left->value, value, key);
-	    solvermsg(sp, PMSERIES_REQUEST, msg);
-	    sts = -EPROTO;
-	}
-	free(cmd);
-	break;
-
-    case N_LT:  case N_LEQ: case N_GEQ: case N_GT:  case N_NEQ:
-    case N_RNE: case N_REQ: case N_NEG:
-    case N_AND: case N_OR:
-	/* TODO */
-
-    default:
-	break;
+static void
+series_label_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    node_t		*left = baton->np->left;
+    char		msg[MSGSIZE];
+    char		id[128];
+
+    /* TODO: need to handle JSONB label name nesting. */
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg), "no %s named \"%s\" found (%s)",
+		    node_subtype(left), left->value, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if (reply->type != REDIS_REPLY_STRING) {
+	pmsprintf(msg, sizeof(msg),
+		    "expected string for %s map \"%s\" (type=%s)",
+		    node_subtype(left), left->value, redis_reply(reply->type));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else {
+	pmsprintf(id, sizeof(id), "pcp:map:%s.%s.value",
+		    node_subtype(left), reply->str);
+	left->key = strdup(id);
+	series_eval_request(sp, baton);
+	return;
     }
-    if (sts < 0)
-	return sts;
-
-    return series_prepare_eval(sp, np->right, level+1);
+    free(baton);
 }
 
+/*
+ * Map human names to internal redis identifiers, starting the
+ * request chain for each leaf search parameter.
+ */
 static int
-series_resolve_eval(SOLVER *sp, node_t *np, int level)
+series_prepare_leaves(SOLVER *sp, node_t *np, int level)
 {
-    redisReply	*reply;
+    seriesBaton	*baton;
     node_t	*left;
+    int		length, sts;
     char	*name;
-    char	id[128];
     char	msg[MSGSIZE];
-    int		sts;
 
     if (np == NULL)
 	return 0;
 
-    if ((sts = series_resolve_eval(sp, np->left, level+1)) < 0)
+    if ((sts = series_prepare_leaves(sp, np->left, level+1)) < 0)
 	return sts;
 
     switch (np->type) {
     case N_EQ:	/* direct hash lookup */
-	left = np->left;
-	name = left->key + sizeof("pcp:map:") - 1;
+	if ((baton = calloc(1, sizeof(seriesBaton))) == NULL)
+	    return -ENOMEM;
+	baton->sp = sp;
+	baton->np = np;
 
-	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
-	    pmsprintf(msg, sizeof(msg),
-		    "map table %s key %s not found",
-		    left->key, np->right->value);
-	    solvermsg(sp, PMSERIES_RESPONSE, msg);
-	    sts = -EPROTO;
+	// may need string quoting with regex escapes? (for MATCH)
+	// - or should we rewrite this earlier perhaps?  (see also KEYS docs)
+	left = np->left;
+	if (left->key) {	/* resolved again, e.g. each vacuum pass */
+	    free(left->key);
+	    left->key = NULL;
 	}
-	if (reply->type != REDIS_REPLY_STRING) {
-	    pmsprintf(msg, sizeof(msg),
-		    "expected string for %s key \"%s\" (type=%s)",
-		    node_subtype(left), left->key, redis_reply(reply->type));
-	    solvermsg(sp, PMSERIES_RESPONSE, msg);
-	    sts = -EPROTO;
+	length = strlen(left->value);
+	if ((name = series_instance_name(left->value, length)) != NULL) {
+	    left->subtype = N_INSTANCE;
+	    left->key = strdup("pcp:map:inst.name");
+	} else if ((name = series_metric_name(left->value, length)) != NULL) {
+	    left->subtype = N_METRIC;
+	    left->key = strdup("pcp:map:metric.name");
 	} else {
-	    sp->replies[sp->index++] = reply;
-	    pmsprintf(id, sizeof(id), "pcp:series:%s:%s", name, reply->str);
-	    if (np->key)
-		free(np->key);
-	    np->key = strdup(id);
+	    left->subtype = N_LABEL;
+	    if ((name = series_label_name(left->value, length)) == NULL)
+		name = left->value;
+	    if (redisSlotsRequest(sp->slots, "pcp:map:label.name",
+			series_label_reply, baton,
+			"HGET pcp:map:label.name %s", name) != REDIS_OK) {
+		pmsprintf(msg, sizeof(msg),
+			"failed to setup label name lookup command");
+		series_fail(sp, PMSERIES_REQUEST, msg, -EAGAIN);
+		free(baton);
+		return -EAGAIN;
+	    }
+	    break;
 	}
+	if ((sts = series_eval_request(sp, baton)) < 0)
+	    return sts;
 	break;
 
     case N_LT:  case N_LEQ: case N_GEQ: case N_GT:  case N_NEQ:
@@ -576,59 +585,16 @@ series_resolve_eval(SOLVER *sp, node_t *np, int level)
     default:
 	break;
     }
-    if (sts < 0)
-	return sts;
 
-    return series_resolve_eval(sp, np->right, level+1);
+    return series_prepare_leaves(sp, np->right, level+1);
 }
 
 /*
- * Prepare evaluation of internal nodes.
+ * Combine the result sets of leaf nodes, once all have arrived.
  */
-static int
-series_prepare_expr(SOLVER *sp, node_t *np, int level)
-{
-    int		length, sts;
-    char	msg[MSGSIZE];
-    char	*cmd;
-
-    if (np == NULL)
-	return 0;
-
-    if ((sts = series_prepare_expr(sp, np->left, level+1)) < 0)
-	return sts;
-    if ((series_prepare_expr(sp, np->right, level+1)) < 0)
-	return sts;
-
-    switch (np->type) {
-    case N_EQ:	/* direct hash lookup */
-	length = redisFormatCommand(&cmd, "SMEMBERS %s", np->key);
-	if (redisAppendFormattedCommand(sp->redis, cmd, length) == REDIS_OK) {
-	    sp->count++;
-	} else {
-	    pmsprintf(msg, sizeof(msg), "failed SMEMBERS (key=%s)", np->key);
-	    solvermsg(sp, PMSERIES_REQUEST, msg);
-	    sts = -EPROTO;
-	}
-	free(cmd);
-	break;
-
-    case N_LT:  case N_LEQ: case N_GEQ: case N_GT:  case N_NEQ:
-    case N_RNE: case N_REQ: case N_NEG:
-    case N_AND: case N_OR:
-	/* TODO */
-
-    default:
-	break;
-    }
-    return sts;
-}
-
 static int
 series_resolve_expr(SOLVER *sp, node_t *np, int level)
 {
-    redisReply	*reply;
-    char	msg[MSGSIZE];
     int		sts;
 
     if (np == NULL)
@@ -641,28 +607,6 @@ series_resolve_expr(SOLVER *sp, node_t *np, int level)
 	return sts;
 
     switch (np->type) {
-    case N_EQ:
-	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
-	    pmsprintf(msg, sizeof(msg),
-			"map table %s key %s not found",
-			np->left->key, np->right->value);
-	    solvermsg(sp, PMSERIES_CORRUPT, msg);
-	    sts = -EPROTO;
-	} else if (reply->type != REDIS_REPLY_ARRAY) {
-	    pmsprintf(msg, sizeof(msg),
-			"expected array for %s set \"%s\" (type=%s)",
-			node_subtype(np->left), np->right->value,
-			redis_reply(reply->type));
-	    solvermsg(sp, PMSERIES_CORRUPT, msg);
-	    sts = -EPROTO;
-	} else {
-	    sp->replies[sp->index++] = reply;
-	    if (pmDebugOptions.series)
-		printf("%s %s\n", node_subtype(np->left), np->key);
-	    sts = node_series_reply(sp, np, reply->elements, reply->element);
-	}
-	break;
-
     case N_LT:  case N_LEQ: case N_GEQ: case N_GT:  case N_NEQ:
     case N_RNE: case N_REQ: case N_NEG:
 	/* TODO */
@@ -678,6 +622,7 @@ series_resolve_expr(SOLVER *sp, node_t *np, int level)
 	/* TODO: error handling */
 	break;
 
+    case N_EQ:	/* resolved by series_expr_reply */
     default:
 	break;
     }
@@ -695,58 +640,522 @@ seriesid_copy(const char *series, pmSeriesID *seriesid)
 
 #define DEFAULT_VALUE_COUNT 10
 
+/*
+ * Functions applied to the values of each series, evaluated on the
+ * Redis node holding that series by the SERIES_REDUCE script.
+ */
+static const char *
+series_function(node_t *np)
+{
+    switch (np->type) {
+    case N_AVG:		return "avg";
+    case N_COUNT:	return "count";
+    case N_DELTA:	return "delta";
+    case N_MAX:		return "max";
+    case N_MIN:		return "min";
+    case N_SUM:		return "sum";
+    case N_RATE:	return "rate";
+    case N_STDDEV:	return "stddev";
+    case N_PERCENTILE:	return "percentile";
+    case N_TOPK:	return "topk";
+    case N_BOTTOMK:	return "bottomk";
+    default:
+	break;
+    }
+    return NULL;
+}
+
+static void series_time_reply(redisSlots *, redisReply *, void *);
+
+static int
+series_time_request(SOLVER *sp, seriesBaton *baton)
+{
+    timing_t	*tp = sp->timing;
+    node_t	*func = sp->function;
+    const char	*script, *hash, *param;
+    char	key[PMSIDSZ + 32];
+
+    pmsprintf(key, sizeof(key), "pcp:values:series:%s", baton->seriesid.name);
+
+    /* ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count] */
+    if (func == NULL)
+	return redisSlotsRequest(sp->slots, key, series_time_reply, baton,
+		"ZREVRANGEBYSCORE %s %s %s WITHSCORES LIMIT %u %d",
+		key, sp->end, sp->start, tp->offset, tp->count);
+
+    /* EVALSHA sha1 1 key max min offset count function parameter */
+    script = redis_script(SERIES_REDUCE, &hash);
+    param = func->right ? func->right->value : "0";
+    if (baton->eval)	/* not yet loaded on this node */
+	return redisSlotsRequest(sp->slots, key, series_time_reply, baton,
+		"EVAL %s 1 %s %s %s %u %d %s %s", script,
+		key, sp->end, sp->start, tp->offset, tp->count,
+		series_function(func), param);
+    return redisSlotsRequest(sp->slots, key, series_time_reply, baton,
+		"EVALSHA %s 1 %s %s %s %u %d %s %s", hash,
+		key, sp->end, sp->start, tp->offset, tp->count,
+		series_function(func), param);
+}
+
+static void
+series_time_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    char		msg[MSGSIZE];
+    int			sts;
+
+    if (reply && reply->type == REDIS_REPLY_ERROR && !baton->eval &&
+	strncmp(reply->str, "NOSCRIPT", sizeof("NOSCRIPT") - 1) == 0) {
+	baton->eval = 1;
+	if (series_time_request(sp, baton) == REDIS_OK)
+	    return;
+    }
+
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg), "failed series %s ZSET query (%s)",
+		    baton->seriesid.name, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if (reply->type == REDIS_REPLY_ERROR) {
+	pmsprintf(msg, sizeof(msg), "series %s values: %s",
+		    baton->seriesid.name, reply->str);
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if (reply->type != REDIS_REPLY_ARRAY) {
+	pmsprintf(msg, sizeof(msg),
+		    "expected array from %s zset values (type=%s)",
+		    baton->seriesid.name, redis_reply(reply->type));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if ((sts = series_values_reply(sp, &baton->seriesid,
+				reply->elements, reply->element)) < 0) {
+	sp->status = sp->status ? sp->status : sts;
+    }
+    free(baton);
+}
+
+/*
+ * Values stored in compressed chunks (see chunk.c) are decoded here
+ * rather than in the server, then merged with any values stored the
+ * plain way - non-numeric types, or values loaded before chunking was
+ * set up.  Functions are then applied here too, following the logic
+ * of the SERIES_REDUCE script.
+ *
+ * Chunks are read newest first, CHUNK_BATCH at a time, until the window
+ * is exhausted or enough samples for the offset and count are decoded;
+ * the plain values are limited to the same number, so only a function
+ * over a whole window has to see all of its values.
+ */
+#define CHUNK_BATCH	8
+
+struct seriesSample {
+    double		stamp;		/* seconds, as a ZSET score */
+    const char		*score;		/* score string, plain values */
+    const char		*value;		/* value string, plain values */
+    pmAtomValue		atom;		/* value, from a chunk */
+};
+
+static void series_chunks_reply(redisSlots *, redisReply *, void *);
+static void series_merge_reply(redisSlots *, redisReply *, void *);
+
+/* samples needed from each of chunks and plain values, -1 for all */
+static int
+series_samples_needed(SOLVER *sp)
+{
+    timing_t	*tp = sp->timing;
+
+    if (tp->count < 0)
+	return -1;
+    return tp->offset + tp->count;
+}
+
+static int
+series_chunks_request(SOLVER *sp, seriesBaton *baton)
+{
+    char	key[PMSIDSZ + 32];
+    int		offset = baton->nchunks;
+
+    pmsprintf(key, sizeof(key), "pcp:chunks:series:%s", baton->seriesid.name);
+    baton->nchunks += CHUNK_BATCH;
+    return redisSlotsRequest(sp->slots, key, series_chunks_reply, baton,
+		"ZREVRANGEBYSCORE %s %s %s LIMIT %d %d",
+		key, sp->end, sp->chunks, offset, CHUNK_BATCH);
+}
+
+static void
+series_free_baton(seriesBaton *baton)
+{
+    if (baton->samples)
+	free(baton->samples);
+    free(baton);
+}
+
+static int
+series_chunk_decode(seriesBaton *baton, redisReply *chunk)
+{
+    chunkReader		reader;
+    seriesSample	*samples, *sample;
+    pmAtomValue		atom;
+    struct timeval	tv;
+    __int64_t		stamp;
+    size_t		size;
+    int			count, sts;
+
+    if (chunk->type != REDIS_REPLY_STRING)
+	return -EPROTO;
+    if ((count = chunk_reader(&reader, chunk->str, chunk->len)) < 0)
+	return count;
+    size = (baton->nsamples + count) * sizeof(seriesSample);
+    if ((samples = (seriesSample *)realloc(baton->samples, size)) == NULL)
+	return -ENOMEM;
+    baton->samples = samples;
+    baton->type = reader.type;
+
+    /* chunks may hold values beyond the window, these are dropped */
+    while ((sts = chunk_next(&reader, &stamp, &atom)) > 0) {
+	sample = &samples[baton->nsamples];
+	tv.tv_sec = stamp / 1000000;
+	tv.tv_usec = stamp % 1000000;
+	sample->stamp = tv2real(&tv);
+	if (sample->stamp < baton->sp->from || sample->stamp > baton->sp->until)
+	    continue;
+	sample->score = sample->value = NULL;
+	sample->atom = atom;
+	baton->nsamples++;
+    }
+    return sts;
+}
+
+static void
+series_chunks_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    char		msg[MSGSIZE];
+    char		key[PMSIDSZ + 32];
+    int			need = series_samples_needed(sp);
+    int			i, sts;
+
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg), "failed series %s chunks query (%s)",
+		    baton->seriesid.name, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if (reply->type != REDIS_REPLY_ARRAY) {
+	pmsprintf(msg, sizeof(msg),
+		    "expected array from %s zset chunks (type=%s)",
+		    baton->seriesid.name, redis_reply(reply->type));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else {
+	for (i = 0; i < reply->elements; i++) {
+	    if ((sts = series_chunk_decode(baton, reply->element[i])) < 0) {
+		pmsprintf(msg, sizeof(msg), "corrupt chunk in series %s: %s",
+			    baton->seriesid.name, pmErrStr(sts));
+		series_fail(sp, PMSERIES_CORRUPT, msg, sts);
+		series_free_baton(baton);
+		return;
+	    }
+	    if (need >= 0 && baton->nsamples >= need)
+		break;	/* older chunks cannot be among the newest */
+	}
+	/* more chunks in the window may be needed yet */
+	if (reply->elements == CHUNK_BATCH &&
+	    (need < 0 || baton->nsamples < need)) {
+	    if (series_chunks_request(sp, baton) == REDIS_OK)
+		return;
+	    pmsprintf(msg, sizeof(msg), "failed series %s chunks query",
+			baton->seriesid.name);
+	    series_fail(sp, PMSERIES_REQUEST, msg, -EPROTO);
+	    series_free_baton(baton);
+	    return;
+	}
+	/* now the plain values, as many as needed to merge with these */
+	pmsprintf(key, sizeof(key), "pcp:values:series:%s", baton->seriesid.name);
+	if (redisSlotsRequest(slots, key, series_merge_reply, baton,
+		"ZREVRANGEBYSCORE %s %s %s WITHSCORES LIMIT 0 %d",
+		key, sp->end, sp->start, need) == REDIS_OK)
+	    return;
+	pmsprintf(msg, sizeof(msg), "failed %s ZREVRANGEBYSCORE", key);
+	series_fail(sp, PMSERIES_REQUEST, msg, -EPROTO);
+    }
+    series_free_baton(baton);
+}
+
+static const char *
+sample_value(seriesBaton *baton, seriesSample *sample, char *buf, size_t len)
+{
+    if (sample->value)
+	return sample->value;
+    return atom_valuestr(baton->type, &sample->atom, buf, len);
+}
+
+static const char *
+sample_score(seriesSample *sample, char *buf, size_t len)
+{
+    if (sample->score)
+	return sample->score;
+    pmsprintf(buf, len, "%.17g", sample->stamp);
+    return buf;
+}
+
+static void
+sample_report(SOLVER *sp, seriesBaton *baton, seriesSample *sample,
+		const char *value)
+{
+    char		vbuf[512], sbuf[64];
+
+    if (value == NULL)
+	value = sample_value(baton, sample, vbuf, sizeof(vbuf));
+    solvervalue(sp, &baton->seriesid, sample_score(sample, sbuf, sizeof(sbuf)),
+		value);
+}
+
+static int
+sample_compare(const void *a, const void *b)
+{
+    const seriesSample	*sa = (const seriesSample *)a;
+    const seriesSample	*sb = (const seriesSample *)b;
+
+    if (sa->stamp == sb->stamp)
+	return 0;
+    return sa->stamp < sb->stamp ? 1 : -1;	/* newest first */
+}
+
+typedef struct {
+    double		value;
+    int			sample;
+} sampleValue;
+
+static int
+value_ascending(const void *a, const void *b)
+{
+    double		va = ((const sampleValue *)a)->value;
+    double		vb = ((const sampleValue *)b)->value;
+
+    return va < vb ? -1 : va > vb ? 1 : 0;
+}
+
+static int
+value_descending(const void *a, const void *b)
+{
+    return value_ascending(b, a);
+}
+
+/* C version of the SERIES_REDUCE script, for chunked values */
+static void
+series_reduce(SOLVER *sp, seriesBaton *baton, seriesSample *samples, int count)
+{
+    node_t		*func = sp->function;
+    const char		*name = series_function(func);
+    sampleValue		*V;
+    double		param = func->right ? strtod(func->right->value, NULL) : 0;
+    double		sum, min, max, mean, sq, d, dt, r;
+    char		vbuf[512], result[64], *end;
+    const char		*value;
+    int			i, n, newest;
+
+    if ((V = (sampleValue *)calloc(count ? count : 1, sizeof(*V))) == NULL) {
+	series_fail(sp, PMSERIES_ERROR, "out of memory", -ENOMEM);
+	return;
+    }
+    for (i = n = 0; i < count; i++) {	/* numeric values only */
+	value = sample_value(baton, &samples[i], vbuf, sizeof(vbuf));
+	V[n].value = strtod(value, &end);
+	if (end == value || *end != '\0')
+	    continue;
+	V[n++].sample = i;
+    }
+    if (n == 0)
+	goto done;
+    newest = V[0].sample;
+
+    if (strcmp(name, "rate") == 0 || strcmp(name, "delta") == 0) {
+	for (i = 0; i < n - 1; i++) {
+	    d = V[i].value - V[i+1].value;
+	    dt = samples[V[i].sample].stamp - samples[V[i+1].sample].stamp;
+	    if (name[0] == 'd')
+		pmsprintf(result, sizeof(result), "%.16g", d);
+	    else if (d >= 0 && dt > 0)	/* skip counter wraps */
+		pmsprintf(result, sizeof(result), "%.16g", d / dt);
+	    else
+		continue;
+	    sample_report(sp, baton, &samples[V[i].sample], result);
+	}
+	goto done;
+    }
+    if (strcmp(name, "topk") == 0 || strcmp(name, "bottomk") == 0) {
+	qsort(V, n, sizeof(*V),
+		name[0] == 't' ? value_descending : value_ascending);
+	for (i = 0; i < n && i < param; i++)
+	    sample_report(sp, baton, &samples[V[i].sample], NULL);
+	goto done;
+    }
+
+    sum = 0;
+    min = max = V[0].value;
+    for (i = 0; i < n; i++) {
+	sum += V[i].value;
+	if (V[i].value < min)
+	    min = V[i].value;
+	if (V[i].value > max)
+	    max = V[i].value;
+    }
+    if (strcmp(name, "sum") == 0)
+	r = sum;
+    else if (strcmp(name, "avg") == 0)
+	r = sum / n;
+    else if (strcmp(name, "count") == 0)
+	r = n;
+    else if (strcmp(name, "min") == 0)
+	r = min;
+    else if (strcmp(name, "max") == 0)
+	r = max;
+    else if (strcmp(name, "stddev") == 0) {
+	mean = sum / n;
+	for (i = 0, sq = 0; i < n; i++)
+	    sq += (V[i].value - mean) * (V[i].value - mean);
+	r = sqrt(sq / n);
+    } else {	/* percentile, nearest rank */
+	i = (int)ceil(param / 100 * n);
+	qsort(V, n, sizeof(*V), value_ascending);
+	r = V[(i < 1 ? 1 : i) - 1].value;
+    }
+    /* stamped with the newest sample */
+    pmsprintf(result, sizeof(result), "%.16g", r);
+    sample_report(sp, baton, &samples[newest], result);
+
+done:
+    free(V);
+}
+
+static void
+series_merge_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    timing_t		*tp = sp->timing;
+    seriesSample	*samples, *sample;
+    redisReply		*value, *score;
+    char		msg[MSGSIZE];
+    int			i, n, first, last;
+
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg), "failed series %s ZSET query (%s)",
+		    baton->seriesid.name, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+	goto done;
+    }
+    if (reply->type != REDIS_REPLY_ARRAY || (reply->elements % 2)) {
+	pmsprintf(msg, sizeof(msg),
+		"expected time:value pairs from %s values ZSET (type=%s)",
+		baton->seriesid.name, redis_reply(reply->type));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+	goto done;
+    }
+
+    n = baton->nsamples;
+    samples = baton->samples;
+    if (reply->elements > 0) {
+	samples = (seriesSample *)realloc(samples,
+			(n + reply->elements / 2) * sizeof(seriesSample));
+	if (samples == NULL) {
+	    series_fail(sp, PMSERIES_ERROR, "out of memory", -ENOMEM);
+	    goto done;
+	}
+	baton->samples = samples;
+    }
+    for (i = 0; i < reply->elements; i += 2) {
+	value = reply->element[i];
+	score = reply->element[i+1];
+	if (value->type != REDIS_REPLY_STRING ||
+	    score->type != REDIS_REPLY_STRING) {
+	    pmsprintf(msg, sizeof(msg),
+			"expected string value and stamp for series %s",
+			baton->seriesid.name);
+	    series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+	    continue;
+	}
+	sample = &samples[n++];
+	sample->stamp = strtod(score->str, NULL);
+	sample->score = score->str;
+	sample->value = value->str;
+    }
+    if (n > 1)
+	qsort(samples, n, sizeof(seriesSample), sample_compare);
+
+    /* apply the sample offset and count, as ZREVRANGEBYSCORE does */
+    first = tp->offset < n ? tp->offset : n;
+    last = (tp->count < 0 || first + tp->count > n) ? n : first + tp->count;
+    if (sp->function)
+	series_reduce(sp, baton, samples + first, last - first);
+    else for (i = first; i < last; i++)
+	sample_report(sp, baton, &samples[i], NULL);
+
+done:
+    series_free_baton(baton);
+}
+
+/*
+ * Query cache for the time series range (time:value pairs) of every
+ * series concurrently, values being reported as each reply arrives.
+ * When a function is given only its result is sent back, reduced on
+ * the server over the whole window unless a sample count is given.
+ */
 static int
 series_prepare_time(SOLVER *sp, timing_t *tp, int nseries, char *series)
 {
-    char	start[64], end[64];
-    char	msg[MSGSIZE], *cmd;
-    pmSeriesID	seriesid;
-    int		sts = 0, len, i;
+    seriesBaton	*baton;
+    char	msg[MSGSIZE];
+    int		sts = 0, request, i;
 
-    pmsprintf(start, sizeof(start), "%.64g", tv2real(&tp->start));
+    sp->timing = tp;
+    sp->from = tv2real(&tp->start);
+    pmsprintf(sp->start, sizeof(sp->start), "%.64g", sp->from);
     if (pmDebugOptions.series)
-	fprintf(stderr, "START: %s\n", start);
+	fprintf(stderr, "START: %s\n", sp->start);
 
-    if (tp->end.tv_sec)
-	pmsprintf(end, sizeof(end), "%.64g", tv2real(&tp->end));
-    else
-	pmsprintf(end, sizeof(end), "+inf");
+    if (tp->end.tv_sec) {
+	sp->until = tv2real(&tp->end);
+	pmsprintf(sp->end, sizeof(sp->end), "%.64g", sp->until);
+    } else {
+	sp->until = HUGE_VAL;
+	pmsprintf(sp->end, sizeof(sp->end), "+inf");
+    }
     if (pmDebugOptions.series)
-	fprintf(stderr, "END: %s\n", end);
+	fprintf(stderr, "END: %s\n", sp->end);
+
+    /* chunks are scored by their start, so may begin a window earlier */
+    pmsprintf(sp->chunks, sizeof(sp->chunks), "(%.64g",
+		tv2real(&tp->start) - sp->window);
 
     if (tp->count == 0)
-	tp->count = DEFAULT_VALUE_COUNT;
-    if (tp->offset > tp->count)
+	tp->count = sp->function ? -1 : DEFAULT_VALUE_COUNT;
+    if (tp->count > 0 && tp->offset > tp->count)
 	nseries = 0;	/* we're finished */
     if (pmDebugOptions.series)
-	fprintf(stderr, "LIMIT: %u %u\n", tp->offset, tp->count);
+	fprintf(stderr, "LIMIT: %u %d\n", tp->offset, tp->count);
 
     /*
-     * Query cache for the time series range (time:value pairs)
-     * - ZSET values are metric values, score is the timestamp.
+     * ZSET values are metric values, score is the timestamp.
      */
-
     for (i = 0; i < nseries; i++, series += PMSIDSZ) {
-	if (seriesid_copy(series, &seriesid) < 0) {
+	if ((baton = calloc(1, sizeof(seriesBaton))) == NULL)
+	    return -ENOMEM;
+	baton->sp = sp;
+	if (seriesid_copy(series, &baton->seriesid) < 0) {
+	    free(baton);
 	    sts = -EPROTO;
 	    continue;
 	}
-
-	/* ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count] */
-	len = redisFormatCommand(&cmd, "ZREVRANGEBYSCORE"
-		" pcp:values:series:%s %s %s WITHSCORES LIMIT %u %u",
-		seriesid.name, end, start, tp->offset, tp->count);
-
-	if (redisAppendFormattedCommand(sp->redis, cmd, len) != REDIS_OK) {
+	if (sp->window)
+	    request = series_chunks_request(sp, baton);
+	else
+	    request = series_time_request(sp, baton);
+	if (request != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg),
 			"failed pcp:values:series:%.*s ZREVRANGEBYSCORE",
 			PMSIDSZ, series);
 	    solvermsg(sp, PMSERIES_REQUEST, msg);
+	    free(baton);
 	    sts = -EPROTO;
-	} else {
-	    sp->count++;
 	}
-	free(cmd);
     }
 
     return sts;
@@ -764,65 +1173,6 @@ series_result(int nseries)
 }
 #endif
 
-static int
-series_resolve_time(SOLVER *sp, int nseries, char *series)
-{
-    redisReply		*reply;
-    pmSeriesID		seriesid;
-    char		msg[MSGSIZE];
-    int			i, sts = 0;
-
-/*--printf("{\n  \"result\": \"%s\",\n", series_result(nseries));
-    printf("  \"series\": {\n");--*TODO*/
-
-    for (i = 0; i < nseries; i++, series += PMSIDSZ) {
-	if (redisGetReply(sp->redis, (void **)&reply) != REDIS_OK) {
-	    pmsprintf(msg, sizeof(msg), "failed series %.*s ZSET query",
-			PMSIDSZ, series);
-	    solvermsg(sp, PMSERIES_RESPONSE, msg);
-	    sts = -EPROTO;
-	} else if (reply->type != REDIS_REPLY_ARRAY) {
-	    pmsprintf(msg, sizeof(msg),
-			"expected array from %.*s zset values (type=%s)",
-			PMSIDSZ, series, redis_reply(reply->type));
-	    solvermsg(sp, PMSERIES_RESPONSE, msg);
-	    sts = -EPROTO;
-	} else {
-	    memcpy(seriesid.name, series, PMSIDSZ);
-	    seriesid.name[PMSIDSZ] = '\0';
-	    sts |= series_values_reply(sp, &seriesid,
-				reply->elements, reply->element);
-	}
-	freeReplyObject(reply);
-
-/*--	if (i + 1 < nseries)
-	    fputc(',', stdout);
-	fputc('\n', stdout);--*TODO*/
-    }
-/*--fputs("  }\n}\n", stdout);--*TODO*/
-
-    return sts;
-}
-
-void
-new_solver_replies(SOLVER *sp)
-{
-    sp->replies = calloc(sp->count, sizeof(redisReply *));
-    /* TODO: error handling */
-    sp->index = 0;
-}
-
-static void
-free_solver_replies(SOLVER *sp)
-{
-#if 0	/* TODO */
-    for (sp->index = 0; sp->index < sp->count; sp->index++)
-	freeReplyObject(&sp->replies[sp->index]);
-    free(sp->replies);
-#endif
-    sp->index = sp->count = 0;
-}
-
 static int
 series_report_set(SOLVER *sp, int nseries, char *series)
 {
@@ -861,48 +1211,337 @@ series_solve(settings_t *settings,
 {
     SOLVER	solver = { .settings = settings, .arg = arg };
     SOLVER	*sp = &solver;
+    char	msg[MSGSIZE];
+    int		sts;
 
-    solver.redis = redis_init();
+    /* Values of the series selected beneath a function are reduced */
+    if (root && series_function(root) != NULL) {
+	solver.function = root;
+	root = root->left;
+    }
+    if (root == NULL)	/* time window alone selects no series */
+	return -EINVAL;
 
-    /* Resolve label and note key names (via their map keys) */
-    if (pmDebugOptions.series)
-	fprintf(stderr, "series_maps\n");
-    series_prepare_maps(sp, root, 0);
-    new_solver_replies(sp);
-    series_resolve_maps(sp, root, 0);
-    free_solver_replies(sp);
+    if ((solver.slots = redis_init()) == NULL)
+	return -ECONNREFUSED;
+    solver.window = redis_chunk_window(solver.slots, 0);
 
-    /* Resolve sets of series identifiers for leaf nodes */
+    /* Resolve sets of series identifiers for all leaf nodes at once */
     if (pmDebugOptions.series)
 	fprintf(stderr, "series_eval\n");
-    series_prepare_eval(sp, root, 0);
-    new_solver_replies(sp);
-    series_resolve_eval(sp, root, 0);
-    free_solver_replies(sp);
+    if (series_prepare_leaves(sp, root, 0) < 0 && solver.status == 0)
+	solver.status = -EPROTO;
+    if ((sts = redisSlotsEventLoop(solver.slots)) < 0) {
+	pmsprintf(msg, sizeof(msg), "series lookup failed: %s",
+		    redisSlotsErrstr(solver.slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, sts);
+    }
+    if (solver.status < 0)
+	goto done;
 
     /* Perform final matching (set of) series solving */
     if (pmDebugOptions.series)
 	fprintf(stderr, "series_expr\n");
-    series_prepare_expr(sp, root, 0);
-    new_solver_replies(sp);
     series_resolve_expr(sp, root, 0);
-    free_solver_replies(sp);
 
     /* Report the matching series ids, unless time window given */
-    if ((flags & PMSERIES_METADATA) || !series_time_window(timing)) {
+    if ((flags & PMSERIES_METADATA) ||
+	(!solver.function && !series_time_window(timing))) {
 	series_report_set(sp, root->nseries, root->series);
-	return 0;
+	goto done;
     }
 
     /* Extract values within the given time window */
     if (pmDebugOptions.series)
 	fprintf(stderr, "series_time\n");
-    series_prepare_time(sp, timing, root->nseries, root->series);
-    new_solver_replies(sp);
-    series_resolve_time(sp, root->nseries, root->series);
-    free_solver_replies(sp);
+    if ((sts = series_prepare_time(sp, timing, root->nseries, root->series)) < 0)
+	solver.status = sts;
+    if ((sts = redisSlotsEventLoop(solver.slots)) < 0) {
+	pmsprintf(msg, sizeof(msg), "series values failed: %s",
+		    redisSlotsErrstr(solver.slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, sts);
+    }
 
-    return 0;
+done:
+    redis_stop(solver.slots);
+    return solver.status;
+}
+
+/*
+ * Retention - values stamped before the start of the time window are
+ * removed from each selected series, or from every series when only a
+ * time window is given.  Series are trimmed a bounded batch at a time
+ * by a script run on the node holding each one, with a bounded number
+ * of requests in flight, so that loading and queries are not stalled.
+ */
+#define VACUUM_BATCH	1000	/* values removed per script call */
+#define VACUUM_REQUESTS	64	/* script calls in flight at once */
+
+static void series_vacuum_reply(redisSlots *, redisReply *, void *);
+static void series_vacuum_chunks(redisSlots *, redisReply *, void *);
+
+static int
+series_vacuum_request(SOLVER *sp, seriesBaton *baton)
+{
+    const char	*script, *hash;
+    char	key[PMSIDSZ + 32];
+
+    pmsprintf(key, sizeof(key), "pcp:values:series:%s", baton->seriesid.name);
+    script = redis_script(SERIES_VACUUM, &hash);
+    if (baton->eval)	/* not yet loaded on this node */
+	return redisSlotsRequest(sp->slots, key, series_vacuum_reply, baton,
+		"EVAL %s 1 %s %s %d", script, key, sp->start, VACUUM_BATCH);
+    return redisSlotsRequest(sp->slots, key, series_vacuum_reply, baton,
+		"EVALSHA %s 1 %s %s %d", hash, key, sp->start, VACUUM_BATCH);
+}
+
+/* keep up to VACUUM_REQUESTS series being trimmed */
+static void
+series_vacuum_next(SOLVER *sp)
+{
+    seriesBaton		*baton;
+    char		msg[MSGSIZE];
+
+    while (sp->inflight < VACUUM_REQUESTS && sp->next < sp->nseries) {
+	if ((baton = calloc(1, sizeof(seriesBaton))) == NULL) {
+	    series_fail(sp, PMSERIES_ERROR, "out of memory", -ENOMEM);
+	    sp->next = sp->nseries;
+	    return;
+	}
+	baton->sp = sp;
+	seriesid_copy(sp->series + (sp->next++ * PMSIDSZ), &baton->seriesid);
+	if (series_vacuum_request(sp, baton) != REDIS_OK) {
+	    pmsprintf(msg, sizeof(msg), "failed series %s vacuum request",
+			baton->seriesid.name);
+	    series_fail(sp, PMSERIES_REQUEST, msg, -EPROTO);
+	    free(baton);
+	    continue;
+	}
+	sp->inflight++;
+    }
+}
+
+static void
+series_vacuum_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    char		msg[MSGSIZE];
+    char		key[PMSIDSZ + 32];
+
+    if (reply && reply->type == REDIS_REPLY_ERROR && !baton->eval &&
+	strncmp(reply->str, "NOSCRIPT", sizeof("NOSCRIPT") - 1) == 0) {
+	baton->eval = 1;
+	if (series_vacuum_request(sp, baton) == REDIS_OK)
+	    return;
+    }
+
+    if (reply == NULL) {
+	pmsprintf(msg, sizeof(msg), "failed series %s vacuum (%s)",
+		    baton->seriesid.name, redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else if (reply->type != REDIS_REPLY_INTEGER) {
+	pmsprintf(msg, sizeof(msg),
+		    "expected integer from %s vacuum (type=%s)",
+		    baton->seriesid.name, redis_reply(reply->type));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else {
+	sp->removed += reply->integer;
+	/* a full batch means there may be more, go around again */
+	if (reply->integer >= VACUUM_BATCH) {
+	    if (series_vacuum_request(sp, baton) == REDIS_OK)
+		return;
+	} else if (sp->window) {
+	    /* whole chunks, ending before the cutoff, go in one step */
+	    pmsprintf(key, sizeof(key), "pcp:chunks:series:%s",
+			baton->seriesid.name);
+	    if (redisSlotsRequest(slots, key, series_vacuum_chunks, baton,
+			"ZREMRANGEBYSCORE %s -inf %s", key, sp->chunks) == REDIS_OK)
+		return;
+	}
+    }
+    free(baton);
+    sp->inflight--;
+    series_vacuum_next(sp);
+}
+
+static void
+series_vacuum_chunks(redisSlots *slots, redisReply *reply, void *arg)
+{
+    seriesBaton		*baton = (seriesBaton *)arg;
+    SOLVER		*sp = baton->sp;
+    char		msg[MSGSIZE];
+
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+	pmsprintf(msg, sizeof(msg), "failed series %s chunks vacuum (%s)",
+		    baton->seriesid.name, reply ? redis_reply(reply->type) :
+		    redisSlotsErrstr(slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+    } else {
+	sp->nchunks += reply->integer;
+    }
+    free(baton);
+    sp->inflight--;
+    series_vacuum_next(sp);
+}
+
+static void
+series_members_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    SOLVER		*sp = (SOLVER *)arg;
+    redisReply		*series;
+    char		*result;
+    int			i;
+
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY)
+	return;	/* metric name without series, e.g. metadata vacuumed */
+    if ((result = realloc(sp->series,
+		(sp->nseries + reply->elements) * PMSIDSZ)) == NULL) {
+	series_fail(sp, PMSERIES_ERROR, "out of memory", -ENOMEM);
+	return;
+    }
+    sp->series = result;
+    for (i = 0; i < reply->elements; i++) {
+	series = reply->element[i];
+	if (series->type != REDIS_REPLY_STRING || series->len != PMSIDSZ)
+	    continue;
+	memcpy(sp->series + (sp->nseries++ * PMSIDSZ), series->str, PMSIDSZ);
+    }
+}
+
+/* find every series, via the series set of each metric name */
+static void
+series_names_reply(redisSlots *slots, redisReply *reply, void *arg)
+{
+    SOLVER		*sp = (SOLVER *)arg;
+    redisReply		*id;
+    char		msg[MSGSIZE];
+    char		key[128];
+    int			i;
+
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+	pmsprintf(msg, sizeof(msg), "expected array for %s (type=%s)",
+		    "pcp:map:metric.name",
+		    reply ? redis_reply(reply->type) : "none");
+	series_fail(sp, PMSERIES_RESPONSE, msg, -EPROTO);
+	return;
+    }
+    for (i = 1; i < reply->elements; i += 2) {
+	id = reply->element[i];
+	if (id->type != REDIS_REPLY_STRING)
+	    continue;
+	pmsprintf(key, sizeof(key), "pcp:series:metric.name:%s", id->str);
+	if (redisSlotsRequest(slots, key, series_members_reply, sp,
+			"SMEMBERS %s", key) != REDIS_OK) {
+	    series_fail(sp, PMSERIES_REQUEST,
+			"failed metric name SMEMBERS request", -EPROTO);
+	    return;
+	}
+    }
+}
+
+static int
+series_vacuum_pass(settings_t *settings, node_t *root, timing_t *tp, void *arg)
+{
+    SOLVER		solver = { .settings = settings, .arg = arg };
+    SOLVER		*sp = &solver;
+    struct timeval	cutoff, range;
+    char		msg[MSGSIZE], *error;
+    int			sts;
+
+    if (tp->ranges) {	/* relative to now, so moves with each pass */
+	if ((sts = pmParseInterval(tp->ranges, &range, &error)) < 0) {
+	    free(error);
+	    return sts;
+	}
+	gettimeofday(&cutoff, NULL);
+	tsub(&cutoff, &range);
+    } else {
+	cutoff = tp->start;
+    }
+    pmsprintf(solver.start, sizeof(solver.start), "%.64g", tv2real(&cutoff));
+
+    if ((solver.slots = redis_init()) == NULL)
+	return -ECONNREFUSED;
+    if ((solver.window = redis_chunk_window(solver.slots, 0)) != 0)
+	pmsprintf(solver.chunks, sizeof(solver.chunks), "%.64g",
+		    tv2real(&cutoff) - solver.window);
+
+    /* Resolve the series to be trimmed, all of them if no selector */
+    if (root == NULL) {
+	if (redisSlotsRequest(solver.slots, "pcp:map:metric.name",
+			series_names_reply, sp,
+			"HGETALL pcp:map:metric.name") != REDIS_OK)
+	    solver.status = -EPROTO;
+    } else if (series_prepare_leaves(sp, root, 0) < 0 && solver.status == 0) {
+	solver.status = -EPROTO;
+    }
+    if ((sts = redisSlotsEventLoop(solver.slots)) < 0) {
+	pmsprintf(msg, sizeof(msg), "series lookup failed: %s",
+		    redisSlotsErrstr(solver.slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, sts);
+    }
+    if (solver.status < 0)
+	goto done;
+    if (root) {
+	series_resolve_expr(sp, root, 0);
+	solver.series = root->series;
+	solver.nseries = root->nseries;
+    }
+
+    if (pmDebugOptions.series)
+	fprintf(stderr, "series_vacuum %d series before %s\n",
+			solver.nseries, solver.start);
+    series_vacuum_next(sp);
+    if ((sts = redisSlotsEventLoop(solver.slots)) < 0) {
+	pmsprintf(msg, sizeof(msg), "series vacuum failed: %s",
+		    redisSlotsErrstr(solver.slots));
+	series_fail(sp, PMSERIES_RESPONSE, msg, sts);
+    }
+
+    if (solver.window)
+	pmsprintf(msg, sizeof(msg),
+		"vacuumed %llu values and %llu chunks from %d series",
+		solver.removed, solver.nchunks, solver.nseries);
+    else
+	pmsprintf(msg, sizeof(msg), "vacuumed %llu values from %d series",
+		solver.removed, solver.nseries);
+    solvermsg(sp, PMSERIES_INFO, msg);
+
+done:
+    if (root) {		/* resolved afresh on the next pass */
+	free(root->series);
+	root->series = NULL;
+	root->nseries = 0;
+    } else {
+	free(solver.series);
+    }
+    redis_stop(solver.slots);
+    return solver.status;
+}
+
+/*
+ * Apply a retention policy once, or with an interval in the time
+ * window, again after each interval for as long as we are running.
+ */
+int
+series_vacuum(settings_t *settings,
+	node_t *root, timing_t *timing, pmseries_flags flags, void *arg)
+{
+    int		sts;
+
+    if (root && series_function(root) != NULL)
+	return -EINVAL;		/* functions do not select values */
+    if (timing->ranges == NULL && timing->starts == NULL)
+	return -EINVAL;		/* no retention window given */
+
+    for (;;) {
+	sts = series_vacuum_pass(settings, root, timing, arg);
+	if (timing->deltas == NULL)
+	    break;
+	__pmtimevalSleep(timing->delta);
+    }
+    return sts;
 }
 
 /* build a reverse hash mapping */
@@ -985,7 +1624,7 @@ series_map_reply(pmSeriesSettings *settings, pmSeriesID *series,
 
 static int
 series_all_labels(pmSeriesSettings *settings,
-	redisContext *redis, void *arg)
+	redisSlots *slots, void *arg)
 {
     redisReply		*reply, *rp;
     char		msg[MSGSIZE];
@@ -995,7 +1634,7 @@ series_all_labels(pmSeriesSettings *settings,
     /* prepare command */
 
     len = redisFormatCommand(&cmd, "HKEYS pcp:map:label.name");
-    if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+    if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:label.name HKEYS");
 	settings->on_info(PMSERIES_REQUEST, msg, arg);
 	return -EAGAIN;
@@ -1004,7 +1643,7 @@ series_all_labels(pmSeriesSettings *settings,
 
     /* response handling */
 
-    if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+    if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:label.name HKEYS");
 	settings->on_info(PMSERIES_RESPONSE, msg, arg);
 	return -EPROTO;
@@ -1043,7 +1682,7 @@ void
 pmSeriesLabel(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisSlots		*slots = redis_init();
     redisReply		*reply, *rp;
     pmSeriesID		seriesid;
     reverseMap		map;
@@ -1053,7 +1692,7 @@ pmSeriesLabel(pmSeriesSettings *settings,
 
     if (nseries <= 0) {
 	if (nseries == 0)
-	    sts = series_all_labels(settings, redis, arg);
+	    sts = series_all_labels(settings, slots, arg);
 	else
 	    sts = -EINVAL;
 	goto done;
@@ -1062,7 +1701,7 @@ pmSeriesLabel(pmSeriesSettings *settings,
     /* prepare command batch */
 
     len = redisFormatCommand(&cmd, "HGETALL pcp:map:label.name");
-    if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+    if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:label.name HGETALL");
 	queryinfo(settings, PMSERIES_REQUEST, msg, arg);
 	free(cmd);
@@ -1074,7 +1713,7 @@ pmSeriesLabel(pmSeriesSettings *settings,
     for (i = 0; i < nseries; i++) {
 	len = redisFormatCommand(&cmd, "SMEMBERS pcp:label.name:series:%s",
 				series[i].name);
-	if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+	if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg),
 			"failed pcp:label.name:series:%.*s SMEMBERS",
 			PMSIDSZ, series[i].name);
@@ -1088,7 +1727,7 @@ pmSeriesLabel(pmSeriesSettings *settings,
 
     /* response handling */
 
-    if (redisGetReply(redis, (void **)&rp) != REDIS_OK) {
+    if (redisSlotsGetReply(slots, &rp) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed HGETALL pcp:map:label.name");
 	settings->on_info(PMSERIES_RESPONSE, msg, arg);
 	sts = -EPROTO;
@@ -1110,7 +1749,7 @@ pmSeriesLabel(pmSeriesSettings *settings,
 
     /* unpack - iterate over series and extract label names for each set */
     for (i = 0; i < nseries; i++) {
-	if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+	if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg),
 			"failed pcp:label.name:series:%.*s SMEMBERS",
 			PMSIDSZ, series[i].name);
@@ -1140,11 +1779,12 @@ pmSeriesLabel(pmSeriesSettings *settings,
     freeReplyObject(rp);
 
 done:
+    redis_stop(slots);
     querydone(settings, sts, arg);
 }
 
 static int
-series_all_metrics(pmSeriesSettings *settings, redisContext *redis,
+series_all_metrics(pmSeriesSettings *settings, redisSlots *slots,
 	void *arg)
 {
     redisReply		*reply, *rp;
@@ -1155,7 +1795,7 @@ series_all_metrics(pmSeriesSettings *settings, redisContext *redis,
     /* prepare command */
 
     len = redisFormatCommand(&cmd, "HKEYS pcp:map:metric.name");
-    if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+    if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:metric.name HKEYS");
 	settings->on_info(PMSERIES_REQUEST, msg, arg);
 	return -EAGAIN;
@@ -1164,7 +1804,7 @@ series_all_metrics(pmSeriesSettings *settings, redisContext *redis,
 
     /* response handling */
 
-    if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+    if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:metric.name HKEYS");
 	settings->on_info(PMSERIES_RESPONSE, msg, arg);
 	return -EPROTO;
@@ -1203,14 +1843,14 @@ series_all_metrics(pmSeriesSettings *settings, redisContext *redis,
 
 static int
 series_metric_name_prepare(pmSeriesSettings *settings,
-	redisContext *redis, void *arg)
+	redisSlots *slots, void *arg)
 {
     char		*cmd;
     char		msg[MSGSIZE];
     int			len, sts = 0;
 
     len = redisFormatCommand(&cmd, "HGETALL pcp:map:metric.name");
-    if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+    if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:metric.name HGETALL");
 	settings->on_info(PMSERIES_REQUEST, msg, arg);
 	sts = -EAGAIN;
@@ -1221,13 +1861,13 @@ series_metric_name_prepare(pmSeriesSettings *settings,
 
 static int
 series_metric_name_execute(pmSeriesSettings *settings,
-	redisContext *redis, redisReply **rp, reverseMap *mp, void *arg)
+	redisSlots *slots, redisReply **rp, reverseMap *mp, void *arg)
 {
     redisReply		*reply;
     char		msg[MSGSIZE];
     int			sts;
 
-    if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+    if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed pcp:map:metric.name HGETALL");
 	settings->on_info(PMSERIES_RESPONSE, msg, arg);
 	sts = -EAGAIN;
@@ -1249,7 +1889,7 @@ void
 pmSeriesMetric(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisSlots		*slots = redis_init();
     redisReply		*reply, *rp;
     reverseMap		map;
     char		*cmd;
@@ -1258,15 +1898,15 @@ pmSeriesMetric(pmSeriesSettings *settings,
 
     if (nseries <= 0) {
 	if (nseries == 0)
-	    sts = series_all_metrics(settings, redis, arg);
+	    sts = series_all_metrics(settings, slots, arg);
 	else
 	    sts = -EINVAL;
 	goto done;
     }
 
-    if ((sts = series_metric_name_prepare(settings, redis, arg)) < 0)
+    if ((sts = series_metric_name_prepare(settings, slots, arg)) < 0)
 	goto done;
-    if ((sts = series_metric_name_execute(settings, redis, &rp, &map, arg)) < 0)
+    if ((sts = series_metric_name_execute(settings, slots, &rp, &map, arg)) < 0)
 	goto done;
 
     /* prepare command series */
@@ -1274,7 +1914,7 @@ pmSeriesMetric(pmSeriesSettings *settings,
     for (i = 0; i < nseries; i++) {
 	len = redisFormatCommand(&cmd, "SMEMBERS pcp:metric.name:series:%s",
 				series[i].name);
-	if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+	if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg),
 			"failed pcp:metric.name:series:%.*s smembers",
 			PMSIDSZ, series[i].name);
@@ -1293,7 +1933,7 @@ pmSeriesMetric(pmSeriesSettings *settings,
 
     /* unpack - iterate over series and extract names for each via map */
     for (i = 0; i < nseries; i++) {
-	if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+	if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg), "SMEMBERS series %.*s query failed",
 			PMSIDSZ, series[i].name);
 	    settings->on_info(PMSERIES_REQUEST, msg, arg);
@@ -1321,6 +1961,7 @@ pmSeriesMetric(pmSeriesSettings *settings,
     freeReplyObject(rp);
 
 done:
+    redis_stop(slots);
     querydone(settings, sts, arg);
 }
 
@@ -1457,7 +2098,7 @@ void
 pmSeriesDesc(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisSlots		*slots = redis_init();
     redisReply		*reply;
     char		msg[MSGSIZE];
     char		*cmd;
@@ -1469,7 +2110,7 @@ pmSeriesDesc(pmSeriesSettings *settings,
 	len = redisFormatCommand(&cmd, "HMGET pcp:desc:series:%s "
 			"domain cluster item serial semantics type units",
 			series[i].name);
-	if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+	if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg), "failed pcp:desc:series:%.*s HMGET",
 			PMSIDSZ, series[i].name);
 	    settings->on_info(PMSERIES_REQUEST, msg, arg);
@@ -1487,7 +2128,7 @@ pmSeriesDesc(pmSeriesSettings *settings,
 
     /* unpack - iterate over series and extract descriptor for each */
     for (i = 0; i < nseries; i++) {
-	if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+	if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg), "failed HMGET on series %.*s",
 			PMSIDSZ, series[i].name);
 	    settings->on_info(PMSERIES_RESPONSE, msg, arg);
@@ -1510,18 +2151,19 @@ pmSeriesDesc(pmSeriesSettings *settings,
 /*--fputs("  }\n}\n", stdout);--*TODO*/
 
 done:
+    redis_stop(slots);
     querydone(settings, sts, arg);
 }
 
 static int
 series_inst_name_prepare(pmSeriesSettings *settings,
-	redisContext *redis, void *arg)
+	redisSlots *slots, void *arg)
 {
     char		*cmd;
     int			len, sts = 0;
 
     len = redisFormatCommand(&cmd, "HGETALL pcp:map:inst.name");
-    if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+    if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	settings->on_info(PMSERIES_REQUEST, "failed pcp:map:inst.name HGETALL", arg);
 	sts = -EINVAL;
     }
@@ -1531,13 +2173,13 @@ series_inst_name_prepare(pmSeriesSettings *settings,
 
 static int
 series_inst_name_execute(pmSeriesSettings *settings, 
-	redisContext *redis, redisReply **rp, reverseMap *mp, void *arg)
+	redisSlots *slots, redisReply **rp, reverseMap *mp, void *arg)
 {
     redisReply		*reply;
     char		msg[MSGSIZE];
     int			sts;
 
-    if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+    if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	pmsprintf(msg, sizeof(msg), "failed HGETALL pcp:map:inst.name");
 	queryinfo(settings, PMSERIES_RESPONSE, msg, arg);
 	sts = -EAGAIN;
@@ -1604,7 +2246,7 @@ void
 pmSeriesInstance(pmSeriesSettings *settings,
 	int nseries, pmSeriesID *series, void *arg)
 {
-    redisContext	*redis = redis_init();
+    redisSlots		*slots = redis_init();
     redisReply		*reply, *rp;
     reverseMap		map;
     char		*cmd;
@@ -1618,9 +2260,9 @@ pmSeriesInstance(pmSeriesSettings *settings,
 	    sts = -EINVAL;
 	goto done;
     }
-    if ((sts = series_inst_name_prepare(settings, redis, arg)) < 0)
+    if ((sts = series_inst_name_prepare(settings, slots, arg)) < 0)
 	goto done;
-    if ((sts = series_inst_name_execute(settings, redis, &rp, &map, arg)) < 0)
+    if ((sts = series_inst_name_execute(settings, slots, &rp, &map, arg)) < 0)
 	goto done;
 
     /* prepare command series */
@@ -1628,7 +2270,7 @@ pmSeriesInstance(pmSeriesSettings *settings,
     for (i = 0; i < nseries; i++) {
 	len = redisFormatCommand(&cmd, "HMGET pcp:inst:series:%s id name",
 			series[i].name);
-	if (redisAppendFormattedCommand(redis, cmd, len) != REDIS_OK) {
+	if (redisSlotsAppendFormatted(slots, NULL, cmd, len) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg), "failed pcp:inst:series:%.*s HMGET",
 			PMSIDSZ, series[i].name);
 	    queryinfo(settings, PMSERIES_REQUEST, msg, arg);
@@ -1646,7 +2288,7 @@ pmSeriesInstance(pmSeriesSettings *settings,
 
     /* unpack - iterate over series and extract instance (if any) for each */
     for (i = 0; i < nseries; i++) {
-	if (redisGetReply(redis, (void **)&reply) != REDIS_OK) {
+	if (redisSlotsGetReply(slots, &reply) != REDIS_OK) {
 	    pmsprintf(msg, sizeof(msg), "failed pcp:inst:series:%.*s HMGET",
 			PMSIDSZ, series[i].name);
 	    settings->on_info(PMSERIES_RESPONSE, msg, arg);
@@ -1672,5 +2314,6 @@ pmSeriesInstance(pmSeriesSettings *settings,
     freeReplyObject(rp);
 
 done:
+    redis_stop(slots);
     querydone(settings, sts, arg);
 }
@@ -71,6 +71,7 @@ typedef pmseries_flags flags_t;
 
 extern int series_solve(settings_t *, node_t *, timing_t *, flags_t, void *);
 extern int series_source(settings_t *, node_t *, timing_t *, flags_t, void *);
+extern int series_vacuum(settings_t *, node_t *, timing_t *, flags_t, void *);
 
 extern char *series_instance_name(char *, size_t);
 extern char *series_metric_name(char *, size_t);
@@ -109,6 +110,10 @@ extern char *series_note_name(char *, size_t);
 #define N_RESCALE	29
 #define N_SCALE		30
 #define N_DEFINED	31
+#define N_STDDEV	32
+#define N_PERCENTILE	33
+#define N_TOPK		34
+#define N_BOTTOMK	35
 
 /* node_t time-related sub-types */
 #define N_RANGE		100
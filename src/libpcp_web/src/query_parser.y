@@ -49,6 +49,7 @@ static node_t *newnode(int);
 static node_t *newmetric(char *);
 static node_t *newmetricquery(char *, node_t *);
 static node_t *newtree(int, node_t *, node_t *);
+static node_t *newfunction(PARSER *, int, node_t *, node_t *);
 static void newaligntime(PARSER *, const char *);
 static void newstarttime(PARSER *, const char *);
 static void newinterval(PARSER *, const char *);
@@ -107,6 +108,10 @@ static const char initial_str[]  = "Unexpected initial";
 %token      L_ANON
 %token      L_RATE
 %token      L_INSTANT
+%token      L_STDDEV
+%token      L_PERCENTILE
+%token      L_TOPK
+%token      L_BOTTOMK
 %token      L_LT
 %token      L_LEQ
 %token      L_EQ
@@ -144,7 +149,7 @@ static const char initial_str[]  = "Unexpected initial";
 
 %type  <n>  query
 %type  <n>  expr
-//%type  <n>  func
+%type  <n>  func
 %type  <n>  exprlist
 %type  <n>  exprval
 %type  <n>  number
@@ -163,39 +168,41 @@ static const char initial_str[]  = "Unexpected initial";
  * yacc productions
  ***********************************************************************/
 
-query	: vector
-	| L_NAME L_ASSIGN vector
+query	: vector L_EOS
+		{ YYACCEPT; }
+	| L_NAME L_ASSIGN vector L_EOS
 		{ lp->yy_series.name = $1;
 		  $$ = lp->yy_series.expr;
 		  YYACCEPT;
 		}
+	| func L_EOS
+		{ YYACCEPT; }
 	/* TODO: vector expressions (many) */
 	;
 
-vector:	L_NAME L_LBRACE exprlist L_RBRACE L_EOS
+vector:	L_NAME L_LBRACE exprlist L_RBRACE
 		{ lp->yy_np = newmetricquery($1, $3);
 		  $$ = lp->yy_series.expr = lp->yy_np;
-		  YYACCEPT;
 		}
-	| L_NAME L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE L_EOS
+	| L_NAME L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE
 		{ lp->yy_np = newmetricquery($1, $3);
 		  $$ = lp->yy_series.expr = lp->yy_np;
-		  YYACCEPT;
 		}
-	| L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE L_EOS
-		{ lp->yy_np = lp->yy_series.expr = $2; YYACCEPT; }
-	| L_LBRACE exprlist L_RBRACE L_EOS
-		{ lp->yy_np = lp->yy_series.expr = $2; YYACCEPT; }
-	| L_NAME L_LSQUARE timelist L_RSQUARE L_EOS
+	| L_LBRACE exprlist L_RBRACE L_LSQUARE timelist L_RSQUARE
+		{ $$ = lp->yy_np = lp->yy_series.expr = $2; }
+	| L_LBRACE exprlist L_RBRACE
+		{ $$ = lp->yy_np = lp->yy_series.expr = $2; }
+	| L_NAME L_LSQUARE timelist L_RSQUARE
 		{ lp->yy_np = newmetric($1);
 		  $$ = lp->yy_series.expr = lp->yy_np;
-		  YYACCEPT;
 		}
-	| L_NAME L_EOS
+	| L_NAME
 		{ lp->yy_np = newmetric($1);
 		  $$ = lp->yy_series.expr = lp->yy_np;
-		  YYACCEPT;
 		}
+	| L_LSQUARE timelist L_RSQUARE	/* all series, see pmSeriesVacuum */
+		{ $$ = lp->yy_np = lp->yy_series.expr = NULL; }
+	;
 
 exprlist : exprlist L_COMMA expr
 		{ lp->yy_np = newnode(N_AND);
@@ -294,100 +301,32 @@ expr	: /* relational expressions */
 	/* TODO: error reporting */
 	;
 
-	/* TODO: functions */
-//func	: L_AVG L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_AVG);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_COUNT L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_COUNT);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_DELTA L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_DELTA);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_MAX L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_MAX);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_MIN L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_MIN);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_SUM L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_SUM);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_RATE L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_RATE);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_INSTANT L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_INSTANT);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_DEFINED L_LPAREN L_NAME L_RPAREN
-//		{ lp->yy_np = newnode(N_DEFINED);
-//		  lp->yy_np->left = newnode(N_NAME);
-//		  lp->yy_np->left->value = $3;
-//		  $$ = lp->yy_np;
-//		}
-//	| L_RESCALE L_LPAREN expr L_COMMA L_STRING L_RPAREN
-//		{ double		mult;
-//		  struct pmUnits	units;
-//		  char			*errmsg;
-//
-//		  lp->yy_np = newnode(N_RESCALE);
-//		  lp->yy_np->left = $3;
-//		  if (pmParseUnitsStr($5, &units, &mult, &errmsg) < 0) {
-//		      gramerr(lp, "Illegal units:", NULL, errmsg);
-//		      free(errmsg);
-//		      series_error(lp, NULL);
-//		      return -1;
-//		  }
-//		  lp->yy_np->right = newnode(N_SCALE);
-//		  lp->yy_np->right->meta.units = units;	/* struct assign */
-//		  free($5);
-//		  $$ = lp->yy_np;
-//		}
-//	| L_AVG L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "avg("); YYERROR; }
-//	| L_COUNT L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "count("); YYERROR; }
-//	| L_DELTA L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "delta("); YYERROR; }
-//	| L_MAX L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "max("); YYERROR; }
-//	| L_MIN L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "min("); YYERROR; }
-//	| L_SUM L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "sum("); YYERROR; }
-//	| L_RATE L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "rate("); YYERROR; }
-//	| L_INSTANT L_LPAREN error
-//		{ gramerr(lp, name_str, follow, "instant("); YYERROR; }
-//	| L_RESCALE L_LPAREN error
-//		{ gramerr(lp, op_str, follow, "rescale("); YYERROR; }
-//	| L_RESCALE L_LPAREN expr L_COMMA error
-//		{ gramerr(lp, "Units string", follow, "rescale(<expr>,"); YYERROR; }
-//	;
+	/* functions, reducing the values of each series in the server */
+func	: L_AVG L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_AVG, $3, NULL)) == NULL) YYERROR; }
+	| L_COUNT L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_COUNT, $3, NULL)) == NULL) YYERROR; }
+	| L_DELTA L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_DELTA, $3, NULL)) == NULL) YYERROR; }
+	| L_MAX L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_MAX, $3, NULL)) == NULL) YYERROR; }
+	| L_MIN L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_MIN, $3, NULL)) == NULL) YYERROR; }
+	| L_SUM L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_SUM, $3, NULL)) == NULL) YYERROR; }
+	| L_RATE L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_RATE, $3, NULL)) == NULL) YYERROR; }
+	| L_STDDEV L_LPAREN vector L_RPAREN
+		{ if (($$ = newfunction(lp, N_STDDEV, $3, NULL)) == NULL) YYERROR; }
+	| L_PERCENTILE L_LPAREN vector L_COMMA number L_RPAREN
+		{ if (($$ = newfunction(lp, N_PERCENTILE, $3, $5)) == NULL) YYERROR; }
+	| L_TOPK L_LPAREN vector L_COMMA number L_RPAREN
+		{ if (($$ = newfunction(lp, N_TOPK, $3, $5)) == NULL) YYERROR; }
+	| L_BOTTOMK L_LPAREN vector L_COMMA number L_RPAREN
+		{ if (($$ = newfunction(lp, N_BOTTOMK, $3, $5)) == NULL) YYERROR; }
+
+	/* TODO: instant, defined, rescale and nested functions */
+	;
 
 %%
 
@@ -399,10 +338,15 @@ static const struct {
 } func[] = {
     { L_AVG,	sizeof("avg")-1,	"avg" },
     { L_COUNT,	sizeof("count")-1,	"count" },
+    { L_DELTA,	sizeof("delta")-1,	"delta" },
     { L_MAX,    sizeof("max")-1,	"max" },
     { L_MIN,    sizeof("min")-1,	"min" },
     { L_SUM,    sizeof("sum")-1,	"sum" },
     { L_RATE,   sizeof("rate")-1,	"rate" },
+    { L_STDDEV, sizeof("stddev")-1,	"stddev" },
+    { L_PERCENTILE, sizeof("percentile")-1, "percentile" },
+    { L_TOPK,   sizeof("topk")-1,	"topk" },
+    { L_BOTTOMK, sizeof("bottomk")-1,	"bottomk" },
     { L_UNDEF,  0,			NULL }
 };
 
@@ -443,6 +387,10 @@ static struct {
     { L_ANON,		N_ANON,		"ANON",		NULL },
     { L_RATE,		N_RATE,		"RATE",		NULL },
     { L_INSTANT,	N_INSTANT,	"INSTANT",	NULL },
+    { L_STDDEV,		N_STDDEV,	"STDDEV",	NULL },
+    { L_PERCENTILE,	N_PERCENTILE,	"PERCENTILE",	NULL },
+    { L_TOPK,		N_TOPK,		"TOPK",		NULL },
+    { L_BOTTOMK,	N_BOTTOMK,	"BOTTOMK",	NULL },
     { L_MKCONST,	0,		"MKCONST",	NULL },
     { L_RESCALE,	N_RESCALE,	"RESCALE",	NULL },
     { 0,		N_SCALE,	"SCALE",	NULL },
@@ -532,6 +480,35 @@ newtree(int type, node_t *left, node_t *right)
     return tree;
 }
 
+static node_t *
+newfunction(PARSER *lp, int type, node_t *vector, node_t *param)
+{
+    node_t	*func;
+    double	value = param ? strtod(param->value, NULL) : 0;
+
+    switch (type) {
+    case N_PERCENTILE:
+	if (value <= 0 || value > 100) {
+	    lp->yy_errstr = "Percentile must be above 0 and at most 100";
+	    lp->yy_error = -EINVAL;
+	    return NULL;
+	}
+	break;
+    case N_TOPK: case N_BOTTOMK:
+	if (param->type != N_INTEGER || value < 1) {
+	    lp->yy_errstr = "Sample count must be a positive integer";
+	    lp->yy_error = -EINVAL;
+	    return NULL;
+	}
+	break;
+    default:
+	break;
+    }
+    func = newtree(type, vector, param);
+    lp->yy_np = lp->yy_series.expr = func;
+    return func;
+}
+
 static node_t *
 newmetric(char *name)
 {
@@ -1179,6 +1156,7 @@ series_dumpexpr(node_t *np, int level)
 	break;
     case N_AVG: case N_COUNT:   case N_DELTA:   case N_MAX:     case N_MIN:
     case N_SUM: case N_ANON:    case N_RATE:    case N_INSTANT: case N_RESCALE:
+    case N_STDDEV: case N_PERCENTILE: case N_TOPK: case N_BOTTOMK:
 	fprintf(stderr, "%*s%s()", level*4, "", n_type_str(np->type));
 	break;
     case N_SCALE: {
@@ -1237,3 +1215,22 @@ pmSeriesLoad(pmSeriesSettings *settings,
     }
     settings->on_done(sts, arg);
 }
+
+void
+pmSeriesVacuum(pmSeriesSettings *settings,
+	const char *policy, pmseries_flags flags, void *arg)
+{
+    int		sts;
+    PARSER	yp = { .yy_settings = settings };
+    series_t	*sp = &yp.yy_series;
+
+    yp.yy_input = (char *)policy;
+    if (series_parse(&yp)) {
+	sts = yp.yy_error;
+    } else {
+	if (pmDebugOptions.series)
+	    series_dumpexpr(sp->expr, 0);
+	sts = series_vacuum(settings, sp->expr, &sp->time, flags, arg);
+    }
+    settings->on_done(sts, arg);
+}
@@ -12,8 +12,12 @@
  * for more details.
  */
 #include <hiredis/hiredis.h>
+#include <pthread.h>
 #include "redis.h"
+#include "slots.h"
 #include "util.h"
+#include "chunk.h"
+#include "libpcp.h"
 
 #define PCP_SCHEMA_VERSION 1
 
@@ -22,6 +26,7 @@ typedef struct redis_script {
     char	*hash;
 } redisScript;
 
+static pthread_mutex_t	scripts_lock = PTHREAD_MUTEX_INITIALIZER;
 static redisScript scripts[] = {
 /* Script HASH_MAP_ID pcp:map:<name> , <string> -> ID
 	returns a map identifier from a given key (hash) and
@@ -37,12 +42,100 @@ static redisScript scripts[] = {
 	"end\n"
 	"return tonumber(ID)\n"
     },
+/* Script SERIES_REDUCE pcp:values:series:<id> , <max> <min> <offset> <count>
+	<function> <parameter> -> (value, timestamp) pairs
+	applies a function to the values of one series within the
+	given time window, so that only the reduced points need to be
+	returned.  Aggregates (avg, count, max, min, sum, stddev and
+	percentile) give one value stamped with the latest sample time,
+	rate and delta give one value per sample interval, and topk and
+	bottomk the <parameter> largest or smallest samples.  Reply
+	format matches ZREVRANGEBYSCORE WITHSCORES (newest first).
+ */
+    { .script = \
+	"local F, P = ARGV[5], tonumber(ARGV[6])\n"
+	"local R = redis.call('ZREVRANGEBYSCORE', KEYS[1], ARGV[1], ARGV[2],\n"
+	"                     'WITHSCORES', 'LIMIT', ARGV[3], ARGV[4])\n"
+	"local S, V, T = {}, {}, {}\n"
+	"for i = 1, #R, 2 do\n"
+	"    local v = tonumber(R[i])\n"
+	"    if v then\n"
+	"        S[#S+1] = R[i]; V[#V+1] = v; T[#T+1] = R[i+1]\n"
+	"    end\n"
+	"end\n"
+	"local N = #V\n"
+	"if N == 0 then return {} end\n"
+	"local function fmt(x) return string.format('%.16g', x) end\n"
+	"local out = {}\n"
+	"if F == 'rate' or F == 'delta' then\n"
+	"    for i = 1, N - 1 do\n"
+	"        local d = V[i] - V[i+1]\n"
+	"        local dt = tonumber(T[i]) - tonumber(T[i+1])\n"
+	"        if F == 'delta' then\n"
+	"            out[#out+1] = fmt(d); out[#out+1] = T[i]\n"
+	"        elseif d >= 0 and dt > 0 then\n"	/* skip counter wraps */
+	"            out[#out+1] = fmt(d / dt); out[#out+1] = T[i]\n"
+	"        end\n"
+	"    end\n"
+	"    return out\n"
+	"end\n"
+	"if F == 'topk' or F == 'bottomk' then\n"
+	"    local I = {}\n"
+	"    for i = 1, N do I[i] = i end\n"
+	"    if F == 'topk' then\n"
+	"        table.sort(I, function(a, b) return V[a] > V[b] end)\n"
+	"    else\n"
+	"        table.sort(I, function(a, b) return V[a] < V[b] end)\n"
+	"    end\n"
+	"    for i = 1, math.min(P, N) do\n"
+	"        out[#out+1] = S[I[i]]; out[#out+1] = T[I[i]]\n"
+	"    end\n"
+	"    return out\n"
+	"end\n"
+	"local sum, min, max, r = 0, V[1], V[1], nil\n"
+	"for i = 1, N do\n"
+	"    sum = sum + V[i]\n"
+	"    if V[i] < min then min = V[i] end\n"
+	"    if V[i] > max then max = V[i] end\n"
+	"end\n"
+	"if F == 'sum' then r = sum\n"
+	"elseif F == 'avg' then r = sum / N\n"
+	"elseif F == 'count' then r = N\n"
+	"elseif F == 'min' then r = min\n"
+	"elseif F == 'max' then r = max\n"
+	"elseif F == 'stddev' then\n"
+	"    local mean, sq = sum / N, 0\n"
+	"    for i = 1, N do sq = sq + (V[i] - mean) ^ 2 end\n"
+	"    r = math.sqrt(sq / N)\n"
+	"elseif F == 'percentile' then\n"	/* nearest rank */
+	"    table.sort(V)\n"
+	"    r = V[math.max(1, math.ceil(P / 100 * N))]\n"
+	"else\n"
+	"    return redis.error_reply('unknown series function ' .. F)\n"
+	"end\n"
+	"return { fmt(r), T[1] }\n"
+    },
+/* Script SERIES_VACUUM pcp:values:series:<id> , <cutoff> <batch> -> count
+	removes the oldest values of one series, stamped before the
+	cutoff time, at most (roughly) batch values per call to bound
+	the time the server spends in the script.  Returns the number
+	removed; a result below batch means the series is now trimmed.
+ */
+    { .script = \
+	"local R = redis.call('ZRANGEBYSCORE', KEYS[1], '-inf', '(' .. ARGV[1],\n"
+	"                     'WITHSCORES', 'LIMIT', 0, ARGV[2])\n"
+	"if #R == 0 then return 0 end\n"
+	"return redis.call('ZREMRANGEBYSCORE', KEYS[1], '-inf', R[#R])\n"
+    },
 };
 
-enum {
-    HASH_MAP_ID = 0,
-    NSCRIPTS
-};
+const char *
+redis_script(int script, const char **hash)
+{
+    if (hash)
+	*hash = scripts[script].hash;
+    return scripts[script].script;
+}
 
 static void
 redis_load_scripts(redisContext *redis)
@@ -68,10 +161,14 @@ redis_load_scripts(redisContext *redis)
 			    i, reply->str, scripts[i].script);
 	    exit(1);
 	}
-	if ((scripts[i].hash = strdup(reply->str)) == NULL) {
+	/* the hash is the same from every connection, keep the first */
+	pthread_mutex_lock(&scripts_lock);
+	if (scripts[i].hash == NULL &&
+	    (scripts[i].hash = strdup(reply->str)) == NULL) {
 	    fprintf(stderr, "Failed to save LUA script SHA1 hash\n");
 	    exit(1);
 	}
+	pthread_mutex_unlock(&scripts_lock);
 	freeReplyObject(reply);
 
 	if (pmDebugOptions.series)
@@ -109,33 +206,253 @@ checkInteger(redisReply *reply, const char *format, ...)
     exit(1);
 }
 
+/*
+ * Loading an archive issues several commands for every value, and the
+ * replies carry nothing we need beyond success or failure.  So these
+ * commands are pipelined - appended to the output buffer of the Redis
+ * node serving each key, then sent and their replies read back and
+ * checked a batch at a time - rather than paying a network round trip
+ * per command.
+ *
+ * String map identifiers are needed immediately (they form part of
+ * later commands), so these are cached locally instead; each string
+ * costs one round trip the first time it is seen, and none after.
+ * The cache may be shared by the batches of several loader threads.
+ * Identifiers are assigned by a script, which Redis runs atomically,
+ * so a string gets the same identifier from any connection and it
+ * does not matter which thread asks first.
+ */
+#define BATCH_SIZE	1024	/* commands in flight before reading replies */
+
+typedef enum {
+    REPLY_STATUS,		/* expecting OK (or QUEUED) */
+    REPLY_INTEGER,
+} batchReply;
+
+typedef struct {
+    batchReply		reply;
+    const char		*what;		/* error message format, for key */
+    char		key[PMSIDSZ+1];
+} batchCommand;
+
+typedef struct {
+    int			id;
+    char		*value;
+    char		map[1];		/* map name, then value, allocated */
+} stringMap;
+
+struct redisMap {
+    pthread_mutex_t	lock;
+    __pmHashCtl		hash;		/* stringMap entries */
+};
+
+struct redisBatch {
+    redisSlots		*slots;
+    redisMap		*strmap;	/* local string map identifier cache */
+    unsigned int	window;		/* chunked values window, seconds */
+    unsigned int	count;		/* commands awaiting replies */
+    batchCommand	commands[BATCH_SIZE];
+};
+
+redisMap *
+redis_map_init(void)
+{
+    redisMap		*map;
+
+    if ((map = (redisMap *)calloc(1, sizeof(redisMap))) == NULL) {
+	fprintf(stderr, "%s: out of memory (redis map, %lld bytes)\n",
+		pmGetProgname(), (long long)sizeof(redisMap));
+	exit(1);
+    }
+    pthread_mutex_init(&map->lock, NULL);
+    __pmHashInit(&map->hash);
+    return map;
+}
+
+void
+redis_map_free(redisMap *map)
+{
+    __pmHashNode	*hp, *next;
+    int			i;
+
+    for (i = 0; i < map->hash.hsize; i++) {
+	for (hp = map->hash.hash[i]; hp != NULL; hp = next) {
+	    next = hp->next;
+	    free(hp->data);
+	    free(hp);
+	}
+    }
+    __pmHashClear(&map->hash);
+    pthread_mutex_destroy(&map->lock);
+    free(map);
+}
+
+redisBatch *
+redis_batch_init(redisSlots *slots, redisMap *strmap)
+{
+    redisBatch		*batch;
+
+    if ((batch = (redisBatch *)calloc(1, sizeof(redisBatch))) == NULL) {
+	fprintf(stderr, "%s: out of memory (redis batch, %lld bytes)\n",
+		pmGetProgname(), (long long)sizeof(redisBatch));
+	exit(1);
+    }
+    batch->slots = slots;
+    batch->strmap = strmap;
+    batch->window = redis_chunk_window(slots, 1);
+    return batch;
+}
+
+void
+redis_batch_flush(redisBatch *batch)
+{
+    batchCommand	*cp;
+    redisReply		*reply;
+    unsigned int	i;
+
+    for (i = 0; i < batch->count; i++) {
+	cp = &batch->commands[i];
+	if (redisSlotsGetReply(batch->slots, &reply) != REDIS_OK) {
+	    fprintf(stderr, "Failed redis reply (%s) for ",
+			    redisSlotsErrstr(batch->slots));
+	    fprintf(stderr, cp->what, cp->key);
+	    exit(1);
+	}
+	if (cp->reply == REPLY_STATUS)
+	    checkStatusOK(reply, cp->what, cp->key);
+	else
+	    checkInteger(reply, cp->what, cp->key);
+	freeReplyObject(reply);
+    }
+    batch->count = 0;
+}
+
+void
+redis_batch_free(redisBatch *batch)
+{
+    redis_batch_flush(batch);
+    free(batch);
+}
+
+/*
+ * Queue a command whose reply is checked later, at the next flush;
+ * the what format and key (usually the series) describe any failure.
+ */
+static void
+redis_batch_append(redisBatch *batch, batchReply reply,
+		const char *what, const char *key, const char *format, ...)
+{
+    batchCommand	*cp;
+    va_list		arg;
+    int			sts;
+
+    if (batch->count == BATCH_SIZE)
+	redis_batch_flush(batch);
+
+    va_start(arg, format);
+    sts = redisSlotsvAppendCommand(batch->slots, NULL, format, arg);
+    va_end(arg);
+    if (sts != REDIS_OK) {
+	fprintf(stderr, "Failed to append redis command (%s) for ",
+			redisSlotsErrstr(batch->slots));
+	fprintf(stderr, what, key);
+	exit(1);
+    }
+
+    cp = &batch->commands[batch->count++];
+    cp->reply = reply;
+    cp->what = what;
+    pmsprintf(cp->key, sizeof(cp->key), "%s", key);
+}
+
+static unsigned int
+strmap_hash(const char *map, const char *value)
+{
+    unsigned int	hash = 2166136261U;	/* FNV-1a */
+    const char		*p;
+
+    for (p = map; *p; p++)
+	hash = (hash ^ (unsigned char)*p) * 16777619U;
+    hash = (hash ^ 0xff) * 16777619U;
+    for (p = value; *p; p++)
+	hash = (hash ^ (unsigned char)*p) * 16777619U;
+    return hash;
+}
+
+/* caller holds the map lock */
+static stringMap *
+strmap_lookup(redisMap *strmap, unsigned int key, const char *map, const char *value)
+{
+    __pmHashNode	*hp;
+    stringMap		*sm;
+
+    for (hp = __pmHashSearch(key, &strmap->hash); hp; hp = hp->next) {
+	if (hp->key != key)
+	    continue;
+	sm = (stringMap *)hp->data;
+	if (strcmp(sm->map, map) == 0 && strcmp(sm->value, value) == 0)
+	    return sm;
+    }
+    return NULL;
+}
+
 static int
-redis_strmap(redisContext *redis, char *map, char *value)
+redis_strmap(redisBatch *batch, const char *map, const char *value)
 {
-    redisReply	*reply;
-    int		mapID;
+    redisMap		*strmap = batch->strmap;
+    redisReply		*reply;
+    stringMap		*sm;
+    size_t		maplen, valuelen;
+    unsigned int	key = strmap_hash(map, value);
+    int			mapID;
+
+    pthread_mutex_lock(&strmap->lock);
+    sm = strmap_lookup(strmap, key, map, value);
+    mapID = sm ? sm->id : 0;
+    pthread_mutex_unlock(&strmap->lock);
+    if (mapID)
+	return mapID;
+
+    /* replies to any queued commands arrive ahead of this one */
+    redis_batch_flush(batch);
 
-    reply = redisCommand(redis,
+    reply = redisSlotsCommand(batch->slots, map,
 			"EVALSHA %s 1 %s %s",
 			scripts[HASH_MAP_ID].hash, map, value);
-    if (reply && reply->type == REDIS_REPLY_INTEGER) {
-	mapID = reply->integer;
-	freeReplyObject(reply);
-	return mapID;
+    if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+	fprintf(stderr, "Failed to EVALSHA %s, string map for %s[%s]\n",
+			scripts[HASH_MAP_ID].hash, map, value);
+	exit(1);
     }
+    mapID = reply->integer;
+    freeReplyObject(reply);
 
-    fprintf(stderr, "Failed to EVALSHA %s, string map for %s[%s]\n",
-		    scripts[HASH_MAP_ID].hash, map, value);
-    exit(1);
+    /* another thread may have mapped the same string meanwhile */
+    pthread_mutex_lock(&strmap->lock);
+    maplen = strlen(map) + 1;
+    valuelen = strlen(value) + 1;
+    if (strmap_lookup(strmap, key, map, value) == NULL &&
+	(sm = (stringMap *)malloc(sizeof(stringMap) + maplen + valuelen)) != NULL) {
+	sm->id = mapID;
+	memcpy(sm->map, map, maplen);
+	sm->value = sm->map + maplen;
+	memcpy(sm->value, value, valuelen);
+	if (__pmHashAdd(key, (void *)sm, &strmap->hash) < 0)
+	    free(sm);
+    }
+    pthread_mutex_unlock(&strmap->lock);
+    return mapID;
 }
 
 void
-redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_desc(redisBatch *batch, metric_t *metric, value_t *value)
 {
-    redisReply	*reply;
+    char	units[60];
 
+    pmUnitsStr_r(&metric->desc.units, units, sizeof(units));
     if (metric->desc.indom != PM_INDOM_NULL) {
-	reply = redisCommand(redis,
+	redis_batch_append(batch, REPLY_STATUS,
+		"pcp:desc:series:%s setup\n", value->hash,
 		"HMSET pcp:desc:series:%s"
 		" cluster %u"
 		" domain %u"
@@ -151,9 +468,10 @@ redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
 	    metric->desc.sem,
 	    pmInDom_serial(metric->desc.indom),
 	    metric->desc.type,
-	    pmUnitsStr(&metric->desc.units));
+	    units);
     } else {
-	reply = redisCommand(redis,
+	redis_batch_append(batch, REPLY_STATUS,
+		"pcp:desc:series:%s setup\n", value->hash,
 		"HMSET pcp:desc:series:%s"
 		" cluster %u"
 		" domain %u"
@@ -167,71 +485,63 @@ redis_series_desc(redisContext *redis, metric_t *metric, value_t *value)
 	    pmID_item(metric->desc.pmid),
 	    metric->desc.sem,
 	    metric->desc.type,
-	    pmUnitsStr(&metric->desc.units));
+	    units);
     }
-    checkStatusOK(reply, "pcp:desc:series:%s setup\n", value->hash);
-    freeReplyObject(reply);
 }
 
 void
-redis_series_inst(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_inst(redisBatch *batch, metric_t *metric, value_t *value)
 {
-    redisReply	*reply;
     int		mapID;
 
     if (!value->name)
 	return;
-    mapID = redis_strmap(redis, "pcp:map:inst.name", value->name);
+    mapID = redis_strmap(batch, "pcp:map:inst.name", value->name);
 
-    reply = redisCommand(redis,
+    redis_batch_append(batch, REPLY_STATUS,
+		"pcp:inst:series:%s setup\n", value->hash,
 		"HMSET pcp:inst:series:%s id %u name %u",
 		value->hash, value_instid(value), mapID);
-    checkStatusOK(reply, "pcp:inst:series:%s setup\n", value->hash);
-    freeReplyObject(reply);
 
-    reply = redisCommand(redis,
+    redis_batch_append(batch, REPLY_INTEGER,
+		"pcp:series:inst.name (sadd %s)\n", value->hash,
 		"SADD pcp:series:inst.name:%u %s", mapID, value->hash);
-    checkInteger(reply, "pcp:series:inst.name:%u (sadd %s)\n", mapID, value->hash);
-    freeReplyObject(reply);
 }
 
 static int
-redis_series_name(redisContext *redis, metric_t *mp, int index, value_t *value)
+redis_series_name(redisBatch *batch, metric_t *mp, int index, value_t *value)
 {
-    redisReply	*reply;
     char	*name = mp->names[index];
     int		mapID = mp->mapids[index];
 
     if (!name)
 	return -EINVAL;
     if (!mapID) {
-	mapID = redis_strmap(redis, "pcp:map:metric.name", name);
+	mapID = redis_strmap(batch, "pcp:map:metric.name", name);
 	mp->mapids[index] = mapID;
     }
 
-    reply = redisCommand(redis,
+    redis_batch_append(batch, REPLY_INTEGER,
+		"pcp:series:metric.name:%s (sadd)\n", value->hash,
 		"SADD pcp:metric.name:series:%s %u", value->hash, mapID);
-    checkInteger(reply, "pcp:series:metric.name:%s (sadd %u)\n", value->hash, mapID);
-    freeReplyObject(reply);
 
-    reply = redisCommand(redis,
+    redis_batch_append(batch, REPLY_INTEGER,
+		"pcp:series:metric.name (sadd %s)\n", value->hash,
 		"SADD pcp:series:metric.name:%u %s", mapID, value->hash);
-    checkInteger(reply, "pcp:series:metric.name:%u (sadd %s)\n", mapID, value->hash);
-    freeReplyObject(reply);
     return 0;
 }
 
 static void
-redis_series_pmns(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_pmns(redisBatch *batch, metric_t *metric, value_t *value)
 {
     int		i;
 
     for (i = 0; i < metric->numnames; i++)
-	redis_series_name(redis, metric, i, value);
+	redis_series_name(batch, metric, i, value);
 }
 
 typedef struct {
-    redisContext	*redis;
+    redisBatch		*batch;
     metric_t		*metric;
     value_t		*value;
     const char		*type;
@@ -240,7 +550,6 @@ typedef struct {
 static int
 cache_annotation(const pmLabel *label, const char *json, annotate_t *my)
 {
-    redisReply	*reply;
     const char	*offset;
     size_t	length;
     char	key[256];
@@ -251,7 +560,7 @@ cache_annotation(const pmLabel *label, const char *json, annotate_t *my)
     offset = json + label->name;
     snprintf(val, sizeof(val), "%.*s", label->namelen, offset);
     snprintf(key, sizeof(key), "pcp:map:%s.name", my->type);
-    name_mapID = redis_strmap(my->redis, key, val);
+    name_mapID = redis_strmap(my->batch, key, val);
 
     offset = json + label->value;
     length = label->valuelen;
@@ -265,21 +574,17 @@ cache_annotation(const pmLabel *label, const char *json, annotate_t *my)
 
     snprintf(val, sizeof(val), "%.*s", (int)length, offset);
     snprintf(key, sizeof(key), "pcp:map:%s.%d.value", my->type, name_mapID);
-    value_mapID = redis_strmap(my->redis, key, val);
+    value_mapID = redis_strmap(my->batch, key, val);
 
-    reply = redisCommand(my->redis,
+    redis_batch_append(my->batch, REPLY_INTEGER,
+		"pcp:%s.name:series (sadd)\n", my->value->hash,
 		"SADD pcp:%s.name:series:%s %d",
 		my->type, my->value->hash, name_mapID);
-    checkInteger(reply, "pcp:%s.name:series:%s (sadd %d)\n",
-		my->type, my->value->hash, name_mapID);
-    freeReplyObject(reply);
 
-    reply = redisCommand(my->redis,
+    redis_batch_append(my->batch, REPLY_INTEGER,
+		"pcp:series:%s.value (sadd)\n", my->value->hash,
 		"SADD pcp:series:%s.%d.value:%d %s",
 		my->type, name_mapID, value_mapID, my->value->hash);
-    checkInteger(reply, "pcp:series:%s.%d.value:%d (sadd %s)\n",
-		my->type, name_mapID, value_mapID, my->value->hash);
-    freeReplyObject(reply);
     return 0;
 }
 
@@ -300,15 +605,16 @@ cache_note(const pmLabel *label, const char *json, void *arg)
 }
 
 void
-redis_series_annotate(redisContext *redis,
+redis_series_annotate(redisBatch *batch,
 	metric_t *metric, value_t *value, const char *type,
 	int (*filter)(const pmLabel *, const char *, void *))
 {
     annotate_t	annotate;
     char	buf[PM_MAXLABELJSONLEN];
+    char	errmsg[PM_MAXERRMSGLEN];
     int		sts;
 
-    annotate.redis = redis;
+    annotate.batch = batch;
     annotate.metric = metric;
     annotate.value = value;
     annotate.type = type;
@@ -316,40 +622,99 @@ redis_series_annotate(redisContext *redis,
     sts = merge_labelsets(metric, value, buf, sizeof(buf), filter, &annotate);
     if (sts < 0) {
 	fprintf(stderr, "%s: failed to merge series %s labelsets: %s\n",
-		pmGetProgname(), value->hash, pmErrStr(sts));
+		pmGetProgname(), value->hash,
+		pmErrStr_r(sts, errmsg, sizeof(errmsg)));
 	exit(1);
     }
 }
 
 void
-redis_series_metadata(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_metadata(redisBatch *batch, metric_t *metric, value_t *value)
 {
-    redis_series_pmns(redis, metric, value);
-    redis_series_inst(redis, metric, value);
-    redis_series_desc(redis, metric, value);
+    redis_series_pmns(batch, metric, value);
+    redis_series_inst(batch, metric, value);
+    redis_series_desc(batch, metric, value);
 
-    redis_series_annotate(redis, metric, value, "label", cache_label);
-    redis_series_annotate(redis, metric, value, "note", cache_note);
+    redis_series_annotate(batch, metric, value, "label", cache_label);
+    redis_series_annotate(batch, metric, value, "note", cache_note);
 }
 
+/* store the samples gathered for a series, if any, as one chunk */
 void
-redis_series_addvalue(redisContext *redis, metric_t *metric, value_t *value)
+redis_series_flush(redisBatch *batch, value_t *value)
+{
+    chunk_t	*chunk = value->chunk;
+    const void	*bytes;
+    size_t	length;
+
+    if (chunk == NULL || (bytes = chunk_bytes(chunk, &length)) == NULL)
+	return;
+    redis_batch_append(batch, REPLY_INTEGER,
+		"pcp:chunks:series:%s sorted set update\n", value->hash,
+		"ZADD pcp:chunks:series:%s %lld %b", value->hash,
+		chunk->window * batch->window, bytes, length);
+    chunk_reset(chunk);
+}
+
+/*
+ * Numeric values are gathered into one chunk per series and window,
+ * the chunk being stored (scored by its window start time) once a
+ * sample from a later window arrives, or the source is finished.
+ */
+static void
+redis_series_addchunk(redisBatch *batch, metric_t *metric, value_t *value)
+{
+    chunk_t	*chunk;
+    long long	window = value->lasttime.tv_sec / batch->window;
+    __int64_t	stamp;
+
+    if ((chunk = value->chunk) == NULL) {
+	if ((chunk = (chunk_t *)calloc(1, sizeof(chunk_t))) == NULL) {
+	    fprintf(stderr, "%s: out of memory (series chunk, %lld bytes)\n",
+		    pmGetProgname(), (long long)sizeof(chunk_t));
+	    exit(1);
+	}
+	value->chunk = chunk;
+    } else if (chunk->count && chunk->window != window) {
+	redis_series_flush(batch, value);
+    }
+    chunk->window = window;
+
+    stamp = (__int64_t)value->lasttime.tv_sec * 1000000 +
+		value->lasttime.tv_usec;
+    if (chunk_append(chunk, metric->desc.type, stamp, &value->lastval) < 0) {
+	fprintf(stderr, "%s: cannot encode value for series %s\n",
+		pmGetProgname(), value->hash);
+	exit(1);
+    }
+}
+
+void
+redis_series_addvalue(redisBatch *batch, metric_t *metric, value_t *value)
 {
-    redisReply	*reply;
     double	timestamp = pmtimevalToReal(&value->lasttime);
+    char	buffer[512];
 
-    reply = redisCommand(redis, "ZADD pcp:values:series:%s %.64g %s",
-		value->hash, timestamp, value_atomstr(metric, value));
-    checkInteger(reply, "pcp:values:series:%s sorted set update", value->hash);
-    freeReplyObject(reply);
+    if (batch->window && chunk_type(metric->desc.type)) {
+	redis_series_addchunk(batch, metric, value);
+	return;
+    }
+    redis_batch_append(batch, REPLY_INTEGER,
+		"pcp:values:series:%s sorted set update\n", value->hash,
+		"ZADD pcp:values:series:%s %.64g %s", value->hash, timestamp,
+		value_atomstr(metric, value, buffer, sizeof(buffer)));
 }
 
 static void
-redis_check_schema(redisContext *redis)
+redis_check_schema(redisSlots *slots)
 {
-    redisReply	*reply = redisCommand(redis, "GET pcp:version:schema");
+    redisReply	*reply = redisSlotsCommand(slots, NULL, "GET pcp:version:schema");
 
-    if (reply->type == REDIS_REPLY_STRING) {
+    if (reply == NULL) {
+	fprintf(stderr, "%s: cannot get schema version: %s\n",
+		pmGetProgname(), redisSlotsErrstr(slots));
+	exit(1);
+    } else if (reply->type == REDIS_REPLY_STRING) {
 	unsigned int	version = (unsigned int) atoi(reply->str);
 
 	if (!version || version > PCP_SCHEMA_VERSION) {
@@ -364,27 +729,80 @@ redis_check_schema(redisContext *redis)
     } else {
 	freeReplyObject(reply);
 
-	reply = redisCommand(redis,
+	reply = redisSlotsCommand(slots, NULL,
 		"SET pcp:version:schema %u", PCP_SCHEMA_VERSION);
+	if (reply == NULL) {
+	    fprintf(stderr, "%s: cannot set schema version: %s\n",
+		    pmGetProgname(), redisSlotsErrstr(slots));
+	    exit(1);
+	}
 	checkStatusOK(reply, "pcp:schema:version setup");
 	freeReplyObject(reply);
     }
 }
 
-redisContext *
+/*
+ * Values may be stored compressed, in chunks covering a fixed window
+ * of time (see chunk.c) - enabled by setting $PCP_SERIES_CHUNK to the
+ * window length in seconds on the first load.  The window is recorded
+ * in Redis, and from then on every load and query follows it.
+ */
+unsigned int
+redis_chunk_window(redisSlots *slots, int loading)
+{
+    redisReply	*reply;
+    char	*value, *endnum;
+    long	window = 0;
+
+    if ((reply = redisSlotsCommand(slots, NULL, "GET pcp:chunks:window")) == NULL) {
+	fprintf(stderr, "%s: cannot get chunk window: %s\n",
+		pmGetProgname(), redisSlotsErrstr(slots));
+	exit(1);
+    }
+    if (reply->type == REDIS_REPLY_STRING)
+	window = atol(reply->str);
+    freeReplyObject(reply);
+    if (window > 0 || !loading)
+	return window > 0 ? (unsigned int)window : 0;
+
+    if ((value = getenv("PCP_SERIES_CHUNK")) == NULL)
+	return 0;
+    window = strtol(value, &endnum, 10);
+    if (*endnum != '\0' || window <= 0) {
+	fprintf(stderr, "%s: ignoring bad PCP_SERIES_CHUNK window \"%s\"\n",
+		pmGetProgname(), value);
+	return 0;
+    }
+    /* first one wins, if several loads start together */
+    reply = redisSlotsCommand(slots, NULL,
+		"SET pcp:chunks:window %ld NX", window);
+    if (reply == NULL) {
+	fprintf(stderr, "%s: cannot set chunk window: %s\n",
+		pmGetProgname(), redisSlotsErrstr(slots));
+	exit(1);
+    }
+    freeReplyObject(reply);
+    return redis_chunk_window(slots, 0);
+}
+
+/*
+ * Connections are made to each node of a Redis cluster as they are
+ * first needed (keys are spread across nodes by their hash slot), and
+ * the scripts are loaded into each node as it is connected.
+ */
+redisSlots *
 redis_init(void)
 {
-    redisContext	*context;   /* TODO: redisSlots */
+    redisSlots		*slots;
 
-    if ((context = redis_connect(NULL, NULL)) == NULL)
+    if ((slots = redisSlotsInit(NULL, NULL, redis_load_scripts)) == NULL)
 	exit(1);	/* TODO: improve error handling */
-    redis_check_schema(context);
-    redis_load_scripts(context);
-    return context;
+    redis_check_schema(slots);
+    return slots;
 }
 
 void
-redis_stop(redisContext *redis)
+redis_stop(redisSlots *slots)
 {
-    redisFree(redis);
+    redisFreeSlots(slots);
 }
@@ -15,13 +15,34 @@
 #define REDIS_SERIES_H
 
 #include "load.h"
-#include <hiredis/hiredis.h>
+#include "slots.h"
 
-extern redisContext *redis_init(void);
-extern redisContext *redis_connect(char *, struct timeval *);
-extern void redis_stop(redisContext *);
+extern redisSlots *redis_init(void);
+extern redisContext *redis_connect(const char *, struct timeval *);
+extern void redis_stop(redisSlots *);
+extern unsigned int redis_chunk_window(redisSlots *, int);
 
-extern void redis_series_metadata(redisContext *, metric_t *, value_t *);
-extern void redis_series_addvalue(redisContext *, metric_t *, value_t *);
+/* server-side Lua scripts, loaded on each new connection */
+enum {
+    HASH_MAP_ID = 0,	/* string to map identifier */
+    SERIES_REDUCE,	/* apply a function to the values of a series */
+    SERIES_VACUUM,	/* trim old values of a series, a batch at a time */
+    NSCRIPTS
+};
+extern const char *redis_script(int, const char **);
+
+typedef struct redisMap redisMap;	/* string map identifier cache */
+typedef struct redisBatch redisBatch;	/* pipelined archive loading */
+
+extern redisMap *redis_map_init(void);
+extern void redis_map_free(redisMap *);
+
+extern redisBatch *redis_batch_init(redisSlots *, redisMap *);
+extern void redis_batch_flush(redisBatch *);
+extern void redis_batch_free(redisBatch *);
+
+extern void redis_series_metadata(redisBatch *, metric_t *, value_t *);
+extern void redis_series_addvalue(redisBatch *, metric_t *, value_t *);
+extern void redis_series_flush(redisBatch *, value_t *);
 
 #endif	/* REDIS_SERIES_H */
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 Red Hat.
+ * Copyright (c) 2017-2018 Red Hat.
  *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the
@@ -11,44 +11,224 @@
  * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
  * for more details.
  */
+#include <poll.h>
+#include <hiredis/async.h>
 #include "redis.h"
 #include "slots.h"
 #include "crc16.h"
+#include "libpcp.h"
 
 #define MAXSLOTS	(1<<14)	/* see CLUSTER_SLOTS in Redis sources */
 #define SLOTMASK	(MAXSLOTS-1)
+#define MAXNODES	(1<<16)	/* node indices are stored as shorts */
+#define MAXREDIRECTS	5	/* MOVED or ASK hops followed per command */
 
-typedef struct redisSlots {
-    redisContext	*contexts[MAXSLOTS];
-    const char		*hostspec;
+typedef struct redisNode {
+    char		*hostspec;	/* host:port, or unix:path */
+    redisContext	*context;	/* connected on first use */
+    unsigned int	inflight;	/* commands sent, replies not yet read */
+    unsigned int	unsent;		/* commands still in the output buffer */
+    redisAsyncContext	*async;		/* non-blocking, also on first use */
+    short		events;		/* poll events wanted for async */
+} redisNode;
+
+typedef struct slotsEvents {
+    redisSlots		*pool;
+    unsigned int	node;
+} slotsEvents;
+
+typedef struct slotsRequest {
+    redisSlots		*pool;
+    redisSlotsCallBack	callback;
+    void		*arg;
+    unsigned int	redirects;
+    size_t		length;
+    char		*cmd;		/* formatted, kept for redirection */
+} slotsRequest;
+
+typedef struct redisPending {
+    unsigned int	node;		/* index of the node it was sent to */
+    size_t		length;
+    char		*cmd;		/* formatted, kept for redirection */
+    redisReply		*reply;		/* read early, see slots_drain() */
+} redisPending;
+
+struct redisSlots {
+    unsigned short	slots[MAXSLOTS];	/* slot -> nodes[] index */
+    redisNode		*nodes;
+    unsigned int	nnodes;
     struct timeval	timeout;
-} redisSlots;
+    redisSetupCallBack	setup;		/* run on each new connection */
+
+    redisPending	*pending;	/* commands awaiting replies */
+    unsigned int	head;		/* next reply to be returned */
+    unsigned int	tail;
+    unsigned int	size;
+
+    unsigned int	requests;	/* asynchronous requests in flight */
+    char		errstr[128];
+};
+
+/* TODO: externalise Redis configuration */
+static char default_server[] = "localhost:6379";
+static struct timeval default_timeout = { 1, 500000 }; /* 1.5 secs */
+
+static void
+slots_error(redisSlots *pool, const char *message)
+{
+    pmsprintf(pool->errstr, sizeof(pool->errstr), "%s", message);
+}
+
+/* find a node by its host:port, adding it to the table if new */
+static int
+slots_node(redisSlots *pool, const char *hostspec)
+{
+    redisNode		*nodes;
+    unsigned int	i;
+
+    for (i = 0; i < pool->nnodes; i++)
+	if (strcmp(pool->nodes[i].hostspec, hostspec) == 0)
+	    return i;
+
+    if (pool->nnodes == MAXNODES) {
+	slots_error(pool, "too many cluster nodes");
+	return -E2BIG;
+    }
+    nodes = realloc(pool->nodes, (pool->nnodes + 1) * sizeof(redisNode));
+    if (nodes == NULL) {
+	slots_error(pool, "out of memory");
+	return -ENOMEM;
+    }
+    pool->nodes = nodes;
+    memset(&nodes[i], 0, sizeof(redisNode));
+    if ((nodes[i].hostspec = strdup(hostspec)) == NULL) {
+	slots_error(pool, "out of memory");
+	return -ENOMEM;
+    }
+    return pool->nnodes++;
+}
+
+static redisContext *
+slots_connect(redisSlots *pool, unsigned int node)
+{
+    redisNode		*np = &pool->nodes[node];
+
+    if (np->context == NULL) {
+	if ((np->context = redis_connect(np->hostspec, &pool->timeout)) == NULL) {
+	    pmsprintf(pool->errstr, sizeof(pool->errstr),
+			"cannot connect to %s", np->hostspec);
+	    return NULL;
+	}
+	if (pool->setup)
+	    pool->setup(np->context);
+    }
+    return np->context;
+}
 
+/*
+ * Ask the first server which node serves each range of slots.  A
+ * server without cluster support fails the request, in which case
+ * all slots stay with that one server.
+ */
+static void
+slots_topology(redisSlots *pool)
+{
+    redisReply		*reply, *range, *master;
+    redisContext	*redis = pool->nodes[0].context;
+    char		hostspec[MAXHOSTNAMELEN + 16];
+    unsigned int	i, start, end;
+    int			node;
+
+    if ((reply = redisCommand(redis, "CLUSTER SLOTS")) == NULL)
+	return;
+    if (reply->type != REDIS_REPLY_ARRAY) {
+	if (pmDebugOptions.series)
+	    fprintf(stderr, "Redis %s is not clustered\n",
+			pool->nodes[0].hostspec);
+	freeReplyObject(reply);
+	return;
+    }
+
+    /* each entry: start slot, end slot, master [host, port, ...], replicas */
+    for (i = 0; i < reply->elements; i++) {
+	range = reply->element[i];
+	if (range->type != REDIS_REPLY_ARRAY || range->elements < 3 ||
+	    range->element[0]->type != REDIS_REPLY_INTEGER ||
+	    range->element[1]->type != REDIS_REPLY_INTEGER)
+	    continue;
+	master = range->element[2];
+	if (master->type != REDIS_REPLY_ARRAY || master->elements < 2 ||
+	    master->element[0]->type != REDIS_REPLY_STRING ||
+	    master->element[1]->type != REDIS_REPLY_INTEGER)
+	    continue;
+
+	start = range->element[0]->integer & SLOTMASK;
+	end = range->element[1]->integer & SLOTMASK;
+	if (master->element[0]->len == 0)	/* unknown, use first server */
+	    node = 0;
+	else {
+	    pmsprintf(hostspec, sizeof(hostspec), "%s:%lld",
+			master->element[0]->str, master->element[1]->integer);
+	    if ((node = slots_node(pool, hostspec)) < 0)
+		break;
+	}
+	for (; start <= end; start++)
+	    pool->slots[start] = node;
+	if (pmDebugOptions.series)
+	    fprintf(stderr, "Redis slots %lld-%lld served by %s\n",
+			range->element[0]->integer, range->element[1]->integer,
+			pool->nodes[node].hostspec);
+    }
+    freeReplyObject(reply);
+}
+
+/*
+ * Setup a slot map from the given server (host:port or unix:path),
+ * which may be any one node of a Redis cluster, or a single server.
+ * Connections to other nodes are only made when first needed, and
+ * setup is called for every new connection.
+ */
 redisSlots *
-redisSlotsInit(const char *hostspec, struct timeval *timeout)
+redisSlotsInit(const char *hostspec, struct timeval *timeout,
+		redisSetupCallBack setup)
 {
     redisSlots		*pool;
 
     if ((pool = (redisSlots *)calloc(1, sizeof(redisSlots))) == NULL)
 	return NULL;
-    pool->hostspec = hostspec;
-    pool->timeout = *timeout;
+    pool->timeout = timeout ? *timeout : default_timeout;
+    pool->setup = setup;
+
+    if (slots_node(pool, hostspec ? hostspec : default_server) < 0 ||
+	slots_connect(pool, 0) == NULL) {
+	redisFreeSlots(pool);
+	return NULL;
+    }
+    slots_topology(pool);
     return pool;
 }
 
 void
 redisFreeSlots(redisSlots *pool)
 {
-    int			i;
+    unsigned int	i;
 
-    for (i = 0; i < MAXSLOTS; i++) {
-	if (pool->contexts[i]) {
-	    redisFree(pool->contexts[i]);
-	    pool->contexts[i] = NULL;
-	}
+    for (i = pool->head; i < pool->tail; i++) {
+	if (pool->pending[i].reply)
+	    freeReplyObject(pool->pending[i].reply);
+	free(pool->pending[i].cmd);
     }
-    free(pool->contexts);
-    memset(pool, 0, sizeof(*pool));
+    free(pool->pending);
+
+    for (i = 0; i < pool->nnodes; i++) {
+	if (pool->nodes[i].async)
+	    redisAsyncFree(pool->nodes[i].async);
+	if (pool->nodes[i].context)
+	    redisFree(pool->nodes[i].context);
+	free(pool->nodes[i].hostspec);
+    }
+    free(pool->nodes);
+    free(pool);
 }
 
 /*
@@ -80,50 +260,655 @@ keySlot(const char *key, unsigned int keylen)
     return crc16(key + start + 1, end - start - 1) & SLOTMASK;
 }
 
-/* TODO: externalise Redis configuration */
-static char default_server[] = "localhost:6379";
-static struct timeval default_timeout = { 1, 500000 }; /* 1.5 secs */
-
 redisContext *
 redisGet(redisSlots *pool, const char *key, unsigned int keylen)
 {
-    redisContext	*ctxp;
-    unsigned int	i, slot = keySlot(key, keylen);
-    struct timeval	*timeout = &default_timeout;
-    char		*server = &default_server[0];
+    return slots_connect(pool, pool->slots[keySlot(key, keylen)]);
+}
+
+/*
+ * Find the first argument of a formatted command, which is the key
+ * for all the commands we use apart from EVAL and EVALSHA.  Format:
+ * *<argc>\r\n$<len>\r\n<name>\r\n$<len>\r\n<key>\r\n ...
+ */
+static int
+command_key(const char *cmd, size_t length, const char **key, unsigned int *keylen)
+{
+    const char		*end = cmd + length;
+    char		*p;
+    unsigned long	len;
+    int			i;
+
+    if (length < 1 || *cmd != '*' || strtoul(cmd + 1, &p, 10) < 2)
+	return -EINVAL;
+    for (i = 0; i < 2; i++) {
+	if (p + 3 > end || p[0] != '\r' || p[1] != '\n' || p[2] != '$')
+	    return -EINVAL;
+	len = strtoul(p + 3, &p, 10);
+	if (p + 2 + len > end)
+	    return -EINVAL;
+	p += 2;			/* skip \r\n, now at argument */
+	if (i == 1) {
+	    *key = p;
+	    *keylen = len;
+	}
+	p += len;
+    }
+    return 0;
+}
+
+/* queue a formatted command, which is freed once its reply is read */
+static int
+slots_append(redisSlots *pool, const char *key, char *cmd, size_t length)
+{
+    redisPending	*pending;
+    redisContext	*redis;
+    const char		*keyp;
+    unsigned int	keylen, node, size;
+
+    if (key) {
+	keyp = key;
+	keylen = strlen(key);
+    } else if (command_key(cmd, length, &keyp, &keylen) < 0) {
+	keyp = NULL;		/* no key, send to the first server */
+	keylen = 0;
+    }
+    node = keyp ? pool->slots[keySlot(keyp, keylen)] : 0;
+
+    if (pool->tail == pool->size) {
+	size = pool->size ? pool->size * 2 : 64;
+	if ((pending = realloc(pool->pending, size * sizeof(redisPending))) == NULL) {
+	    slots_error(pool, "out of memory");
+	    free(cmd);
+	    return REDIS_ERR;
+	}
+	pool->pending = pending;
+	pool->size = size;
+    }
+    if ((redis = slots_connect(pool, node)) == NULL) {
+	free(cmd);
+	return REDIS_ERR;
+    }
+    if (redisAppendFormattedCommand(redis, cmd, length) != REDIS_OK) {
+	slots_error(pool, redis->errstr);
+	free(cmd);
+	return REDIS_ERR;
+    }
+    pool->nodes[node].inflight++;
+    pool->nodes[node].unsent = 1;
+
+    pending = &pool->pending[pool->tail++];
+    pending->node = node;
+    pending->cmd = cmd;
+    pending->length = length;
+    pending->reply = NULL;
+    return REDIS_OK;
+}
+
+int
+redisSlotsvAppendCommand(redisSlots *pool, const char *key,
+		const char *format, va_list arg)
+{
+    char		*cmd;
+    int			length;
+
+    if ((length = redisvFormatCommand(&cmd, format, arg)) < 0) {
+	slots_error(pool, "out of memory");
+	return REDIS_ERR;
+    }
+    return slots_append(pool, key, cmd, length);
+}
+
+int
+redisSlotsAppendCommand(redisSlots *pool, const char *key,
+		const char *format, ...)
+{
+    va_list		arg;
+    int			sts;
+
+    va_start(arg, format);
+    sts = redisSlotsvAppendCommand(pool, key, format, arg);
+    va_end(arg);
+    return sts;
+}
+
+int
+redisSlotsAppendFormatted(redisSlots *pool, const char *key,
+		const char *cmd, size_t length)
+{
+    char		*copy;
+
+    if ((copy = malloc(length)) == NULL) {
+	slots_error(pool, "out of memory");
+	return REDIS_ERR;
+    }
+    memcpy(copy, cmd, length);
+    return slots_append(pool, key, copy, length);
+}
+
+/*
+ * Write out everything buffered for every node before waiting on any
+ * one of them, so all the shards work on their share of a pipeline at
+ * the same time instead of one after another.
+ */
+static void
+slots_send(redisSlots *pool)
+{
+    redisNode		*np;
+    unsigned int	i;
+    int			done;
+
+    for (i = 0; i < pool->nnodes; i++) {
+	np = &pool->nodes[i];
+	if (!np->unsent || np->context == NULL)
+	    continue;
+	do {
+	    if (redisBufferWrite(np->context, &done) != REDIS_OK)
+		break;	/* reported when the reply is read */
+	} while (!done);
+	np->unsent = 0;
+    }
+}
+
+static int
+slots_read(redisSlots *pool, unsigned int node, redisReply **reply)
+{
+    redisNode		*np = &pool->nodes[node];
+
+    np->unsent = 0;
+    if (redisGetReply(np->context, (void **)reply) != REDIS_OK) {
+	slots_error(pool, np->context->errstr);
+	*reply = NULL;
+	return REDIS_ERR;
+    }
+    np->inflight--;
+    return REDIS_OK;
+}
+
+/*
+ * Before a command is resent to another node, read the replies to
+ * any later commands already sent there - so the next reply on that
+ * connection is the one for the resent command.  These are kept with
+ * their commands until it is their turn to be returned.
+ */
+static int
+slots_drain(redisSlots *pool, unsigned int node)
+{
+    redisPending	*pending;
+    unsigned int	i;
+
+    for (i = pool->head + 1;
+	 i < pool->tail && pool->nodes[node].inflight > 0; i++) {
+	pending = &pool->pending[i];
+	if (pending->node != node || pending->reply != NULL)
+	    continue;
+	if (slots_read(pool, node, &pending->reply) != REDIS_OK)
+	    return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/*
+ * Follow MOVED (the slot now lives elsewhere, update our map) and
+ * ASK (the slot is being migrated, ask the other node just this once)
+ * redirections.  Other errors are returned to the caller as replies.
+ */
+static int
+slots_redirect(redisSlots *pool, redisPending *pending)
+{
+    redisContext	*redis;
+    redisReply		*reply;
+    char		*hostspec;
+    unsigned int	slot, redirects;
+    int			node, moved;
+
+    for (redirects = 0; redirects < MAXREDIRECTS; redirects++) {
+	reply = pending->reply;
+	if (reply->type != REDIS_REPLY_ERROR)
+	    break;
+	if (strncmp(reply->str, "MOVED ", 6) == 0)
+	    moved = 1;
+	else if (strncmp(reply->str, "ASK ", 4) == 0)
+	    moved = 0;
+	else
+	    break;
+
+	/* MOVED|ASK <slot> <host>:<port> */
+	slot = strtoul(reply->str + (moved ? 6 : 4), &hostspec, 10);
+	if (*hostspec++ != ' ')
+	    break;
+	if ((node = slots_node(pool, hostspec)) < 0)
+	    return REDIS_ERR;
+	if (pmDebugOptions.series)
+	    fprintf(stderr, "Redis %s\n", reply->str);
+	if (moved)
+	    pool->slots[slot & SLOTMASK] = node;
+
+	if (slots_drain(pool, node) != REDIS_OK)
+	    return REDIS_ERR;
+	if ((redis = slots_connect(pool, node)) == NULL)
+	    return REDIS_ERR;
+	if (!moved && redisAppendCommand(redis, "ASKING") != REDIS_OK)
+	    goto fail;
+	if (redisAppendFormattedCommand(redis, pending->cmd, pending->length) != REDIS_OK)
+	    goto fail;
+	if (!moved) {
+	    if (redisGetReply(redis, (void **)&reply) != REDIS_OK)
+		goto fail;
+	    freeReplyObject(reply);
+	}
+	freeReplyObject(pending->reply);
+	pending->reply = NULL;
+	pending->node = node;
+	if (redisGetReply(redis, (void **)&pending->reply) != REDIS_OK)
+	    goto fail;
+    }
+    return REDIS_OK;
+
+fail:
+    slots_error(pool, redis->errstr);
+    return REDIS_ERR;
+}
+
+/*
+ * Return the reply to the oldest command not yet answered.
+ */
+int
+redisSlotsGetReply(redisSlots *pool, redisReply **reply)
+{
+    redisPending	*pending;
+    int			sts = REDIS_OK;
+
+    *reply = NULL;
+    if (pool->head == pool->tail) {
+	slots_error(pool, "no commands pending");
+	return REDIS_ERR;
+    }
+    slots_send(pool);
+
+    pending = &pool->pending[pool->head];
+    if (pending->reply == NULL)
+	sts = slots_read(pool, pending->node, &pending->reply);
+    if (sts == REDIS_OK)
+	sts = slots_redirect(pool, pending);
+    if (sts == REDIS_OK) {
+	*reply = pending->reply;
+    } else if (pending->reply) {
+	freeReplyObject(pending->reply);
+    }
+    free(pending->cmd);
+
+    if (++pool->head == pool->tail)
+	pool->head = pool->tail = 0;
+    return sts;
+}
+
+/*
+ * Synchronous command, only used with no pipelined commands pending.
+ */
+redisReply *
+redisSlotsCommand(redisSlots *pool, const char *key, const char *format, ...)
+{
+    redisReply		*reply;
+    va_list		arg;
+    int			sts;
+
+    if (pool->head != pool->tail) {
+	slots_error(pool, "pipelined commands pending");
+	return NULL;
+    }
+    va_start(arg, format);
+    sts = redisSlotsvAppendCommand(pool, key, format, arg);
+    va_end(arg);
+    if (sts != REDIS_OK || redisSlotsGetReply(pool, &reply) != REDIS_OK)
+	return NULL;
+    return reply;
+}
+
+const char *
+redisSlotsErrstr(redisSlots *pool)
+{
+    return pool->errstr;
+}
+
+/*
+ * Event hooks for asynchronous connections, recording which events
+ * each wants so that redisSlotsEventLoop() can poll for them.
+ */
+static void
+slots_add_read(void *data)
+{
+    slotsEvents		*ep = (slotsEvents *)data;
+
+    ep->pool->nodes[ep->node].events |= POLLIN;
+}
+
+static void
+slots_del_read(void *data)
+{
+    slotsEvents		*ep = (slotsEvents *)data;
+
+    ep->pool->nodes[ep->node].events &= ~POLLIN;
+}
 
-    if ((ctxp = pool->contexts[slot]) != NULL)
-	return ctxp;
+static void
+slots_add_write(void *data)
+{
+    slotsEvents		*ep = (slotsEvents *)data;
+
+    ep->pool->nodes[ep->node].events |= POLLOUT;
+}
+
+static void
+slots_del_write(void *data)
+{
+    slotsEvents		*ep = (slotsEvents *)data;
+
+    ep->pool->nodes[ep->node].events &= ~POLLOUT;
+}
 
-    if ((ctxp = redis_connect(server, timeout)) == NULL)
+/* called as hiredis frees the context, including after errors */
+static void
+slots_cleanup(void *data)
+{
+    slotsEvents		*ep = (slotsEvents *)data;
+    redisNode		*np = &ep->pool->nodes[ep->node];
+
+    np->async = NULL;
+    np->events = 0;
+    free(ep);
+}
+
+static redisAsyncContext *
+slots_async_connect(redisSlots *pool, unsigned int node)
+{
+    redisAsyncContext	*async;
+    redisNode		*np = &pool->nodes[node];
+    slotsEvents		*ep;
+    unsigned int	port;
+    char		host[MAXHOSTNAMELEN + 16];
+    char		*endnum, *p;
+
+    if (np->async)
+	return np->async;
+
+    if (strncmp(np->hostspec, "unix:", 5) == 0) {
+	async = redisAsyncConnectUnix(np->hostspec + 5);
+    } else {
+	pmsprintf(host, sizeof(host), "%s", np->hostspec);
+	if ((p = rindex(host, ':')) == NULL) {
+	    port = 6379;  /* default redis port */
+	} else {
+	    port = (unsigned int) strtoul(p + 1, &endnum, 10);
+	    if (*endnum != '\0')
+		port = 6379;
+	    else
+		*p = '\0';
+	}
+	async = redisAsyncConnect(host, port);
+    }
+    if (async == NULL || async->err) {
+	pmsprintf(pool->errstr, sizeof(pool->errstr), "cannot connect to %s%s%s",
+		np->hostspec, async ? ": " : "", async ? async->errstr : "");
+	if (async)
+	    redisAsyncFree(async);
+	return NULL;
+    }
+    if ((ep = (slotsEvents *)malloc(sizeof(slotsEvents))) == NULL) {
+	slots_error(pool, "out of memory");
+	redisAsyncFree(async);
 	return NULL;
+    }
+    ep->pool = pool;
+    ep->node = node;
+    async->ev.data = ep;
+    async->ev.addRead = slots_add_read;
+    async->ev.delRead = slots_del_read;
+    async->ev.addWrite = slots_add_write;
+    async->ev.delWrite = slots_del_write;
+    async->ev.cleanup = slots_cleanup;
+    np->async = async;
+    np->events = 0;
+    return async;
+}
+
+static void slots_async_reply(redisAsyncContext *, void *, void *);
+
+static int
+slots_async_send(redisSlots *pool, unsigned int node, slotsRequest *rp, int asking)
+{
+    redisAsyncContext	*async;
+
+    if ((async = slots_async_connect(pool, node)) == NULL)
+	return REDIS_ERR;
+    if (asking && redisAsyncCommand(async, NULL, NULL, "ASKING") != REDIS_OK)
+	goto fail;
+    if (redisAsyncFormattedCommand(async, slots_async_reply, rp,
+				rp->cmd, rp->length) != REDIS_OK)
+	goto fail;
+    return REDIS_OK;
+
+fail:
+    slots_error(pool, async->errstr);
+    return REDIS_ERR;
+}
+
+static void
+slots_async_done(slotsRequest *rp, redisReply *reply)
+{
+    redisSlots		*pool = rp->pool;
+
+    pool->requests--;
+    rp->callback(pool, reply, rp->arg);
+    free(rp->cmd);
+    free(rp);
+}
+
+/* reply handler for every request, following MOVED and ASK as needed */
+static void
+slots_async_reply(redisAsyncContext *async, void *r, void *arg)
+{
+    slotsRequest	*rp = (slotsRequest *)arg;
+    redisSlots		*pool = rp->pool;
+    redisReply		*reply = (redisReply *)r;
+    char		*hostspec;
+    unsigned int	slot;
+    int			node, moved;
+
+    if (reply == NULL) {
+	pmsprintf(pool->errstr, sizeof(pool->errstr), "%s",
+			async->errstr ? async->errstr : "request dropped");
+	slots_async_done(rp, NULL);
+	return;
+    }
+    if (reply->type != REDIS_REPLY_ERROR || rp->redirects >= MAXREDIRECTS)
+	goto done;
+    if (strncmp(reply->str, "MOVED ", 6) == 0)
+	moved = 1;
+    else if (strncmp(reply->str, "ASK ", 4) == 0)
+	moved = 0;
+    else
+	goto done;
+
+    /* MOVED|ASK <slot> <host>:<port> */
+    slot = strtoul(reply->str + (moved ? 6 : 4), &hostspec, 10);
+    if (*hostspec++ != ' ' || (node = slots_node(pool, hostspec)) < 0)
+	goto done;
+    if (pmDebugOptions.series)
+	fprintf(stderr, "Redis %s\n", reply->str);
+    if (moved)
+	pool->slots[slot & SLOTMASK] = node;
+    rp->redirects++;
+    if (slots_async_send(pool, node, rp, !moved) == REDIS_OK)
+	return;		/* the reply from the new node completes it */
+
+done:
+    slots_async_done(rp, reply);
+}
+
+/* queue a formatted request, which is freed once it has completed */
+static int
+slots_request(redisSlots *pool, const char *key, redisSlotsCallBack callback,
+		void *arg, char *cmd, size_t length)
+{
+    slotsRequest	*rp;
+    const char		*keyp;
+    unsigned int	keylen, node;
+
+    if (key) {
+	keyp = key;
+	keylen = strlen(key);
+    } else if (command_key(cmd, length, &keyp, &keylen) < 0) {
+	keyp = NULL;		/* no key, send to the first server */
+	keylen = 0;
+    }
+    node = keyp ? pool->slots[keySlot(keyp, keylen)] : 0;
+
+    if ((rp = (slotsRequest *)malloc(sizeof(slotsRequest))) == NULL) {
+	slots_error(pool, "out of memory");
+	free(cmd);
+	return REDIS_ERR;
+    }
+    rp->pool = pool;
+    rp->callback = callback;
+    rp->arg = arg;
+    rp->redirects = 0;
+    rp->cmd = cmd;
+    rp->length = length;
 
-    /* TODO: spread this context properly throughout the array */
-    /* This requires a list of available Redis servers, first. */
+    if (slots_async_send(pool, node, rp, 0) != REDIS_OK) {
+	free(cmd);
+	free(rp);
+	return REDIS_ERR;
+    }
+    pool->requests++;
+    return REDIS_OK;
+}
 
-    for (i = 0; i < MAXSLOTS; i++)
-	pool->contexts[i] = ctxp;
+int
+redisSlotsRequest(redisSlots *pool, const char *key,
+		redisSlotsCallBack callback, void *arg, const char *format, ...)
+{
+    va_list		arg_list;
+    char		*cmd;
+    int			length;
 
-    return ctxp;
+    va_start(arg_list, format);
+    length = redisvFormatCommand(&cmd, format, arg_list);
+    va_end(arg_list);
+    if (length < 0) {
+	slots_error(pool, "out of memory");
+	return REDIS_ERR;
+    }
+    return slots_request(pool, key, callback, arg, cmd, length);
+}
+
+int
+redisSlotsFormattedRequest(redisSlots *pool, const char *key,
+		redisSlotsCallBack callback, void *arg,
+		const char *cmd, size_t length)
+{
+    char		*copy;
+
+    if ((copy = malloc(length)) == NULL) {
+	slots_error(pool, "out of memory");
+	return REDIS_ERR;
+    }
+    memcpy(copy, cmd, length);
+    return slots_request(pool, key, callback, arg, copy, length);
+}
+
+/*
+ * Service the asynchronous connections until every request (including
+ * those issued from callbacks along the way) has completed.  Requests
+ * still outstanding when a node stays silent for the timeout period
+ * are failed, their callbacks passed a NULL reply.
+ */
+int
+redisSlotsEventLoop(redisSlots *pool)
+{
+    struct pollfd	*fds = NULL;
+    unsigned int	*nodes = NULL;
+    unsigned int	i, nfds, nalloc = 0;
+    redisNode		*np;
+    int			sts, timeout;
+
+    timeout = pool->timeout.tv_sec * 1000 + pool->timeout.tv_usec / 1000;
+
+    while (pool->requests > 0) {
+	if (pool->nnodes > nalloc) {	/* redirections may add nodes */
+	    free(fds);
+	    free(nodes);
+	    nalloc = pool->nnodes;
+	    fds = (struct pollfd *)calloc(nalloc, sizeof(struct pollfd));
+	    nodes = (unsigned int *)calloc(nalloc, sizeof(unsigned int));
+	    if (fds == NULL || nodes == NULL) {
+		slots_error(pool, "out of memory");
+		free(fds);
+		free(nodes);
+		return -ENOMEM;
+	    }
+	}
+
+	for (i = nfds = 0; i < pool->nnodes; i++) {
+	    np = &pool->nodes[i];
+	    if (np->async == NULL || np->events == 0)
+		continue;
+	    fds[nfds].fd = np->async->c.fd;
+	    fds[nfds].events = np->events;
+	    fds[nfds].revents = 0;
+	    nodes[nfds++] = i;
+	}
+	if (nfds == 0)
+	    break;	/* nothing in flight can make progress */
+
+	if ((sts = poll(fds, nfds, timeout)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    slots_error(pool, "poll failed");
+	    break;
+	}
+	if (sts == 0) {
+	    slots_error(pool, "timed out waiting for Redis");
+	    for (i = 0; i < nfds; i++)
+		if ((np = &pool->nodes[nodes[i]])->async != NULL)
+		    redisAsyncFree(np->async);	/* fails its requests */
+	    break;
+	}
+
+	for (i = 0; i < nfds; i++) {
+	    /* nodes array may move as redirections add nodes */
+	    np = &pool->nodes[nodes[i]];
+	    if (np->async && (fds[i].revents & (POLLIN|POLLERR|POLLHUP)))
+		redisAsyncHandleRead(np->async);
+	    np = &pool->nodes[nodes[i]];
+	    if (np->async && (fds[i].revents & POLLOUT))
+		redisAsyncHandleWrite(np->async);
+	}
+    }
+    free(fds);
+    free(nodes);
+    return pool->requests ? -ETIMEDOUT : 0;
 }
 
 redisContext *
-redis_connect(char *server, struct timeval *timeout)
+redis_connect(const char *server, struct timeval *timeout)
 {
-    redisContext *redis;
+    redisContext	*redis;
+    unsigned int	port;
+    char		host[MAXHOSTNAMELEN + 16];
+    char		*endnum, *p;
 
     if (server == NULL)
-	server = strdup(default_server);
+	server = default_server;
     if (timeout == NULL)
 	timeout = &default_timeout;
 
     if (strncmp(server, "unix:", 5) == 0) {
 	redis = redisConnectUnixWithTimeout(server + 5, *timeout);
     } else {
-	unsigned int    port;
-	char	    *endnum, *p;
-
-	if ((p = rindex(server, ':')) == NULL) {
+	pmsprintf(host, sizeof(host), "%s", server);
+	if ((p = rindex(host, ':')) == NULL) {
 	    port = 6379;  /* default redis port */
 	} else {
 	    port = (unsigned int) strtoul(p + 1, &endnum, 10);
@@ -132,7 +917,7 @@ redis_connect(char *server, struct timeval *timeout)
 	    else
 		*p = '\0';
 	}
-	redis = redisConnectWithTimeout(server, port, *timeout);
+	redis = redisConnectWithTimeout(host, port, *timeout);
     }
 
     if (!redis || redis->err) {
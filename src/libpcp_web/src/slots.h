@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2017 Red Hat.
+ * Copyright (c) 2017-2018 Red Hat.
  *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the
@@ -14,9 +14,42 @@
 #ifndef SLOTS_H
 #define SLOTS_H
 
-struct redisSlots;
-extern struct redisSlots *redisInitSlots(const char *);
-extern void redisFreeSlots(struct redisSlots *);
-extern redisContext *redisGet(struct redisSlots *, const char *, unsigned int);
+#include <hiredis/hiredis.h>
+
+typedef struct redisSlots redisSlots;
+typedef void (*redisSetupCallBack)(redisContext *);
+typedef void (*redisSlotsCallBack)(redisSlots *, redisReply *, void *);
+
+extern redisSlots *redisSlotsInit(const char *, struct timeval *,
+				redisSetupCallBack);
+extern void redisFreeSlots(redisSlots *);
+extern unsigned int keySlot(const char *, unsigned int);
+extern redisContext *redisGet(redisSlots *, const char *, unsigned int);
+
+/*
+ * Pipelined commands, each sent to the node serving its key (NULL
+ * means the first command argument is the key); replies are returned
+ * in the order the commands were appended, with any MOVED and ASK
+ * redirections already followed.
+ */
+extern int redisSlotsAppendCommand(redisSlots *, const char *, const char *, ...);
+extern int redisSlotsvAppendCommand(redisSlots *, const char *, const char *, va_list);
+extern int redisSlotsAppendFormatted(redisSlots *, const char *, const char *, size_t);
+extern int redisSlotsGetReply(redisSlots *, redisReply **);
+extern redisReply *redisSlotsCommand(redisSlots *, const char *, const char *, ...);
+extern const char *redisSlotsErrstr(redisSlots *);
+
+/*
+ * Non-blocking requests, each sent to the node serving its key over
+ * an asynchronous connection.  Callbacks run from the event loop as
+ * replies arrive - in any order across nodes - and may issue further
+ * requests.  A reply is only valid during its callback, and is NULL
+ * if the request failed (disconnect or timeout).
+ */
+extern int redisSlotsRequest(redisSlots *, const char *,
+		redisSlotsCallBack, void *, const char *, ...);
+extern int redisSlotsFormattedRequest(redisSlots *, const char *,
+		redisSlotsCallBack, void *, const char *, size_t);
+extern int redisSlotsEventLoop(redisSlots *);
 
 #endif	/* SLOTS_H */
@@ -42,7 +42,7 @@ tadd(struct timeval *a, struct timeval *b)
 void
 fputstamp(struct timeval *stamp, int delimiter, FILE *out)
 {
-    static char	timebuf[32];
+    char	timebuf[32];
     char	*ddmm;
     char	*yr;
 
@@ -56,17 +56,14 @@ fputstamp(struct timeval *stamp, int delimiter, FILE *out)
 }
 
 const char *
-value_instname(value_t *value)
+value_instname(value_t *value, char *namebuf, size_t length)
 {
-    static char	namebuf[2048];
     const char	*n;
 
-    if ((n = value->name) != NULL) {
-	pmsprintf(namebuf, sizeof(namebuf), "\"%s\"", n);
-	namebuf[sizeof(namebuf)-1] = '\0';
-    } else {
-	strncpy(namebuf, "null", sizeof(namebuf));
-    }
+    if ((n = value->name) != NULL)
+	pmsprintf(namebuf, length, "\"%s\"", n);
+    else
+	pmsprintf(namebuf, length, "null");
     return namebuf;
 }
 
@@ -99,55 +96,61 @@ value_precision(char *buf, int maxlen, int usedlen)
     }
 }
 
+/* string form of a value, as stored in the pcp:values:series sets */
 const char *
-value_atomstr(metric_t *metric, value_t *value)
+atom_valuestr(int type, pmAtomValue *atom, char *valuebuf, size_t length)
 {
-    static char	valuebuf[512];
     int		len;
 
-    switch (metric->desc.type) {
+    switch (type) {
     case PM_TYPE_32:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%ld",
-		(long)value->lastval.l);
+	pmsprintf(valuebuf, length, "%ld",
+		(long)atom->l);
 	break;
     case PM_TYPE_U32:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%lu",
-		(unsigned long)value->lastval.ul);
+	pmsprintf(valuebuf, length, "%lu",
+		(unsigned long)atom->ul);
 	break;
     case PM_TYPE_64:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%lld",
-		(long long)value->lastval.ll);
+	pmsprintf(valuebuf, length, "%lld",
+		(long long)atom->ll);
 	break;
     case PM_TYPE_U64:
-	pmsprintf(valuebuf, sizeof(valuebuf), "%llu",
-		(unsigned long long)value->lastval.ull);
+	pmsprintf(valuebuf, length, "%llu",
+		(unsigned long long)atom->ull);
 	break;
     case PM_TYPE_DOUBLE:
-	if ((long long)value->lastval.d == value->lastval.d)
-	    pmsprintf(valuebuf, sizeof(valuebuf), "%lld",
-			(long long)value->lastval.d);
+	if ((long long)atom->d == atom->d)
+	    pmsprintf(valuebuf, length, "%lld",
+			(long long)atom->d);
 	else {
-	    len = pmsprintf(valuebuf, sizeof(valuebuf), "%f", value->lastval.d);
-	    value_precision(valuebuf, sizeof(valuebuf), len);
+	    len = pmsprintf(valuebuf, length, "%f", atom->d);
+	    value_precision(valuebuf, length, len);
 	}
 	break;
     case PM_TYPE_FLOAT:
-	if ((long long)value->lastval.f == value->lastval.f)
-	    pmsprintf(valuebuf, sizeof(valuebuf), "%lld",
-			(long long)value->lastval.f);
+	if ((long long)atom->f == atom->f)
+	    pmsprintf(valuebuf, length, "%lld",
+			(long long)atom->f);
 	else {
-	    len = pmsprintf(valuebuf, sizeof(valuebuf), "%f", value->lastval.f);
-	    value_precision(valuebuf, sizeof(valuebuf), len);
+	    len = pmsprintf(valuebuf, length, "%f", atom->f);
+	    value_precision(valuebuf, length, len);
 	}
 	break;
     default:
 	/* TODO: support remaining data types - indirect maps */
-	pmsprintf(valuebuf, sizeof(valuebuf), "%lu", 0UL);
+	pmsprintf(valuebuf, length, "%lu", 0UL);
 	break;
     }
     return valuebuf;
 }
 
+const char *
+value_atomstr(metric_t *metric, value_t *value, char *valuebuf, size_t length)
+{
+    return atom_valuestr(metric->desc.type, &value->lastval, valuebuf, length);
+}
+
 int
 merge_labelsets(metric_t *metric, value_t *value, char *buffer, int length,
 	int (*filter)(const pmLabel *, const char *, void *), void *type)
@@ -185,12 +188,11 @@ labels(const pmLabel *label, const char *json, void *arg)
 }
 
 char *
-value_labels(metric_t *metric, value_t *value)
+value_labels(metric_t *metric, value_t *value, char *lbuf, size_t length)
 {
-    static char	lbuf[PM_MAXLABELJSONLEN];
     int		sts;
 
-    sts = merge_labelsets(metric, value, lbuf, sizeof(lbuf), labels, NULL);
+    sts = merge_labelsets(metric, value, lbuf, length, labels, NULL);
     if (sts < 0)
 	return NULL;
     return lbuf;
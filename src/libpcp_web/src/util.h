@@ -32,9 +32,10 @@ extern int merge_labelsets(struct metric *, struct value *,
 		void *type);
 
 extern unsigned int value_instid(struct value *);
-extern const char *value_instname(struct value *);
+extern const char *value_instname(struct value *, char *, size_t);
 
-extern const char *value_atomstr(struct metric *, struct value *);
-extern char *value_labels(struct metric *, struct value *);
+extern const char *atom_valuestr(int, pmAtomValue *, char *, size_t);
+extern const char *value_atomstr(struct metric *, struct value *, char *, size_t);
+extern char *value_labels(struct metric *, struct value *, char *, size_t);
 
 #endif	/* UTIL_H */
@@ -26,6 +26,23 @@
 #include <sys/resource.h>
 #endif
 
+/*
+ * Readiness set for daemon PMDA output descriptors while pmcd waits for
+ * replies (DoFetch, DoStore).  Created on first use, and never bounded
+ * by FD_SETSIZE like the __pmFdSet it replaces.
+ */
+__pmPollSet	*agentPoll;
+
+__pmPollSet *
+AgentPollSet(void)
+{
+    if (agentPoll == NULL && (agentPoll = __pmPollSetCreate()) == NULL) {
+	pmNoMem("AgentPollSet", sizeof(void *), PM_FATAL_ERR);
+	/* NOTREACHED */
+    }
+    return agentPoll;
+}
+
 static pid_t
 waitpid_pmcd(int *status)
 {
@@ -85,6 +102,16 @@ CleanupAgent(AgentInfo* aPtr, int why, int status)
     }
     else {
 	pmcd_trace(TR_DEL_AGENT, aPtr->pmDomainId, aPtr->inFd, aPtr->outFd);
+	/*
+	 * Stop watching before closing, as a descriptor inherited by a
+	 * child process would otherwise remain registered with epoll(7).
+	 */
+	if (aPtr->outFd != -1) {
+	    if (agentPoll != NULL)
+		__pmPollSetDel(agentPoll, aPtr->outFd);
+	    if (clientPoll != NULL)
+		__pmPollSetDel(clientPoll, aPtr->outFd);
+	}
 	if (aPtr->inFd != -1) {
 	    if (aPtr->ipcType == AGENT_SOCKET)
 	      __pmCloseSocket(aPtr->inFd);
@@ -184,6 +211,9 @@ CleanupAgent(AgentInfo* aPtr, int why, int status)
 	pmcd_dump_trace(stderr);
 
     MarkStateChanges(PMCD_DROP_AGENT);
+
+    /* any fetch requests still queued will not be answered now */
+    AbortAgentFetches(aPtr);
 }
 
 static int
@@ -20,9 +20,44 @@
 #define MIN_CLIENTS_ALLOC 8
 
 int		maxClientFd = -1;	/* largest fd for a client */
-__pmFdSet	clientFds;		/* for client select() */
+__pmPollSet	*clientPoll;		/* client and request port fds */
 
 static int	clientSize;
+static int	*fdClient;		/* fd -> client[] index + 1 map */
+static int	fdClientSize;		/* number of entries in fdClient */
+
+static void
+SetClientFd(int fd, int index)
+{
+    int		sz, need;
+
+    if (fd >= fdClientSize) {
+	for (sz = fdClientSize ? fdClientSize : 64; sz <= fd; sz *= 2)
+	    ;
+	need = sz * sizeof(int);
+	if ((fdClient = (int *)realloc(fdClient, need)) == NULL) {
+	    pmNoMem("SetClientFd", need, PM_RECOV_ERR);
+	    Shutdown();
+	    exit(1);
+	}
+	memset(&fdClient[fdClientSize], 0, (sz - fdClientSize) * sizeof(int));
+	fdClientSize = sz;
+    }
+    fdClient[fd] = index + 1;
+}
+
+/* Map a ready file descriptor back to its client, in constant time */
+ClientInfo *
+FindClientFd(int fd)
+{
+    int		i;
+
+    if (fd < 0 || fd >= fdClientSize || (i = fdClient[fd] - 1) < 0)
+	return NULL;
+    if (i >= nClients || !client[i].status.connected || client[i].fd != fd)
+	return NULL;
+    return &client[i];
+}
 
 /*
  * For PMDA_INTERFACE_5 or later PMDAs, post a notification that
@@ -41,6 +76,7 @@ NotifyEndContext(int ctx)
 	    pmdaInterface	*dp = &agent[i].ipc.dso.dispatch;
 	    if (dp->comm.pmda_interface >= PMDA_INTERFACE_5) {
 		if (dp->version.four.ext->e_endCallBack != NULL) {
+		    DrainAgentFetches(&agent[i]);
 		    if (pmDebugOptions.context) {
 			fprintf(stderr, "NotifyEndContext: DSO PMDA %s (%d) notified of context %d close\n",
 			    agent[i].pmDomainLabel, agent[i].pmDomainId,
@@ -75,7 +111,7 @@ ClientInfo *
 AcceptNewClient(int reqfd)
 {
     static unsigned int	seq = 0;
-    int			i, fd;
+    int			i, fd, sts;
     __pmSockLen		addrlen;
     struct timeval	now;
 
@@ -108,7 +144,14 @@ AcceptNewClient(int reqfd)
 
     pmcd_openfds_sethi(fd);
 
-    __pmFD_SET(fd, &clientFds);
+    if ((sts = __pmPollSetAdd(clientPoll, fd)) < 0) {
+	pmNotifyErr(LOG_ERR, "AcceptNewClient(%d): cannot watch fd %d: %s\n",
+			reqfd, fd, pmErrStr(sts));
+	client[i].fd = fd;
+	DeleteClient(&client[i]);
+	return NULL;
+    }
+    SetClientFd(fd, i);
     __pmSetVersionIPC(fd, UNKNOWN_VERSION);	/* before negotiation */
     __pmSetSocketIPC(fd);
 
@@ -117,6 +160,7 @@ AcceptNewClient(int reqfd)
     client[i].status.attributes = 0;
     client[i].status.changes = 0;
     memset(&client[i].attrs, 0, sizeof(__pmHashCtl));
+    client[i].fetch = NULL;
 
     /*
      * Note seq needs to be unique, but we're using a free running counter
@@ -187,8 +231,12 @@ DeleteClient(ClientInfo *cp)
 	}
 	return;
     }
+    if (cp->fetch != NULL)
+	OrphanClientFetch(cp);
     if (cp->fd != -1) {
-	__pmFD_CLR(cp->fd, &clientFds);
+	__pmPollSetDel(clientPoll, cp->fd);
+	if (cp->fd < fdClientSize)
+	    fdClient[cp->fd] = 0;
 	__pmCloseSocket(cp->fd);
     }
     if (i == nClients-1) {
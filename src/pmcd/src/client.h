@@ -34,18 +34,20 @@ typedef struct {
     time_t		start;		/* Time client connected (pmdapmcd) */
     __pmSockAddr	*addr;		/* Network address of client */
     __pmHashCtl		attrs;		/* Connection attributes (tuples) */
+    struct FetchCtl	*fetch;		/* Fetch awaiting agent replies */
 } ClientInfo;
 
 PMCD_DATA extern ClientInfo *client;		/* Array of clients */
 PMCD_DATA extern int	nClients;		/* Number of entries in array */
 extern int		maxClientFd;		/* largest fd for a client */
-extern __pmFdSet	clientFds;		/* for client select() */
+extern __pmPollSet	*clientPoll;		/* client and request port fds */
 PMCD_DATA extern int	this_client_id;		/* client for current request */
 
 /* prototypes */
 extern ClientInfo *AcceptNewClient(int);
 extern int NewClient(void);
 extern void DeleteClient(ClientInfo *);
+extern ClientInfo *FindClientFd(int);
 PMCD_CALL extern ClientInfo *GetClient(int);
 PMCD_CALL extern int SetClientAttribute(int, int, char *);
 PMCD_CALL extern void ShowClients(FILE *m);
@@ -1358,6 +1358,7 @@ DoAttributes(AgentInfo *ap, int clientID)
 	if (ap->ipc.dso.dispatch.comm.pmda_interface < PMDA_INTERFACE_6 ||
 	    ap->ipc.dso.dispatch.version.six.attribute == NULL)
 	    return 0;
+	DrainAgentFetches(ap);
 	for (node = __pmHashWalk(attrs, PM_HASH_WALK_START);
 	     node != NULL;
 	     node = __pmHashWalk(attrs, PM_HASH_WALK_NEXT)) {
@@ -2386,37 +2387,42 @@ ParseRestartAgents(char *fileName)
     AgentInfo	*oldAgent;
     int		oldNAgents;
     AgentInfo	*ap;
-    __pmFdSet	fds;
+    __pmPollSet	*fds;
+
+    /* The agent table may be rebuilt below, so complete any outstanding
+     * fetch requests first.
+     */
+    for (i = 0; i < nAgents; i++)
+	DrainAgentFetches(&agent[i]);
 
     /* Clean up any deceased agents.  We haven't seen an agent's death unless
      * a PDU transfer involving the agent has occurred.  This cleans up others
      * as well.
      */
-    __pmFD_ZERO(&fds);
-    j = -1;
+    fds = AgentPollSet();
+    j = 0;
     for (i = 0; i < nAgents; i++) {
 	ap = &agent[i];
 	if (ap->status.connected &&
 	    (ap->ipcType == AGENT_SOCKET || ap->ipcType == AGENT_PIPE)) {
 
-	    __pmFD_SET(ap->outFd, &fds);
-	    if (ap->outFd > j)
-		j = ap->outFd;
+	    if (__pmPollSetAdd(fds, ap->outFd) == 0)
+		j++;
 	}
     }
-    if (++j) {
+    if (j) {
 	/* any agent with output ready has either closed the file descriptor or
 	 * sent an unsolicited PDU.  Clean up the agent in either case.
 	 */
 	struct timeval	timeout = {0, 0};
 
-	sts = __pmSelectRead(j, &fds, &timeout);
+	sts = __pmPollSetWait(fds, NULL, &timeout);
 	if (sts > 0) {
 	    for (i = 0; i < nAgents; i++) {
 		ap = &agent[i];
 		if (ap->status.connected &&
 		    (ap->ipcType == AGENT_SOCKET || ap->ipcType == AGENT_PIPE) &&
-		    __pmFD_ISSET(ap->outFd, &fds)) {
+		    __pmPollSetIsReady(fds, ap->outFd)) {
 
 		    /* try to discover more ... */
 		    __pmPDU	*pb;
@@ -2438,6 +2444,8 @@ ParseRestartAgents(char *fileName)
 	else if (sts < 0)
 	    fprintf(stderr, "pmcd: deceased agents select: %s\n",
 			 netstrerror());
+	for (i = 0; i < nAgents; i++)
+	    __pmPollSetDel(fds, agent[i].outFd);
     }
 
     /* gather any deceased children */
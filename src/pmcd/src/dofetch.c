@@ -193,8 +193,15 @@ MakeBadResult(int npmids, pmID *list, int sts)
     return result;
 }
 
+/*
+ * Send a fetch request to an agent.  Returns the agent's pmResult, or
+ * a "bad" pmResult if the request could not be sent, or NULL when the
+ * reply will come later (daemon agents, and DSO agents when job is
+ * not NULL and the fetch is handed to a worker thread).
+ */
 static pmResult *
-SendFetch(DomPmidList *dpList, AgentInfo *aPtr, ClientInfo *cPtr, int ctxnum)
+SendFetch(DomPmidList *dpList, AgentInfo *aPtr, ClientInfo *cPtr, int ctxnum,
+	  WorkerJob *job)
 {
     __pmHashCtl		*hcp;
     __pmHashNode	*hp;
@@ -269,6 +276,10 @@ SendFetch(DomPmidList *dpList, AgentInfo *aPtr, ClientInfo *cPtr, int ctxnum)
 	if (aPtr->ipcType == AGENT_DSO) {
 	    if (aPtr->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 		aPtr->ipc.dso.dispatch.version.four.ext->e_context = cPtr - client;
+	    if (job != NULL) {
+		WorkerSubmit(job);
+		return NULL;
+	    }
 	    sts = aPtr->ipc.dso.dispatch.version.any.fetch(dpList->listSize,
 				   dpList->list, &result, 
 				   aPtr->ipc.dso.dispatch.version.any.ext);
@@ -350,45 +361,492 @@ ExtractState(pmResult *result)
     return (int)byte;
 }
 
+
+/*
+ * Fetches are handled asynchronously.  DSO agents are called as soon as
+ * the client's request has been split by domain, but the requests for
+ * daemon agents are appended to a queue on each agent, and up to
+ * FETCH_PIPELINE of them are sent ahead of the agent's replies.  Replies
+ * are collected from ClientLoop() as they arrive, so a slow agent only
+ * delays the clients whose fetches involve it.  Each agent must answer
+ * its oldest outstanding request within pmcd_timeout, otherwise it is
+ * cleaned up and its part of every pending fetch is returned as
+ * PM_ERR_NOAGENT.
+ *
+ * While a client's fetch is pending, the client's fd is not watched, so
+ * any further PDUs from that client are processed after the reply has
+ * been sent.
+ */
+#define FETCH_PIPELINE	4
+
+/*
+ * With worker threads (pmcd -w), fetches from DSO agents that set
+ * PMDA_FLAG_THREADSAFE are queued in the same way, but run on a worker
+ * thread, one request at a time for each agent.  Every other call into
+ * such an agent first waits for its queue to drain, so the PMDA itself
+ * never sees concurrent calls.  Other DSO agents are still called
+ * inline, on the main thread.
+ */
+#define WorkerAgent(ap)	(pmcd_workers > 0 && (ap)->ipcType == AGENT_DSO && \
+			 ((ap)->status.flags & PMDA_FLAG_THREADSAFE))
+
+typedef struct FetchCtl {
+    int			client;		/* index into client[], -1 if gone */
+    int			ctxnum;		/* client context slot */
+    int			nPmids;
+    pmID		*pmidList;	/* pinned in the client's PDU buffer */
+    int			nDoms;		/* dList[nDoms] is the "bad" list */
+    DomPmidList		*dList;		/* private copy of SplitPmidList() */
+    pmResult		**results;	/* indexed like dList */
+    char		*dsoResult;	/* results[i] is a live DSO's skeleton */
+    int			*resIndex;	/* next vset in results[i] */
+    unsigned int	changes;	/* PMCD_* bits from agent results */
+    int			nWait;		/* results still to come */
+    int			blocked;	/* client fd removed from clientPoll */
+} FetchCtl;
+
+struct FetchReq {
+    WorkerJob		job;		/* DSO agents on a worker thread */
+    FetchReq		*next;
+    FetchCtl		*fcp;		/* the fetch this request is part of */
+    int			dom;		/* index into fcp->dList */
+    AgentInfo		*agent;		/* these are only for worker jobs */
+    pmResult		*result;
+    int			sts;
+};
+
+static int	nowReady;		/* agents that sent PMDAREADY */
+
+/*
+ * DSO agents reuse their pmResult skeleton on the next call, so take a
+ * private copy of the skeleton (the value sets are passed on as is).
+ */
+static pmResult *
+CopyResult(pmResult *rp)
+{
+    pmResult	*copy;
+    int		need;
+
+    need = (int)sizeof(pmResult) + (rp->numpmid - 1) * (int)sizeof(pmValueSet *);
+    if ((copy = (pmResult *)malloc(need)) == NULL) {
+	pmNoMem("CopyResult", need, PM_FATAL_ERR);
+    }
+    memcpy(copy, rp, need);
+    return copy;
+}
+
+/* Worker thread side of a fetch from a DSO agent */
+static void
+RunDsoFetch(WorkerJob *job)
+{
+    FetchReq	*rp = (FetchReq *)job;
+    AgentInfo	*ap = rp->agent;
+    DomPmidList	*dp = &rp->fcp->dList[rp->dom];
+
+    rp->result = NULL;
+    rp->sts = ap->ipc.dso.dispatch.version.any.fetch(dp->listSize, dp->list,
+				&rp->result, ap->ipc.dso.dispatch.version.any.ext);
+}
+
+static FetchCtl *
+NewFetch(ClientInfo *cip, int ctxnum, int nPmids, pmID *pmidList,
+	 DomPmidList *dList)
+{
+    FetchCtl	*fcp;
+    size_t	dsize;
+    size_t	need;
+    int		nDoms;
+    int		i;
+
+    for (nDoms = 0; dList[nDoms].domain != -1; nDoms++)
+	;
+    /* dList is a single heap block, laid out as in SplitPmidList() */
+    dsize = (nDoms + 1) * sizeof(DomPmidList) + nPmids * sizeof(pmID);
+    need = sizeof(FetchCtl) + (nDoms + 1) * (sizeof(pmResult *) + sizeof(int));
+    need += dsize + nDoms + 1;
+    if ((fcp = (FetchCtl *)calloc(1, need)) == NULL) {
+	pmNoMem("NewFetch", need, PM_FATAL_ERR);
+    }
+    fcp->client = cip - client;
+    fcp->ctxnum = ctxnum;
+    fcp->nPmids = nPmids;
+    fcp->pmidList = pmidList;
+    fcp->nDoms = nDoms;
+    fcp->results = (pmResult **)&fcp[1];
+    fcp->dList = (DomPmidList *)&fcp->results[nDoms + 1];
+    memcpy(fcp->dList, dList, dsize);
+    for (i = 0; i <= nDoms; i++)
+	fcp->dList[i].list = (pmID *)((char *)fcp->dList +
+				((char *)dList[i].list - (char *)dList));
+    fcp->resIndex = (int *)((char *)fcp->dList + dsize);
+    fcp->dsoResult = (char *)&fcp->resIndex[nDoms + 1];
+    return fcp;
+}
+
+/*
+ * All the per-domain results are in, so assemble the client's pmResult,
+ * send it and release the fetch.
+ */
+static void
+FinishFetch(FetchCtl *fcp)
+{
+    static pmResult	*endResult = NULL;
+    static int		maxnpmids = 0;	/* sizes endResult */
+    ClientInfo		*cip;
+    int			i, j;
+    int			sts;
+
+    if (fcp->changes)
+	MarkStateChanges(fcp->changes);
+
+    if (fcp->client >= 0) {
+	cip = &client[fcp->client];
+	cip->fetch = NULL;
+
+	if (fcp->nPmids > maxnpmids) {
+	    int		need;
+	    if (endResult != NULL)
+		free(endResult);
+	    need = (int)sizeof(pmResult) + (fcp->nPmids - 1) * (int)sizeof(pmValueSet *);
+	    if ((endResult = (pmResult *)malloc(need)) == NULL) {
+		pmNoMem("FinishFetch.endResult", need, PM_FATAL_ERR);
+	    }
+	    maxnpmids = fcp->nPmids;
+	}
+
+	endResult->numpmid = fcp->nPmids;
+	pmtimevalNow(&endResult->timestamp);
+	/* The order of the pmIDs in the per-domain results is the same as in
+	 * the original request, but on a per-domain basis.  resIndex is the
+	 * index of the next metric to be retrieved from each per-domain
+	 * result's vset.  Agents may have come and gone since the request was
+	 * split, so search dList rather than using mapdom[].
+	 */
+	for (i = 0; i < fcp->nPmids; i++) {
+	    int	domain = ((__pmID_int *)&fcp->pmidList[i])->domain;
+
+	    for (j = 0; j < fcp->nDoms; j++)
+		if (fcp->dList[j].domain == domain)
+		    break;
+	    endResult->vset[i] = fcp->results[j]->vset[fcp->resIndex[j]++];
+	}
+	pmcd_trace(TR_XMIT_PDU, cip->fd, PDU_RESULT, endResult->numpmid);
+
+	sts = 0;
+	if (cip->status.changes) {
+	    /* notify client of PMCD state change */
+	    sts = __pmSendError(cip->fd, FROM_ANON, (int)cip->status.changes);
+	    if (sts > 0)
+		sts = 0;
+	    cip->status.changes = 0;
+	}
+	if (sts == 0)
+	    sts = __pmSendResult(cip->fd, FROM_ANON, endResult);
+	if (sts >= 0 && fcp->blocked)
+	    /* resume processing PDUs from this client */
+	    sts = __pmPollSetAdd(clientPoll, cip->fd);
+
+	if (sts < 0) {
+	    pmcd_trace(TR_XMIT_ERR, cip->fd, PDU_RESULT, sts);
+	    CleanupClient(cip, sts);
+	}
+    }
+
+    /*
+     * pmFreeResult() all the accumulated results.
+     */
+    for (i = 0; i <= fcp->nDoms; i++) {
+	if (fcp->results[i] == NULL)
+	    continue;
+	if (fcp->dsoResult[i])
+	    /* Living DSO's manage their own pmResult skeleton unless
+	     * MakeBadResult was called to create the result.  The value sets
+	     * within the skeleton need to be freed though!
+	     */
+	    __pmFreeResultValues(fcp->results[i]);
+	else
+	    /* For others it is dynamically allocated in __pmDecodeResult or
+	     * MakeBadResult
+	     */
+	    pmFreeResult(fcp->results[i]);
+    }
+    __pmUnpinPDUBuf(fcp->pmidList);
+    free(fcp);
+}
+
+/* One per-domain result (NULL if nobody needs it) has arrived */
+static void
+FetchDone(FetchCtl *fcp, int dom, pmResult *result)
+{
+    if (result != NULL) {
+	fcp->results[dom] = result;
+	fcp->changes |= ExtractState(result);
+    }
+    if (--fcp->nWait == 0)
+	FinishFetch(fcp);
+}
+
+static void
+WatchAgentReply(AgentInfo *ap)
+{
+    pmtimevalNow(&ap->fetchDeadline);
+    ap->fetchDeadline.tv_sec += pmcd_timeout;
+}
+
+/*
+ * Send queued requests to a daemon agent, keeping at most FETCH_PIPELINE
+ * of them outstanding.  Sent requests are always at the head of the queue.
+ */
+static void
+DispatchFetches(AgentInfo *ap)
+{
+    FetchReq	*rp, *prev;
+    FetchCtl	*fcp;
+    pmResult	*result;
+    int		depth;
+    int		i, sts;
+
+    depth = (ap->ipcType == AGENT_DSO) ? 1 : FETCH_PIPELINE;
+    while (ap->fetchSent < depth) {
+	prev = NULL;
+	rp = ap->fetchHead;
+	for (i = 0; rp != NULL && i < ap->fetchSent; i++) {
+	    prev = rp;
+	    rp = rp->next;
+	}
+	if (rp == NULL)
+	    break;
+
+	/* unlink while sending, as SendFetch may clean up the agent */
+	if (prev == NULL)
+	    ap->fetchHead = rp->next;
+	else
+	    prev->next = rp->next;
+	if (ap->fetchTail == rp)
+	    ap->fetchTail = prev;
+
+	fcp = rp->fcp;
+	if (fcp->client < 0) {
+	    /* client has gone away, no need to ask */
+	    FetchDone(fcp, rp->dom, NULL);
+	    free(rp);
+	    continue;
+	}
+	if (ap->ipcType == AGENT_DSO) {
+	    rp->job.run = RunDsoFetch;
+	    rp->agent = ap;
+	}
+	result = SendFetch(&fcp->dList[rp->dom], ap, &client[fcp->client],
+			   fcp->ctxnum,
+			   ap->ipcType == AGENT_DSO ? &rp->job : NULL);
+	if (result != NULL) {
+	    FetchDone(fcp, rp->dom, result);
+	    free(rp);
+	    continue;
+	}
+
+	/* sent, so back into the queue to wait for the agent's reply */
+	if (prev == NULL) {
+	    rp->next = ap->fetchHead;
+	    ap->fetchHead = rp;
+	}
+	else {
+	    rp->next = prev->next;
+	    prev->next = rp;
+	}
+	if (rp->next == NULL)
+	    ap->fetchTail = rp;
+	if (ap->fetchSent++ == 0 && ap->ipcType != AGENT_DSO) {
+	    WatchAgentReply(ap);
+	    if ((sts = __pmPollSetAdd(clientPoll, ap->outFd)) < 0) {
+		pmNotifyErr(LOG_ERR, "DoFetch: cannot wait on \"%s\" agent: %s\n",
+			ap->pmDomainLabel, pmErrStr(sts));
+		CleanupAgent(ap, AT_COMM, ap->outFd);
+		break;
+	    }
+	}
+    }
+}
+
+static void
+QueueFetch(AgentInfo *ap, FetchCtl *fcp, int dom)
+{
+    FetchReq	*rp;
+
+    if ((rp = (FetchReq *)malloc(sizeof(FetchReq))) == NULL) {
+	pmNoMem("QueueFetch", sizeof(FetchReq), PM_FATAL_ERR);
+    }
+    rp->next = NULL;
+    rp->fcp = fcp;
+    rp->dom = dom;
+    if (ap->fetchTail == NULL)
+	ap->fetchHead = rp;
+    else
+	ap->fetchTail->next = rp;
+    ap->fetchTail = rp;
+    fcp->nWait++;
+    DispatchFetches(ap);
+}
+
+/*
+ * Complete the fetch request at the head of a DSO agent's queue, once
+ * the worker thread is done with it.
+ */
+static void
+DsoFetchReply(AgentInfo *ap)
+{
+    FetchReq		*rp = ap->fetchHead;
+    DomPmidList		*dp = &rp->fcp->dList[rp->dom];
+    pmResult		*result;
+    int			sts;
+
+    WorkerWait(&rp->job);
+    if ((ap->fetchHead = rp->next) == NULL)
+	ap->fetchTail = NULL;
+    ap->fetchSent--;
+
+    result = rp->result;
+    if ((sts = rp->sts) >= 0) {
+	if (result == NULL) {
+	    pmNotifyErr(LOG_WARNING,
+			"\"%s\" agent (DSO) returned a null result\n",
+			ap->pmDomainLabel);
+	    sts = PM_ERR_PMID;
+	}
+	else if (result->numpmid != dp->listSize) {
+	    pmNotifyErr(LOG_WARNING,
+			"\"%s\" agent (DSO) returned %d pmIDs (%d expected)\n",
+			ap->pmDomainLabel, result->numpmid, dp->listSize);
+	    sts = PM_ERR_PMID;
+	}
+    }
+    if (sts < 0) {
+	if (pmDebugOptions.appl0)
+	    fprintf(stderr, "FETCH error: \"%s\" agent : %s\n",
+		    ap->pmDomainLabel, pmErrStr(sts));
+	/* as for inline DSO calls, "no values" rather than an error */
+	result = MakeBadResult(dp->listSize, dp->list, 0);
+    }
+    else
+	result = CopyResult(result);
+
+    FetchDone(rp->fcp, rp->dom, result);
+    free(rp);
+    DispatchFetches(ap);
+}
+
+/*
+ * Read one PDU from a daemon agent with fetch requests outstanding.
+ * This is the reply to the request at the head of the agent's queue,
+ * unless the agent is announcing that it is ready again.
+ */
+static void
+AgentFetchReply(AgentInfo *ap)
+{
+    FetchReq		*rp;
+    DomPmidList		*dp;
+    pmResult		*result = NULL;
+    __pmPDU		*pb;
+    int			pinpdu;
+    int			sts;
+
+    if (ap->ipcType == AGENT_DSO) {
+	DsoFetchReply(ap);
+	return;
+    }
+
+    pinpdu = sts = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
+    if (sts > 0)
+	pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
+    if (sts == PDU_ERROR) {
+	int s;
+	if ((s = __pmDecodeError(pb, &sts)) < 0)
+	    sts = s;
+	else if (sts == PM_ERR_PMDAREADY && ap->status.notReady) {
+	    if (pmDebugOptions.appl0)
+		pmNotifyErr(LOG_INFO, "%s agent (not ready) sent ready status(%d)\n",
+			     ap->pmDomainLabel, sts);
+	    ap->status.notReady = 0;
+	    nowReady++;
+	    __pmUnpinPDUBuf(pb);
+	    return;
+	}
+	else if (sts >= 0)
+	    sts = PM_ERR_GENERIC;
+	pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_RESULT, sts);
+    }
+
+    rp = ap->fetchHead;
+    if ((ap->fetchHead = rp->next) == NULL)
+	ap->fetchTail = NULL;
+    if (--ap->fetchSent > 0)
+	WatchAgentReply(ap);
+    else
+	__pmPollSetDel(clientPoll, ap->outFd);
+    dp = &rp->fcp->dList[rp->dom];
+
+    if (sts == PDU_RESULT) {
+	if ((sts = __pmDecodeResult(pb, &result)) >= 0) {
+	    if (result->numpmid != dp->listSize) {
+		if (pmDebugOptions.appl0)
+		    pmNotifyErr(LOG_ERR, "DoFetch: \"%s\" agent given %d pmIDs, returned %d\n",
+				 ap->pmDomainLabel, dp->listSize, result->numpmid);
+		pmFreeResult(result);
+		result = NULL;
+		sts = PM_ERR_IPC;
+	    }
+	}
+    }
+    else if (sts >= 0 && sts != PDU_ERROR) {
+	pmcd_trace(TR_WRONG_PDU, ap->outFd, PDU_RESULT, sts);
+	sts = PM_ERR_IPC;
+    }
+    if (pinpdu > 0)
+	__pmUnpinPDUBuf(pb);
+
+    if (sts < 0) {
+	result = MakeBadResult(dp->listSize, dp->list, sts);
+
+	if (sts == PM_ERR_PMDANOTREADY) {
+	    /* the agent is indicating it can't handle PDUs for now */
+	    int k;
+	    extern int CheckError(AgentInfo *ap, int sts);
+
+	    for (k = 0; k < dp->listSize; k++)
+		result->vset[k]->numval = PM_ERR_AGAIN;
+	    sts = CheckError(ap, sts);
+	}
+
+	if (pmDebugOptions.appl0) {
+	    fprintf(stderr, "RESULT error from \"%s\" agent : %s\n",
+		    ap->pmDomainLabel, pmErrStr(sts));
+	}
+	if (sts == PM_ERR_IPC || sts == PM_ERR_TIMEOUT)
+	    CleanupAgent(ap, AT_COMM, ap->outFd);
+    }
+
+    FetchDone(rp->fcp, rp->dom, result);
+    free(rp);
+    if (ap->status.connected)
+	DispatchFetches(ap);
+}
+
 int
 DoFetch(ClientInfo *cip, __pmPDU* pb)
 {
     int			i, j;
     int 		sts;
     int			ctxnum;
-    unsigned int	changes = 0;
     pmTimeval		when;
     int			nPmids;
     pmID		*pmidList;
-    static pmResult	*endResult = NULL;
-    static int		maxnpmids = 0;	/* sizes endResult */
     DomPmidList		*dList;		/* NOTE: NOT indexed by agent index */
-    static int		nDoms = 0;
-    static pmResult	**results = NULL;
-    static int		*resIndex = NULL;
-    __pmFdSet		waitFds;
-    __pmFdSet		readyFds;
-    int			nWait;
-    int			maxFd;
-    struct timeval	timeout;
+    FetchCtl		*fcp;
+    AgentInfo		*ap;
     __pmHashCtl		*hcp;
     __pmHashNode	*hp;
     pmProfile		*profile;
 
-    if (nAgents > nDoms) {
-	if (results != NULL)
-	    free(results);
-	if (resIndex != NULL)
-	    free(resIndex);
-	results = (pmResult **)malloc((nAgents + 1) * sizeof (pmResult *));
-	resIndex = (int *)malloc((nAgents + 1) * sizeof(int));
-	if (results == NULL || resIndex == NULL) {
-	    pmNoMem("DoFetch.results", (nAgents + 1) * sizeof (pmResult *) + (nAgents + 1) * sizeof(int), PM_FATAL_ERR);
-	}
-	nDoms = nAgents;
-    }
-    memset(results, 0, (nAgents + 1) * sizeof(results[0]));
-
     sts = __pmDecodeFetch(pb, &ctxnum, &when, &nPmids, &pmidList);
     if (sts < 0)
 	return sts;
@@ -410,211 +868,199 @@ DoFetch(ClientInfo *cip, __pmPDU* pb)
 	return PM_ERR_NOPROFILE;
     }
 
-    if (nPmids > maxnpmids) {
-	int		need;
-	if (endResult != NULL)
-	    free(endResult);
-	need = (int)sizeof(pmResult) + (nPmids - 1) * (int)sizeof(pmValueSet *);
-	if ((endResult = (pmResult *)malloc(need)) == NULL) {
-	    pmNoMem("DoFetch.endResult", need, PM_FATAL_ERR);
-	}
-	maxnpmids = nPmids;
-    }
-
     dList = SplitPmidList(nPmids, pmidList);
+    fcp = NewFetch(cip, ctxnum, nPmids, pmidList, dList);
+    dList = fcp->dList;
 
     /* For each domain in the split pmidList, dispatch the per-domain subset
      * of pmIDs to the appropriate agent.  For DSO agents, the pmResult will
      * come back immediately.  If a request cannot be sent to an agent, a
      * suitable pmResult (containing metric not available values) will be
-     * returned.
+     * returned.  nWait holds an extra count until all requests have been
+     * dispatched, so the fetch cannot finish underneath us.
      */
-    __pmFD_ZERO(&waitFds);
-    nWait = 0;
-    maxFd = -1;
+    fcp->nWait = 1;
     for (i = 0; dList[i].domain != -1; i++) {
 	j = mapdom[dList[i].domain];
-	results[j] = SendFetch(&dList[i], &agent[j], cip, ctxnum);
-	if (results[j] == NULL) { /* Wait for agent's response */
-	    int fd = agent[j].outFd;
-	    agent[j].status.busy = 1;
-	    __pmFD_SET(fd, &waitFds);
-	    if (fd > maxFd)
-		maxFd = fd;
-	    nWait++;
-	} else {
-	    changes |= ExtractState(results[j]);
+	ap = &agent[j];
+	if (ap->ipcType == AGENT_DSO && !WorkerAgent(ap)) {
+	    fcp->results[i] = SendFetch(&dList[i], ap, cip, ctxnum, NULL);
+	    fcp->dsoResult[i] = ap->status.connected && !ap->status.madeDsoResult;
+	    fcp->changes |= ExtractState(fcp->results[i]);
 	}
+	else
+	    QueueFetch(ap, fcp, i);
     }
     /* Construct pmResult for bad-pmID list */
     if (dList[i].listSize != 0)
-	results[nAgents] = MakeBadResult(dList[i].listSize, dList[i].list, PM_ERR_NOAGENT);
-
-    /* Wait for results to roll in from agents */
-    while (nWait > 0) {
-        __pmFD_COPY(&readyFds, &waitFds);
-	if (nWait > 1) {
-	    timeout.tv_sec = pmcd_timeout;
-	    timeout.tv_usec = 0;
-
-            retry:
-	    setoserror(0);
-	    sts = __pmSelectRead(maxFd+1, &readyFds, &timeout);
-
-	    if (sts == 0) {
-		pmNotifyErr(LOG_INFO, "DoFetch: select timeout");
-
-		/* Timeout, terminate agents with undelivered results */
-		for (i = 0; i < nAgents; i++) {
-		    if (agent[i].status.busy) {
-			/* Find entry in dList for this agent */
-			for (j = 0; dList[j].domain != -1; j++)
-			    if (dList[j].domain == agent[i].pmDomainId)
-				break;
-			results[i] = MakeBadResult(dList[j].listSize,
-						   dList[j].list,
-						   PM_ERR_NOAGENT);
-			pmcd_trace(TR_RECV_TIMEOUT, agent[i].outFd, PDU_RESULT, 0);
-			CleanupAgent(&agent[i], AT_COMM, agent[i].inFd);
-		    }
-		}
-		break;
-	    }
-	    else if (sts < 0) {
-		if (neterror() == EINTR)
-		    goto retry;
-		/* this is not expected to happen! */
-		pmNotifyErr(LOG_ERR, "DoFetch: fatal select failure: %s\n",
-			netstrerror());
-		Shutdown();
-		exit(1);
-	    }
-	}
+	fcp->results[i] = MakeBadResult(dList[i].listSize, dList[i].list, PM_ERR_NOAGENT);
 
-	/* Read results from agents that have them ready */
-	for (i = 0; i < nAgents; i++) {
-	    AgentInfo	*ap = &agent[i];
-	    int		pinpdu;
-	    if (!ap->status.busy || !__pmFD_ISSET(ap->outFd, &readyFds))
-		continue;
-	    ap->status.busy = 0;
-	    __pmFD_CLR(ap->outFd, &waitFds);
-	    nWait--;
-	    pinpdu = sts = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
-	    if (sts > 0)
-		pmcd_trace(TR_RECV_PDU, ap->outFd, sts, (int)((__psint_t)pb & 0xffffffff));
-	    if (sts == PDU_RESULT) {
-		if ((sts = __pmDecodeResult(pb, &results[i])) >= 0) {
-		    if (results[i]->numpmid == aFreq[i]) {
-			changes |= ExtractState(results[i]);
-		    } else {
-			if (pmDebugOptions.appl0)
-			    pmNotifyErr(LOG_ERR, "DoFetch: \"%s\" agent given %d pmIDs, returned %d\n",
-					 ap->pmDomainLabel, aFreq[i], results[i]->numpmid);
-			pmFreeResult(results[i]);
-			sts = PM_ERR_IPC;
-		    }
-		}
-	    }
-	    else {
-		if (sts == PDU_ERROR) {
-		    int s;
-		    if ((s = __pmDecodeError(pb, &sts)) < 0)
-			sts = s;
-		    else if (sts >= 0)
-			sts = PM_ERR_GENERIC;
-		    pmcd_trace(TR_RECV_ERR, ap->outFd, PDU_RESULT, sts);
-		}
-		else if (sts >= 0) {
-		    pmcd_trace(TR_WRONG_PDU, ap->outFd, PDU_RESULT, sts);
-		    sts = PM_ERR_IPC;
-		}
-	    }
-	    if (pinpdu > 0)
-		__pmUnpinPDUBuf(pb);
-
-	    if (sts < 0) {
-		/* Find entry in dList for this agent */
-		for (j = 0; dList[j].domain != -1; j++)
-		    if (dList[j].domain == agent[i].pmDomainId)
-			break;
-		results[i] = MakeBadResult(dList[j].listSize,
-					   dList[j].list, sts);
-
-		if (sts == PM_ERR_PMDANOTREADY) {
-		    /* the agent is indicating it can't handle PDUs for now */
-		    int k;
-		    extern int CheckError(AgentInfo *ap, int sts);
-
-		    for (k = 0; k < dList[j].listSize; k++)
-			results[i]->vset[k]->numval = PM_ERR_AGAIN;
-		    sts = CheckError(&agent[i], sts);
-		}
+    if (fcp->nWait == 1) {
+	/* nothing outstanding, reply now */
+	FinishFetch(fcp);
+	return 0;
+    }
 
-		if (pmDebugOptions.appl0) {
-		    fprintf(stderr, "RESULT error from \"%s\" agent : %s\n",
-			    ap->pmDomainLabel, pmErrStr(sts));
-		}
-		if (sts == PM_ERR_IPC || sts == PM_ERR_TIMEOUT)
-		    CleanupAgent(ap, AT_COMM, ap->outFd);
-	    }
+    /* results from DSO agents called inline must outlive the next call */
+    for (i = 0; i < fcp->nDoms; i++) {
+	if (fcp->dsoResult[i]) {
+	    fcp->results[i] = CopyResult(fcp->results[i]);
+	    fcp->dsoResult[i] = 0;
 	}
     }
 
-    if (changes)
-	MarkStateChanges(changes);
+    /* stop reading from this client until the reply has been sent */
+    __pmPollSetDel(clientPoll, cip->fd);
+    fcp->blocked = 1;
+    cip->fetch = fcp;
+    FetchDone(fcp, fcp->nDoms, NULL);
+    return 0;
+}
+
+/*
+ * Complete all fetch requests queued on an agent, before a synchronous
+ * request/reply exchange with that agent.
+ */
+void
+DrainAgentFetches(AgentInfo *ap)
+{
+    while (ap->fetchHead != NULL) {
+	if (ap->fetchSent == 0)
+	    DispatchFetches(ap);
+	else
+	    AgentFetchReply(ap);
+    }
+}
+
+/*
+ * Called from CleanupAgent(), fail every fetch request still queued on
+ * the agent.
+ */
+void
+AbortAgentFetches(AgentInfo *ap)
+{
+    FetchReq	*rp, *next;
+    DomPmidList	*dp;
+
+    if (ap->ipcType == AGENT_DSO && ap->fetchSent > 0) {
+	/* cannot interrupt the worker thread, and its result is unwanted */
+	rp = ap->fetchHead;
+	WorkerWait(&rp->job);
+	if (rp->sts >= 0 && rp->result != NULL)
+	    __pmFreeResultValues(rp->result);
+    }
+    rp = ap->fetchHead;
+    ap->fetchHead = ap->fetchTail = NULL;
+    ap->fetchSent = 0;
+    for ( ; rp != NULL; rp = next) {
+	next = rp->next;
+	dp = &rp->fcp->dList[rp->dom];
+	FetchDone(rp->fcp, rp->dom,
+		  MakeBadResult(dp->listSize, dp->list, PM_ERR_NOAGENT));
+	free(rp);
+    }
+}
+
+/*
+ * Called from DeleteClient(), the fetch finishes as usual but the
+ * result is discarded.
+ */
+void
+OrphanClientFetch(ClientInfo *cip)
+{
+    FetchCtl	*fcp = cip->fetch;
+    int		i;
 
-    endResult->numpmid = nPmids;
-    pmtimevalNow(&endResult->timestamp);
-    /* The order of the pmIDs in the per-domain results is the same as in the
-     * original request, but on a per-domain basis.  resIndex is an array of
-     * indices (one per agent) of the next metric to be retrieved from each
-     * per-domain result's vset.
+    /* a worker thread may be using this client's profile, which is
+     * about to be freed
      */
-    memset(resIndex, 0, (nAgents + 1) * sizeof(resIndex[0]));
+    for (i = 0; i < nAgents; i++) {
+	AgentInfo	*ap = &agent[i];
 
-    for (i = 0; i < nPmids; i++) {
-	j = mapdom[((__pmID_int *)&pmidList[i])->domain];
-	endResult->vset[i] = results[j]->vset[resIndex[j]++];
+	if (ap->ipcType == AGENT_DSO && ap->fetchSent > 0 &&
+	    ap->fetchHead->fcp == fcp)
+	    WorkerWait(&ap->fetchHead->job);
     }
-    pmcd_trace(TR_XMIT_PDU, cip->fd, PDU_RESULT, endResult->numpmid);
+    fcp->client = -1;
+    cip->fetch = NULL;
+}
 
-    sts = 0;
-    if (cip->status.changes) {
-	/* notify client of PMCD state change */
-	sts = __pmSendError(cip->fd, FROM_ANON, (int)cip->status.changes);
-	if (sts > 0)
-	    sts = 0;
-	cip->status.changes = 0;
+/*
+ * Collect replies from agents with fetch requests outstanding, returns
+ * the number of agents that have become ready.
+ */
+int
+HandleFetchReplies(void)
+{
+    int		i;
+    int		ready;
+
+    for (i = 0; i < nAgents; i++) {
+	AgentInfo	*ap = &agent[i];
+
+	if (ap->fetchSent == 0)
+	    continue;
+	if (ap->ipcType == AGENT_DSO) {
+	    if (WorkerIsDone(&ap->fetchHead->job))
+		AgentFetchReply(ap);
+	}
+	else if (__pmPollSetIsReady(clientPoll, ap->outFd))
+	    AgentFetchReply(ap);
     }
-    if (sts == 0)
-	sts = __pmSendResult(cip->fd, FROM_ANON, endResult);
+    ready = nowReady;
+    nowReady = 0;
+    return ready;
+}
 
-    if (sts < 0) {
-	pmcd_trace(TR_XMIT_ERR, cip->fd, PDU_RESULT, sts);
-	CleanupClient(cip, sts);
+/*
+ * Time until the next agent reply is overdue, or NULL if no replies
+ * are outstanding.
+ */
+struct timeval *
+FetchTimeout(struct timeval *tv)
+{
+    struct timeval	now;
+    struct timeval	*due = NULL;
+    int			i;
+
+    for (i = 0; i < nAgents; i++) {
+	if (agent[i].fetchSent == 0 || agent[i].ipcType == AGENT_DSO)
+	    continue;
+	if (due == NULL || pmtimevalSub(&agent[i].fetchDeadline, due) < 0)
+	    due = &agent[i].fetchDeadline;
+    }
+    if (due == NULL)
+	return NULL;
+    pmtimevalNow(&now);
+    if (pmtimevalSub(due, &now) <= 0)
+	tv->tv_sec = tv->tv_usec = 0;
+    else {
+	*tv = *due;
+	pmtimevalDec(tv, &now);
     }
+    return tv;
+}
 
-    /*
-     * pmFreeResult() all the accumulated results.
-     */
-    for (i = 0; dList[i].domain != -1; i++) {
-	j = mapdom[dList[i].domain];
-	if (agent[j].ipcType == AGENT_DSO && agent[j].status.connected &&
-	    !agent[j].status.madeDsoResult)
-	    /* Living DSO's manage their own pmResult skeleton unless
-	     * MakeBadResult was called to create the result.  The value sets
-	     * within the skeleton need to be freed though!
-	     */
-	    __pmFreeResultValues(results[j]);
-	else
-	    /* For others it is dynamically allocated in __pmDecodeResult or
-	     * MakeBadResult
-	     */
-	    pmFreeResult(results[j]);
+/*
+ * Terminate agents that have not replied to their oldest fetch request
+ * in time.
+ */
+void
+CheckFetchTimeouts(void)
+{
+    struct timeval	now;
+    int			i;
+
+    pmtimevalNow(&now);
+    for (i = 0; i < nAgents; i++) {
+	AgentInfo	*ap = &agent[i];
+
+	if (ap->fetchSent == 0 || ap->ipcType == AGENT_DSO ||
+	    pmtimevalSub(&ap->fetchDeadline, &now) > 0)
+	    continue;
+	pmNotifyErr(LOG_INFO, "DoFetch: timeout waiting for \"%s\" agent",
+		     ap->pmDomainLabel);
+	pmcd_trace(TR_RECV_TIMEOUT, ap->outFd, PDU_RESULT, 0);
+	CleanupAgent(ap, AT_COMM, ap->inFd);
     }
-    if (results[nAgents] != NULL)
-	pmFreeResult(results[nAgents]);
-    __pmUnpinPDUBuf(pmidList);
-    return 0;
 }
@@ -70,6 +70,7 @@ DoText(ClientInfo *cp, __pmPDU* pb)
     else if (!ap->status.connected)
 	return PM_ERR_NOAGENT;
 
+    DrainAgentFetches(ap);
     if (ap->ipcType == AGENT_DSO) {
 	if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 	    ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -182,6 +183,7 @@ DoDesc(ClientInfo *cp, __pmPDU *pb)
     else if (!ap->status.connected)
 	return PM_ERR_NOAGENT;
 
+    DrainAgentFetches(ap);
     if (ap->ipcType == AGENT_DSO) {
 	if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 	    ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -267,6 +269,7 @@ DoInstance(ClientInfo *cp, __pmPDU *pb)
 	return PM_ERR_NOAGENT;
     }
 
+    DrainAgentFetches(ap);
     if (ap->ipcType == AGENT_DSO) {
 	if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 	    ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -443,6 +446,7 @@ DoLabel(ClientInfo *cp, __pmPDU *pb)
     if (!ap->status.connected)
 	return PM_ERR_NOAGENT;
 
+    DrainAgentFetches(ap);
     if (ap->ipcType == AGENT_DSO) {
 	if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 	    ap->ipc.dso.dispatch.version.seven.ext->e_context = cp - client;
@@ -549,6 +553,7 @@ DoPMNSIDs(ClientInfo *cp, __pmPDU *pb)
 	    sts = PM_ERR_NOAGENT;
 	    goto fail;
 	}
+	DrainAgentFetches(ap);
 	if (ap->ipcType == AGENT_DSO) {
 	    if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 		ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -663,6 +668,7 @@ DoPMNSNames(ClientInfo *cp, __pmPDU *pb)
 	    lsts = PM_ERR_NOAGENT;
 	}
 	else {
+	    DrainAgentFetches(ap);
 	    if (ap->ipcType == AGENT_DSO) {
 		if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 		    ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -785,6 +791,7 @@ DoPMNSChild(ClientInfo *cp, __pmPDU *pb)
 	    sts = PM_ERR_NOAGENT;
 	    goto done;
 	}
+	DrainAgentFetches(ap);
 	if (ap->ipcType == AGENT_DSO) {
 	    if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 		ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -958,6 +965,7 @@ traverse_dynamic(ClientInfo *cp, char *start, int *num_names, char ***names)
 		continue;
 	    if (!ap->status.connected)
 		continue;
+	    DrainAgentFetches(ap);
 	    if (ap->ipcType == AGENT_DSO) {
 		if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 		    ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
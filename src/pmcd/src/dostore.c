@@ -134,10 +134,9 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
     pmResult	*result;
     pmResult	**dResult;
     int		i;
-    __pmFdSet	readyFds;
-    __pmFdSet	waitFds;
+    __pmPollSet	*waitSet;
     int		nWait = 0;
-    int		maxFd = -1;
+    int		polled;
     int		badStore;		/* != 0 => store to nonexistent agent */
     int		notReady = 0;		/* != 0 => store to agent that's not ready */
     struct timeval	timeout;
@@ -150,13 +149,14 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
 
     /* Send the per-domain results to their respective agents */
 
-    __pmFD_ZERO(&waitFds);
+    waitSet = AgentPollSet();
     for (i = 0; dResult[i]->numpmid > 0; i++) {
-	int fd;
 	ap = FindDomainAgent(((__pmID_int *)&dResult[i]->vset[0]->pmid)->domain);
 	/* If it's in a "good" list, pmID has agent that is connected */
 	assert(ap != NULL);
 
+	/* finish any fetches in progress on this agent first */
+	DrainAgentFetches(ap);
 	if (ap->ipcType == AGENT_DSO) {
 	    if (ap->ipc.dso.dispatch.comm.pmda_interface >= PMDA_INTERFACE_5)
 		ap->ipc.dso.dispatch.version.four.ext->e_context = cp - client;
@@ -168,12 +168,8 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
 		/* agent is ready for PDUs */
 		pmcd_trace(TR_XMIT_PDU, ap->inFd, PDU_RESULT, dResult[i]->numpmid);
 		s = __pmSendResult(ap->inFd, cp - client, dResult[i]);
-		if (s >= 0) {
+		if (s >= 0 && (s = __pmPollSetAdd(waitSet, ap->outFd)) >= 0) {
 		    ap->status.busy = 1;
-		    fd = ap->outFd;
-		    __pmFD_SET(fd, &waitFds);
-		    if (fd > maxFd)
-			maxFd = fd;
 		    nWait++;
 		}
 		else if (s == PM_ERR_IPC || sts == PM_ERR_TIMEOUT || s == -EPIPE) {
@@ -200,14 +196,14 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
     /* Collect error PDUs containing store status from each active agent */
 
     while (nWait > 0) {
-        __pmFD_COPY(&readyFds, &waitFds);
-	if (nWait > 1) {
+	polled = (nWait > 1);
+	if (polled) {
 	    timeout.tv_sec = pmcd_timeout;
 	    timeout.tv_usec = 0;
 
 	    retry:
 	    setoserror(0);
-	    s = __pmSelectRead(maxFd+1, &readyFds, &timeout);
+	    s = __pmPollSetWait(waitSet, NULL, &timeout);
 
 	    if (s == 0) {
 		pmNotifyErr(LOG_INFO, "DoStore: select timeout");
@@ -236,10 +232,13 @@ DoStore(ClientInfo *cp, __pmPDU* pb)
 	for (i = 0; i < nAgents; i++) {
 	    int		pinpdu;
 	    ap = &agent[i];
-	    if (!ap->status.busy || !__pmFD_ISSET(ap->outFd, &readyFds))
+	    if (!ap->status.busy)
+		continue;
+	    /* with only one reply outstanding, __pmGetPDU does the waiting */
+	    if (polled && !__pmPollSetIsReady(waitSet, ap->outFd))
 		continue;
 	    ap->status.busy = 0;
-	    __pmFD_CLR(ap->outFd, &waitFds);
+	    __pmPollSetDel(waitSet, ap->outFd);
 	    nWait--;
 	    pinpdu = s = __pmGetPDU(ap->outFd, ANY_SIZE, pmcd_timeout, &pb);
 	    if (s > 0)
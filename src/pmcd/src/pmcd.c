@@ -34,6 +34,8 @@ int		labelChanged;		/* For SIGHUP labels check */
 static int	timeToDie;		/* For SIGINT handling */
 static int	restart;		/* For SIGHUP restart */
 static int	maxReqPortFd;		/* Largest request port fd */
+static __pmFdSet requestFds;		/* Request port fds */
+static int	workerFd = -1;		/* Worker thread completions */
 static char	configFileName[MAXPATHLEN]; /* path to pmcd.conf */
 static char	*logfile = "pmcd.log";	/* log file name */
 static int	run_daemon = 1;		/* run as a daemon, see -f */
@@ -104,6 +106,7 @@ static pmLongOptions longopts[] = {
     { "", 1, 'L', "BYTES", "maximum size for PDUs from clients [default 65536]" },
     { "", 1, 'q', "TIME", "PMDA initial negotiation timeout (seconds) [default 3]" },
     { "", 1, 't', "TIME", "PMDA response timeout (seconds) [default 5]" },
+    { "workers", 1, 'w', "N", "fetch from thread-safe DSO PMDAs on N threads [default 0]" },
     { "verify", 0, 'v', 0, "check validity of pmcd configuration, then exit" },
     PMAPI_OPTIONS_HEADER("Connection options"),
     { "interface", 1, 'i', "ADDR", "accept connections on this IP address" },
@@ -118,7 +121,7 @@ static pmLongOptions longopts[] = {
 
 static pmOptions opts = {
     .flags = PM_OPTFLAG_POSIX,
-    .short_options = "Ac:C:D:fH:i:l:L:M:N:n:p:P:q:Qs:St:T:U:vx:?",
+    .short_options = "Ac:C:D:fH:i:l:L:M:N:n:p:P:q:Qs:St:T:U:vw:x:?",
     .long_options = longopts,
 };
 
@@ -268,6 +271,17 @@ ParseOptions(int argc, char *argv[], int *nports)
 		verify = 1;
 		break;
 
+	    case 'w':
+		val = (int)strtol(opts.optarg, &endptr, 10);
+		if (*endptr != '\0' || val < 0) {
+		    pmprintf("%s: -w requires a positive numeric argument\n",
+			pmGetProgname());
+		    opts.errors++;
+		} else {
+		    pmcd_workers = val;
+		}
+		break;
+
 	    case 'x':
 		fatalfile = opts.optarg;
 		break;
@@ -300,21 +314,24 @@ ParseOptions(int argc, char *argv[], int *nports)
  * as required.
  */
 void
-HandleClientInput(__pmFdSet *fdsPtr)
+HandleClientInput(int *readyFds, int nReady)
 {
     int		sts;
-    int		i;
+    int		i, r;
     __pmPDU	*pb;
     __pmPDUHdr	*php;
     ClientInfo	*cp;
 
-    for (i = 0; i < nClients; i++) {
+    for (r = 0; r < nReady; r++) {
 	int		pinpdu;
 
-	if (!client[i].status.connected || !__pmFD_ISSET(client[i].fd, fdsPtr))
+	/* may have been closed while handling an earlier descriptor */
+	if (!__pmPollSetIsReady(clientPoll, readyFds[r]))
+	    continue;
+	if ((cp = FindClientFd(readyFds[r])) == NULL)
 	    continue;
 
-	cp = &client[i];
+	i = cp - client;
 	this_client_id = i;
 
 	pinpdu = sts = __pmGetPDU(cp->fd, LIMIT_SIZE, pmcd_timeout, &pb);
@@ -598,7 +615,7 @@ SignalReloadPMNS(void)
  * to handle PDUs.
  */
 static int
-HandleReadyAgents(__pmFdSet *readyFds)
+HandleReadyAgents(void)
 {
     int		i, s, sts;
     int		fd;
@@ -609,9 +626,10 @@ HandleReadyAgents(__pmFdSet *readyFds)
 
     for (i = 0; i < nAgents; i++) {
 	ap = &agent[i];
-	if (ap->status.notReady) {
+	/* with fetches outstanding, HandleFetchReplies() reads the agent */
+	if (ap->status.notReady && ap->fetchSent == 0) {
 	    fd = ap->outFd;
-	    if (__pmFD_ISSET(fd, readyFds)) {
+	    if (__pmPollSetIsReady(clientPoll, fd)) {
 		int		pinpdu;
 
 		/* Expect an error PDU containing PM_ERR_PMDAREADY */
@@ -744,56 +762,72 @@ static void
 ClientLoop(void)
 {
     int		i, fd, sts;
-    int		maxFd;
     int		checkAgents;
     int		reload_namespace = 0;
     int		restartAgents = -1;	/* initial state unknown */
-    __pmFdSet	readableFds;
+    int		*readyFds;
+    __pmFdSet	readyPorts;
+    struct timeval	timeout;
 
     for (;;) {
 
-	/* Figure out which file descriptors to wait for input on.  Keep
-	 * track of the highest numbered descriptor for the select call.
-	 */
-	readableFds = clientFds;
-	maxFd = maxClientFd + 1;
-
-	/* If an agent was not ready, it may send an ERROR PDU to indicate it
-	 * is now ready.  Add such agents to the list of file descriptors.
+	/* Client and request port file descriptors stay in clientPoll for
+	 * as long as they are open, so there is no set to rebuild here.
+	 *
+	 * If an agent was not ready, it may send an ERROR PDU to indicate it
+	 * is now ready.  Watch such agents for this iteration only.
 	 */
 	checkAgents = 0;
 	for (i = 0; i < nAgents; i++) {
 	    AgentInfo	*ap = &agent[i];
 
-	    if (ap->status.notReady) {
+	    if (ap->status.notReady && ap->outFd >= 0) {
 		fd = ap->outFd;
-		__pmFD_SET(fd, &readableFds);
-		if (fd > maxFd)
-		    maxFd = fd + 1;
+		if (__pmPollSetAdd(clientPoll, fd) < 0)
+		    continue;
 		checkAgents = 1;
 		if (pmDebugOptions.appl0)
 		    pmNotifyErr(LOG_INFO,
-				 "not ready: check %s agent on fd %d (max = %d)\n",
-				 ap->pmDomainLabel, fd, maxFd);
+				 "not ready: check %s agent on fd %d\n",
+				 ap->pmDomainLabel, fd);
 	    }
 	}
 
-	sts = __pmSelectRead(maxFd, &readableFds, NULL);
+	/* Agents with fetch requests outstanding have their output fd in
+	 * clientPoll, and the wait is bounded by the earliest reply due.
+	 */
+	sts = __pmPollSetWait(clientPoll, &readyFds, FetchTimeout(&timeout));
 	if (sts > 0) {
-	    if (pmDebugOptions.appl0)
-		for (i = 0; i <= maxClientFd; i++)
-		    if (__pmFD_ISSET(i, &readableFds))
-			fprintf(stderr, "DATA: from %s (fd %d)\n",
-				FdToString(i), i);
-	    __pmServerAddNewClients(&readableFds, CheckNewClient);
+	    /* request ports are opened first, so always within FD_SETSIZE */
+	    __pmFD_ZERO(&readyPorts);
+	    for (i = 0; i < sts; i++) {
+		fd = readyFds[i];
+		if (pmDebugOptions.appl0)
+		    fprintf(stderr, "DATA: from %s (fd %d)\n",
+				FdToString(fd), fd);
+		if (fd <= maxReqPortFd && __pmFD_ISSET(fd, &requestFds))
+		    __pmFD_SET(fd, &readyPorts);
+	    }
+	    __pmServerAddNewClients(&readyPorts, CheckNewClient);
 	    if (checkAgents)
-		reload_namespace = HandleReadyAgents(&readableFds);
-	    HandleClientInput(&readableFds);
+		reload_namespace = HandleReadyAgents();
+	    if (workerFd >= 0 && __pmPollSetIsReady(clientPoll, workerFd))
+		WorkerNotified();
+	    if (HandleFetchReplies())
+		reload_namespace = 1;
+	    HandleClientInput(readyFds, sts);
 	}
 	else if (sts == -1 && neterror() != EINTR) {
-	    pmNotifyErr(LOG_ERR, "ClientLoop select: %s\n", netstrerror());
+	    pmNotifyErr(LOG_ERR, "ClientLoop wait: %s\n", netstrerror());
 	    break;
 	}
+	CheckFetchTimeouts();
+	if (checkAgents) {
+	    for (i = 0; i < nAgents; i++) {
+		if (agent[i].fetchSent == 0)
+		    __pmPollSetDel(clientPoll, agent[i].outFd);
+	    }
+	}
 	if (AgentDied) {
 	    if (restartAgents == -1) {
 		char *args;
@@ -983,9 +1017,18 @@ main(int argc, char *argv[])
     __pmSetSignalHandler(SIGBUS, SigBad);
     __pmSetSignalHandler(SIGSEGV, SigBad);
 
-    if ((sts = __pmServerOpenRequestPorts(&clientFds, maxpending)) < 0)
+    if ((sts = __pmServerOpenRequestPorts(&requestFds, maxpending)) < 0)
 	DontStart();
     maxReqPortFd = maxClientFd = sts;
+    if ((clientPoll = __pmPollSetCreate()) == NULL) {
+	fprintf(stderr, "Error: cannot create client poll set: %s\n",
+			osstrerror());
+	DontStart();
+    }
+    for (sts = 0; sts <= maxReqPortFd; sts++) {
+	if (__pmFD_ISSET(sts, &requestFds))
+	    __pmPollSetAdd(clientPoll, sts);
+    }
 
     /*
      * would prefer open log earlier so any messages up to this point
@@ -1038,10 +1081,24 @@ main(int argc, char *argv[])
     if (__pmSecureServerCertificateSetup(certdb, dbpassfile, cert_nickname) < 0)
 	DontStart();
 
+    /* after any change of identity, which would apply to all threads */
+    if (pmcd_workers > 0) {
+	if ((sts = WorkerStart(pmcd_workers)) < 0 ||
+	    (sts = __pmPollSetAdd(clientPoll, workerFd = sts)) < 0) {
+	    fprintf(stderr, "Warning: cannot start worker threads: %s\n",
+		    pmErrStr(sts));
+	    fprintf(stderr, "         DSO PMDAs will be called from the main thread\n");
+	    pmcd_workers = 0;
+	}
+    }
+
     PrintAgentInfo(stderr);
     __pmAccDumpLists(stderr);
     fprintf(stderr, "\npmcd: PID = %" FMT_PID, pmcd_pid);
-    fprintf(stderr, ", PDU version = %u\n", PDU_VERSION);
+    fprintf(stderr, ", PDU version = %u", PDU_VERSION);
+    if (pmcd_workers > 0)
+	fprintf(stderr, ", worker threads = %d", pmcd_workers);
+    fputc('\n', stderr);
     __pmServerDumpRequestPorts(stderr);
     fflush(stderr);
 
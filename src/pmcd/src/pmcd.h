@@ -71,6 +71,9 @@ typedef struct {
     pid_t agentPid;			/* Process ID of the agent */
 } PipeInfo;
 
+/* A per-domain fetch request, queued on an agent (see dofetch.c) */
+typedef struct FetchReq FetchReq;
+
 /* The agent table and its size. */
 
 typedef struct {
@@ -96,6 +99,10 @@ typedef struct {
 	    flags : 16;			/* Agent-supplied connection flags */
     } status;
     int		reason;			/* if ! connected */
+    FetchReq	*fetchHead;		/* Queued fetch requests, oldest first */
+    FetchReq	*fetchTail;		/* Last queued fetch request */
+    int		fetchSent;		/* Requests sent, replies outstanding */
+    struct timeval fetchDeadline;	/* When reply to oldest is overdue */
     union {				/* per-ipcType info */
 	DsoInfo    dso;
 	SocketInfo socket;
@@ -146,6 +153,8 @@ extern int		AgentDied;	/* for updating mapdom[] */
 
 extern AgentInfo *FindDomainAgent(int);
 extern void CleanupAgent(AgentInfo *, int, int);
+extern __pmPollSet *AgentPollSet(void);
+extern __pmPollSet *agentPoll;		/* waiting for replies from agents */
 extern int HarvestAgents(unsigned int);
 
 /* pmdaroot file descriptor */
@@ -157,6 +166,24 @@ PMCD_DATA extern int	pmcd_timeout;
 /* timeout for credentials */
 extern int	_creds_timeout;
 
+/*
+ * Optional worker threads, used for fetches from DSO PMDAs that set
+ * PMDA_FLAG_THREADSAFE.  A job's run() callback is called on a worker
+ * thread and must not touch pmcd's global state.
+ */
+typedef struct WorkerJob {
+    struct WorkerJob	*next;
+    void		(*run)(struct WorkerJob *);
+    int			done;		/* run() has returned */
+} WorkerJob;
+
+extern int	pmcd_workers;		/* number of worker threads (-w) */
+extern int WorkerStart(int);
+extern void WorkerSubmit(WorkerJob *);
+extern int WorkerIsDone(WorkerJob *);
+extern void WorkerWait(WorkerJob *);
+extern void WorkerNotified(void);
+
 /* flag for context label changes */
 extern int	labelChanged;
 
@@ -203,6 +230,12 @@ extern int pmcd_load_libpcp_pmda(void);
  * PDU handling routines
  */
 extern int DoFetch(ClientInfo *, __pmPDU *);
+extern void DrainAgentFetches(AgentInfo *);
+extern void AbortAgentFetches(AgentInfo *);
+extern void OrphanClientFetch(ClientInfo *);
+extern int HandleFetchReplies(void);
+extern struct timeval *FetchTimeout(struct timeval *);
+extern void CheckFetchTimeouts(void);
 extern int DoProfile(ClientInfo *, __pmPDU *);
 extern int DoDesc(ClientInfo *, __pmPDU *);
 extern int DoLabel(ClientInfo *, __pmPDU *);
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Pool of worker threads for pmcd.
+ *
+ * Everything else in pmcd runs on the main thread; workers only ever
+ * execute WorkerJob run() callbacks, which must not touch pmcd's global
+ * state.  Completion is flagged in the job, and a byte is written to a
+ * pipe that ClientLoop() watches, so the main thread can pick up the
+ * result without polling.
+ */
+
+#include "pmcd.h"
+#include <pthread.h>
+#include <signal.h>
+
+int		pmcd_workers;		/* number of worker threads (-w) */
+
+static pthread_mutex_t	worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	worker_todo = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	worker_done = PTHREAD_COND_INITIALIZER;
+static WorkerJob	*todo_head;	/* jobs waiting for a worker */
+static WorkerJob	*todo_tail;
+static int		notify_fd[2] = { -1, -1 };
+
+static void *
+WorkerMain(void *arg)
+{
+    WorkerJob	*job;
+    char	c = 0;
+
+    for ( ; ; ) {
+	pthread_mutex_lock(&worker_lock);
+	while (todo_head == NULL)
+	    pthread_cond_wait(&worker_todo, &worker_lock);
+	job = todo_head;
+	if ((todo_head = job->next) == NULL)
+	    todo_tail = NULL;
+	pthread_mutex_unlock(&worker_lock);
+
+	job->run(job);
+
+	pthread_mutex_lock(&worker_lock);
+	job->done = 1;
+	pthread_cond_broadcast(&worker_done);
+	pthread_mutex_unlock(&worker_lock);
+
+	/* if the pipe is full, ClientLoop is going to wake up anyway */
+	if (write(notify_fd[1], &c, 1) < 0 && oserror() != EAGAIN)
+	    pmNotifyErr(LOG_ERR, "WorkerMain: notify write: %s\n",
+			osstrerror());
+    }
+    return NULL;
+}
+
+/*
+ * Start nthreads workers.  Returns the descriptor that becomes readable
+ * when a job completes, or a negative error code.
+ */
+int
+WorkerStart(int nthreads)
+{
+    pthread_t	tid;
+    sigset_t	all, save;
+    int		i, sts;
+
+    if (pipe(notify_fd) < 0)
+	return -oserror();
+    for (i = 0; i < 2; i++) {
+	if (fcntl(notify_fd[i], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(notify_fd[i], F_SETFD, FD_CLOEXEC) < 0) {
+	    sts = -oserror();
+	    goto fail;
+	}
+    }
+
+    /* signals are handled by the main thread, never by workers */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &save);
+    for (i = 0; i < nthreads; i++) {
+	if ((sts = pthread_create(&tid, NULL, WorkerMain, NULL)) != 0) {
+	    sts = -sts;
+	    break;
+	}
+	pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &save, NULL);
+    if (i == 0)
+	goto fail;
+    if (i < nthreads)
+	pmNotifyErr(LOG_WARNING, "WorkerStart: only %d of %d worker threads started: %s\n",
+			i, nthreads, pmErrStr(sts));
+    pmcd_workers = i;
+    pmcd_openfds_sethi(notify_fd[0]);
+    pmcd_openfds_sethi(notify_fd[1]);
+    return notify_fd[0];
+
+fail:
+    close(notify_fd[0]);
+    close(notify_fd[1]);
+    notify_fd[0] = notify_fd[1] = -1;
+    return sts;
+}
+
+void
+WorkerSubmit(WorkerJob *job)
+{
+    job->next = NULL;
+    job->done = 0;
+    pthread_mutex_lock(&worker_lock);
+    if (todo_tail == NULL)
+	todo_head = job;
+    else
+	todo_tail->next = job;
+    todo_tail = job;
+    pthread_cond_signal(&worker_todo);
+    pthread_mutex_unlock(&worker_lock);
+}
+
+int
+WorkerIsDone(WorkerJob *job)
+{
+    int		done;
+
+    pthread_mutex_lock(&worker_lock);
+    done = job->done;
+    pthread_mutex_unlock(&worker_lock);
+    return done;
+}
+
+/* Block the main thread until a job has completed */
+void
+WorkerWait(WorkerJob *job)
+{
+    pthread_mutex_lock(&worker_lock);
+    while (!job->done)
+	pthread_cond_wait(&worker_done, &worker_lock);
+    pthread_mutex_unlock(&worker_lock);
+}
+
+/* Consume completion notifications, the jobs themselves are checked later */
+void
+WorkerNotified(void)
+{
+    char	buf[64];
+
+    while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+	;
+}
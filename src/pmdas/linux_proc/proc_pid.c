@@ -824,7 +824,7 @@ refresh_proc_pidlist(proc_pid_t *proc_pid, proc_pid_list_t *pids)
     int fd;
     char *p;
     char buf[MAXPATHLEN];
-    __pmHashNode *node, *next, *prev;
+    __pmHashNode *node, *next;
     proc_pid_entry_t *ep;
     pmdaIndom *indomp = proc_pid->indom;
 
@@ -984,11 +984,11 @@ refresh_proc_pidlist(proc_pid_t *proc_pid, proc_pid_list_t *pids)
      * harvest exited pids from the pid hash table
      */
     for (i=0; i < proc_pid->pidhash.hsize; i++) {
-	for (prev=NULL, node=proc_pid->pidhash.hash[i]; node != NULL;) {
+	for (node=proc_pid->pidhash.hash[i]; node != NULL;) {
 	    next = node->next;
 	    ep = (proc_pid_entry_t *)node->data;
-	    // fprintf(stderr, "CHECKING key=%d node=" PRINTF_P_PFX "%p prev=" PRINTF_P_PFX "%p next=" PRINTF_P_PFX "%p ep=" PRINTF_P_PFX "%p valid=%d\n",
-	    	// ep->id, node, prev, node->next, ep, ep->valid);
+	    // fprintf(stderr, "CHECKING key=%d node=" PRINTF_P_PFX "%p next=" PRINTF_P_PFX "%p ep=" PRINTF_P_PFX "%p valid=%d\n",
+	    	// ep->id, node, node->next, ep, ep->valid);
 	    if (!(ep->flags & PROC_PID_FLAG_VALID)) {
 	        //fprintf(stderr, "DELETED key=%d name=\"%s\"\n", ep->id, ep->name);
 		if (ep->name != NULL)
@@ -1010,15 +1010,8 @@ refresh_proc_pidlist(proc_pid_t *proc_pid, proc_pid_list_t *pids)
 		if (ep->environ_buf != NULL)
 		    free(ep->environ_buf);
 
-	    	if (prev == NULL)
-		    proc_pid->pidhash.hash[i] = node->next;
-		else
-		    prev->next = node->next;
+		__pmHashDel(node->key, (void *)ep, &proc_pid->pidhash);
 		free(ep);
-		free(node);
-	    }
-	    else {
-	    	prev = node;
 	    }
 	    if ((node = next) == NULL)
 	    	break;
@@ -183,6 +183,12 @@ metrictype(int mtype)
     case MMV_TYPE_ELAPSED:
 	type = "elapsed";
 	break;
+    case MMV_TYPE_HISTOGRAM:
+	type = "histogram";
+	break;
+    case MMV_TYPE_SKETCH:
+	type = "sketch";
+	break;
     default:
 	type = "?";
 	break;
@@ -354,7 +360,9 @@ dump_value(void *addr, size_t size, mmv_disk_value_t *vals, int i, int toc, int
 {
     mmv_disk_string_t *string;
     struct timeval tv;
+    __uint64_t *buckets, total;
     __int64_t t;
+    int j, count;
 
     switch (type) {
     case MMV_TYPE_I32:
@@ -396,6 +404,23 @@ dump_value(void *addr, size_t size, mmv_disk_value_t *vals, int i, int toc, int
 	    printf("Bad (positive) ELAPSED 'extra' value found!");
 	}
 	break;
+    case MMV_TYPE_HISTOGRAM:
+    case MMV_TYPE_SKETCH:
+	count = (type == MMV_TYPE_HISTOGRAM) ?
+		MMV_HISTOGRAM_BUCKETS : MMV_SKETCH_BUCKETS;
+	if (vals[i].extra <= 0 ||
+	    size < vals[i].extra + count * sizeof(__uint64_t)) {
+	    printf(" = ?\n");
+	    printf("Bad file size: toc[%d] %s value[%d] extra\n",
+		    toc, metrictype(type), i);
+	    return 1;
+	}
+	buckets = (__uint64_t *)((char *)addr + vals[i].extra);
+	for (j = 0, total = 0; j < count; j++)
+	    total += buckets[j];
+	printf(" = %"PRIu64" observations (buckets at %"PRIi64")",
+		total, vals[i].extra);
+	break;
     default:
 	printf("Unknown type %d", type);
     }
@@ -535,6 +560,75 @@ dump_strings(void *addr, size_t size, int idx, long base, __uint64_t offset, __i
     return 0;
 }
 
+int
+dump_slots(void *addr, size_t size, int idx, long base, __uint64_t offset, __int32_t count)
+{
+    int i;
+    mmv_disk_slot_t *slot = (mmv_disk_slot_t *)((char *)addr + offset);
+
+    printf("\nTOC[%d]: offset %ld, slots offset %"PRIu64" (%d entries)\n",
+		idx, base, offset, count);
+
+    for (i = 0; i < count; i++) {
+	__uint64_t off = offset + i * sizeof(mmv_disk_slot_t);
+
+	if (size < off + sizeof(mmv_disk_slot_t)) {
+	    printf("Bad file size: toc[%d] slot[%d]\n", idx, i);
+	    return 1;
+	}
+	/* only slots that have been written to, there are many */
+	if (slot[i].value.ull != 0)
+	    printf("  [%u/%"PRIu64"] 0x%"PRIx64"\n",
+		    i, off, slot[i].value.ull);
+    }
+    return 0;
+}
+
+int
+dump_hash(void *addr, size_t size, int idx, long base, __uint64_t offset, __int32_t count)
+{
+    int i;
+    mmv_disk_hash_t *hash = (mmv_disk_hash_t *)((char *)addr + offset);
+
+    printf("\nTOC[%d]: offset %ld, index offset %"PRIu64" (%d entries)\n",
+		idx, base, offset, count);
+
+    for (i = 0; i < count; i++) {
+	__uint64_t off = offset + i * sizeof(mmv_disk_hash_t);
+
+	if (size < off + sizeof(mmv_disk_hash_t)) {
+	    printf("Bad file size: toc[%d] bucket[%d]\n", idx, i);
+	    return 1;
+	}
+	/* only buckets in use, at least half are empty */
+	if (hash[i].value != 0)
+	    printf("  [%u/%"PRIu64"] hash 0x%08x value %"PRIu64"\n",
+		    i, off, hash[i].hash, hash[i].value);
+    }
+    return 0;
+}
+
+int
+dump_buckets(void *addr, size_t size, int idx, long base, __uint64_t offset, __int32_t count)
+{
+    int i;
+    __uint64_t *bucket = (__uint64_t *)((char *)addr + offset);
+
+    printf("\nTOC[%d]: offset %ld, buckets offset %"PRIu64" (%d entries)\n",
+		idx, base, offset, count);
+
+    if (size < offset + count * sizeof(__uint64_t)) {
+	printf("Bad file size: toc[%d] buckets\n", idx);
+	return 1;
+    }
+    /* only buckets that have been counted in, most are empty */
+    for (i = 0; i < count; i++)
+	if (bucket[i] != 0)
+	    printf("  [%u/%"PRIu64"] %"PRIu64"\n",
+		    i, offset + i * sizeof(__uint64_t), bucket[i]);
+    return 0;
+}
+
 static char *
 flagstr(int flags)
 {
@@ -551,8 +645,11 @@ flagstr(int flags)
 	strcat(buf, "process, ");
     if (flags & MMV_FLAG_SENTINEL)
 	strcat(buf, "sentinel, ");
+    if (flags & MMV_FLAG_PERCPU)
+	strcat(buf, "percpu, ");
 
-    flags &= ~(MMV_FLAG_NOPREFIX | MMV_FLAG_PROCESS | MMV_FLAG_SENTINEL);
+    flags &= ~(MMV_FLAG_NOPREFIX | MMV_FLAG_PROCESS | MMV_FLAG_SENTINEL |
+		MMV_FLAG_PERCPU);
 
     /* unrecognised bits */
     if (flags) {
@@ -654,6 +751,18 @@ dump(const char *file, void *addr, size_t size)
 	    if (dump_strings(addr, size, i, base, offset, count))
 		sts = 1;
 	    break;
+	case MMV_TOC_SLOTS:
+	    if (dump_slots(addr, size, i, base, offset, count))
+		sts = 1;
+	    break;
+	case MMV_TOC_HASH:
+	    if (dump_hash(addr, size, i, base, offset, count))
+		sts = 1;
+	    break;
+	case MMV_TOC_BUCKETS:
+	    if (dump_buckets(addr, size, i, base, offset, count))
+		sts = 1;
+	    break;
 	default:
 	    printf("Unrecognised TOC[%d] type: 0x%x\n", i, type);
 	    sts = 1;
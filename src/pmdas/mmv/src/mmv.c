@@ -33,6 +33,7 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <math.h>
 
 static int isDSO = 1;
 static char *username;
@@ -76,7 +77,11 @@ typedef struct {
     mmv_disk_value_t * values;		/* values in mmap */
     mmv_disk_metric_t * metrics1;	/* v1 metric descs in mmap */
     mmv_disk_metric2_t * metrics2;	/* v2 metric descs in mmap */
+    mmv_disk_slot_t * slots;		/* per-CPU value slots in mmap */
+    __uint64_t * buckets;		/* histogram/sketch counts in mmap */
     int		vcnt;			/* number of values */
+    int		nslots;			/* number of slots per value */
+    int		bcnt;			/* number of bucket counts */
     int		mcnt1;			/* number of metrics */
     int		mcnt2;			/* number of v2 metrics */
     int		version;		/* v1/v2 version number */
@@ -91,6 +96,40 @@ static int scnt;
 
 #define MAX_MMV_COUNT 10000		/* enforce reasonable limits */
 #define MAX_MMV_CLUSTER ((1<<12)-1)
+#define MAX_MMV_ITEM ((1<<10)-1)
+
+/*
+ * Histogram and sketch metrics are exported as their bucket counts,
+ * one instance per bucket (fixed instance domains in cluster zero,
+ * shared by all files), under the metric name plus ".bucket".  Next
+ * to that are derived metrics - the number of observations and some
+ * quantiles - with items taken from a reserved range, a fixed slot of
+ * DERIVED_SLOTS items for each histogram item below DERIVED_MAX, so
+ * their PMIDs do not depend on the other metrics in the file.
+ */
+#define HISTOGRAM_INDOM	1
+#define SKETCH_INDOM	2
+
+#define DERIVED_BASE	512
+#define DERIVED_SLOTS	4
+#define DERIVED_MAX	((MAX_MMV_ITEM + 1 - DERIVED_BASE) / DERIVED_SLOTS)
+
+typedef struct {
+    unsigned int	item;		/* histogram or sketch item */
+    double		quantile;	/* zero for the observation count */
+} derived_t;
+
+/* at most DERIVED_SLOTS of these, the item layout depends on it */
+static const struct {
+    const char *	suffix;
+    double		quantile;
+} derived[] = {
+    { "count",	0.0 },
+    { "p50",	0.50 },
+    { "p90",	0.90 },
+    { "p99",	0.99 },
+};
+#define NDERIVED (sizeof(derived) / sizeof(derived[0]))
 
 /*
  * Check cluster number validity (must be in range 0 .. 1<<12).
@@ -476,10 +515,193 @@ create_indom(pmdaExt *pmda, stats_t *s, __uint64_t offset, __uint32_t count,
     return 0;
 }
 
+static int
+mmv_type_buckets(int type)
+{
+    if (type == MMV_TYPE_HISTOGRAM)
+	return MMV_HISTOGRAM_BUCKETS;
+    if (type == MMV_TYPE_SKETCH)
+	return MMV_SKETCH_BUCKETS;
+    return 0;
+}
+
+/* Inclusive value range of a log-linear histogram bucket */
+static void
+histogram_bounds(unsigned int bucket, __uint64_t *lo, __uint64_t *hi)
+{
+    unsigned int exp = bucket / MMV_HISTOGRAM_SUB;
+    unsigned int sub = bucket % MMV_HISTOGRAM_SUB;
+
+    if (exp == 0) {
+	*lo = *hi = bucket;
+	return;
+    }
+    *lo = (__uint64_t)(MMV_HISTOGRAM_SUB + sub) << (exp - 1);
+    *hi = *lo + ((__uint64_t)1 << (exp - 1)) - 1;
+}
+
+/* Upper bound of a sketch bucket (the last one has none) */
+static double
+sketch_bound(unsigned int bucket)
+{
+    if (bucket == 0)
+	return 0.0;
+    return pow(MMV_SKETCH_GAMMA, (int)bucket - MMV_SKETCH_OFFSET);
+}
+
+/*
+ * Instance names of the buckets are their (inclusive) upper bounds,
+ * built once and kept for the life of the PMDA.
+ */
+static char **
+bucket_names(mmv_metric_type_t type, int *count)
+{
+    static char *histogram[MMV_HISTOGRAM_BUCKETS];
+    static char *sketch[MMV_SKETCH_BUCKETS];
+    char buffer[64], **names;
+    __uint64_t lo, hi;
+    int i;
+
+    if (type == MMV_TYPE_HISTOGRAM) {
+	names = histogram;
+	*count = MMV_HISTOGRAM_BUCKETS;
+    } else {
+	names = sketch;
+	*count = MMV_SKETCH_BUCKETS;
+    }
+    for (i = 0; i < *count; i++) {
+	if (names[i] != NULL)
+	    continue;
+	if (type == MMV_TYPE_HISTOGRAM) {
+	    histogram_bounds(i, &lo, &hi);
+	    pmsprintf(buffer, sizeof(buffer), "%" PRIu64, hi);
+	} else if (i == MMV_SKETCH_BUCKETS - 1) {
+	    pmsprintf(buffer, sizeof(buffer), "inf");
+	} else {
+	    pmsprintf(buffer, sizeof(buffer), "%.6g", sketch_bound(i));
+	}
+	if ((names[i] = strdup(buffer)) == NULL)
+	    return NULL;
+    }
+    return names;
+}
+
+static int
+create_bucket_indom(pmdaExt *pmda, stats_t *s, mmv_metric_type_t type,
+		pmInDom *indom)
+{
+    pmdaIndom *ip;
+    char **names;
+    int i, count;
+
+    *indom = pmInDom_build(pmda->e_domain, type == MMV_TYPE_HISTOGRAM ?
+				HISTOGRAM_INDOM : SKETCH_INDOM);
+    for (i = 0; i < intot; i++)
+	if (indoms[i].it_indom == *indom)
+	    return 0;
+
+    if (pmDebugOptions.appl0)
+	pmNotifyErr(LOG_DEBUG, "MMV: create_bucket_indom: %s",
+			pmInDomStr(*indom));
+
+    if ((names = bucket_names(type, &count)) == NULL) {
+	pmNotifyErr(LOG_ERR, "%s: cannot get memory for bucket names in %s",
+			pmGetProgname(), s->name);
+	return -ENOMEM;
+    }
+    indoms = realloc(indoms, sizeof(pmdaIndom) * (intot + 1));
+    if (indoms == NULL) {
+	pmNotifyErr(LOG_ERR, "%s: cannot grow indom list in %s",
+			pmGetProgname(), s->name);
+	return -ENOMEM;
+    }
+    ip = &indoms[intot++];
+    ip->it_indom = *indom;
+    ip->it_set = (pmdaInstid *)calloc(count, sizeof(pmdaInstid));
+    if (ip->it_set == NULL) {
+	pmNotifyErr(LOG_ERR, "%s: cannot get memory for instance list in %s",
+			pmGetProgname(), s->name);
+	ip->it_numinst = 0;
+	return -ENOMEM;
+    }
+    ip->it_numinst = count;
+    for (i = 0; i < count; i++) {
+	ip->it_set[i].i_inst = i;
+	ip->it_set[i].i_name = names[i];
+    }
+    return 0;
+}
+
+/*
+ * Add the bucket counts metric of a histogram or sketch, and its
+ * derived metrics - items for those are DERIVED_BASE plus a slot per
+ * histogram item, and are refused if the file uses any of them itself
+ * (marked in used[]).
+ */
+static int
+create_histogram(pmdaExt *pmda, stats_t *s, char *name, pmID pmid,
+	mmv_metric_type_t type, pmUnits units, unsigned char *used)
+{
+    pmUnits count = PMDA_PMUNITS(0,0,1,0,0,PM_COUNT_ONE);
+    char buffer[MAXPATHLEN];
+    derived_t *dp;
+    pmInDom indom;
+    pmID id;
+    int i, item, sts;
+
+    if ((sts = create_bucket_indom(pmda, s, type, &indom)) < 0)
+	return sts;
+    pmsprintf(buffer, sizeof(buffer), "%s.bucket", name);
+    if ((sts = create_metric(pmda, s, buffer, pmid, 0,
+			MMV_TYPE_U64, MMV_SEM_COUNTER, count)) < 0)
+	return sts;
+    metrics[mtot-1].m_desc.indom = indom;
+
+    if (pmID_item(pmid) >= DERIVED_MAX) {
+	pmNotifyErr(LOG_WARNING, "item %u (%s) in %s is not below %d, "
+			"no derived metrics", pmID_item(pmid), name, s->name,
+			DERIVED_MAX);
+	return -EINVAL;
+    }
+    item = DERIVED_BASE + pmID_item(pmid) * DERIVED_SLOTS;
+    for (i = 0; i < NDERIVED; i++) {
+	if (used[item + i]) {
+	    pmNotifyErr(LOG_WARNING, "item %d reserved for %s.%s in use in %s, "
+			"no derived metrics", item + i, name, derived[i].suffix,
+			s->name);
+	    return -EEXIST;
+	}
+    }
+
+    for (i = 0; i < NDERIVED; i++) {
+	pmsprintf(buffer, sizeof(buffer), "%s.%s", name, derived[i].suffix);
+	if (pmdaTreePMID(pmns, buffer, &id) == 0)
+	    continue;
+	if ((dp = (derived_t *)malloc(sizeof(derived_t))) == NULL)
+	    return -ENOMEM;
+	dp->item = pmID_item(pmid);
+	dp->quantile = derived[i].quantile;
+	id = pmID_build(pmda->e_domain, s->cluster, item + i);
+	if (dp->quantile == 0)
+	    sts = create_metric(pmda, s, buffer, id, 0,
+			MMV_TYPE_U64, MMV_SEM_COUNTER, count);
+	else
+	    sts = create_metric(pmda, s, buffer, id, 0,
+			MMV_TYPE_DOUBLE, MMV_SEM_INSTANT, units);
+	if (sts < 0) {
+	    free(dp);
+	    return sts;
+	}
+	metrics[mtot-1].m_user = dp;
+    }
+    return 0;
+}
+
 static void
 map_stats(pmdaExt *pmda)
 {
     struct dirent **files;
+    unsigned char used[MAX_MMV_ITEM + 1];
     char name[64];
     int need_reload = 0;
     int i, j, k, sts, num;
@@ -497,6 +719,10 @@ map_stats(pmdaExt *pmda)
 	return;
     }
 
+    /* derived metric descriptions from the previous mapping */
+    for (i = 3; i < mtot; i++)
+	free(metrics[i].m_user);
+
     /* hard-coded metrics (not from mmap'd files) */
     pmsprintf(name, sizeof(name), "%s.control.reload", prefix);
     __pmAddPMNSNode(pmns, pmID_build(pmda->e_domain, 0, 0), name);
@@ -585,6 +811,11 @@ map_stats(pmdaExt *pmda)
 		    s->metrics1 = ml;
 		    s->mcnt1 = count;
 
+		    memset(used, 0, sizeof(used));
+		    for (k = 0; k < count; k++)
+			if (ml[k].item <= MAX_MMV_ITEM)
+			    used[ml[k].item] = 1;
+
 		    for (k = 0; k < count; k++) {
 			mmv_disk_metric_t *mp = &ml[k];
 			char name[MAXPATHLEN];
@@ -602,7 +833,11 @@ map_stats(pmdaExt *pmda)
 			    continue;
 
 			pmid = pmID_build(pmda->e_domain, s->cluster, mp->item);
-			create_metric(pmda, s, name, pmid, mp->indom,
+			if (mmv_type_buckets(mp->type))
+			    create_histogram(pmda, s, name, pmid,
+					mp->type, mp->dimension, used);
+			else
+			    create_metric(pmda, s, name, pmid, mp->indom,
 					mp->type, mp->semantics, mp->dimension);
 		    }
 		}
@@ -623,6 +858,11 @@ map_stats(pmdaExt *pmda)
 		    s->metrics2 = ml;
 		    s->mcnt2 = count;
 
+		    memset(used, 0, sizeof(used));
+		    for (k = 0; k < count; k++)
+			if (ml[k].item <= MAX_MMV_ITEM)
+			    used[ml[k].item] = 1;
+
 		    for (k = 0; k < count; k++) {
 			mmv_disk_metric2_t *mp = &ml[k];
 			mmv_disk_string_t *string;
@@ -657,7 +897,11 @@ map_stats(pmdaExt *pmda)
 			    continue;
 
 			pmid = pmID_build(pmda->e_domain, s->cluster, mp->item);
-			create_metric(pmda, s, name, pmid, mp->indom,
+			if (mmv_type_buckets(mp->type))
+			    create_histogram(pmda, s, name, pmid,
+					mp->type, mp->dimension, used);
+			else
+			    create_metric(pmda, s, name, pmid, mp->indom,
 					mp->type, mp->semantics, mp->dimension);
 		    }
 		}
@@ -760,6 +1004,41 @@ map_stats(pmdaExt *pmda)
 		s->values = (mmv_disk_value_t *)((char *)s->addr + offset);
 		break;
 
+	    case MMV_TOC_SLOTS:
+		offset += ((__uint64_t)count * sizeof(mmv_disk_slot_t));
+		if (s->len < offset) {
+		    if (pmDebugOptions.appl0) {
+			pmNotifyErr(LOG_ERR, "MMV: %s - "
+					"slots offset: %"PRIu64" < %"PRIu64,
+					s->name, s->len, offset);
+		    }
+		    continue;
+		}
+		offset -= ((__uint64_t)count * sizeof(mmv_disk_slot_t));
+
+		s->nslots = count;	/* total, divided up below */
+		s->slots = (mmv_disk_slot_t *)((char *)s->addr + offset);
+		break;
+
+	    case MMV_TOC_HASH:	/* name index, used by writers only */
+		break;
+
+	    case MMV_TOC_BUCKETS:
+		offset += ((__uint64_t)count * sizeof(__uint64_t));
+		if (s->len < offset) {
+		    if (pmDebugOptions.appl0) {
+			pmNotifyErr(LOG_ERR, "MMV: %s - "
+					"buckets offset: %"PRIu64" < %"PRIu64,
+					s->name, s->len, offset);
+		    }
+		    continue;
+		}
+		offset -= ((__uint64_t)count * sizeof(__uint64_t));
+
+		s->bcnt = count;
+		s->buckets = (__uint64_t *)((char *)s->addr + offset);
+		break;
+
 	    default:
 		if (pmDebugOptions.appl0) {
 		    pmNotifyErr(LOG_DEBUG, "MMV: %s - bad TOC type (%x)",
@@ -768,6 +1047,22 @@ map_stats(pmdaExt *pmda)
 		break;
 	    }
 	}
+
+	/* slots are only usable if every value has the same number */
+	if (s->slots) {
+	    if (s->vcnt > 0 && s->nslots % s->vcnt == 0 &&
+		s->nslots / s->vcnt <= MMV_SLOTMAX) {
+		s->nslots /= s->vcnt;
+	    } else {
+		if (pmDebugOptions.appl0) {
+		    pmNotifyErr(LOG_ERR, "MMV: %s - "
+				    "slots count: %d for %d values",
+				    s->name, s->nslots, s->vcnt);
+		}
+		s->slots = NULL;
+		s->nslots = 0;
+	    }
+	}
     }
 
     pmdaTreeRebuildHash(pmns, mtot);	/* for reverse (pmid->name) lookups */
@@ -875,6 +1170,119 @@ mmv_lookup_stat_metric_value(pmID pmid, unsigned int inst,
     return mmv_lookup_stat_metric(pmid, inst, stats, value, NULL, NULL);
 }
 
+/*
+ * Add the per-CPU slots of a value (MMV_FLAG_PERCPU clients) into
+ * the value itself - writers each update their own CPU's slot, with
+ * the total only ever formed here, at fetch time.
+ */
+static void
+mmv_sum_slots(stats_t *s, mmv_disk_value_t *v, int type, pmAtomValue *atom)
+{
+    mmv_disk_slot_t *slot = s->slots + (v - s->values) * s->nslots;
+    pmAtomValue value;
+    int i;
+
+    for (i = 0; i < s->nslots; i++) {
+	memcpy(&value, &slot[i].value, sizeof(pmAtomValue));
+	switch (type) {
+	case MMV_TYPE_I32:
+	    atom->l += value.l;
+	    break;
+	case MMV_TYPE_U32:
+	    atom->ul += value.ul;
+	    break;
+	case MMV_TYPE_I64:
+	    atom->ll += value.ll;
+	    break;
+	case MMV_TYPE_U64:
+	    atom->ull += value.ull;
+	    break;
+	case MMV_TYPE_FLOAT:
+	    atom->f += value.f;
+	    break;
+	case MMV_TYPE_DOUBLE:
+	    atom->d += value.d;
+	    break;
+	}
+    }
+}
+
+/*
+ * Bucket counts of a histogram or sketch value, which must lie
+ * within the buckets section of the file.
+ */
+static __uint64_t *
+mmv_value_buckets(stats_t *s, mmv_disk_value_t *v, int type, int *count)
+{
+    __uint64_t start, end;
+
+    *count = mmv_type_buckets(type);
+    if (s->buckets == NULL || *count == 0)
+	return NULL;
+    start = (char *)s->buckets - (char *)s->addr;
+    end = start + (__uint64_t)s->bcnt * sizeof(__uint64_t);
+    if (v->extra < start || (v->extra - start) % sizeof(__uint64_t) ||
+	v->extra + (__uint64_t)*count * sizeof(__uint64_t) > end) {
+	if (pmDebugOptions.appl0)
+	    pmNotifyErr(LOG_ERR, "MMV: %s - "
+			"bad buckets offset: %"PRId64" (%"PRIu64"-%"PRIu64")",
+			s->name, v->extra, start, end);
+	return NULL;
+    }
+    return (__uint64_t *)((char *)s->addr + v->extra);
+}
+
+/*
+ * Observation count or a quantile of a histogram or sketch - the
+ * quantile is estimated from the bucket holding that rank, as the
+ * middle of its range (histograms) or the value with least relative
+ * error in its range (sketches).
+ */
+static int
+mmv_fetch_derived(pmdaMetric *mdesc, pmAtomValue *atom)
+{
+    static __uint64_t counts[MMV_SKETCH_BUCKETS];
+    derived_t *dp = (derived_t *)mdesc->m_user;
+    __uint64_t *buckets, lo, hi, total = 0, sum = 0, rank;
+    mmv_disk_value_t *v;
+    stats_t *s;
+    pmID pmid;
+    int i, rv, count;
+
+    pmid = pmID_build(pmID_domain(mdesc->m_desc.pmid),
+		      pmID_cluster(mdesc->m_desc.pmid), dp->item);
+    if ((rv = mmv_lookup_stat_metric_value(pmid, PM_IN_NULL, &s, &v)) < 0)
+	return rv;
+    if ((buckets = mmv_value_buckets(s, v, rv, &count)) == NULL)
+	return PM_ERR_GENERIC;
+
+    /* take one copy of the counts, writers keep updating them */
+    for (i = 0; i < count; i++)
+	total += (counts[i] = buckets[i]);
+
+    if (dp->quantile == 0) {
+	atom->ull = total;
+	return PMDA_FETCH_STATIC;
+    }
+    if (total == 0)
+	return PMDA_FETCH_NOVALUES;
+
+    rank = (__uint64_t)(dp->quantile * (total - 1));
+    for (i = 0; i < count - 1; i++) {
+	if ((sum += counts[i]) > rank)
+	    break;
+    }
+    if (rv == MMV_TYPE_HISTOGRAM) {
+	histogram_bounds(i, &lo, &hi);
+	atom->d = lo / 2.0 + hi / 2.0;
+    } else if (i == 0) {
+	atom->d = 0.0;
+    } else {
+	atom->d = 2.0 * sketch_bound(i) / (MMV_SKETCH_GAMMA + 1.0);
+    }
+    return PMDA_FETCH_STATIC;
+}
+
 /*
  * callback provided to pmdaFetch
  */
@@ -900,6 +1308,9 @@ mmv_fetchCallBack(pmdaMetric *mdesc, unsigned int inst, pmAtomValue *atom)
 	stats_t *s;
 	int rv, fl;
 
+	if (mdesc->m_user != NULL)	/* histogram or sketch derived */
+	    return mmv_fetch_derived(mdesc, atom);
+
 	rv = mmv_lookup_stat_metric_value(mdesc->m_desc.pmid, inst, &s, &v);
 	if (rv < 0)
 	    return rv;
@@ -921,16 +1332,22 @@ mmv_fetchCallBack(pmdaMetric *mdesc, unsigned int inst, pmAtomValue *atom)
 		if ((fl & MMV_FLAG_SENTINEL) &&
 		    (memcmp(atom, &aNaN, sizeof(*atom)) == 0))
 		    return PMDA_FETCH_NOVALUES;
+		if (s->slots)
+		    mmv_sum_slots(s, v, rv, atom);
 		break;
 	    case MMV_TYPE_FLOAT:
 		memcpy(atom, &v->value, sizeof(pmAtomValue));
 		if ((fl & MMV_FLAG_SENTINEL) && atom->f == fNaN)
 		    return PMDA_FETCH_NOVALUES;
+		if (s->slots)
+		    mmv_sum_slots(s, v, rv, atom);
 		break;
 	    case MMV_TYPE_DOUBLE:
 		memcpy(atom, &v->value, sizeof(pmAtomValue));
 		if ((fl & MMV_FLAG_SENTINEL) && atom->d == dNaN)
 		    return PMDA_FETCH_NOVALUES;
+		if (s->slots)
+		    mmv_sum_slots(s, v, rv, atom);
 		break;
 	    case MMV_TYPE_ELAPSED: {
 		atom->ll = v->value.ll;
@@ -962,6 +1379,19 @@ mmv_fetchCallBack(pmdaMetric *mdesc, unsigned int inst, pmAtomValue *atom)
 		atom->cp = buffer;
 		break;
 	    }
+	    case MMV_TYPE_HISTOGRAM:
+	    case MMV_TYPE_SKETCH: {
+		__uint64_t *buckets;
+		int count;
+
+		if ((buckets = mmv_value_buckets(s, v, rv, &count)) == NULL)
+		    return PM_ERR_GENERIC;
+		if (inst >= count)
+		    return PM_ERR_INST;
+		if ((atom->ull = buckets[inst]) == 0)
+		    return PMDA_FETCH_NOVALUES;	/* only buckets in use */
+		break;
+	    }
 	    case MMV_TYPE_NOSUPPORT:
 		return PM_ERR_APPVERSION;
 	}
@@ -1036,6 +1466,23 @@ mmv_desc(pmID pmid, pmDesc *desc, pmdaExt *ep)
     return pmdaDesc(pmid, desc, ep);
 }
 
+/* Derived metrics share the help text of their histogram or sketch */
+static pmID
+mmv_derived_base(pmID pmid)
+{
+    derived_t *dp;
+    int m;
+
+    for (m = 3; m < mtot; m++) {
+	if (metrics[m].m_desc.pmid != pmid)
+	    continue;
+	if ((dp = (derived_t *)metrics[m].m_user) != NULL)
+	    return pmID_build(pmID_domain(pmid), pmID_cluster(pmid), dp->item);
+	break;
+    }
+    return pmid;
+}
+
 static int
 mmv_lookup_metric_helptext(pmID pmid, int type, char **text)
 {
@@ -1126,7 +1573,7 @@ mmv_text(int ident, int type, char **buffer, pmdaExt *ep)
 	return PM_ERR_PMID;
     }
 
-    return mmv_lookup_metric_helptext(ident, type, buffer);
+    return mmv_lookup_metric_helptext(mmv_derived_base(ident), type, buffer);
 }
 
 static int
@@ -2976,6 +2976,8 @@ sample_init(pmdaInterface *dp)
     if (dp->status != 0)
 	return;
     dp->comm.flags |= PDU_FLAG_AUTH;
+    if (_isDSO)
+	dp->comm.flags |= PMDA_FLAG_THREADSAFE;
 
     dp->version.any.fetch = sample_fetch;
     dp->version.any.desc = sample_desc;
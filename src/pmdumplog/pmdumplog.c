@@ -469,13 +469,20 @@ dumpInDom(__pmContext *ctxp)
 {
     int		i;
     int		j;
+    int		sts;
     __pmHashNode	*hp;
     __pmLogInDom	*idp;
     __pmLogInDom	*ldp;
 
     printf("\nInstance Domains in the Log ...\n");
+    /* with a .metaidx index, instance domains are otherwise read lazily */
+    if ((sts = __pmLogLoadInDoms(ctxp->c_archctl)) < 0)
+	fprintf(stderr, "%s: Warning: cannot load instance domains: %s\n",
+		pmGetProgname(), pmErrStr(sts));
     for (i = 0; i < ctxp->c_archctl->ac_log->l_hashindom.hsize; i++) {
 	for (hp = ctxp->c_archctl->ac_log->l_hashindom.hash[i]; hp != NULL; hp = hp->next) {
+	    if (hp->data == NULL)
+		continue;
 	    printf("InDom: %s\n", pmInDomStr((pmInDom)hp->key));
 	    /*
 	     * in reverse chronological order, so iteration is a bit funny
@@ -26,6 +26,7 @@
 long totalmalloc;
 static pmUnits nullunits;
 static int desperate;
+static int metaindex;
 
 pmID pmid_pid;
 pmID pmid_seqnum;
@@ -36,6 +37,7 @@ static pmLongOptions longopts[] = {
     { "desperate", 0, 'd', 0, "desperate, save output after fatal error" },
     { "first", 0, 'f', 0, "use timezone from first archive [default is last]" },
     { "mark", 0, 'm', 0, "ignore prologue/epilogue records and <mark> between archives" },
+    { "meta-index", 0, 'M', 0, "write a .metaidx index for the output metadata" },
     PMOPT_START,
     { "samples", 1, 's', "NUM", "terminate after NUM log records have been written" },
     PMOPT_FINISH,
@@ -47,7 +49,7 @@ static pmLongOptions longopts[] = {
 };
 
 static pmOptions opts = {
-    .short_options = "c:D:dfmS:s:T:v:wZ:z?",
+    .short_options = "c:D:dfMmS:s:T:v:wZ:z?",
     .long_options = longopts,
     .short_usage = "[options] input-archive output-archive",
 };
@@ -1493,6 +1495,10 @@ parseargs(int argc, char *argv[])
 	    farg = 1;
 	    break;
 
+	case 'M':	/* write a .metaidx index for the output archive */
+	    metaindex = 1;
+	    break;
+
 	case 'm':	/* always add <mark> between archives */
 	    old_mark_logic = 1;
 	    break;
@@ -2302,6 +2308,14 @@ cleanup:
 
 	/* need to fix up label with new start-time */
 	writelabel_metati(1);
+
+	if (metaindex) {
+	    __pmFflush(logctl.l_mdfp);
+	    if ((sts = __pmLogWriteMetaIndex(outarchname)) < 0) {
+		fprintf(stderr, "%s: Warning: cannot write metadata index for \"%s\": %s\n",
+			pmGetProgname(), outarchname, pmErrStr(sts));
+	    }
+	}
     }
     if (pmDebugOptions.appl0) {
         fprintf(stderr, "main        : total allocated %ld\n", totalmalloc);
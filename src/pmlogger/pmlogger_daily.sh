@@ -68,6 +68,10 @@ COMPRESS=xz
 COMPRESSAFTER=""
 COMPRESSREGEX="\.(meta|index|Z|gz|bz2|zip|xz|lzma|lzo|lz4)$"
 
+# intervals for rollup archives (none by default)
+#
+ROLLUP=""
+
 # threshold size to roll $PCP_LOG_DIR/NOTICES
 #
 NOTICES=$PCP_LOG_DIR/NOTICES
@@ -113,6 +117,7 @@ Options:
   -N,--showme             perform a dry run, showing what would be done
   -o                      merge yesterdays logs only (old form, default is all) 
   -r,--norewrite          do not process archives with pmlogrewrite(1)
+  -R=INTERVALS,--rollup=INTERVALS  build rollup archives at these intervals, e.g. 10m,1h
   -s=SIZE,--rotate=SIZE   rotate NOTICES file after reaching SIZE bytes
   -t=WANT                 implies -VV, keep verbose output trace for WANT days
   -V,--verbose            verbose output (multiple times for very verbose)
@@ -180,6 +185,19 @@ do
 		;;
 	-r)	RFLAG=true
 		;;
+	-R)	ROLLUP="$2"
+		shift
+		for interval in `echo "$ROLLUP" | sed -e 's/,/ /g'`
+		do
+		    check=`echo "$interval" | sed -e 's/^[0-9][0-9.]*[a-z]*$//'`
+		    if [ ! -z "$check" ]
+		    then
+			echo "Error: -R option ($ROLLUP) must be a list of intervals like 10m,1h"
+			status=1
+			exit
+		    fi
+		done
+		;;
 	-s)	ROLLNOTICES="$2"
 		shift
 		check=`echo "$ROLLNOTICES" | sed -e 's/[0-9]//g'`
@@ -908,6 +926,36 @@ END	{ if (inlist != "") print lastdate,inlist }' >$tmp/list
 	    fi
 	fi
 
+	# and build rollup archives (see pmlogreduce -R) for the daily
+	# archives, one per -R interval, named like 20180325.rollup-10m,
+	# next to the archive ... each is built once, after the merge
+	# (after cull - don't reduce unnecessarily)
+	#
+	if [ -n "$ROLLUP" ]
+	then
+	    ls [12][0-9][0-9][0-9][0-1][0-9][0-3][0-9].meta \
+	       [0-9][0-9][0-1][0-9][0-3][0-9].meta 2>/dev/null \
+	    | sed -e 's/\.meta$//' >$tmp/list
+	    for arch in `cat $tmp/list`
+	    do
+		for interval in `echo "$ROLLUP" | sed -e 's/,/ /g'`
+		do
+		    rollup="$arch.rollup-$interval"
+		    [ -f "$rollup.meta" ] && continue
+		    if $SHOWME
+		    then
+			echo "+ pmlogreduce -R -t $interval $arch $rollup"
+		    elif pmlogreduce -R -t $interval $arch $rollup >$tmp/out 2>&1
+		    then
+			$VERY_VERBOSE && echo "Rollup archive $rollup created"
+		    else
+			_warning "problems executing pmlogreduce for archive $arch"
+			cat $tmp/out
+		    fi
+		done
+	    done
+	fi
+
 	# and compress old archive data files
 	# (after cull - don't compress unnecessarily)
 	#
@@ -568,7 +568,9 @@ do_work(task_t *tp)
     int			changed;
     int			needindom;
     int			needti;
-    static int		flushsize = 100000;
+    static __int64_t	flushsize = -1;
+    static int		ti_samples;
+    static pmTimeval	ti_stamp;
     long		old_meta_offset;
     long		new_offset;
     long		new_meta_offset;
@@ -906,10 +908,31 @@ do_work(task_t *tp)
 	    }
 	}
 
-	if (__pmFtell(archctl.ac_mfp) > flushsize) {
+	/*
+	 * a temporal index entry every index_bytes (by default), or
+	 * index_samples records or index_time seconds (-I), bounds the
+	 * scan needed after __pmLogSetTime positions an archive reader
+	 */
+	if (index_bytes > 0 && flushsize < 0)
+	    flushsize = index_bytes;
+	if (index_bytes > 0 && __pmFtell(archctl.ac_mfp) > flushsize) {
+	    needti = 1;
+	    if (pmDebugOptions.appl2)
+		fprintf(stderr, "callback: file size (%d) reached flushsize (%d)\n", (int)__pmFtell(archctl.ac_mfp), (int)flushsize);
+	}
+	if (index_samples > 0 && ++ti_samples >= index_samples) {
 	    needti = 1;
 	    if (pmDebugOptions.appl2)
-		fprintf(stderr, "callback: file size (%d) reached flushsize (%d)\n", (int)__pmFtell(archctl.ac_mfp), flushsize);
+		fprintf(stderr, "callback: %d records since last index entry\n", ti_samples);
+	}
+	if (index_time.tv_sec > 0 || index_time.tv_usec > 0) {
+	    tmp.tv_sec = (__int32_t)resp->timestamp.tv_sec;
+	    tmp.tv_usec = (__int32_t)resp->timestamp.tv_usec;
+	    if (__pmTimevalSub(&tmp, &ti_stamp) >= pmtimevalToReal(&index_time)) {
+		needti = 1;
+		if (pmDebugOptions.appl2)
+		    fprintf(stderr, "callback: index interval since last index entry\n");
+	    }
 	}
 
 	if (last_log_offset == 0 || last_log_offset == sizeof(__pmLogLabel)+2*sizeof(int)) {
@@ -939,7 +962,9 @@ do_work(task_t *tp)
 	     */
 	    __pmFseek(archctl.ac_mfp, new_offset, SEEK_SET);
 	    __pmFseek(logctl.l_mdfp, new_meta_offset, SEEK_SET);
-	    flushsize = __pmFtell(archctl.ac_mfp) + 100000;
+	    flushsize = __pmFtell(archctl.ac_mfp) + index_bytes;
+	    ti_samples = 0;
+	    ti_stamp = tmp;		/* struct assignment */
 	}
 
 	last_stamp = resp->timestamp;	/* struct assignment */
@@ -171,6 +171,9 @@ extern int		vol_switch_samples;
 extern __int64_t	vol_switch_bytes;
 extern int		vol_switch_flag;
 extern int		vol_samples_counter;
+extern int		index_samples;
+extern __int64_t	index_bytes;
+extern struct timeval	index_time;
 extern int		archive_version; 
 extern int		parse_done;
 extern __int64_t	exit_bytes;
@@ -33,6 +33,9 @@ int		vol_samples_counter;     /* Counts samples - reset for new vol*/
 int		vol_switch_afid = -1;    /* afid of event for vol switch */
 int		vol_switch_flag;         /* sighup received - switch vol now */
 int		vol_switch_alarm;	 /* vol_switch_callback() called */
+int		index_samples = -1;	 /* samples between index entries */
+__int64_t	index_bytes = 100000;	 /* bytes between index entries */
+struct timeval	index_time;		 /* time between index entries */
 int		run_done_alarm;		 /* run_done_callback() called */
 int		log_alarm;	 	 /* log_callback() called */
 int		parse_done;
@@ -46,6 +49,7 @@ int		archive_version = PM_LOG_VERS02; /* Type of archive to create */
 int		linger = 0;		/* linger with no tasks/events */
 int		rflag;			/* report sizes */
 int		Cflag;			/* parse config and exit */
+int		Mflag;			/* write .metaidx index at exit */
 struct timeval	epoch;
 struct timeval	delta = { 60, 0 };	/* default logging interval */
 int		sig_code;		/* caught signal */
@@ -98,6 +102,17 @@ run_done(int sts, char *msg)
 	__pmLogPutIndex(&archctl, &tmp);
     }
 
+    /*
+     * the metadata is complete, so index it if asked ... the index
+     * makes later pmNewContext calls on this archive much cheaper
+     */
+    if (Mflag) {
+	__pmFflush(logctl.l_mdfp);
+	if ((lsts = __pmLogWriteMetaIndex(archBase)) < 0)
+	    fprintf(stderr, "Warning: cannot write metadata index: %s\n",
+		pmErrStr(lsts));
+    }
+
     exit(sts);
 }
 
@@ -496,9 +511,11 @@ static pmLongOptions longopts[] = {
     PMOPT_DEBUG,
     PMOPT_HOST,
     { "labelhost", 1, 'H', "LABELHOST", "override the hostname written into the label" },
+    { "index", 1, 'I', "SIZE", "write a temporal index entry after size [default 100Kb]" },
     { "log", 1, 'l', "FILE", "redirect diagnostics and trace output" },
     { "linger", 0, 'L', 0, "run even if not primary logger instance and nothing to log" },
     { "note", 1, 'm', "MSG", "descriptive note to be added to the port map file" },
+    { "meta-index", 0, 'M', 0, "write a .metaidx index for the metadata at exit" },
     PMOPT_SPECLOCAL,
     { "local-PMDA", 0, 'o', 0, "metrics sourced without connecting to pmcd" },
     PMOPT_NAMESPACE,
@@ -519,7 +536,7 @@ static pmLongOptions longopts[] = {
 };
 
 static pmOptions opts = {
-    .short_options = "c:CD:h:H:l:K:Lm:n:op:Prs:T:t:uU:v:V:x:y?",
+    .short_options = "c:CD:h:H:I:l:K:LMm:n:op:Prs:T:t:uU:v:V:x:y?",
     .long_options = longopts,
     .short_usage = "[options] archive",
 };
@@ -653,6 +670,16 @@ main(int argc, char **argv)
 	    pmcd_host_label = strndup(opts.optarg, PM_LOG_MAXHOSTLEN-1);
 	    break;
 
+	case 'I':		/* temporal index entry after given size */
+	    sts = ParseSize(opts.optarg, &index_samples, &index_bytes,
+			    &index_time);
+	    if (sts < 0) {
+		pmprintf("%s: illegal size argument '%s' for index size\n",
+			pmGetProgname(), opts.optarg);
+		opts.errors++;
+	    }
+	    break;
+
 	case 'l':		/* log file name */
 	    logfile = opts.optarg;
 	    break;
@@ -669,6 +696,10 @@ main(int argc, char **argv)
 	    linger = 1;
 	    break;
 
+	case 'M':		/* write .metaidx index at exit */
+	    Mflag = 1;
+	    break;
+
 	case 'm':		/* note for port map file */
 	    note = opts.optarg;
 	    isdaemon = ((strcmp(note, "pmlogger_check") == 0) ||
@@ -1,5 +1,142 @@
 #include "pmlogreduce.h"
 
+static const char *rollup_stat[NUM_ROLLUP] = { "min", "max", "count" };
+
+/*
+ * -R metadata for the rollup.<stat>.<name> metrics ... min and max
+ * are just like the (averaged) metric, count is a plain number of
+ * observations
+ */
+static void
+dorollup(metric_t *mp, int numnames, char **names)
+{
+    pmDesc		desc;
+    char		**rnames;
+    size_t		len;
+    int			i;
+    int			j;
+    int			sts;
+
+    if ((rnames = (char **)malloc(numnames*sizeof(rnames[0]))) == NULL) {
+	fprintf(stderr,
+	    "%s: dorollup: Error: cannot malloc space for %d names\n",
+		pmGetProgname(), numnames);
+	exit(1);
+    }
+    for (i = 0; i < NUM_ROLLUP; i++) {
+	desc = mp->odesc;	/* struct assignment */
+	desc.pmid = mp->rpmid[i];
+	if (i == ROLLUP_COUNT) {
+	    desc.type = PM_TYPE_U32;
+	    desc.sem = PM_SEM_INSTANT;
+	    memset(&desc.units, 0, sizeof(desc.units));
+	    desc.units.dimCount = 1;
+	}
+	for (j = 0; j < numnames; j++) {
+	    len = strlen("rollup.") + strlen(rollup_stat[i]) + strlen(names[j]) + 2;
+	    if ((rnames[j] = (char *)malloc(len)) == NULL) {
+		fprintf(stderr,
+		    "%s: dorollup: Error: cannot malloc rollup name for %s\n",
+			pmGetProgname(), names[j]);
+		exit(1);
+	    }
+	    pmsprintf(rnames[j], len, "rollup.%s.%s", rollup_stat[i], names[j]);
+	}
+	if (pmDebugOptions.appl0) {
+	    fprintf(stderr, "rollup metric: \"");
+	    __pmPrintMetricNames(stderr, numnames, rnames, " or ");
+	    fprintf(stderr, "\" (%s)\n", pmIDStr(desc.pmid));
+	}
+	if ((sts = __pmLogPutDesc(&archctl, &desc, numnames, rnames)) < 0) {
+	    fprintf(stderr,
+		"%s: Error: failed to add pmDesc for", pmGetProgname());
+	    __pmPrintMetricNames(stderr, numnames, rnames, " or ");
+	    fprintf(stderr,
+		" (%s): %s\n", pmIDStr(desc.pmid), pmErrStr(sts));
+	    exit(1);
+	}
+	for (j = 0; j < numnames; j++)
+	    free(rnames[j]);
+    }
+    free(rnames);
+}
+
+/*
+ * -R PMIDs depend only on the PMID of the metric, so that a metric has
+ * the same rollup PMIDs in every reduced archive, and these archives
+ * can be merged ... the statistic is in the top bits of the cluster,
+ * and the other 20 bits are a hash of the metric's domain, cluster and
+ * item
+ */
+static pmID
+rollup_pmid(pmID pmid, int stat)
+{
+    __uint32_t		h = pmid;
+
+    h = ((h >> 16) ^ h) * 0x45d9f3b;
+    h = ((h >> 16) ^ h) * 0x45d9f3b;
+    h = (h >> 16) ^ h;
+    return pmID_build(ROLLUP_DOMAIN, (stat << 10) | ((h >> 10) & 1023), h & 1023);
+}
+
+/*
+ * -R metadata, once all the metrics are known ... metrics whose rollup
+ * PMIDs collide get no rollup metrics at all, whatever order they are
+ * found in (their values are still averaged)
+ */
+void
+dorollups(void)
+{
+    __pmHashCtl		hash;
+    __pmHashNode	*hp;
+    metric_t		*mp;
+    metric_t		*xmp;
+    int			numnames;
+    char		**names;
+    int			i;
+    int			x;
+
+    __pmHashInit(&hash);
+    for (i = 0; i < numpmid; i++) {
+	mp = &metriclist[i];
+	if (!mp->rollup)
+	    continue;
+	if ((hp = __pmHashSearch(mp->rpmid[ROLLUP_MIN], &hash)) == NULL) {
+	    if (__pmHashAdd(mp->rpmid[ROLLUP_MIN], (void *)(__psint_t)i, &hash) < 0) {
+		fprintf(stderr,
+		    "%s: dorollups: Error: cannot add rollup PMID for %s\n",
+			pmGetProgname(), namelist[i]);
+		exit(1);
+	    }
+	    continue;
+	}
+	x = (int)(__psint_t)hp->data;
+	xmp = &metriclist[x];
+	fprintf(stderr,
+	    "%s: Warning: rollup PMIDs for %s (%s) and %s collide, "
+	    "no rollup metrics for either\n",
+		pmGetProgname(), namelist[i], pmIDStr(pmidlist[i]), namelist[x]);
+	for (x = 0; x < NUM_ROLLUP; x++)
+	    xmp->rpmid[x] = mp->rpmid[x] = PM_ID_NULL;
+    }
+    __pmHashClear(&hash);
+
+    for (i = 0; i < numpmid; i++) {
+	mp = &metriclist[i];
+	if (!mp->rollup || mp->rpmid[ROLLUP_MIN] == PM_ID_NULL)
+	    continue;
+	if ((numnames = pmNameAll(pmidlist[i], &names)) < 0) {
+	    fprintf(stderr,
+		"%s: Error: failed to get names for %s (%s): %s\n",
+		    pmGetProgname(), namelist[i], pmIDStr(pmidlist[i]),
+		    pmErrStr(numnames));
+	    exit(1);
+	}
+	dorollup(mp, numnames, names);
+	free(names);
+    }
+}
+
 void
 dometric(const char *name)
 {
@@ -44,6 +181,7 @@ dometric(const char *name)
     }
     mp->odesc = mp->idesc;	/* struct assignment */
     mp->mode = MODE_NORMAL;
+    mp->rollup = 0;
     mp->idp = NULL;
 
     /*
@@ -110,6 +248,29 @@ dometric(const char *name)
 #endif
     }
 
+    /*
+     * -R for numeric instantaneous and discrete metrics, the value
+     * written for each interval is the average of the observations
+     * over the interval (as a double), with the min, max and number
+     * of those observations as extra rollup.* metrics
+     */
+    if (Rarg && mp->idesc.sem != PM_SEM_COUNTER) {
+	switch (mp->idesc.type) {
+	    case PM_TYPE_32:
+	    case PM_TYPE_U32:
+	    case PM_TYPE_64:
+	    case PM_TYPE_U64:
+	    case PM_TYPE_FLOAT:
+	    case PM_TYPE_DOUBLE:
+		mp->odesc.type = PM_TYPE_DOUBLE;
+		mp->mode = MODE_REWRITE;
+		mp->rollup = 1;
+		for (j = 0; j < NUM_ROLLUP; j++)
+		    mp->rpmid[j] = rollup_pmid(pmidlist[numpmid], j);
+		break;
+	}
+    }
+
     /* get all the names for this metric ... */
     if ((numnames = pmNameAll(pmidlist[numpmid], &names)) < 0) {
 	fprintf(stderr,
@@ -17,6 +17,12 @@ doindom(pmResult *rp)
 	vsp = rp->vset[i];
 	if (vsp->numval <= 0)
 	    continue;
+	/*
+	 * -R statistics share the indom of their metric, which is
+	 * also in this pmResult
+	 */
+	if (pmID_domain(vsp->pmid) == ROLLUP_DOMAIN)
+	    continue;
 
 	/*
 	 * pmidlist[] and rp->vset[]->pmid may not be in 1:1
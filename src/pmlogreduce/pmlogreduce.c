@@ -64,6 +64,7 @@ char		*Aarg;			/* -A arg - output time alignment */
 int		varg = -1;		/* -v arg - switch log vol every X */
 int		zarg;			/* -z arg - use archive timezone */
 char		*tz;			/* -Z arg - use timezone from user */
+int		Rarg;			/* -R arg - rollup statistics */
 
 int	        written;		/* num log writes so far */
 int		exit_status;
@@ -89,6 +90,7 @@ static pmLongOptions longopts[] = {
     PMOPT_START,
     PMOPT_SAMPLES,
     PMOPT_FINISH,
+    { "rollup", 0, 'R', 0, "average values, and add min/max/count metrics" },
     { "interval", 1, 't', "DELTA", "sample output interval [default 10min]" },
     { "", 1, 'v', "NUM", "switch log volumes after this many samples" },
     PMOPT_TIMEZONE,
@@ -98,7 +100,7 @@ static pmLongOptions longopts[] = {
 };
 
 static pmOptions opts = {
-    .short_options = "A:D:S:s:T:t:v:Z:z?",
+    .short_options = "A:D:RS:s:T:t:v:Z:z?",
     .long_options = longopts,
     .short_usage = "[options] input-archive output-archive",
 };
@@ -128,6 +130,10 @@ parseargs(int argc, char *argv[])
 	    }
 	    break;
 
+	case 'R':	/* rollup statistics */
+	    Rarg = 1;
+	    break;
+
 	case 's':	/* number of samples to write out */
 	    sarg = (int)strtol(opts.optarg, &endnum, 10);
 	    if (*endnum != '\0' || sarg < 0) {
@@ -338,6 +344,8 @@ main(int argc, char **argv)
 		pmGetProgname(), pmErrStr(sts));
 	goto cleanup;
     }
+    if (Rarg)
+	dorollups();
 
     /*
      * All the initial metadata has been generated, add timestamp
@@ -21,6 +21,12 @@ typedef struct value {
     int			nobs;		/* number of observations */
     int			nwrap;		/* number of counter wraps */
     pmAtomValue		pvalue;		/* used for counter wrap detection */
+    /*
+     * -R statistics over the observations in the last interval
+     */
+    double		sum;
+    double		min;
+    double		max;
 } value_t;
 
 /*
@@ -39,6 +45,18 @@ typedef struct {
     char	**name;
 } indom_t;
 
+/*
+ * -R rollup statistics, each an extra metric in the output archive
+ * named rollup.<stat>.<metric> with a PMID in ROLLUP_DOMAIN (reserved
+ * in stdpmid) ... the cluster and item encode the statistic and a
+ * hash of the metric's PMID, see rollup_pmid()
+ */
+#define ROLLUP_DOMAIN	510
+#define ROLLUP_MIN	0
+#define ROLLUP_MAX	1
+#define ROLLUP_COUNT	2
+#define NUM_ROLLUP	3
+
 /*
  * Metric control record in metric hash list
  */
@@ -48,6 +66,9 @@ typedef struct {
     value_t	*first;		/* list of values, one per instance */
     indom_t	*idp;		/* instance domain control, if any */
     int		mode;		/* have to skip or rewrite the value format */
+    int		rollup;		/* -R statistics kept for this one */
+    pmID	rpmid[NUM_ROLLUP];	/* ... and their PMIDs, PM_ID_NULL
+					 * if these collide with another's */
 } metric_t;
 #define MODE_NORMAL	0
 #define MODE_REWRITE	1
@@ -70,6 +91,7 @@ extern char		*Aarg;		/* -A arg - output time alignment */
 extern int		varg;		/* -v arg - switch log vol every X */
 extern int		zarg;		/* -z arg - use archive timezone */
 extern char		*tz;		/* -Z arg - use timezone from user */
+extern int		Rarg;		/* -R arg - rollup statistics */
 
 
 extern int	_pmLogGet(__pmLogCtl *, int, __pmPDU **);
@@ -82,5 +104,6 @@ extern pmResult *rewrite(pmResult *);
 extern void	rewrite_free(void);
 
 extern void	dometric(const char *);
+extern void	dorollups(void);
 extern void	doindom(pmResult *);
 extern void	doscan(struct timeval *);
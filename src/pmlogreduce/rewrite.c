@@ -2,6 +2,56 @@
 #include <inttypes.h>
 
 static pmResult	*orp;
+static value_t	**rvp;		/* -R metric-instances with statistics */
+static int	rvp_size;
+
+/*
+ * -R append the rollup.{min,max,count} value sets for the nr
+ * metric-instances in rvp[], all observed in the last interval
+ */
+static void
+addrollup(metric_t *mp, int nr)
+{
+    pmValueSet		*ovsp;
+    pmAtomValue		av;
+    int			i;
+    int			j;
+    int			k;
+    int			type;
+
+    for (i = 0; i < NUM_ROLLUP; i++) {
+	ovsp = (pmValueSet *)malloc(sizeof(pmValueSet) +
+				(nr - 1)*sizeof(pmValue));
+	if (ovsp == NULL) {
+	    fprintf(stderr,
+		"%s: rewrite: Arrgh, cannot malloc rollup vset for %d values\n",
+		    pmGetProgname(), nr);
+	    exit(1);
+	}
+	ovsp->pmid = mp->rpmid[i];
+	ovsp->numval = nr;
+	type = i == ROLLUP_COUNT ? PM_TYPE_U32 : PM_TYPE_DOUBLE;
+	for (j = 0; j < nr; j++) {
+	    if (i == ROLLUP_MIN)
+		av.d = rvp[j]->min;
+	    else if (i == ROLLUP_MAX)
+		av.d = rvp[j]->max;
+	    else
+		av.ul = rvp[j]->nobs;
+	    ovsp->vlist[j].inst = rvp[j]->inst;
+	    k = __pmStuffValue(&av, &ovsp->vlist[j], type);
+	    if (k < 0) {
+		fprintf(stderr,
+		    "%s: rewrite: __pmStuffValue failed for pmid %s value %d: %s\n",
+			pmGetProgname(), pmIDStr(ovsp->pmid), j, pmErrStr(k));
+		exit(1);
+	    }
+	    ovsp->valfmt = k;
+	}
+	orp->vset[orp->numpmid] = ovsp;
+	orp->numpmid++;
+    }
+}
 
 /*
  * Must either re-write the pmResult, or return NULL for non-fatal
@@ -12,9 +62,12 @@ rewrite(pmResult *rp)
 {
     int			i;
     int			sts;
+    int			nslot;
 
+    /* -R adds up to NUM_ROLLUP value sets per metric */
+    nslot = Rarg ? rp->numpmid * (1 + NUM_ROLLUP) : rp->numpmid;
     if ((orp = (pmResult *)malloc(sizeof(pmResult) +
-			(rp->numpmid - 1) * sizeof(pmValueSet *))) == NULL) {
+			(nslot - 1) * sizeof(pmValueSet *))) == NULL) {
 	fprintf(stderr,
 		"%s: rewrite: cannot malloc pmResult for %d metrics\n",
 		    pmGetProgname(), rp->numpmid);
@@ -30,6 +83,7 @@ rewrite(pmResult *rp)
 	pmValueSet	*ovsp;
 	int		j;
 	int		need;
+	int		nr = 0;
 
 	if (pmidlist[i] != vsp->pmid) {
 	    fprintf(stderr,
@@ -54,6 +108,11 @@ rewrite(pmResult *rp)
 	ovsp->pmid = vsp->pmid;
 	ovsp->valfmt = vsp->valfmt;
 	if (vsp->numval <= 0) {
+	    /* skipped metrics have no metadata in the output archive */
+	    if (metriclist[i].mode == MODE_SKIP) {
+		free(ovsp);
+		continue;
+	    }
 	    ovsp->numval = vsp->numval;
 	    orp->vset[orp->numpmid] = ovsp;
 	    orp->numpmid++;
@@ -61,6 +120,15 @@ rewrite(pmResult *rp)
 	else {
 	    ovsp->numval = 0;
 	    mp = &metriclist[i];
+	    if (mp->rollup && vsp->numval > rvp_size) {
+		rvp_size = vsp->numval;
+		if ((rvp = (value_t **)realloc(rvp, rvp_size*sizeof(rvp[0]))) == NULL) {
+		    fprintf(stderr,
+			"%s: rewrite: Arrgh, cannot realloc space for %d rollup values\n",
+			    pmGetProgname(), rvp_size);
+		    exit(1);
+		}
+	    }
 	    if (mp->mode != MODE_SKIP) {
 		for (j = 0; j < vsp->numval; j++) {
 		    for (vp = mp->first; vp != NULL; vp = vp->next) {
@@ -82,12 +150,19 @@ rewrite(pmResult *rp)
 		    if (mp->mode == MODE_REWRITE) {
 			pmAtomValue	av;
 			int		k;
-			sts = pmExtractValue(vsp->valfmt, &vsp->vlist[j], mp->idesc.type, &av, mp->odesc.type);
-			if (sts < 0) {
-			    fprintf(stderr,
-				"%s: rewrite: pmExtractValue failed for pmid %s value %d: %s\n",
-				    pmGetProgname(), pmIDStr(vsp->pmid), j, pmErrStr(sts));
-			    exit(1);
+			if (mp->rollup && vp->nobs > 0) {
+			    /* -R, average over the interval */
+			    av.d = vp->sum / vp->nobs;
+			    rvp[nr++] = vp;
+			}
+			else {
+			    sts = pmExtractValue(vsp->valfmt, &vsp->vlist[j], mp->idesc.type, &av, mp->odesc.type);
+			    if (sts < 0) {
+				fprintf(stderr,
+				    "%s: rewrite: pmExtractValue failed for pmid %s value %d: %s\n",
+					pmGetProgname(), pmIDStr(vsp->pmid), j, pmErrStr(sts));
+				exit(1);
+			    }
 			}
 			ovsp->pmid = vsp->pmid;
 			ovsp->vlist[ovsp->numval].inst = vsp->vlist[j].inst;
@@ -95,7 +170,7 @@ rewrite(pmResult *rp)
 			if (k < 0) {
 			    fprintf(stderr,
 				"%s: rewrite: __pmStuffValue failed for pmid %s value %d: %s\n",
-				    pmGetProgname(), pmIDStr(vsp->pmid), j, pmErrStr(sts));
+				    pmGetProgname(), pmIDStr(vsp->pmid), j, pmErrStr(k));
 			    exit(1);
 			}
 			if (ovsp->numval == 0)
@@ -117,6 +192,8 @@ rewrite(pmResult *rp)
 	    }
 	    else
 		free(ovsp);
+	    if (nr > 0 && mp->rpmid[ROLLUP_MIN] != PM_ID_NULL)
+		addrollup(mp, nr);
 	}
     }
 
@@ -147,6 +224,16 @@ rewrite_free(void)
 	int		j;
 	metric_t	*mp;
 
+	if (pmID_domain(vsp->pmid) == ROLLUP_DOMAIN) {
+	    /* -R statistics from addrollup(), doubles are not in situ */
+	    if (vsp->valfmt == PM_VAL_DPTR) {
+		for (j = 0; j < vsp->numval; j++)
+		    free(vsp->vlist[j].value.pval);
+	    }
+	    free(vsp);
+	    continue;
+	}
+
 	for (j = 0; j < numpmid; j++) {
 	    if (vsp->pmid == pmidlist[j])
 		break;
@@ -65,6 +65,7 @@ doscan(struct timeval *end)
     for (i = 0; i < numpmid; i++) {
 	for (vp = metriclist[i].first; vp != NULL; vp = vp->next) {
 	    vp->nobs = vp->nwrap = 0;
+	    vp->sum = 0;
 	    vp->control &= ~V_SEEN;
 	}
     }
@@ -176,6 +177,7 @@ doscan(struct timeval *end)
 			lvp->next = vp;
 		    vp->inst = vsp->vlist[j].inst;
 		    vp->nobs = vp->nwrap = 0;
+		    vp->sum = 0;
 		    vp->control = V_INIT;
 		    vp->next = NULL;
 
@@ -193,6 +195,21 @@ doscan(struct timeval *end)
 		     */
 		    ;
 		}
+		if (mp->rollup) {
+		    /*
+		     * -R, accumulate the statistics for this interval
+		     */
+		    pmAtomValue	av;
+		    if (pmExtractValue(vsp->valfmt, &vsp->vlist[j],
+				mp->idesc.type, &av, PM_TYPE_DOUBLE) == 0) {
+			if (vp->nobs == 0 || av.d < vp->min)
+			    vp->min = av.d;
+			if (vp->nobs == 0 || av.d > vp->max)
+			    vp->max = av.d;
+			vp->sum += av.d;
+			vp->nobs++;
+		    }
+		}
 		if (pmDebugOptions.appl1) {
 		    pmPrintStamp(stderr, &rp->timestamp);
 		    fprintf(stderr, ": seen %s (%s) inst %d\n",
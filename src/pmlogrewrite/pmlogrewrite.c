@@ -904,6 +904,13 @@ main(int argc, char **argv)
      */
     PM_UNLOCK(inarch.ctxp->c_lock);
 
+    /* all instance domains are needed, even if there is a .metaidx index */
+    if ((sts = __pmLogLoadInDoms(inarch.ctxp->c_archctl)) < 0) {
+	fprintf(stderr, "%s: Error: cannot load instance domains (%s): %s\n",
+		pmGetProgname(), inarch.name, pmErrStr(sts));
+	exit(1);
+    }
+
     if ((sts = pmGetArchiveLabel(&inarch.label)) < 0) {
 	fprintf(stderr, "%s: Error: cannot get archive label record (%s): %s\n",
 		pmGetProgname(), inarch.name, pmErrStr(sts));
@@ -94,6 +94,7 @@ AcceptNewClient(int reqfd)
     client[i].pmcd_fd = -1;
     client[i].status.connected = 1;
     client[i].status.allowed = 0;
+    client[i].status.secure = 0;
     client[i].pmcd_hostname = NULL;
 
     /*
@@ -206,8 +207,13 @@ AcceptNewClient(int reqfd)
     return &client[i];
 }
 
-void
-DeleteClient(ClientInfo *cp)
+/*
+ * Release a client table entry, closing the client and pmcd sockets if
+ * requested - otherwise they have been handed over to a forwarding
+ * thread, and only need to be forgotten here.
+ */
+static void
+ReleaseClient(ClientInfo *cp, int closefds)
 {
     int		i;
 
@@ -216,20 +222,24 @@ DeleteClient(ClientInfo *cp)
 	    break;
 
     if (i == nClients) {
-	fprintf(stderr, "DeleteClient: Botch: tried to delete non-existent client @" PRINTF_P_PFX "%p\n", cp);
+	fprintf(stderr, "%s: Botch: tried to delete non-existent client @" PRINTF_P_PFX "%p\n",
+		closefds ? "DeleteClient" : "DetachClient", cp);
 	return;
     }
 
     if (pmDebugOptions.context)
-	fprintf(stderr, "DeleteClient [%d]\n", i);
+	fprintf(stderr, "%s [%d]\n",
+		closefds ? "DeleteClient" : "DetachClient", i);
 
     if (cp->fd >= 0) {
 	__pmFD_CLR(cp->fd, &sockFds);
-	__pmCloseSocket(cp->fd);
+	if (closefds)
+	    __pmCloseSocket(cp->fd);
     }
     if (cp->pmcd_fd >= 0) {
 	__pmFD_CLR(cp->pmcd_fd, &sockFds);
-	__pmCloseSocket(cp->pmcd_fd);
+	if (closefds)
+	    __pmCloseSocket(cp->pmcd_fd);
     }
     if (i == nClients-1) {
 	i--;
@@ -258,3 +268,15 @@ DeleteClient(ClientInfo *cp)
 	cp->pmcd_hostname = NULL;
     }
 }
+
+void
+DeleteClient(ClientInfo *cp)
+{
+    ReleaseClient(cp, 1);
+}
+
+void
+DetachClient(ClientInfo *cp)
+{
+    ReleaseClient(cp, 0);
+}
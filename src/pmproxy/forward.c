@@ -0,0 +1,1139 @@
+/*
+ * Copyright (c) 2018 Red Hat.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Event-driven forwarding of established client connections.
+ *
+ * Once a client has passed the credentials exchange on the main thread,
+ * its socket and the matching pmcd socket are handed to one of several
+ * forwarding threads (shards), chosen round-robin.  Each thread waits
+ * on a poll set of its own (epoll(7) where available) and copies bytes
+ * in both directions as they arrive - as many PDUs per read and write
+ * as the sockets hold, without decoding, pinned PDU buffers or
+ * re-encoding.  Only the length fields of client PDUs are examined, to
+ * enforce the -L size limit exactly as __pmGetPDU would.
+ *
+ * The sockets are non-blocking.  Bytes a socket will not take straight
+ * away are queued for it and written as poll reports room, and while
+ * that queue is long nothing more is read from the other end of the
+ * connection - so a slow reader holds up its own connection, and never
+ * the other connections served by the same thread.
+ *
+ * Connections with a secure, compressed or authenticated channel stay
+ * on the main thread, where libpcp handles each PDU, as do all of them
+ * when PDU tracing is enabled (so that the traces are complete).
+ *
+ * With a fetch window (-c), connections are instead assigned to threads
+ * by pmcd host and port, and each thread shares fetches between its
+ * clients: a PDU_FETCH identical to one already sent to the same pmcd -
+ * same PMIDs, same instance profile and attributes for the context -
+ * is not sent upstream again if that fetch is still in progress, or
+ * was sent within the window.  The first client's reply PDUs are kept
+ * and sent to every client sharing the fetch.  Should that fetch fail
+ * in any way, the clients waiting on it send their own fetch instead.
+ * The replies from pmcd are followed PDU by PDU, and a client's fetch
+ * is only shared when none of its other requests are still to be
+ * answered - as is the case for libpcp clients, which wait for each
+ * reply before making another request.  Fetches of pmcd metrics
+ * (domain 2), some of which describe the requesting client, are never
+ * shared.
+ */
+
+#include "pmproxy.h"
+#include <pthread.h>
+
+#define FORWARD_BUFSIZE	(64*1024)	/* bytes moved per read */
+#define PMCD_DOMAIN	2		/* pmcd metrics, never shared */
+
+/* byte offsets of PDU fields, see libpcp p_fetch.c and p_error.c */
+#define FETCH_CTXID	12
+#define FETCH_WHEN	16
+#define FETCH_NUMPMID	24
+#define FETCH_PMIDS	28
+#define ERROR_CODE	12
+#define ERROR_PDUSIZE	16
+
+typedef struct Shared Shared;
+
+typedef struct {
+    char	*buf;		/* bytes the socket would not take yet */
+    int		len;
+    int		max;
+} Output;
+
+typedef struct {
+    int		ctxid;		/* context slot index from the client */
+    int		length;
+    char	*body;		/* profile PDU following the ctxid */
+} Profile;
+
+typedef struct {
+    unsigned int id;		/* unique, identifies it in Shared takers */
+    int		fd;		/* client socket descriptor */
+    int		pmcd_fd;	/* PMCD socket file descriptor */
+    int		need;		/* bytes remaining in current client PDU */
+    int		hdrlen;		/* length bytes of next client PDU seen */
+    unsigned char hdr[4];	/* ... and the bytes themselves */
+    Output	toclient;	/* queued for the client socket */
+    Output	topmcd;		/* ... and for the pmcd socket */
+
+    /* fetch sharing state, only used with a fetch window */
+    char	*target;	/* "hostname port" of pmcd */
+    int		targetlen;	/* ... including the null byte */
+    char	*inbuf;		/* client input, not yet a whole PDU */
+    int		inlen;
+    int		inmax;
+    char	*attrs;		/* attribute PDU contents, in order */
+    int		attrlen;
+    Profile	*profiles;	/* latest instance profile per context */
+    int		nprofiles;
+    int		outstanding;	/* requests sent, replies not yet seen */
+    int		replyneed;	/* bytes remaining in current reply PDU */
+    int		replyhdrlen;	/* bytes of next reply PDU header seen */
+    char	replyhdr[ERROR_PDUSIZE]; /* ... and the bytes themselves */
+    Shared	*leading;	/* fetch sent on behalf of others too */
+    int		replied;	/* start of the next reply PDU in it */
+    Shared	*waiting;	/* fetch this client is sharing */
+    char	*fetch;		/* ... and its own fetch, should it fail */
+    int		fetchlen;
+} Forward;
+
+/* A fetch sent to pmcd for one client, and shared with others */
+struct Shared {
+    unsigned int	hash;		/* of key, in the shard table */
+    char		*key;		/* pmcd, attributes, profile, PMIDs */
+    int			keylen;
+    struct timeval	sent;		/* when the fetch went upstream */
+    Forward		*leader;	/* connection it went on, until done */
+    Forward		**waiters;	/* connections waiting for the reply */
+    int			nwaiters;
+    int			maxwaiters;
+    char		*reply;		/* reply PDUs, complete when done */
+    int			replylen;
+    int			replymax;
+    int			done;
+    unsigned int	*takers;	/* ids of connections given the reply */
+    int			ntakers;
+    int			maxtakers;
+};
+
+typedef struct {
+    pthread_t		thread;
+    pthread_mutex_t	lock;		/* protects the pending list */
+    Forward		**pending;	/* handed over, not yet polled */
+    int			npending;
+    int			maxpending;
+    int			wakefd[2];	/* pipe, wakes thread for pending */
+    __pmPollSet		*set;		/* descriptors this thread serves */
+    Forward		**conns;	/* connections, indexed by fd */
+    int			nconns;		/* allocated entries in conns[] */
+    char		*buffer;	/* FORWARD_BUFSIZE bytes */
+    __pmHashCtl		shared;		/* Shared fetches, by key hash */
+    int			nshared;	/* entries in the shared table */
+    struct timeval	swept;		/* last expiry of Shared fetches */
+    char		*key;		/* lookup key being built */
+    int			keymax;
+    unsigned long	upstream;	/* fetches sent to pmcd */
+    unsigned long	coalesced;	/* fetches answered by sharing */
+} Shard;
+
+static Shard		*shards;
+static int		nShards;
+static unsigned int	nextShard;	/* round-robin assignment */
+static int		ceiling;	/* largest client PDU accepted */
+static int		window;		/* fetch sharing window (msec) */
+static unsigned int	nextId;		/* for Forward ids, main thread only */
+
+static int
+GrowBuffer(char **bufp, int *maxp, int need)
+{
+    char	*buf;
+    int		size;
+
+    if (need <= *maxp)
+	return 0;
+    for (size = *maxp ? *maxp : 256; size < need; size *= 2)
+	;
+    if ((buf = (char *)realloc(*bufp, size)) == NULL) {
+	pmNoMem("pmproxy.forward", size, PM_RECOV_ERR);
+	return -ENOMEM;
+    }
+    *bufp = buf;
+    *maxp = size;
+    return 0;
+}
+
+static Output *
+OutputFor(Forward *fp, int fd)
+{
+    return fd == fp->fd ? &fp->toclient : &fp->topmcd;
+}
+
+/*
+ * Write as much of buf as the non-blocking socket will take, returning
+ * the number of bytes written (possibly none) or a negative error.
+ */
+static int
+WriteSome(int fd, const char *buf, int bytes)
+{
+    int		sent, sts;
+
+    for (sent = 0; sent < bytes; ) {
+	sts = __pmSend(fd, buf + sent, bytes - sent, 0);
+	if (sts < 0) {
+	    if (neterror() == EINTR)
+		continue;
+	    if (neterror() == EAGAIN || neterror() == EWOULDBLOCK)
+		break;
+	    return -neterror();
+	}
+	sent += sts;
+    }
+    return sent;
+}
+
+/* Send bytes on one of a connection's sockets, queueing what is left */
+static int
+SendBytes(Forward *fp, int fd, const char *buf, int bytes)
+{
+    Output	*op = OutputFor(fp, fd);
+    int		sts;
+
+    if (op->len == 0) {		/* nothing queued ahead of these bytes */
+	if ((sts = WriteSome(fd, buf, bytes)) < 0)
+	    return sts;
+	buf += sts;
+	bytes -= sts;
+	if (bytes == 0)
+	    return 0;
+    }
+    if ((sts = GrowBuffer(&op->buf, &op->max, op->len + bytes)) < 0)
+	return sts;
+    memcpy(op->buf + op->len, buf, bytes);
+    op->len += bytes;
+    return 0;
+}
+
+/* Socket has room, so send whatever is queued for it */
+static int
+FlushOutput(Forward *fp, int fd)
+{
+    Output	*op = OutputFor(fp, fd);
+    int		sts;
+
+    if ((sts = WriteSome(fd, op->buf, op->len)) <= 0)
+	return sts;
+    op->len -= sts;
+    memmove(op->buf, op->buf + sts, op->len);
+    return 0;
+}
+
+/*
+ * Watch each socket of a connection for output while bytes are queued
+ * for it, and for input unless the queue in the other direction is
+ * backed up (or the client is waiting for a shared fetch).
+ */
+static int
+UpdatePolling(Shard *sp, Forward *fp)
+{
+    int		sts;
+
+    if (fp->waiting == NULL && fp->topmcd.len < FORWARD_BUFSIZE)
+	sts = __pmPollSetAdd(sp->set, fp->fd);
+    else
+	sts = __pmPollSetDel(sp->set, fp->fd);
+    if (sts < 0)
+	return sts;
+    if (fp->toclient.len < FORWARD_BUFSIZE)
+	sts = __pmPollSetAdd(sp->set, fp->pmcd_fd);
+    else
+	sts = __pmPollSetDel(sp->set, fp->pmcd_fd);
+    if (sts < 0)
+	return sts;
+    if (fp->toclient.len > 0)
+	sts = __pmPollSetAddWrite(sp->set, fp->fd);
+    else
+	sts = __pmPollSetDelWrite(sp->set, fp->fd);
+    if (sts < 0)
+	return sts;
+    if (fp->topmcd.len > 0)
+	return __pmPollSetAddWrite(sp->set, fp->pmcd_fd);
+    return __pmPollSetDelWrite(sp->set, fp->pmcd_fd);
+}
+
+static __int32_t
+PDUField(const char *pdu, int offset)
+{
+    __int32_t	value;
+
+    memcpy(&value, pdu + offset, sizeof(value));
+    return ntohl(value);
+}
+
+/* 32-bit FNV-1a */
+static unsigned int
+HashBytes(const char *bytes, int length)
+{
+    unsigned int	hash = 2166136261U;
+    int			i;
+
+    for (i = 0; i < length; i++) {
+	hash ^= (unsigned char)bytes[i];
+	hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void ReleaseWaiters(Shard *, Shared *, int);
+static int ProcessRequests(Shard *, Forward *);
+
+static void
+CloseForward(Shard *sp, Forward *fp)
+{
+    if (pmDebugOptions.context)
+	fprintf(stderr, "CloseForward [shard %d] fd=%d pmcd_fd=%d\n",
+		(int)(sp - shards), fp->fd, fp->pmcd_fd);
+
+    __pmPollSetDel(sp->set, fp->fd);
+    __pmPollSetDel(sp->set, fp->pmcd_fd);
+    __pmPollSetDelWrite(sp->set, fp->fd);
+    __pmPollSetDelWrite(sp->set, fp->pmcd_fd);
+    sp->conns[fp->fd] = sp->conns[fp->pmcd_fd] = NULL;
+    __pmCloseSocket(fp->fd);
+    __pmCloseSocket(fp->pmcd_fd);
+
+    if (fp->leading)	/* others must now fetch for themselves */
+	ReleaseWaiters(sp, fp->leading, 0);
+    if (fp->waiting) {
+	Shared	*sh = fp->waiting;
+	int	i;
+
+	for (i = 0; i < sh->nwaiters; i++) {
+	    if (sh->waiters[i] == fp) {
+		sh->waiters[i] = sh->waiters[--sh->nwaiters];
+		break;
+	    }
+	}
+    }
+    while (fp->nprofiles > 0)
+	free(fp->profiles[--fp->nprofiles].body);
+    free(fp->profiles);
+    free(fp->target);
+    free(fp->inbuf);
+    free(fp->attrs);
+    free(fp->fetch);
+    free(fp->toclient.buf);
+    free(fp->topmcd.buf);
+    free(fp);
+}
+
+static int
+SetNonBlocking(int fd)
+{
+    int		flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0 ||
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	return -oserror();
+    return 0;
+}
+
+/* Start polling the connections handed over by the main thread */
+static void
+AdoptPending(Shard *sp)
+{
+    Forward	*fp, **conns;
+    char	wake[64];
+    int		i, maxfd, size, npending, sts;
+
+    while (read(sp->wakefd[0], wake, sizeof(wake)) == sizeof(wake))
+	;
+
+    pthread_mutex_lock(&sp->lock);
+    npending = sp->npending;
+    for (i = 0; i < npending; i++) {
+	fp = sp->pending[i];
+	maxfd = fp->fd > fp->pmcd_fd ? fp->fd : fp->pmcd_fd;
+	if (maxfd >= sp->nconns) {
+	    for (size = sp->nconns ? sp->nconns : 64; size <= maxfd; size *= 2)
+		;
+	    if ((conns = realloc(sp->conns, size * sizeof(Forward *))) == NULL) {
+		pmNoMem("AdoptPending", size * sizeof(Forward *), PM_RECOV_ERR);
+		__pmCloseSocket(fp->fd);
+		__pmCloseSocket(fp->pmcd_fd);
+		free(fp->target);
+		free(fp);
+		continue;
+	    }
+	    memset(conns + sp->nconns, 0, (size - sp->nconns) * sizeof(Forward *));
+	    sp->conns = conns;
+	    sp->nconns = size;
+	}
+	sp->conns[fp->fd] = sp->conns[fp->pmcd_fd] = fp;
+	if ((sts = SetNonBlocking(fp->fd)) < 0 ||
+	    (sts = SetNonBlocking(fp->pmcd_fd)) < 0 ||
+	    (sts = UpdatePolling(sp, fp)) < 0) {
+	    pmNotifyErr(LOG_ERR, "AdoptPending: cannot poll fd=%d or fd=%d: %s",
+			fp->fd, fp->pmcd_fd, pmErrStr(sts));
+	    CloseForward(sp, fp);
+	}
+    }
+    sp->npending = 0;
+    pthread_mutex_unlock(&sp->lock);
+}
+
+/*
+ * Walk the PDU boundaries in a chunk of client input, checking each
+ * PDU length field on the way past (these may be split across reads).
+ */
+static int
+CheckRequests(Forward *fp, const unsigned char *buf, int len)
+{
+    __int32_t	pdulen;
+    int		n;
+
+    while (len > 0) {
+	if (fp->need > 0) {
+	    n = fp->need < len ? fp->need : len;
+	    fp->need -= n;
+	    buf += n;
+	    len -= n;
+	    continue;
+	}
+	fp->hdr[fp->hdrlen++] = *buf++;
+	len--;
+	if (fp->hdrlen < sizeof(fp->hdr))
+	    continue;
+	memcpy(&pdulen, fp->hdr, sizeof(pdulen));
+	pdulen = ntohl(pdulen);
+	fp->hdrlen = 0;
+	if (pdulen < (int)sizeof(__pmPDUHdr)) {
+	    pmNotifyErr(LOG_ERR, "CheckRequests: fd=%d illegal PDU len=%d in hdr",
+			fp->fd, pdulen);
+	    return PM_ERR_IPC;
+	}
+	if (pdulen > ceiling) {
+	    pmNotifyErr(LOG_ERR, "CheckRequests: fd=%d bad PDU len=%d in hdr "
+			"exceeds maximum client PDU size (%d)",
+			fp->fd, pdulen, ceiling);
+	    return PM_ERR_TOOBIG;
+	}
+	fp->need = pdulen - sizeof(pdulen);
+    }
+    return 0;
+}
+
+/*
+ * Follow the PDU boundaries in the replies from pmcd to a client, as
+ * CheckRequests does for its requests, counting off each request that
+ * is answered - a pmcd state change notice answers none.
+ */
+static int
+CheckReplies(Forward *fp, const char *buf, int len)
+{
+    __int32_t	pdulen, type, code;
+    int		n;
+
+    while (len > 0) {
+	if (fp->replyneed > 0) {
+	    n = fp->replyneed < len ? fp->replyneed : len;
+	    fp->replyneed -= n;
+	    buf += n;
+	    len -= n;
+	    continue;
+	}
+	fp->replyhdr[fp->replyhdrlen++] = *buf++;
+	len--;
+	if (fp->replyhdrlen < sizeof(pdulen))
+	    continue;
+	pdulen = PDUField(fp->replyhdr, 0);
+	if (pdulen < (int)sizeof(__pmPDUHdr)) {
+	    pmNotifyErr(LOG_ERR, "CheckReplies: fd=%d illegal PDU len=%d in hdr",
+			fp->pmcd_fd, pdulen);
+	    return PM_ERR_IPC;
+	}
+	if (fp->replyhdrlen < (pdulen < ERROR_PDUSIZE ? pdulen : ERROR_PDUSIZE))
+	    continue;
+	type = PDUField(fp->replyhdr, sizeof(pdulen));
+	if (type == PDU_ERROR && pdulen >= ERROR_PDUSIZE)
+	    code = PDUField(fp->replyhdr, ERROR_CODE);
+	else
+	    code = 0;
+	if ((type != PDU_ERROR || code <= 0) && fp->outstanding > 0)
+	    fp->outstanding--;
+	fp->replyneed = pdulen - fp->replyhdrlen;
+	fp->replyhdrlen = 0;
+    }
+    return 0;
+}
+
+/* Remember the latest instance profile sent for each client context */
+static int
+SaveProfile(Forward *fp, const char *pdu, int len)
+{
+    Profile	*pp;
+    char	*body;
+    int		i, ctxid;
+
+    if (len < (int)(sizeof(__pmPDUHdr) + sizeof(__int32_t)))
+	return 0;	/* pmcd will reject it */
+    ctxid = PDUField(pdu, sizeof(__pmPDUHdr));
+    len -= sizeof(__pmPDUHdr) + sizeof(__int32_t);
+    if ((body = (char *)malloc(len)) == NULL) {
+	pmNoMem("SaveProfile", len, PM_RECOV_ERR);
+	return -ENOMEM;
+    }
+    memcpy(body, pdu + sizeof(__pmPDUHdr) + sizeof(__int32_t), len);
+
+    for (i = 0; i < fp->nprofiles; i++)
+	if (fp->profiles[i].ctxid == ctxid)
+	    break;
+    if (i == fp->nprofiles) {
+	pp = (Profile *)realloc(fp->profiles, (i + 1) * sizeof(Profile));
+	if (pp == NULL) {
+	    pmNoMem("SaveProfile", (i + 1) * sizeof(Profile), PM_RECOV_ERR);
+	    free(body);
+	    return -ENOMEM;
+	}
+	fp->profiles = pp;
+	fp->nprofiles++;
+	pp[i].ctxid = ctxid;
+    } else {
+	free(fp->profiles[i].body);
+    }
+    fp->profiles[i].length = len;
+    fp->profiles[i].body = body;
+    return 0;
+}
+
+/* Attributes accumulate for the life of the connection, as in pmcd */
+static int
+SaveAttr(Forward *fp, const char *pdu, int len)
+{
+    char	*attrs;
+
+    len -= sizeof(__pmPDUHdr);
+    if ((attrs = (char *)realloc(fp->attrs, fp->attrlen + len)) == NULL) {
+	pmNoMem("SaveAttr", fp->attrlen + len, PM_RECOV_ERR);
+	return -ENOMEM;
+    }
+    fp->attrs = attrs;
+    memcpy(fp->attrs + fp->attrlen, pdu + sizeof(__pmPDUHdr), len);
+    fp->attrlen += len;
+    return 0;
+}
+
+static void
+FreeShared(Shared *sh)
+{
+    free(sh->key);
+    free(sh->waiters);
+    free(sh->reply);
+    free(sh->takers);
+    free(sh);
+}
+
+/*
+ * Note a connection given (or about to be given) the reply, which is
+ * not replayed to it - a client fetching again wants new values.
+ */
+static int
+AddTaker(Shared *sh, Forward *fp)
+{
+    unsigned int	*takers;
+    int			size;
+
+    if (sh->ntakers == sh->maxtakers) {
+	size = sh->maxtakers ? sh->maxtakers * 2 : 4;
+	takers = (unsigned int *)realloc(sh->takers, size * sizeof(unsigned int));
+	if (takers == NULL)
+	    return -ENOMEM;
+	sh->takers = takers;
+	sh->maxtakers = size;
+    }
+    sh->takers[sh->ntakers++] = fp->id;
+    return 0;
+}
+
+static int
+TookReply(Shared *sh, Forward *fp)
+{
+    int		i;
+
+    for (i = 0; i < sh->ntakers; i++)
+	if (sh->takers[i] == fp->id)
+	    return 1;
+    return 0;
+}
+
+static void
+DropShared(Shard *sp, Shared *sh)
+{
+    __pmHashDel(sh->hash, (void *)sh, &sp->shared);
+    sp->nshared--;
+    FreeShared(sh);
+}
+
+/*
+ * The fetch shared by a group of clients has finished (done), or cannot
+ * be shared after all - each waiting client then gets the reply, or
+ * sends its own fetch, and carries on with any requests that followed.
+ */
+static void
+ReleaseWaiters(Shard *sp, Shared *sh, int done)
+{
+    Forward	**waiters = sh->waiters;
+    Forward	*fp;
+    int		nwaiters = sh->nwaiters;
+    int		i, sts;
+
+    if (pmDebugOptions.appl1)
+	fprintf(stderr, "ReleaseWaiters [shard %d] %s, %d waiters "
+		"(fetches: %lu sent, %lu shared)\n",
+		(int)(sp - shards), done ? "done" : "failed", nwaiters,
+		sp->upstream, sp->coalesced);
+
+    if (sh->leader) {
+	sh->leader->leading = NULL;
+	sh->leader = NULL;
+    }
+    sh->waiters = NULL;
+    sh->nwaiters = sh->maxwaiters = 0;
+    if (done)
+	sh->done = 1;
+
+    for (i = 0; i < nwaiters; i++) {
+	fp = waiters[i];
+	fp->waiting = NULL;
+	if (done)
+	    sts = SendBytes(fp, fp->fd, sh->reply, sh->replylen);
+	else if ((sts = SendBytes(fp, fp->pmcd_fd, fp->fetch, fp->fetchlen)) >= 0)
+	    fp->outstanding++;
+	free(fp->fetch);
+	fp->fetch = NULL;
+	if (sts < 0) {
+	    CloseForward(sp, fp);
+	    waiters[i] = NULL;
+	}
+    }
+    if (!done)
+	DropShared(sp, sh);
+
+    /* sh may be gone from here on, as any of these may replace it */
+    for (i = 0; i < nwaiters; i++) {
+	if ((fp = waiters[i]) == NULL)
+	    continue;
+	if ((sts = ProcessRequests(sp, fp)) < 0 ||
+	    (sts = UpdatePolling(sp, fp)) < 0)
+	    CloseForward(sp, fp);
+    }
+    free(waiters);
+}
+
+/*
+ * Key identifying a fetch: everything pmcd bases the reply on, which
+ * is the pmcd instance, client attributes (e.g. container), instance
+ * profile for the context, and the fetch itself less the context.
+ */
+static int
+FetchKey(Shard *sp, Forward *fp, const char *pdu, int len)
+{
+    Profile	*pp = NULL;
+    __int32_t	length;
+    int		i, ctxid, need, sts;
+    char	*key;
+
+    ctxid = PDUField(pdu, FETCH_CTXID);
+    for (i = 0; i < fp->nprofiles; i++) {
+	if (fp->profiles[i].ctxid == ctxid) {
+	    pp = &fp->profiles[i];
+	    break;
+	}
+    }
+    need = fp->targetlen + 2 * sizeof(length) + fp->attrlen +
+	   (pp ? pp->length : 0) + len - FETCH_WHEN;
+    if ((sts = GrowBuffer(&sp->key, &sp->keymax, need)) < 0)
+	return sts;
+
+    key = sp->key;
+    memcpy(key, fp->target, fp->targetlen);
+    key += fp->targetlen;
+    length = fp->attrlen;
+    memcpy(key, &length, sizeof(length));
+    key += sizeof(length);
+    memcpy(key, fp->attrs, fp->attrlen);
+    key += fp->attrlen;
+    length = pp ? pp->length : -1;
+    memcpy(key, &length, sizeof(length));
+    key += sizeof(length);
+    if (pp) {
+	memcpy(key, pp->body, pp->length);
+	key += pp->length;
+    }
+    memcpy(key, pdu + FETCH_WHEN, len - FETCH_WHEN);
+    return need;
+}
+
+/*
+ * Returns 0 when the fetch must be sent upstream, 1 when it has been
+ * answered from (or is waiting for) a fetch made for another client.
+ */
+static int
+CoalesceFetch(Shard *sp, Forward *fp, const char *pdu, int len)
+{
+    __pmHashNode	*hp;
+    Shared		*sh = NULL;
+    struct timeval	now;
+    unsigned int	hash;
+    pmID		pmid;
+    int			i, numpmid, keylen, size, sts;
+
+    if (fp->leading)	/* not waiting for the last reply, so be safe */
+	return 0;
+    if (fp->outstanding > 0 || fp->replyneed > 0 || fp->replyhdrlen > 0)
+	return 0;	/* a shared reply must not split another one */
+    if (len < FETCH_PMIDS)
+	return 0;
+    numpmid = PDUField(pdu, FETCH_NUMPMID);
+    if (numpmid <= 0 || numpmid > (len - FETCH_PMIDS) / (int)sizeof(pmID))
+	return 0;	/* pmcd will reject it */
+    for (i = 0; i < numpmid; i++) {
+	pmid = PDUField(pdu, FETCH_PMIDS + i * sizeof(pmID));
+	if (pmID_domain(pmid) == PMCD_DOMAIN)
+	    return 0;
+    }
+
+    if ((keylen = FetchKey(sp, fp, pdu, len)) < 0)
+	return 0;
+    hash = HashBytes(sp->key, keylen);
+    for (hp = __pmHashSearch(hash, &sp->shared); hp != NULL; hp = hp->next) {
+	if (hp->key != hash)
+	    continue;
+	sh = (Shared *)hp->data;
+	if (sh->keylen == keylen && memcmp(sh->key, sp->key, keylen) == 0)
+	    break;
+	sh = NULL;
+    }
+
+    pmtimevalNow(&now);
+    if (sh && sh->done) {
+	/*
+	 * a reply within the window is for clients that have not seen
+	 * it yet, one that has gets a new fetch, shared from here on
+	 */
+	if (pmtimevalSub(&now, &sh->sent) * 1000 < window &&
+	    !TookReply(sh, fp) && AddTaker(sh, fp) == 0) {
+	    if (pmDebugOptions.appl1)
+		fprintf(stderr, "CoalesceFetch: fd=%d reply from %d bytes\n",
+			fp->fd, sh->replylen);
+	    sp->coalesced++;
+	    if ((sts = SendBytes(fp, fp->fd, sh->reply, sh->replylen)) < 0)
+		return sts;
+	    return 1;
+	}
+	DropShared(sp, sh);
+	sh = NULL;
+    }
+
+    if (sh) {	/* in progress, so wait for the reply */
+	if (sh->nwaiters == sh->maxwaiters) {
+	    Forward	**waiters;
+
+	    size = sh->maxwaiters ? sh->maxwaiters * 2 : 4;
+	    waiters = (Forward **)realloc(sh->waiters, size * sizeof(Forward *));
+	    if (waiters == NULL)
+		return 0;
+	    sh->waiters = waiters;
+	    sh->maxwaiters = size;
+	}
+	if (AddTaker(sh, fp) < 0)
+	    return 0;
+	if ((fp->fetch = (char *)malloc(len)) == NULL) {
+	    sh->ntakers--;
+	    return 0;
+	}
+	memcpy(fp->fetch, pdu, len);
+	fp->fetchlen = len;
+	sh->waiters[sh->nwaiters++] = fp;
+	fp->waiting = sh;
+	sp->coalesced++;
+	if (pmDebugOptions.appl1)
+	    fprintf(stderr, "CoalesceFetch: fd=%d waits on fd=%d\n",
+		    fp->fd, sh->leader->fd);
+	return 1;
+    }
+
+    /* first of its kind, this client's fetch is sent for all */
+    if ((sh = (Shared *)calloc(1, sizeof(Shared))) == NULL)
+	return 0;
+    if ((sh->key = (char *)malloc(keylen)) == NULL) {
+	free(sh);
+	return 0;
+    }
+    memcpy(sh->key, sp->key, keylen);
+    sh->keylen = keylen;
+    sh->hash = hash;
+    sh->sent = now;
+    if (AddTaker(sh, fp) < 0 || __pmHashAdd(hash, (void *)sh, &sp->shared) < 0) {
+	FreeShared(sh);
+	return 0;
+    }
+    sp->nshared++;
+    sh->leader = fp;
+    fp->leading = sh;
+    fp->replied = 0;
+    sp->upstream++;
+    return 0;
+}
+
+/*
+ * Forward each complete client PDU in the input buffer to pmcd, except
+ * fetches that can be shared.  A client waiting on a shared fetch sends
+ * nothing further until the reply arrives, and stays in the buffer.
+ */
+static int
+ProcessRequests(Shard *sp, Forward *fp)
+{
+    __int32_t	pdulen;
+    int		start = 0, offset = 0;
+    int		type, sts;
+
+    while (!fp->waiting && fp->inlen - offset >= (int)sizeof(pdulen)) {
+	sts = 0;
+	pdulen = PDUField(fp->inbuf, offset);
+	if (pdulen < (int)sizeof(__pmPDUHdr)) {
+	    pmNotifyErr(LOG_ERR, "ProcessRequests: fd=%d illegal PDU len=%d in hdr",
+			fp->fd, pdulen);
+	    return PM_ERR_IPC;
+	}
+	if (pdulen > ceiling) {
+	    pmNotifyErr(LOG_ERR, "ProcessRequests: fd=%d bad PDU len=%d in hdr "
+			"exceeds maximum client PDU size (%d)",
+			fp->fd, pdulen, ceiling);
+	    return PM_ERR_TOOBIG;
+	}
+	if (fp->inlen - offset < pdulen)
+	    break;
+
+	type = PDUField(fp->inbuf, offset + sizeof(pdulen));
+	if (type == PDU_PROFILE)
+	    sts = SaveProfile(fp, fp->inbuf + offset, pdulen);
+	else if (type == PDU_ATTR)
+	    sts = SaveAttr(fp, fp->inbuf + offset, pdulen);
+	else if (type == PDU_FETCH) {
+	    /* requests before the fetch go first, in order */
+	    if (offset > start &&
+		(sts = SendBytes(fp, fp->pmcd_fd, fp->inbuf + start, offset - start)) < 0)
+		return sts;
+	    start = offset;
+	    sts = CoalesceFetch(sp, fp, fp->inbuf + offset, pdulen);
+	    if (sts > 0)	/* answered, or waiting */
+		start = offset + pdulen;
+	}
+	if (sts < 0)
+	    return sts;
+	/* pmcd answers all but these, if they are forwarded */
+	if (start <= offset && type != PDU_PROFILE && type != PDU_ATTR &&
+	    type != PDU_CREDS)
+	    fp->outstanding++;
+	offset += pdulen;
+    }
+
+    if (offset > start &&
+	(sts = SendBytes(fp, fp->pmcd_fd, fp->inbuf + start, offset - start)) < 0)
+	return sts;
+    if (offset > 0) {
+	fp->inlen -= offset;
+	memmove(fp->inbuf, fp->inbuf + offset, fp->inlen);
+    }
+    return 0;
+}
+
+/*
+ * Keep a copy of the reply to a shared fetch as it passes through to
+ * the leading client.  A pmResult or an error ends the reply - but not
+ * an error reporting a pmcd state change, which is for each client to
+ * see for itself, so the fetch is not shared in that case.
+ */
+static void
+SaveReply(Shard *sp, Forward *fp, const char *buf, int len)
+{
+    Shared	*sh = fp->leading;
+    __int32_t	pdulen;
+    int		type, code;
+
+    if (GrowBuffer(&sh->reply, &sh->replymax, sh->replylen + len) < 0) {
+	ReleaseWaiters(sp, sh, 0);
+	return;
+    }
+    memcpy(sh->reply + sh->replylen, buf, len);
+    sh->replylen += len;
+
+    while (sh->replylen - fp->replied >= (int)sizeof(__pmPDUHdr)) {
+	pdulen = PDUField(sh->reply, fp->replied);
+	if (pdulen < (int)sizeof(__pmPDUHdr)) {
+	    ReleaseWaiters(sp, sh, 0);
+	    return;
+	}
+	if (sh->replylen - fp->replied < pdulen)
+	    return;
+	type = PDUField(sh->reply, fp->replied + sizeof(pdulen));
+	if (type == PDU_ERROR && pdulen >= ERROR_CODE + (int)sizeof(__int32_t))
+	    code = PDUField(sh->reply, fp->replied + ERROR_CODE);
+	else
+	    code = 0;
+	if (type == PDU_RESULT || (type == PDU_ERROR && code <= 0)) {
+	    sh->replylen = fp->replied + pdulen;
+	    ReleaseWaiters(sp, sh, 1);
+	} else {
+	    ReleaseWaiters(sp, sh, 0);
+	}
+	return;
+    }
+}
+
+/* Move whatever one socket has to offer across to the other one */
+static int
+ForwardInput(Shard *sp, Forward *fp, int fromfd)
+{
+    ssize_t	bytes;
+    int		sts;
+
+    do {
+	bytes = __pmRecv(fromfd, sp->buffer, FORWARD_BUFSIZE, 0);
+    } while (bytes < 0 && neterror() == EINTR);
+    if (bytes < 0 && (neterror() == EAGAIN || neterror() == EWOULDBLOCK))
+	return 0;
+    if (bytes <= 0)
+	return bytes < 0 ? -neterror() : PM_ERR_EOF;
+
+    if (fromfd == fp->pmcd_fd) {
+	if ((sts = SendBytes(fp, fp->fd, sp->buffer, bytes)) < 0)
+	    return sts;
+	if (window > 0 && (sts = CheckReplies(fp, sp->buffer, bytes)) < 0)
+	    return sts;
+	if (fp->leading)
+	    SaveReply(sp, fp, sp->buffer, bytes);
+	return 0;
+    }
+    if (window == 0) {
+	if ((sts = CheckRequests(fp, (unsigned char *)sp->buffer, bytes)) < 0)
+	    return sts;
+	return SendBytes(fp, fp->pmcd_fd, sp->buffer, bytes);
+    }
+    if ((sts = GrowBuffer(&fp->inbuf, &fp->inmax, fp->inlen + bytes)) < 0)
+	return sts;
+    memcpy(fp->inbuf + fp->inlen, sp->buffer, bytes);
+    fp->inlen += bytes;
+    return ProcessRequests(sp, fp);
+}
+
+/* Forget shared fetch replies that have aged beyond the window */
+static __pmHashWalkState
+ExpireShared(const __pmHashNode *hp, void *arg)
+{
+    Shared		*sh = (Shared *)hp->data;
+    Shard		*sp = (Shard *)arg;
+
+    if (sh->done && pmtimevalSub(&sp->swept, &sh->sent) * 1000 >= window) {
+	sp->nshared--;
+	FreeShared(sh);
+	return PM_HASH_WALK_DELETE_NEXT;
+    }
+    return PM_HASH_WALK_NEXT;
+}
+
+static void *
+ShardLoop(void *arg)
+{
+    Shard		*sp = (Shard *)arg;
+    Forward		*fp;
+    struct timeval	timeout, now;
+    int			*ready;
+    int			i, fd, nready, adopt, sts;
+
+    for (;;) {
+	if (sp->nshared > 0) {		/* wake up to expire replies */
+	    timeout.tv_sec = window / 1000;
+	    timeout.tv_usec = (window % 1000) * 1000;
+	    nready = __pmPollSetWait(sp->set, &ready, &timeout);
+	} else {
+	    nready = __pmPollSetWait(sp->set, &ready, NULL);
+	}
+	if (nready < 0) {
+	    if (neterror() == EINTR)
+		continue;
+	    pmNotifyErr(LOG_ERR, "ShardLoop: poll failed: %s\n", netstrerror());
+	    break;
+	}
+	for (i = adopt = 0; i < nready; i++) {
+	    fd = ready[i];
+	    if (!__pmPollSetIsReady(sp->set, fd) &&
+		!__pmPollSetIsWritable(sp->set, fd))
+		continue;	/* closed earlier in this round */
+	    if (fd == sp->wakefd[0]) {
+		adopt = 1;	/* after this round, as ready[] may move */
+		continue;
+	    }
+	    if (fd >= sp->nconns || (fp = sp->conns[fd]) == NULL)
+		continue;
+	    sts = 0;
+	    if (__pmPollSetIsWritable(sp->set, fd))
+		sts = FlushOutput(fp, fd);
+	    if (sts >= 0 && __pmPollSetIsReady(sp->set, fd))
+		sts = ForwardInput(sp, fp, fd);
+	    if (sts >= 0)
+		sts = UpdatePolling(sp, fp);
+	    if (sts < 0) {
+		if (pmDebugOptions.appl0)
+		    fprintf(stderr, "ShardLoop: fd=%d %s (%d)\n",
+			    fd, pmErrStr(sts), sts);
+		CloseForward(sp, fp);
+	    }
+	}
+	if (adopt)
+	    AdoptPending(sp);
+	if (sp->nshared > 0) {
+	    pmtimevalNow(&now);
+	    if (pmtimevalSub(&now, &sp->swept) * 1000 >= window) {
+		sp->swept = now;
+		__pmHashWalkCB(ExpireShared, sp, &sp->shared);
+		if (pmDebugOptions.appl1)
+		    fprintf(stderr, "ShardLoop [shard %d] %d fetches shared "
+			    "after expiry\n", (int)(sp - shards), sp->nshared);
+	    }
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Start the forwarding threads, returning the number started - zero
+ * means every connection is served from the main thread.  Identical
+ * fetches to the same pmcd are shared within msec milliseconds, if
+ * that is non-zero.
+ */
+int
+StartForwarding(int nthreads, int msec)
+{
+    Shard	*sp;
+    int		i, sts;
+
+    if (nthreads <= 0)
+	return 0;
+    if ((shards = (Shard *)calloc(nthreads, sizeof(Shard))) == NULL) {
+	pmNoMem("StartForwarding", nthreads * sizeof(Shard), PM_RECOV_ERR);
+	return 0;
+    }
+    ceiling = __pmSetPDUCeiling(0);	/* current limit, see -L */
+    window = msec > 0 ? msec : 0;
+#ifdef HAVE_SIGPIPE
+    __pmSetSignalHandler(SIGPIPE, SIG_IGN);
+#endif
+
+    for (i = 0; i < nthreads; i++) {
+	sp = &shards[nShards];
+	if ((sp->buffer = malloc(FORWARD_BUFSIZE)) == NULL ||
+	    (sp->set = __pmPollSetCreate()) == NULL) {
+	    pmNoMem("StartForwarding", FORWARD_BUFSIZE, PM_RECOV_ERR);
+	    free(sp->buffer);
+	    break;
+	}
+	if (pipe(sp->wakefd) < 0 ||
+	    fcntl(sp->wakefd[0], F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(sp->wakefd[1], F_SETFL, O_NONBLOCK) < 0 ||
+	    (sts = __pmPollSetAdd(sp->set, sp->wakefd[0])) < 0) {
+	    pmNotifyErr(LOG_ERR, "StartForwarding: wakeup pipe: %s\n",
+			osstrerror());
+	    __pmPollSetDestroy(sp->set);
+	    free(sp->buffer);
+	    break;
+	}
+	__pmHashInit(&sp->shared);
+	pthread_mutex_init(&sp->lock, NULL);
+	if ((sts = pthread_create(&sp->thread, NULL, ShardLoop, sp)) != 0) {
+	    pmNotifyErr(LOG_ERR, "StartForwarding: pthread_create: %s\n",
+			pmErrStr(-sts));
+	    pthread_mutex_destroy(&sp->lock);
+	    close(sp->wakefd[0]);
+	    close(sp->wakefd[1]);
+	    __pmPollSetDestroy(sp->set);
+	    free(sp->buffer);
+	    break;
+	}
+	nShards++;
+    }
+    return nShards;
+}
+
+/*
+ * Hand the client and pmcd sockets of an established connection over
+ * to a forwarding thread.  On success the sockets belong to that thread
+ * and the caller should forget them (DetachClient), otherwise the main
+ * thread carries on serving the connection.
+ */
+int
+ForwardClient(ClientInfo *cp)
+{
+    Forward	*fp, **pending;
+    Shard	*sp;
+    char	target[MAXHOSTNAMELEN + 16];
+    int		size;
+
+    if (nShards == 0 || cp->status.secure || pmDebugOptions.pdu)
+	return -1;
+
+    if ((fp = (Forward *)calloc(1, sizeof(Forward))) == NULL)
+	return -ENOMEM;
+    fp->id = ++nextId;
+    fp->fd = cp->fd;
+    fp->pmcd_fd = cp->pmcd_fd;
+
+    if (window == 0) {
+	sp = &shards[nextShard++ % nShards];
+    } else {
+	/* clients of one pmcd share a thread, and so their fetches */
+	fp->targetlen = pmsprintf(target, sizeof(target), "%s %d",
+				cp->pmcd_hostname, cp->pmcd_port) + 1;
+	if ((fp->target = strdup(target)) == NULL) {
+	    free(fp);
+	    return -ENOMEM;
+	}
+	sp = &shards[HashBytes(target, fp->targetlen) % nShards];
+    }
+    pthread_mutex_lock(&sp->lock);
+    if (sp->npending == sp->maxpending) {
+	size = sp->maxpending ? sp->maxpending * 2 : 8;
+	pending = (Forward **)realloc(sp->pending, size * sizeof(Forward *));
+	if (pending == NULL) {
+	    pthread_mutex_unlock(&sp->lock);
+	    free(fp->target);
+	    free(fp);
+	    return -ENOMEM;
+	}
+	sp->pending = pending;
+	sp->maxpending = size;
+    }
+    sp->pending[sp->npending++] = fp;
+    pthread_mutex_unlock(&sp->lock);
+
+    if (pmDebugOptions.context)
+	fprintf(stderr, "ForwardClient [shard %d] fd=%d pmcd_fd=%d\n",
+		(int)(sp - shards), fp->fd, fp->pmcd_fd);
+
+    /* a full pipe already has a wakeup pending, so ignore failure */
+    if (write(sp->wakefd[1], "", 1) < 0 && pmDebugOptions.desperate)
+	fprintf(stderr, "ForwardClient: wakeup: %s\n", osstrerror());
+    return 0;
+}
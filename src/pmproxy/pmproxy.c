@@ -21,6 +21,7 @@
 
 #define MAXPENDING	5	/* maximum number of pending connections */
 #define FDNAMELEN	40	/* maximum length of a fd description */
+#define MAXTHREADS	16	/* default forwarding threads limit */
 #define STRINGIFY(s)    #s
 #define TO_STRING(s)    STRINGIFY(s)
 
@@ -35,6 +36,8 @@ static char	*certdb;		/* certificate DB path (NSS) */
 static char	*dbpassfile;		/* certificate DB password file */
 static char     *cert_nickname;         /* Alternate nickname to use for server certificate */
 static char	*hostname;
+static int	nthreads = -1;		/* forwarding threads, see -t */
+static int	coalesce;		/* fetch sharing window, see -c */
 
 static void
 DontStart(void)
@@ -76,6 +79,8 @@ static pmLongOptions longopts[] = {
     PMAPI_OPTIONS_HEADER("Connection options"),
     { "interface", 1, 'i', "ADDR", "accept connections on this IP address" },
     { "port", 1, 'p', "N", "accept connections on this port" },
+    { "threads", 1, 't', "N", "forward established connections using N threads" },
+    { "coalesce", 1, 'c', "MSEC", "share identical fetches within MSEC milliseconds" },
     PMAPI_OPTIONS_HEADER("Diagnostic options"),
     { "log", 1, 'l', "PATH", "redirect diagnostics and trace output" },
     { "", 1, 'x', "PATH", "fatal messages at startup sent to file [default /dev/tty]" },
@@ -83,7 +88,7 @@ static pmLongOptions longopts[] = {
 };
 
 static pmOptions opts = {
-    .short_options = "A:C:D:fi:l:L:M:p:P:U:x:?",
+    .short_options = "A:c:C:D:fi:l:L:M:p:P:t:U:x:?",
     .long_options = longopts,
 };
 
@@ -93,6 +98,7 @@ ParseOptions(int argc, char *argv[], int *nports)
     int		c;
     int		sts;
     int		usage = 0;
+    char	*endnum;
 
     while ((c = pmgetopt_r(argc, argv, &opts)) != EOF) {
 	switch (c) {
@@ -101,6 +107,15 @@ ParseOptions(int argc, char *argv[], int *nports)
 	    __pmServerClearFeature(PM_SERVER_FEATURE_DISCOVERY);
 	    break;
 
+	case 'c':	/* window for sharing fetches between clients */
+	    coalesce = (int)strtol(opts.optarg, &endnum, 10);
+	    if (*endnum != '\0' || coalesce < 0) {
+		pmprintf("%s: -c requires a non-negative numeric argument (%s)\n",
+			pmGetProgname(), opts.optarg);
+		opts.errors++;
+	    }
+	    break;
+
 	case 'C':	/* path to NSS certificate database */
 	    certdb = opts.optarg;
 	    break;
@@ -155,6 +170,15 @@ ParseOptions(int argc, char *argv[], int *nports)
 	    dbpassfile = opts.optarg;
 	    break;
 
+	case 't':	/* number of forwarding threads */
+	    nthreads = (int)strtol(opts.optarg, &endnum, 10);
+	    if (*endnum != '\0' || nthreads < 0) {
+		pmprintf("%s: -t requires a non-negative numeric argument (%s)\n",
+			pmGetProgname(), opts.optarg);
+		opts.errors++;
+	    }
+	    break;
+
 	case 'U':	/* run as user username */
 	    username = opts.optarg;
 	    break;
@@ -255,8 +279,10 @@ VerifyClient(ClientInfo *cp, __pmPDU *pb)
 
     /* need to ensure both the pmcd and client channel use flags */
 
-    if (sts >= 0 && flags)
+    if (sts >= 0 && flags) {
 	sts = __pmSecureServerHandshake(cp->fd, flags, &attrs);
+	cp->status.secure = 1;	/* libpcp must handle every PDU */
+    }
 
     /* send credentials PDU through to pmcd now (order maintained) */
     if (sts >= 0)
@@ -319,6 +345,9 @@ HandleInput(__pmFdSet *fdsPtr)
 		continue;
 	    }
 	    cp->status.allowed = 1;
+	    /* from here on, just bytes to shuffle - if not secure */
+	    if (ForwardClient(cp) == 0)
+		DetachClient(cp);
 	    continue;
 	}
 
@@ -587,6 +616,21 @@ main(int argc, char *argv[])
     if (__pmSecureServerCertificateSetup(certdb, dbpassfile, cert_nickname) < 0)
 	DontStart();
 
+    /* one forwarding thread per CPU by default, within reason */
+    if (nthreads < 0) {
+	nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+	    nthreads = 1;
+	else if (nthreads > MAXTHREADS)
+	    nthreads = MAXTHREADS;
+    }
+    sts = StartForwarding(nthreads, coalesce);
+    if (pmDebugOptions.context)
+	fprintf(stderr, "pmproxy: forwarding threads = %d\n", sts);
+    if (pmDebugOptions.appl1 && sts > 0 && coalesce > 0)
+	fprintf(stderr, "pmproxy: fetch coalescing window = %d msec\n", coalesce);
+    fflush(stderr);
+
     /* all the work is done here */
     ClientLoop();
 
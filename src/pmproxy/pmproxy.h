@@ -25,6 +25,7 @@ typedef struct {
     struct {				/* Status of connection to client */
 	unsigned int	connected : 1;	/* Client connected, socket level */
 	unsigned int	allowed : 1;	/* Creds seen, OK to talk to pmcd */
+	unsigned int	secure : 1;	/* Secure/compressed/authenticated */
     } status;
     char		*pmcd_hostname;	/* PMCD hostname */
     int			pmcd_port;	/* PMCD port */
@@ -43,6 +44,9 @@ extern __pmFdSet	sockFds;	/* for select() */
 /* prototypes */
 extern ClientInfo *AcceptNewClient(int);
 extern void DeleteClient(ClientInfo *);
+extern void DetachClient(ClientInfo *);
+extern int StartForwarding(int, int);
+extern int ForwardClient(ClientInfo *);
 extern void StartDaemon(int, char **);
 extern void Shutdown(void);
 
@@ -160,6 +160,20 @@ series_load_all(pmSeriesSettings *settings, const char *query)
     return data.status;
 }
 
+/*
+ *  pmSeriesVacuum calls - retention policy is a query with time window
+ */
+
+static int
+series_vacuum(pmSeriesSettings *settings, const char *policy)
+{
+    series_data		data;
+
+    series_data_init(&data);
+    pmSeriesVacuum(settings, policy, 0, (void *)&data);
+    return data.status;
+}
+
 /*
  *  pmSeriesQuery calls and associated callbacks
  */
@@ -500,6 +514,7 @@ static pmLongOptions longopts[] = {
     { "loadmeta", 0, 'M', 0, "load time series metadata only" },
     { "metrics", 0, 'm', 0, "metric names for time series" },
     { "query", 0, 'q', 0, "perform a time series query" },
+    { "vacuum", 0, 'v', 0, "drop time series values older than the query window" },
     PMOPT_VERSION,
     PMOPT_HELP,
     PMAPI_OPTIONS_END
@@ -507,7 +522,7 @@ static pmLongOptions longopts[] = {
 
 static pmOptions opts = {
     .flags = PM_OPTFLAG_BOUNDARIES,
-    .short_options = "adD:ilLmMqV?",
+    .short_options = "adD:ilLmMqvV?",
     .long_options = longopts,
     .short_usage = "[query ... | series ...]",
     .override = pmseries_overrides,
@@ -561,6 +576,10 @@ main(int argc, char *argv[])
 	    command = series_query_meta;
 	    break;
 
+	case 'v':	/* command line contains retention policy */
+	    command = series_vacuum;
+	    break;
+
 	default:
 	    opts.errors++;
 	    break;
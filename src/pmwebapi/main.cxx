@@ -41,6 +41,7 @@ static __pmServerPresence *presence;
 unsigned multithread = 0;       /* set by -M option */
 unsigned graphite_timestep = 60;  /* set by -i option */
 unsigned graphite_hostcache = 0; /* set by -J option */
+unsigned graphite_ctxpool = 64; /* set by -k option */
 string logfile = "";		/* set by -l option */
 string fatalfile = "/dev/tty";	/* fatal messages at startup go here */
 
@@ -390,6 +391,7 @@ server_dump_configuration ()
     clog << "\tGraphite API " << (graphite_p ? "enabled" : "disabled") << endl;
     clog << "\tGraphite API name encoding " << (graphite_encode ? "long" : "short") << endl;
     clog << "\tGraphite API metric naming " << (graphite_hostcache ? "hostname-based" : "file-based") << endl;
+    clog << "\tGraphite API archive contexts kept open: " << graphite_ctxpool << endl;
     clog << "\tGraphite API Cairo graphics rendering "
 #ifdef HAVE_CAIRO
          << "compiled-in"
@@ -471,6 +473,7 @@ option_overrides (int opt, pmOptions * opts)
     case 't':
     case 'i':
     case 'I':
+    case 'k':
     case 'X':
         return 1;
     }
@@ -489,6 +492,7 @@ longopts[] = {
     {"graphite-timestamp", 1, 'i', "SEC", "minimum graphite timestep (s) [default 60]"},
     {"graphite-archivedir", 0, 'I', 0, "prefer archive directories [default OFF]"},
     {"graphite-host", 0, 'J', 0, "prefer hostname as metric component [default OFF]"},
+    {"graphite-contexts", 1, 'k', "NUM", "archive contexts kept open for graphite [default 64]"},
     PMAPI_OPTIONS_HEADER ("Context options"),
     {"timeout", 1, 't', "SEC", "max time (seconds) for PMAPI polling [default 300]"},
     {"context", 1, 'c', "NUM", "set next permanent-binding context number"},
@@ -543,7 +547,7 @@ main (int argc, char *argv[])
     pmGetUsername (&username_str);
     __pmServerSetFeature (PM_SERVER_FEATURE_DISCOVERY);
 
-    opts.short_options = "A:a:c:CD:h:Ll:NM:Pp:R:GJi:It:U:vx:d:SX46?";
+    opts.short_options = "A:a:c:CD:h:Ll:NM:Pp:R:GJi:Ik:t:U:vx:d:SX46?";
     opts.long_options = longopts;
     opts.override = option_overrides;
 
@@ -598,6 +602,14 @@ main (int argc, char *argv[])
             graphite_hostcache = 1;
             break;
 
+        case 'k':
+            graphite_ctxpool = strtoul (opts.optarg, &endptr, 0);
+            if (*endptr != '\0') {
+                pmprintf ("%s: invalid context pool size %s\n", pmGetProgname(), opts.optarg);
+                opts.errors++;
+            }
+            break;
+
         case 'A':
             archivesdir = opts.optarg;
             break;
@@ -29,6 +29,7 @@
 #include <set>
 #include <stack>
 #include <map>
+#include <list>
 
 using namespace std;
 
@@ -350,6 +351,217 @@ ac_by_fn_t archivecache_by_filename;
 typedef multimap<string,archivecache_entry*> ac_by_ap_t;
 ac_by_ap_t archivecache_by_archivepart;
 
+// Rollup archives (pmlogreduce -R, as maintained by pmlogger_daily -R)
+// found next to an archive, e.g. 20180325.rollup-10m next to 20180325.
+// These carry the same metric names with averaged values at a coarser
+// interval, so they are not archives in their own right as far as the
+// graphite namespace goes; they are only used to answer a fetch whose
+// step is at least their interval.  Keyed by the .meta filename of the
+// original archive, then by interval in seconds.  Rebuilt on each scan.
+typedef map<string,map<time_t,string> > ac_rollups_t;
+ac_rollups_t archivecache_rollups;
+
+
+
+// Pool of open archive contexts for the graphite fetch path.
+//
+// Dashboards re-render every few seconds, and each render used to
+// pmNewContext() every archive it touched, then look up the same
+// label, archive end, metric names, descriptors and instances again,
+// only to pmDestroyContext() it all at the end.  So we keep up to
+// graphite_ctxpool archive contexts open, least recently used first
+// out, each with those lookups cached alongside.  ac_refresh() drops
+// an entry when its archive's metadata or volumes change, or just
+// asks for a new archive end when the last volume has grown.
+//
+// An entry is checked out by one fetch_series_jobqueue thread at a
+// time; if it is already busy, the next thread gets a private context
+// that is not pooled.
+
+struct ctxpool_target {
+    bool ok; // resolved to something we can fetch
+    pmID pmid;
+    pmDesc desc;
+    int inst;
+    string message; // diagnostics, repeated whenever this target is used
+};
+
+struct ctxpool_entry {
+    string filename;
+    int ctx; // -1 until opened by the first user
+    pmLogLabel label;
+    struct timeval archive_end;
+    bool end_stale; // archive has grown; ask pmGetArchiveEnd again
+    bool busy; // checked out by a fetch thread
+    bool pooled; // on ctxpool_lru; if not, discard at checkin
+    map<string,ctxpool_target> targets; // keyed by metric_string::unsplit()
+};
+
+typedef list<ctxpool_entry*> ctxpool_lru_t; // most recently used first
+static ctxpool_lru_t ctxpool_lru;
+typedef map<string,ctxpool_lru_t::iterator> ctxpool_by_fn_t;
+static ctxpool_by_fn_t ctxpool_by_filename;
+static unsigned long ctxpool_hits, ctxpool_misses;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t ctxpool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+static void
+ctxpool_discard (ctxpool_entry *e)
+{
+    if (e->ctx >= 0)
+        pmDestroyContext (e->ctx);
+    delete e;
+}
+
+
+// Unlink an entry from the pool.  Caller holds ctxpool_lock.
+static void
+ctxpool_unlink (ctxpool_by_fn_t::iterator it)
+{
+    ctxpool_entry *e = *(it->second);
+
+    ctxpool_lru.erase (it->second);
+    ctxpool_by_filename.erase (it);
+    e->pooled = false;
+}
+
+
+// Trim the pool to size, dropping idle entries from the cold end.
+// Caller holds ctxpool_lock.
+static void
+ctxpool_trim (vector<ctxpool_entry*>& doomed)
+{
+    ctxpool_lru_t::iterator it = ctxpool_lru.end ();
+
+    while (ctxpool_lru.size () > graphite_ctxpool && it != ctxpool_lru.begin ()) {
+        ctxpool_entry *e = *(--it);
+        if (e->busy)
+            continue;
+        it++;
+        ctxpool_unlink (ctxpool_by_filename.find (e->filename));
+        doomed.push_back (e);
+    }
+}
+
+
+// Find, or make, an entry for the given archive and mark it busy.
+// Its ctx is -1 if the caller has to open it.
+static ctxpool_entry *
+ctxpool_checkout (const string& filename)
+{
+    ctxpool_entry *e = 0;
+    vector<ctxpool_entry*> doomed;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (& ctxpool_lock);
+#endif
+    ctxpool_by_fn_t::iterator it = ctxpool_by_filename.find (filename);
+    if (it != ctxpool_by_filename.end () && ! (*(it->second))->busy) {
+        e = *(it->second);
+        ctxpool_lru.splice (ctxpool_lru.begin (), ctxpool_lru, it->second);
+        ctxpool_hits++;
+    } else {
+        e = new ctxpool_entry;
+        e->filename = filename;
+        e->ctx = -1;
+        e->end_stale = false;
+        e->pooled = false;
+        if (graphite_ctxpool > 0 && it == ctxpool_by_filename.end ()) {
+            ctxpool_lru.push_front (e);
+            ctxpool_by_filename.insert (make_pair (filename, ctxpool_lru.begin ()));
+            e->pooled = true;
+        }
+        ctxpool_misses++;
+    }
+    e->busy = true;
+    ctxpool_trim (doomed);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock (& ctxpool_lock);
+#endif
+
+    // destroy contexts outside the lock
+    for (unsigned i = 0; i < doomed.size (); i++)
+        ctxpool_discard (doomed[i]);
+    return e;
+}
+
+
+// Hand an entry back; if it has been dropped from the pool meanwhile,
+// or the caller could not make use of it (ok false), it goes away.
+static void
+ctxpool_checkin (ctxpool_entry *e, bool ok)
+{
+    vector<ctxpool_entry*> doomed;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (& ctxpool_lock);
+#endif
+    e->busy = false;
+    if (e->pooled && (! ok || e->ctx < 0))
+        ctxpool_unlink (ctxpool_by_filename.find (e->filename));
+    if (! e->pooled)
+        doomed.push_back (e);
+    ctxpool_trim (doomed);
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock (& ctxpool_lock);
+#endif
+
+    for (unsigned i = 0; i < doomed.size (); i++)
+        ctxpool_discard (doomed[i]);
+}
+
+
+// The archive has changed under us.  If only the last volume has
+// grown (reopen false), the pooled context can keep going with a fresh
+// archive end; otherwise its metadata is out of date, so drop it.
+static void
+ctxpool_invalidate (const string& filename, bool reopen)
+{
+    ctxpool_entry *doomed = 0;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (& ctxpool_lock);
+#endif
+    ctxpool_by_fn_t::iterator it = ctxpool_by_filename.find (filename);
+    if (it != ctxpool_by_filename.end ()) {
+        ctxpool_entry *e = *(it->second);
+        if (reopen) {
+            ctxpool_unlink (it);
+            if (! e->busy)
+                doomed = e;
+        } else {
+            e->end_stale = true;
+        }
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock (& ctxpool_lock);
+#endif
+
+    if (doomed)
+        ctxpool_discard (doomed);
+}
+
+
+// Close everything, at exit.  No fetch threads are running by then.
+static void
+ctxpool_drain (void)
+{
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock (& ctxpool_lock);
+#endif
+    while (! ctxpool_lru.empty ()) {
+        ctxpool_entry *e = ctxpool_lru.front ();
+        ctxpool_lru.pop_front ();
+        ctxpool_discard (e);
+    }
+    ctxpool_by_filename.clear ();
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock (& ctxpool_lock);
+#endif
+}
+
 
 
 // Compute an "archivepart" for the given archive file name (.meta or
@@ -408,6 +620,7 @@ ac_refresh(struct MHD_Connection * connection, const string& filename)
 
     // clean up
     if (e && exit_p) {
+        ctxpool_invalidate (filename, true);
         archivecache_by_filename.erase(filename);
         // the multimaps are harder
         pair<ac_by_ap_t::iterator,ac_by_ap_t::iterator> its =
@@ -489,6 +702,7 @@ ac_refresh(struct MHD_Connection * connection, const string& filename)
     rc = stat(filename.c_str(), &st);
     if (rc < 0) {
         // the .meta file has disappeared - retire this archivecache_entry!
+        ctxpool_invalidate (filename, true);
         // the map is easy
         archivecache_by_filename.erase(filename);
         // the multimaps are harder
@@ -509,6 +723,9 @@ ac_refresh(struct MHD_Connection * connection, const string& filename)
     } else { // need to (re)load the metrics
         e->metadata_mtime = st.st_mtime;
 
+        // a pooled context would not see the new metadata
+        ctxpool_invalidate (filename, true);
+
         // open a context if not already open from the new-archive case above
         if (ctx < 0) {
             ctx = pmNewContext (PM_CONTEXT_ARCHIVE, filename.c_str ());
@@ -603,6 +820,10 @@ ac_refresh(struct MHD_Connection * connection, const string& filename)
                                              << pmErrStr_r (rc, pmmsg, sizeof (pmmsg))
                                              << endl;
             }
+            // nor would it find the new volume
+            ctxpool_invalidate (filename, true);
+        } else {
+            ctxpool_invalidate (filename, false);
         }
 
         // update the cached mtim, whether it's the previous or next volume's stat
@@ -623,6 +844,49 @@ ac_refresh(struct MHD_Connection * connection, const string& filename)
 
 
 
+// Note a rollup archive, <base>.rollup-<interval>.meta, against <base>.meta.
+// Returns false if the given .meta file is not a rollup archive.
+static bool
+ac_rollup_add (const string& filename)
+{
+    const string tag = ".rollup-";
+    const string metastring = ".meta";
+    string::size_type tagidx = filename.rfind(tag);
+    if (tagidx == string::npos)
+        return false;
+
+    string::size_type intidx = tagidx + tag.length();
+    string interval = filename.substr(intidx, filename.length() - metastring.length() - intidx);
+    struct timeval tv;
+    char *errmsg = NULL;
+    if (pmParseInterval (interval.c_str(), &tv, &errmsg) < 0) {
+        free (errmsg);
+        return false;
+    }
+    if (tv.tv_sec <= 0)
+        return false;
+
+    string base = filename.substr(0, tagidx) + metastring;
+    archivecache_rollups[base][tv.tv_sec] = filename;
+    return true;
+}
+
+
+// Pick the archive to fetch from at the given step: the coarsest
+// rollup of the archive no coarser than t_step, else the archive itself.
+static const string&
+ac_rollup_choose (const string& filename, time_t t_step)
+{
+    ac_rollups_t::const_iterator it = archivecache_rollups.find(filename);
+    if (it == archivecache_rollups.end())
+        return filename;
+    map<time_t,string>::const_iterator r = it->second.upper_bound(t_step);
+    if (r == it->second.begin())
+        return filename;
+    return (--r)->second;
+}
+
+
 // Refresh our archivecache database.  This is much harder than it
 // sounds, because one thing we must not do is rescan archivesdir
 // completely every time, and reopen each .meta archive we find in
@@ -646,6 +910,10 @@ ac_refresh_all(struct MHD_Connection* connection /* may be null */)
     
     const time_t min_refresh_interval = 60; 
     static time_t last_refresh = 0;
+
+    if (exit_p)
+        ctxpool_drain ();
+
     // Don't scan more than once per this long; so we may miss the
     // creation of new archives for that long.
     if (last_refresh > 0 && (last_refresh + min_refresh_interval) >= last_report)
@@ -671,6 +939,7 @@ ac_refresh_all(struct MHD_Connection* connection /* may be null */)
     // XXX: investigate *notify linux apis instead of active scanning.
     
     set<string> refreshed_archivenames;
+    archivecache_rollups.clear();
 #if HAVE_FTS_H
     // fts(3) is not available everywhere, and convenient substitutes don't
     // seem to exist either.  nftw(3) is not multithread-safe nor can it operate
@@ -697,7 +966,10 @@ ac_refresh_all(struct MHD_Connection* connection /* may be null */)
         
             switch(ent->fts_info) {
             case FTS_F:
-                if (has_suffix (ent->fts_path, ".meta")) {
+                if (has_suffix (ent->fts_path, ".meta") &&
+                    ac_rollup_add (ent->fts_path)) {
+                    ; // remembered against its original archive
+                } else if (has_suffix (ent->fts_path, ".meta")) {
                     num_archives ++;
                     string archivename = string(ent->fts_path);
                     refreshed_archivenames.insert(archivename);
@@ -775,7 +1047,10 @@ ac_refresh_all(struct MHD_Connection* connection /* may be null */)
     if (dumpstats > 0 && (last_dumpstats + dumpstats) < first_report) {
         timestamp (clog) << "Archive cache: "
                          << archivecache_by_filename.size() << " files, "
-                         << archivecache_by_archivepart.size() << " names" << endl;
+                         << archivecache_by_archivepart.size() << " names, "
+                         << ctxpool_lru.size() << " open contexts ("
+                         << ctxpool_hits << " reused, "
+                         << ctxpool_misses << " opened)" << endl;
         last_dumpstats = time(NULL);
     }
     
@@ -1312,6 +1587,134 @@ void fetch_series_jobqueue<Spec>::run ()
 
 
 
+// Resolve one graphite target (its metric name, and instance name if
+// any) in the current archive context.  The outcome, good or bad, is
+// kept with the context in the ctxpool, so each target is looked up
+// only once per open archive.
+static void
+pmgraphite_resolve_target (const metric_string& target, ctxpool_target& r)
+{
+    stringstream message;
+    string last_component;
+
+    r.ok = false;
+    r.pmid = 0; // always invalid
+    r.inst = -1;
+    memset (& r.desc, 0, sizeof (r.desc));
+
+    const vector<string>& target_tok = target.split();
+    if (target_tok.size () < 2) {
+        message << " " << target.unsplit() << ": not enough target components";
+        r.message = message.str ();
+        return;
+    }
+    for (unsigned i = 0; i < target_tok.size (); i++)
+        if (target_tok[i] == "") {
+            message << " " << target.unsplit() << ": empty target components";
+            continue;
+        }
+
+    // We need to decide whether the next dotted components represent
+    // a metric name, or whether there is an instance name squished at
+    // the end.
+    string metric_name = "";
+    for (unsigned i = 1; i < target_tok.size () - 1; i++) {
+        const string & piece = target_tok[i];
+        if (i > 1) {
+            metric_name += '.';
+        }
+        metric_name += piece;
+    }
+    last_component = target_tok[target_tok.size () - 1];
+
+    char *namelist[1];
+    pmID pmidlist[1];
+    namelist[0] = (char *) metric_name.c_str ();
+    int sts = pmLookupName (1, namelist, & pmidlist[0]);
+
+    if (sts == 1) {
+        // found ... last name must be instance domain name
+        sts = pmLookupDesc (pmidlist[0], &r.desc);
+        if (sts != 0) {
+            if (! graphite_hostcache) // this is normal in -J mode; mixing archives
+                message << " cannot find metric descriptor " << metric_name;
+            r.message = message.str ();
+            return;
+        }
+        // check that there is an instance domain, in order to use that last component
+        if (r.desc.indom == PM_INDOM_NULL) {
+            if (! graphite_hostcache) // this is normal in -J mode; mixing archives
+                message << " metric " << metric_name << " lacks expected indom "
+                        << last_component;
+            r.message = message.str ();
+            return;
+        }
+        // look up that instance name
+        string instance_name = pmgraphite_metric_decode (last_component);
+        int inst = pmLookupInDomArchive (r.desc.indom,
+                                         (char *) instance_name.c_str ());
+        if (inst < 0) {
+            if (! graphite_hostcache) // this is normal in -J mode; mixing archives
+                message << " metric " << metric_name << " lacks recognized indom "
+                        << last_component;
+            r.message = message.str ();
+            return;
+        }
+        r.inst = inst;
+        // NB: don't mess with instance domain profiles.  We may have multiple
+        // contradictory sets for different metrics in the same fetch loop.
+        // Instead we receive them all and search through them via pminst[i].
+    } else {
+        // not found ... ok, try again with that last component
+        metric_name = metric_name + '.' + last_component;
+        namelist[0] = (char *) metric_name.c_str ();
+        int sts = pmLookupName (1, namelist, pmidlist);
+        if (sts != 1) {
+            // still not found .. give up
+            if (! graphite_hostcache) // this is normal in -J mode; mixing archives
+                message << " cannot find metric name " << metric_name;
+            r.message = message.str ();
+            return;
+        }
+
+        sts = pmLookupDesc (pmidlist[0], &r.desc);
+        if (sts != 0) {
+            message << " cannot find metric descriptor " << metric_name;
+            r.message = message.str ();
+            return;
+        }
+        // check that there is no instance domain
+        if (r.desc.indom != PM_INDOM_NULL) {
+            message << " metric " << metric_name << " has unexpected indom " << r.desc.indom;
+            r.message = message.str ();
+            return;
+        }
+
+        r.inst = -1; // PMAPI magic value for pmResult inst for PM_INDOM_NULL
+    }
+
+    // Check that the pmDesc type is numeric
+    switch (r.desc.type) {
+    case PM_TYPE_32:
+    case PM_TYPE_U32:
+    case PM_TYPE_64:
+    case PM_TYPE_U64:
+    case PM_TYPE_FLOAT:
+    case PM_TYPE_DOUBLE:
+        break;
+    default:
+        message << " metric " << metric_name << " has unsupported type " << r.desc.type;
+        r.message = message.str ();
+        return;
+    }
+
+    r.pmid = pmidlist[0]; // Now we're committed to trying to fetch this pmid.
+    r.ok = true;
+    r.message = message.str ();
+}
+
+
+
 // Heavy lifter.  Parse graphite "target" name into archive
 // file/directory, metric names, and (if appropriate) instances within
 // metric indom; fetch all the data values interpolated between given
@@ -1333,8 +1736,8 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
     time_t t_end = spec->t_end;
     time_t t_step = spec->t_step;
     int sts;
-    string last_component;
-    int pmc;
+    ctxpool_entry *pce;
+    bool pce_ok = true;
     string archive;
     unsigned entries_good = 0, entries;
     stringstream message;
@@ -1354,37 +1757,54 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
 
     // XXX: in future, parse graphite functions-of-metrics
     // http://graphite.readthedocs.org/en/latest/functions.html
-    //
-    // XXX: in future, cache the pmid/pmdesc/inst# -> pcp-context
 
     // -------------------- PART 1 - per-archive processing
 
     archive = spec->filename;
 
-    // Open the bad boy.
-    pmc = pmNewContext (PM_CONTEXT_ARCHIVE, archive.c_str ());
-    if (pmc < 0) {
-        // error already noted XXX where?
-        goto out0;
-    }
+    // Reuse a pooled context for this archive, or open the bad boy.
+    pce = ctxpool_checkout (archive);
 
-    // NB: past this point, exit via 'goto out;' to release pmc
+    // NB: past this point, exit via 'goto out;' to check pce back in
 
-    // Fetch end of archive time boundaries, to avoid having libpcp
-    // iterate across vast regions of void.  This would be especially
-    // bad if libpcp worries the archive might have grown since last
-    // call, go and do an fstat(2)/lseek(2) every point.
-    sts = pmGetArchiveLabel (& archive_label);
-    if (sts < 0) {
-        message << "cannot find archive label";
-        goto out;
+    if (pce->ctx < 0) {
+        pce->ctx = pmNewContext (PM_CONTEXT_ARCHIVE, archive.c_str ());
+        if (pce->ctx < 0) {
+            // error already noted XXX where?
+            goto out;
+        }
+
+        // Fetch end of archive time boundaries, to avoid having libpcp
+        // iterate across vast regions of void.  This would be especially
+        // bad if libpcp worries the archive might have grown since last
+        // call, go and do an fstat(2)/lseek(2) every point.
+        sts = pmGetArchiveLabel (& pce->label);
+        if (sts < 0) {
+            message << "cannot find archive label";
+            pce_ok = false;
+            goto out;
+        }
+        pce->end_stale = true;
+    } else {
+        sts = pmUseContext (pce->ctx);
+        if (sts < 0) {
+            message << "cannot reuse archive context";
+            pce_ok = false;
+            goto out;
+        }
     }
 
-    sts = pmGetArchiveEnd (& archive_end);
-    if (sts < 0) {
-        message << "cannot find archive end";
-        goto out;
+    if (pce->end_stale) {
+        sts = pmGetArchiveEnd (& pce->archive_end);
+        if (sts < 0) {
+            message << "cannot find archive end";
+            pce_ok = false;
+            goto out;
+        }
+        pce->end_stale = false;
     }
+    archive_label = pce->label;
+    archive_end = pce->archive_end;
 
     if (verbosity > 3) {
         message << "[" << archive_label.ll_start.tv_sec
@@ -1406,105 +1826,22 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
         const metric_string& target = spec->targets[j];
         pmids[j] = 0; // always invalid
 
-        const vector<string>& target_tok = target.split();
-        if (target_tok.size () < 2) {
-            message << " " << target.unsplit() << ": not enough target components";
-            continue;
+        const string target_name = target.unsplit ();
+        map<string,ctxpool_target>::iterator rt = pce->targets.find (target_name);
+        if (rt == pce->targets.end ()) {
+            ctxpool_target r;
+            pmgraphite_resolve_target (target, r);
+            rt = pce->targets.insert (make_pair (target_name, r)).first;
         }
-        for (unsigned i = 0; i < target_tok.size (); i++)
-            if (target_tok[i] == "") {
-                message << " " << target.unsplit() << ": empty target components";
-                continue;
-            }
-
-        // We need to decide whether the next dotted components represent
-        // a metric name, or whether there is an instance name squished at
-        // the end.
-        string metric_name = "";
-        for (unsigned i = 1; i < target_tok.size () - 1; i++) {
-            const string & piece = target_tok[i];
-            if (i > 1) {
-                metric_name += '.';
-            }
-            metric_name += piece;
-        }
-        last_component = target_tok[target_tok.size () - 1];
-
-        char *namelist[1];
-        pmID pmidlist[1]; // fetch here instead of pmids[i], so an early error continue leaves latter zero
-        namelist[0] = (char *) metric_name.c_str ();
-        int sts = pmLookupName (1, namelist, & pmidlist[0]);
-
-        if (sts == 1) {
-            // found ... last name must be instance domain name
-            sts = pmLookupDesc (pmidlist[0], &pmdescs[j]);
-            if (sts != 0) {
-                if (! graphite_hostcache) // this is normal in -J mode; mixing archives
-                    message << " cannot find metric descriptor " << metric_name;
-                continue;
-            }
-            // check that there is an instance domain, in order to use that last component
-            if (pmdescs[j].indom == PM_INDOM_NULL) {
-                if (! graphite_hostcache) // this is normal in -J mode; mixing archives
-                    message << " metric " << metric_name << " lacks expected indom "
-                            << last_component;
-                continue;
-            }
-            // look up that instance name
-            string instance_name = pmgraphite_metric_decode (last_component);
-            int inst = pmLookupInDomArchive (pmdescs[j].indom,
-                                             (char *) instance_name.c_str ());
-            if (inst < 0) {
-                if (! graphite_hostcache) // this is normal in -J mode; mixing archives
-                    message << " metric " << metric_name << " lacks recognized indom "
-                            << last_component;
-                continue;
-            }
-            pminsts[j] = inst;
-            // NB: don't mess with instance domain profiles.  We may have multiple
-            // contradictory sets for different metrics in the same fetch loop.
-            // Instead we receive them all and search through them via pminst[i].
-        } else {
-            // not found ... ok, try again with that last component
-            metric_name = metric_name + '.' + last_component;
-            namelist[0] = (char *) metric_name.c_str ();
-            int sts = pmLookupName (1, namelist, pmidlist);
-            if (sts != 1) {
-                // still not found .. give up
-                if (! graphite_hostcache) // this is normal in -J mode; mixing archives
-                    message << " cannot find metric name " << metric_name;
-                continue;
-            }
+        const ctxpool_target& r = rt->second;
 
-            sts = pmLookupDesc (pmidlist[0], &pmdescs[j]);
-            if (sts != 0) {
-                message << " cannot find metric descriptor " << metric_name;
-                continue;
-            }
-            // check that there is no instance domain
-            if (pmdescs[j].indom != PM_INDOM_NULL) {
-                message << " metric " << metric_name << " has unexpected indom " << pmdescs[j].indom;
-                continue;
-            }
-
-            pminsts[j] = -1; // PMAPI magic value for pmResult inst for PM_INDOM_NULL
-        }
-
-        // Check that the pmDesc type is numeric
-        switch (pmdescs[j].type) {
-        case PM_TYPE_32:
-        case PM_TYPE_U32:
-        case PM_TYPE_64:
-        case PM_TYPE_U64:
-        case PM_TYPE_FLOAT:
-        case PM_TYPE_DOUBLE:
-            break;
-        default:
-            message << " metric " << metric_name << " has unsupported type " << pmdescs[j].type;
+        message << r.message;
+        if (! r.ok)
             continue;
-        }
 
-        pmids[j] = pmidlist[0]; // Now we're committed to trying to fetch this pmid.
+        pmdescs[j] = r.desc;
+        pminsts[j] = r.inst;
+        pmids[j] = r.pmid; // Now we're committed to trying to fetch this pmid.
 
         // supply the pmDesc to caller
 #ifdef HAVE_PTHREAD_H
@@ -1609,8 +1946,7 @@ void pmgraphite_fetch_series (fetch_series_jobspec *spec)
     }
 
  out:
-    pmDestroyContext (pmc);
- out0:
+    ctxpool_checkin (pce, pce_ok);
     // vector output already returned via jobspec pointer
 
     spec->message = message.str (); // pass back message
@@ -1691,14 +2027,19 @@ pmgraphite_fetch_all_series (struct MHD_Connection* connection,
                 continue;
             }
             
-            map<string,fetch_series_jobspec>::iterator it2 = jobmap.find(e->filename);
+            // Long time ranges at a coarse step are served from a
+            // rollup archive, where there is one, for far fewer reads.
+            const string& filename = ac_rollup_choose (e->filename, t_step);
+            map<string,fetch_series_jobspec>::iterator it2 = jobmap.find(filename);
             if (it2 == jobmap.end()) {
+                if (verbosity > 2 && filename != e->filename)
+                    connstamp (clog, connection) << "Using rollup archive " << filename << endl;
                 fetch_series_jobspec js;
                 js.t_start = t_start;
                 js.t_end = t_end;
                 js.t_step = t_step;
-                js.filename = e->filename;
-                it2 = jobmap.insert(make_pair(e->filename,js)).first;
+                js.filename = filename;
+                it2 = jobmap.insert(make_pair(filename,js)).first;
             }
 
             it2->second.targets.push_back (target);
@@ -2985,47 +3326,59 @@ out1:
 /* ------------------------------------------------------------------------ */
 
 
-// Render raw archive data in JSON form.
-int
-pmgraphite_respond_render_json (struct MHD_Connection *connection,
-                                const http_params & params, const vector <string> &url,
-                                bool rawdata_flavour_p)
-{
-    int rc;
-    struct MHD_Response *resp;
+// Render raw archive data in JSON form, a slice of one series at a
+// time, as the client connection drains.  Only the fetched floats are
+// held, not the (several times larger) JSON text; each series' floats
+// are released as soon as it has been written out.
 
+struct render_json_producer: public response_producer {
     vector<metric_string> targets;
+    vector<timeseries> results; // indexed as targets[]
     time_t t_start, t_end, t_step;
-    int t_relative_p;
-    rc = pmgraphite_gather_data (connection, params, url, targets, t_start, t_end, t_step, t_relative_p);
-    if (rc) {
-        return mhd_notify_error (connection, rc);
-    }
+    bool rawdata_flavour_p;
 
-    vector<timeseries> all_results; // indexed as targets[]
-    vector<pmDesc> all_result_descs; // indexed as targets[]
-    pmgraphite_fetch_all_series (connection, targets, all_results, all_result_descs, t_start, t_end, t_step);
+    bool begun; // "[" written
+    unsigned k; // next target to write
+    unsigned i; // next point of targets[k] to write
+    unsigned printed; // points of targets[k] written so far
 
+    render_json_producer (bool r): rawdata_flavour_p(r), begun(false), k(0), i(0), printed(0) {}
+    bool produce (string& out);
+};
+
+// Points per produce() call, keeping each piece to some tens of KB.
+static const unsigned render_json_slice = 1024;
+
+bool
+render_json_producer::produce (string& out)
+{
     stringstream output;
-    output << "[";
-    for (unsigned k = 0; k < targets.size (); k++) {
-        const metric_string& target = targets[k];
-        const timeseries& results = all_results[k];
 
-        if (k > 0) {
-            output << ",";
-        }
+    if (! begun) {
+        output << "[";
+        begun = true;
+    }
+
+    if (k < targets.size ()) {
+        const metric_string& target = targets[k];
+        const timeseries& results = this->results[k];
+        unsigned limit = min ((size_t) i + render_json_slice, results.size ());
 
         // NB: as an optimization, we could filter out targets with all-null results[].
-        
+
         if (rawdata_flavour_p) { // a vector of values with implicit timestamp - can't elide null runs
-            output << "{";
-            json_key_value (output, "start", t_start, ",");
-            json_key_value (output, "step", t_step, ",");
-            json_key_value (output, "end", t_end, ",");
-            json_key_value (output, "name", string(target.unsplit()), ",");
-            output << " \"data\":[";
-            for (unsigned i = 0; i < results.size (); i++) {
+            if (i == 0) {
+                if (k > 0) {
+                    output << ",";
+                }
+                output << "{";
+                json_key_value (output, "start", t_start, ",");
+                json_key_value (output, "step", t_step, ",");
+                json_key_value (output, "end", t_end, ",");
+                json_key_value (output, "name", string(target.unsplit()), ",");
+                output << " \"data\":[";
+            }
+            for (; i < limit; i++) {
                 if (i > 0) {
                     output << ",";
                 }
@@ -3038,20 +3391,23 @@ pmgraphite_respond_render_json (struct MHD_Connection *connection,
                     output << results[i];
                 }
             }
-            output << "]}";
 
         } else { // a timestamped vector of values
-            output << "{";
-            json_key_value (output, "target", string(target.unsplit()), ",");
-            output << " \"datapoints\":[";
+            if (i == 0) {
+                if (k > 0) {
+                    output << ",";
+                }
+                output << "{";
+                json_key_value (output, "target", string(target.unsplit()), ",");
+                output << " \"datapoints\":[";
+            }
 
             // We can elide runs of nulls, but carefully: we can
             // remove the middle but not first & last nulls in a run.
             // In some experiments, other tunings resulted in grafana
             // 1.9.1 complaints about "Datapoints outside time range".
 
-            unsigned printed = 0;
-            for (unsigned i = 0; i < results.size (); i++) {
+            for (; i < limit; i++) {
                 if (! isfinite (results[i]) && // NaN
                     // not sandwiched between NaNs
                     ! (((i>0) && !isfinite (results[i-1])) &&
@@ -3065,16 +3421,49 @@ pmgraphite_respond_render_json (struct MHD_Connection *connection,
                     output << "[" << results[i] << "," << results.when(i) << "]";
                 }
             }
+        }
+
+        if (i == results.size ()) { // done with this series
             output << "]}";
+            vector<float> ().swap (this->results[k].data);
+            k++;
+            i = 0;
+            printed = 0;
         }
+    }
 
+    bool more = (k < targets.size ());
+    if (! more) {
+        output << "]";
     }
-    output << "]";
+    out = output.str ();
+    return more;
+}
 
-    // wrap it up in mhd response ribbons
-    resp = NOTMHD_compressible_response (connection, output.str());
+
+int
+pmgraphite_respond_render_json (struct MHD_Connection *connection,
+                                const http_params & params, const vector <string> &url,
+                                bool rawdata_flavour_p)
+{
+    int rc;
+    struct MHD_Response *resp;
+
+    render_json_producer *p = new render_json_producer (rawdata_flavour_p);
+    int t_relative_p;
+    rc = pmgraphite_gather_data (connection, params, url, p->targets, p->t_start, p->t_end, p->t_step, t_relative_p);
+    if (rc) {
+        delete p;
+        return mhd_notify_error (connection, rc);
+    }
+
+    vector<pmDesc> all_result_descs; // indexed as targets[]
+    pmgraphite_fetch_all_series (connection, p->targets, p->results, all_result_descs, p->t_start, p->t_end, p->t_step);
+
+    // wrap it up in mhd response ribbons; it is rendered from here on
+    resp = NOTMHD_streaming_response (connection, p);
     if (resp == NULL) {
-        connstamp (cerr, connection) << "MHD_create_response_from_buffer failed" << endl;
+        connstamp (cerr, connection) << "MHD_create_response_from_callback failed" << endl;
         rc = -ENOMEM;
         goto out1;
     }
@@ -3084,25 +3473,27 @@ pmgraphite_respond_render_json (struct MHD_Connection *connection,
     if (rc != MHD_YES) {
         connstamp (cerr, connection) << "MHD_add_response_header ACAO failed" << endl;
         rc = -ENOMEM;
-        goto out1;
+        goto out2;
     }
 
     rc = MHD_add_response_header (resp, "Content-Type", "application/json");
     if (rc != MHD_YES) {
         connstamp (cerr, connection) << "MHD_add_response_header CT failed" << endl;
         rc = -ENOMEM;
-        goto out1;
+        goto out2;
     }
     rc = MHD_queue_response (connection, MHD_HTTP_OK, resp);
     if (rc != MHD_YES) {
         connstamp (cerr, connection) << "MHD_queue_response failed" << endl;
         rc = -ENOMEM;
-        goto out1;
+        goto out2;
     }
 
     MHD_destroy_response (resp);
     return MHD_YES;
 
+out2:
+    MHD_destroy_response (resp);
 out1:
     return mhd_notify_error (connection, rc);
 }
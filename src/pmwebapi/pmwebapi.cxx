@@ -498,9 +498,9 @@ pmwebapi_respond_metric_list (struct MHD_Connection *connection,
     string s = mltc.mhdb->str ();
     delete mltc.mhdb;
     mltc.mhdb = 0;
-    resp = NOTMHD_compressible_response (connection, s);
+    resp = NOTMHD_streaming_response (connection, new string_producer (s));
     if (resp == NULL) {
-        connstamp (cerr, connection) << "MHD_create_response_from_buffer failed" << endl;
+        connstamp (cerr, connection) << "MHD_create_response_from_callback failed" << endl;
         rc = -ENOMEM;
         goto out;
     }
@@ -833,10 +833,10 @@ pmwebapi_respond_metric_fetch (struct MHD_Connection *connection,
 
     {
         string s = output.str ();
-        resp = NOTMHD_compressible_response (connection, s);
+        resp = NOTMHD_streaming_response (connection, new string_producer (s));
     }
     if (resp == NULL) {
-        connstamp (cerr, connection) << "MHDB_create_response_from_buffer failed" << endl;
+        connstamp (cerr, connection) << "MHD_create_response_from_callback failed" << endl;
         rc = -ENOMEM;
         goto out;
     }
@@ -1055,10 +1055,10 @@ pmwebapi_respond_instance_list (struct MHD_Connection *connection,
     }
     {
         string s = output.str ();
-        resp = NOTMHD_compressible_response (connection, s);
+        resp = NOTMHD_streaming_response (connection, new string_producer (s));
     }
     if (resp == NULL) {
-        connstamp (cerr, connection) << "MHD_create_response_from_buffer failed" << endl;
+        connstamp (cerr, connection) << "MHD_create_response_from_callback failed" << endl;
         rc = -ENOMEM;
         goto out;
     }
@@ -1339,9 +1339,9 @@ pmwebapi_respond_prometheus (struct MHD_Connection *connection,
                    << "# number of metrics completed: " << mptc.num_metrics_completed << endl;
     
     string s = mptc.output->str ();
-    resp = NOTMHD_compressible_response (connection, s);
+    resp = NOTMHD_streaming_response (connection, new string_producer (s));
     if (resp == NULL) {
-        connstamp (cerr, connection) << "MHD_create_response_from_buffer failed" << endl;
+        connstamp (cerr, connection) << "MHD_create_response_from_callback failed" << endl;
         rc = -ENOMEM;
         goto out;
     }
@@ -72,6 +72,7 @@ extern unsigned multithread;			/* set by -M option */
 extern unsigned graphite_timestep;              /* set by -i option */
 extern unsigned graphite_hostcache;             /* set by -J option */
 extern unsigned graphite_encode;                /* set by -X option */
+extern unsigned graphite_ctxpool;               /* set by -k option */
 
 struct http_params: public std::multimap <std::string, std::string> {
     std::string operator [] (const std::string &) const;
@@ -124,6 +125,29 @@ extern int cursed_path_p (const std::string & blessed, const std::string & quest
 extern void json_quote (std::ostream & o, const std::string & value);
 extern struct MHD_Response *NOTMHD_compressible_response(struct MHD_Connection *connection,
                                                          const std::string& buf);
+
+// A source of response body text, pulled a piece at a time by
+// NOTMHD_streaming_response as the client connection drains, so the
+// whole body need never be held in memory at once.
+struct response_producer {
+    virtual ~response_producer () {}
+    // Append the next piece of the body to out.  Return false if
+    // that was the last piece.
+    virtual bool produce (std::string& out) = 0;
+};
+
+// A body that has already been rendered; taken over (swapped out of
+// the caller's string) and handed out in slices.
+struct string_producer: public response_producer {
+    std::string body;
+    size_t offset;
+
+    string_producer (std::string& s): offset(0) { body.swap (s); }
+    bool produce (std::string& out);
+};
+
+extern struct MHD_Response *NOTMHD_streaming_response(struct MHD_Connection *connection,
+                                                      response_producer *producer);
 extern std::string escapeString(const std::string&);
 
 // inlined right here
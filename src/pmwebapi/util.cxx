@@ -20,6 +20,7 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <algorithm>
 
 extern "C"
 {
@@ -330,3 +331,168 @@ struct MHD_Response *NOTMHD_compressible_response(struct MHD_Connection *connect
 
     return resp;
 }
+
+
+
+/* The body is handed to MHD in pieces of about this size. */
+static const size_t streaming_block_size = 32 * 1024;
+
+bool string_producer::produce (std::string& out)
+{
+    size_t n = min (streaming_block_size, body.size () - offset);
+
+    out.assign (body, offset, n);
+    offset += n;
+    if (offset < body.size ())
+        return true;
+    string ().swap (body); /* release it now, not at response teardown */
+    return false;
+}
+
+
+/* State of one NOTMHD_streaming_response, between MHD callbacks. */
+struct streaming_response {
+    response_producer *producer;
+    string pending;		/* ready for MHD; compressed if gzip */
+    size_t pending_offset;
+    bool done;			/* producer has nothing more */
+#if HAVE_ZLIB
+    bool gzip;
+    z_stream stream;
+#endif
+};
+
+
+#if HAVE_ZLIB
+/* Run one produced piece through the gzip stream onto sr->pending;
+   flush is Z_FINISH for the last piece.  Return 0 or -1 on error. */
+static int streaming_deflate (streaming_response *sr, const string& piece, int flush)
+{
+    char buf[16 * 1024];
+
+    sr->stream.next_in = (Bytef*) piece.data ();
+    sr->stream.avail_in = (uInt) piece.size ();
+    do {
+        sr->stream.next_out = (Bytef*) buf;
+        sr->stream.avail_out = (uInt) sizeof (buf);
+        int rc = deflate (& sr->stream, flush);
+        if (rc == Z_STREAM_ERROR)
+            return -1;
+        sr->pending.append (buf, sizeof (buf) - sr->stream.avail_out);
+    } while (sr->stream.avail_out == 0);
+    return 0;
+}
+#endif
+
+
+/* MHD_ContentReaderCallback: copy out what is pending, asking the
+   producer for more (and compressing it) whenever we run dry. */
+static ssize_t streaming_response_read (void *cls, uint64_t pos, char *buf, size_t max)
+{
+    streaming_response *sr = (streaming_response *) cls;
+
+    (void) pos;
+    try {
+        while (sr->pending_offset == sr->pending.size ()) {
+            if (sr->done)
+                return MHD_CONTENT_READER_END_OF_STREAM;
+
+            string piece;
+            bool more = sr->producer->produce (piece);
+            if (! more)
+                sr->done = true;
+
+            sr->pending.clear ();
+            sr->pending_offset = 0;
+#if HAVE_ZLIB
+            if (sr->gzip) {
+                if (streaming_deflate (sr, piece, more ? Z_NO_FLUSH : Z_FINISH) < 0)
+                    return MHD_CONTENT_READER_END_WITH_ERROR;
+                continue;
+            }
+#endif
+            sr->pending.swap (piece);
+        }
+    } catch (const std::exception& e) {
+        timestamp (cerr) << "response rendering failed: " << e.what () << endl;
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+
+    size_t n = min (max, sr->pending.size () - sr->pending_offset);
+    memcpy (buf, sr->pending.data () + sr->pending_offset, n);
+    sr->pending_offset += n;
+    return (ssize_t) n;
+}
+
+
+/* MHD_ContentReaderFreeCallback */
+static void streaming_response_free (void *cls)
+{
+    streaming_response *sr = (streaming_response *) cls;
+
+#if HAVE_ZLIB
+    if (sr->gzip)
+        deflateEnd (& sr->stream);
+#endif
+    delete sr->producer;
+    delete sr;
+}
+
+
+/* Create and return an MHD_Response whose body is pulled from the given
+   producer as the client reads it, gzip-compressed on the fly if the
+   client asked for that and we can.  The response takes ownership of
+   the producer, even on error.  Return NULL on error.  */
+struct MHD_Response *NOTMHD_streaming_response(struct MHD_Connection *connection,
+                                               response_producer *producer)
+{
+    struct MHD_Response* resp;
+    streaming_response *sr = new streaming_response;
+
+    sr->producer = producer;
+    sr->pending_offset = 0;
+    sr->done = false;
+
+#if HAVE_ZLIB
+    const char *encodings = MHD_lookup_connection_value (connection,
+                                                         MHD_HEADER_KIND,
+                                                         MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    if (encodings == NULL) encodings = "";
+
+    sr->gzip = false;
+    if (strstr (encodings, "gzip") != NULL) {
+        sr->stream.zalloc = (alloc_func) 0;
+        sr->stream.zfree = (free_func) 0;
+        sr->stream.opaque = (voidpf) 0;
+        /* http-compatible gzip encoding, as in compress_string() */
+        int rc = deflateInit2 (& sr->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                               MAX_WBITS | 16 /*gzip*/,
+                               8 /*DEF_MEM_LEVEL*/, Z_DEFAULT_STRATEGY);
+        sr->gzip = (rc == Z_OK);
+    }
+#else
+    (void) connection;
+#endif
+
+    /* unknown size => chunked transfer encoding */
+    resp = MHD_create_response_from_callback (MHD_SIZE_UNKNOWN, streaming_block_size,
+                                              & streaming_response_read, sr,
+                                              & streaming_response_free);
+    if (resp == NULL) {
+        streaming_response_free (sr);
+        return NULL;
+    }
+
+#if HAVE_ZLIB
+    if (sr->gzip) {
+        int rc = MHD_add_response_header (resp, "Content-Encoding", "gzip");
+        if (rc != MHD_YES) {
+            /* the body is already committed to gzip; give up */
+            MHD_destroy_response (resp);
+            return NULL;
+        }
+    }
+#endif
+
+    return resp;
+}
@@ -178,6 +178,9 @@ LIBPCP_MMV.mmv_lookup_value_desc.argtypes = [c_void_p, c_char_p, c_char_p]
 LIBPCP_MMV.mmv_inc_value.restype = None
 LIBPCP_MMV.mmv_inc_value.argtypes = [c_void_p, POINTER(pmAtomValue), c_double]
 
+LIBPCP_MMV.mmv_observe_value.restype = None
+LIBPCP_MMV.mmv_observe_value.argtypes = [c_void_p, POINTER(pmAtomValue), c_double]
+
 LIBPCP_MMV.mmv_set_value.restype = None
 LIBPCP_MMV.mmv_set_value.argtypes = [c_void_p, POINTER(pmAtomValue), c_double]
 
@@ -191,6 +194,9 @@ LIBPCP_MMV.mmv_stats_add.argtypes = [c_void_p, c_char_p, c_char_p, c_double]
 LIBPCP_MMV.mmv_stats_inc.restype = None
 LIBPCP_MMV.mmv_stats_inc.argtypes = [c_void_p, c_char_p, c_char_p]
 
+LIBPCP_MMV.mmv_stats_observe.restype = None
+LIBPCP_MMV.mmv_stats_observe.argtypes = [c_void_p, c_char_p, c_char_p, c_double]
+
 LIBPCP_MMV.mmv_stats_set.restype = None
 LIBPCP_MMV.mmv_stats_set.argtypes = [c_void_p, c_char_p, c_char_p, c_double]
 
@@ -326,6 +332,10 @@ class MemoryMappedValues(object):
         """ Set the mapped metric to a given value """
         LIBPCP_MMV.mmv_set_value(self._handle, mapping, value)
 
+    def observe(self, mapping, value):
+        """ Count one observation in the mapped histogram or sketch """
+        LIBPCP_MMV.mmv_observe_value(self._handle, mapping, value)
+
     def set_string(self, mapping, value):
         """ Set the string mapped metric to a given value """
         if value != None and type(value) != type(b''):
@@ -359,6 +369,14 @@ class MemoryMappedValues(object):
             inst = inst.encode('utf-8')
         LIBPCP_MMV.mmv_stats_inc(self._handle, name, inst)
 
+    def lookup_observe(self, name, inst, value):
+        """ Lookup the named histogram or sketch and count an observation """
+        if name != None and type(name) != type(b''):
+            name = name.encode('utf-8')
+        if inst != None and type(inst) != type(b''):
+            inst = inst.encode('utf-8')
+        LIBPCP_MMV.mmv_stats_observe(self._handle, name, inst, value)
+
     def lookup_set(self, name, inst, value):
         """ Lookup the named metric[instance] and set its value """
         if name != None and type(name) != type(b''):